@@ -0,0 +1,246 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../minitensor.h"
+
+/**
+ * Minitensor benchmarks. Every case is run `warmup` times untimed, then
+ * `reps` times timed; the median and 99th percentile of the timings are
+ * reported with the throughput they imply and the tensor buffers each run
+ * requested, as one JSON document on stdout.
+ *
+ * usage: minitensor_bench [-r reps] [-w warmup] [-t threads] [filter]
+ *
+ * Only the cases whose name contains `filter` are run.
+ */
+
+typedef struct {
+        MTTensor *a, *b, *targets;
+        /* the weights and biases of the MLP case */
+        MTTensor *params[4];
+        int       dim;
+} BenchState;
+
+typedef struct {
+        const char *name;
+        void (*setup)(MTContext *ctx, BenchState *s, int *shape);
+        void (*run)(BenchState *s);
+        int    shape[3];
+        double flops; /* per run */
+        double bytes; /* read and written per run, for float32 elements */
+} BenchCase;
+
+static int reps = 20, warmup = 3;
+
+static double now(void) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int cmp_double(const void *a, const void *b) {
+        double x = *(const double *)a, y = *(const double *)b;
+        return (x > y) - (x < y);
+}
+
+/* A tensor of `shape` filled with pseudo-random values in [-1, 1) */
+static MTTensor *random_tensor(MTContext *ctx, int *shape, int ndims) {
+        static unsigned long state = 12345;
+        long                 n     = 1;
+        for (int i = 0; i < ndims; i++) n *= shape[i];
+        float *data = malloc(sizeof(float) * n);
+        for (long i = 0; i < n; i++) {
+                state   = state * 6364136223846793005UL + 1442695040888963407UL;
+                data[i] = (state >> 40) / (float)(1 << 23) - 1;
+        }
+        MTTensor *t = mt_new_tensor(ctx, data, shape, ndims);
+        free(data);
+        return t;
+}
+
+/* Setups. `shape` is that of the case: (m, k, n) for matmuls */
+
+static void setup_matmul(MTContext *ctx, BenchState *s, int *shape) {
+        s->a = random_tensor(ctx, Arr(int, shape[0], shape[1]), 2);
+        s->b = random_tensor(ctx, Arr(int, shape[1], shape[2]), 2);
+}
+
+static void setup_binary(MTContext *ctx, BenchState *s, int *shape) {
+        s->a = random_tensor(ctx, Arr(int, shape[0], shape[1]), 2);
+        s->b = random_tensor(ctx, Arr(int, shape[0], shape[1]), 2);
+}
+
+static void setup_row_bcast(MTContext *ctx, BenchState *s, int *shape) {
+        s->a = random_tensor(ctx, Arr(int, shape[0], shape[1]), 2);
+        s->b = random_tensor(ctx, Arr(int, shape[1]), 1);
+}
+
+static void setup_col_bcast(MTContext *ctx, BenchState *s, int *shape) {
+        s->a = random_tensor(ctx, Arr(int, shape[0], shape[1]), 2);
+        s->b = random_tensor(ctx, Arr(int, shape[0], 1), 2);
+}
+
+/* shape[2] is the dimension to reduce along */
+static void setup_reduce(MTContext *ctx, BenchState *s, int *shape) {
+        s->dim = shape[2];
+        s->a   = random_tensor(ctx, Arr(int, shape[0], shape[1]), 2);
+}
+
+static void setup_reduce3(MTContext *ctx, BenchState *s, int *shape) {
+        s->dim = shape[2];
+        s->a   = random_tensor(ctx, Arr(int, 64, 128, 128), 3);
+}
+
+static void setup_unary(MTContext *ctx, BenchState *s, int *shape) {
+        s->a = random_tensor(ctx, Arr(int, shape[0], shape[1]), 2);
+}
+
+/* An MLP with a (batch, in) input, a hidden layer of shape[2] units and 10
+ * classes. Gradients are created by every step, so none is kept. */
+static void setup_mlp(MTContext *ctx, BenchState *s, int *shape) {
+        int in = shape[1], hidden = shape[2];
+        s->a   = random_tensor(ctx, Arr(int, shape[0], in), 2);
+        s->targets = mt_new_tensor_full(ctx, 0, Arr(int, shape[0]), 1);
+        for (int i = 0; i < shape[0]; i++) s->targets->data[i] = i % 10;
+        s->params[0] = random_tensor(ctx, Arr(int, in, hidden), 2);
+        s->params[1] = random_tensor(ctx, Arr(int, hidden), 1);
+        s->params[2] = random_tensor(ctx, Arr(int, hidden, 10), 2);
+        s->params[3] = random_tensor(ctx, Arr(int, 10), 1);
+        for (int i = 0; i < 4; i++) {
+                mt_tensor_enable_grad(s->params[i]);
+                mt_tensor_free(s->params[i]->grad);
+                s->params[i]->grad = NULL;
+        }
+}
+
+/* Runs */
+
+static void run_matmul(BenchState *s) { mt_tensor_matmul(s->a, s->b); }
+static void run_add(BenchState *s) { mt_tensor_add(s->a, s->b); }
+static void run_mul(BenchState *s) { mt_tensor_mul(s->a, s->b); }
+static void run_exp(BenchState *s) { mt_tensor_exp(s->a); }
+static void run_relu(BenchState *s) { mt_tensor_relu(s->a); }
+static void run_sum(BenchState *s) { mt_tensor_sum(s->a, s->dim, 0); }
+static void run_transpose(BenchState *s) { mt_tensor_transpose(s->a); }
+
+/* Every other index along s->dim */
+static void run_slice(BenchState *s) {
+        int n = s->a->shape[s->dim] / 2, index[n];
+        for (int i = 0; i < n; i++) index[i] = 2 * i;
+        mt_tensor_slice(s->a->context, s->a, s->dim, index, n);
+}
+
+static void run_slice0(BenchState *s) { s->dim = 0, run_slice(s); }
+static void run_slice1(BenchState *s) { s->dim = 1, run_slice(s); }
+
+static void run_mlp(BenchState *s) {
+        for (int i = 0; i < 4; i++) mt_tensor_zero_grad(s->params[i]);
+        MTTensor *h    = mt_tensor_relu(mt_tensor_add(mt_tensor_matmul(s->a, s->params[0]), s->params[1]));
+        MTTensor *out  = mt_tensor_add(mt_tensor_matmul(h, s->params[2]), s->params[3]);
+        MTTensor *loss = mt_tensor_cross_entropy(out, s->targets);
+        mt_tensor_backward(loss, NULL);
+        for (int i = 0; i < 4; i++) mt_tensor_sgd_step(s->params[i], 0.01);
+}
+
+#define MM(m, k, n) {"matmul_" #m "x" #k "x" #n, setup_matmul, run_matmul, {m, k, n}, \
+                     2.0 * m * k * n, 4.0 * ((double)m * k + (double)k * n + (double)m * n)}
+#define EW(name, setup, run, m, n, nin) {name, setup, run, {m, n}, (double)m * n, 4.0 * (nin + 1) * m * n}
+#define RD(name, m, n, dim) {name, setup_reduce, run_sum, {m, n, dim}, (double)m * n, 4.0 * m * n}
+#define RD3(name, dim) {name, setup_reduce3, run_sum, {0, 0, dim}, 64.0 * 128 * 128, 4.0 * 64 * 128 * 128}
+
+static BenchCase cases[] = {
+    MM(64, 64, 64),
+    MM(256, 256, 256),
+    MM(512, 512, 512),
+    MM(1024, 1024, 1024),
+    MM(4096, 256, 64),
+    MM(1, 1024, 1024),
+    EW("add_1024x1024", setup_binary, run_add, 1024, 1024, 2),
+    EW("mul_1024x1024", setup_binary, run_mul, 1024, 1024, 2),
+    EW("add_row_bcast_1024x1024", setup_row_bcast, run_add, 1024, 1024, 1),
+    EW("add_col_bcast_1024x1024", setup_col_bcast, run_add, 1024, 1024, 1),
+    EW("add_row_bcast_16x16", setup_row_bcast, run_add, 16, 16, 1),
+    EW("exp_1024x1024", setup_unary, run_exp, 1024, 1024, 1),
+    EW("relu_1024x1024", setup_unary, run_relu, 1024, 1024, 1),
+    RD("sum_dim0_1024x1024", 1024, 1024, 0),
+    RD("sum_dim1_1024x1024", 1024, 1024, 1),
+    RD3("sum_dim0_64x128x128", 0),
+    RD3("sum_dim1_64x128x128", 1),
+    RD3("sum_dim2_64x128x128", 2),
+    {"slice_dim0_1024x1024", setup_unary, run_slice0, {1024, 1024}, 0, 4.0 * 1024 * 1024},
+    {"slice_dim1_1024x1024", setup_unary, run_slice1, {1024, 1024}, 0, 4.0 * 1024 * 1024},
+    {"transpose_1024x1024", setup_unary, run_transpose, {1024, 1024}, 0, 8.0 * 1024 * 1024},
+    /* forward and backward are about 3 times the forward matmuls */
+    {"mlp_step_256x784x256", setup_mlp, run_mlp, {256, 784, 256},
+     3 * 2.0 * 256 * (784.0 * 256 + 256.0 * 10), 4.0 * 3 * (256.0 * 784 + 784.0 * 256)},
+};
+
+/* Free the tensors created since the context tracked `mark` of them */
+static void release_since(MTContext *ctx, BenchState *s, int mark) {
+        for (int i = 0; i < 4; i++)
+                if (s->params[i] != NULL) s->params[i]->grad = NULL;
+        for (int i = mark; i < ctx->ntracked; i++) mt_tensor_free(ctx->tracked[i]);
+        mt_context_defrag(ctx);
+}
+
+static void bench(BenchCase *bc, int nthreads, int first) {
+        MTContext *ctx = mt_new_context();
+        BenchState s   = {0};
+        if (nthreads > 0) ctx->nthreads = nthreads;
+        bc->setup(ctx, &s, bc->shape);
+        mt_context_defrag(ctx);
+        int mark = ctx->ntracked;
+
+        for (int i = 0; i < warmup; i++) bc->run(&s), release_since(ctx, &s, mark);
+
+        double       times[reps];
+        MTAllocStats before = mt_context_get_stats(ctx);
+        for (int i = 0; i < reps; i++) {
+                double t0 = now();
+                bc->run(&s);
+                times[i] = now() - t0;
+                release_since(ctx, &s, mark);
+        }
+        MTAllocStats after = mt_context_get_stats(ctx);
+        long         calls = after.nallocs - before.nallocs;
+        long         bufs  = calls + after.pool_hits - before.pool_hits;
+
+        qsort(times, reps, sizeof(double), cmp_double);
+        double median = times[reps / 2], p99 = times[(int)(0.99 * (reps - 1) + 0.5)];
+        printf("%s\n    {\"name\": \"%s\", \"median_ms\": %.4f, \"p99_ms\": %.4f, \"gflops\": %.3f, "
+               "\"gbps\": %.3f, \"allocs_per_op\": %.1f, \"allocator_calls_per_op\": %.1f}",
+               first ? "" : ",", bc->name, median * 1e3, p99 * 1e3, bc->flops / median * 1e-9,
+               bc->bytes / median * 1e-9, (double)bufs / reps, (double)calls / reps);
+        fflush(stdout);
+        mt_context_free(ctx);
+}
+
+int main(int argc, char **argv) {
+        int nthreads = 0, opt;
+        while ((opt = getopt(argc, argv, "r:w:t:")) != -1) {
+                if (opt == 'r') reps = atoi(optarg);
+                else if (opt == 'w') warmup = atoi(optarg);
+                else if (opt == 't') nthreads = atoi(optarg);
+                else {
+                        fprintf(stderr, "usage: %s [-r reps] [-w warmup] [-t threads] [filter]\n", argv[0]);
+                        return 1;
+                }
+        }
+        if (reps < 1) reps = 1;
+        const char *filter = optind < argc ? argv[optind] : "";
+
+        MTContext *probe = mt_new_context();
+        printf("{\n  \"reps\": %d,\n  \"warmup\": %d,\n  \"threads\": %d,\n  \"results\": [",
+               reps, warmup, nthreads > 0 ? nthreads : probe->nthreads);
+        mt_context_free(probe);
+
+        int first = 1;
+        for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+                if (strstr(cases[i].name, filter) != NULL) bench(cases + i, nthreads, first), first = 0;
+        printf("\n  ]\n}\n");
+        return 0;
+}
@@ -1,13 +1,40 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
 #include "minitensor.h"
 
 #include <math.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
 
 #define INITIAL_CAP 8
 #define INITIAL_N_DEPS 4
 #define MT_EPS 1e-6
+/* Chunk length for staging the operands of a kernel on the stack */
+#define MT_VEC_CHUNK 256
+/* Bytes streamed per read or write when data cannot be used in place */
+#define MT_STREAM_CHUNK (1 << 20)
+/* Positions held by float tensors (gather indices, and the positions of
+ * maxima and top-k) must stay below 2^24, where float still represents
+ * every integer exactly */
+#define MT_INDEX_LIMIT (1L << 24)
 
 #define __mt_newptr(type, len) ((type *)calloc((len), sizeof(type)))
 #define __mt_memcpy(to, from, len) (memcpy(to, from, (len) * sizeof(*from)))
@@ -57,11 +84,883 @@
         __p;                          \
 })
 
+/**
+ * Allocation through the context's MTAllocator. Every block is counted in
+ * the context's statistics: `size` must be the size the block was
+ * allocated (or last reallocated) with.
+ */
+void *__mt_default_alloc(void *user, size_t size, size_t align) {
+        (void)user;
+        void *p = NULL;
+        return posix_memalign(&p, __max(align, sizeof(void *)), __max(size, 1)) == 0 ? p : NULL;
+}
+
+void *__mt_default_realloc(void *user, void *ptr, size_t oldsize, size_t newsize) {
+        (void)user, (void)oldsize;
+        return realloc(ptr, __max(newsize, 1));
+}
+
+void __mt_default_free(void *user, void *ptr, size_t size) {
+        (void)user, (void)size;
+        free(ptr);
+}
+
+/* The histogram bucket of an allocation of `size` bytes */
+int __mt_size_bucket(size_t size) {
+        int b = 0;
+        while (size > 1 && b < MT_ALLOC_NBUCKETS - 1) size >>= 1, b++;
+        return b;
+}
+
+void __mt_stats_alloc(MTContext *ctx, size_t size) {
+        MTAllocStats *s = &ctx->stats;
+        s->live_bytes += size;
+        s->peak_bytes = __max(s->peak_bytes, s->live_bytes);
+        s->nallocs++;
+        s->histogram[__mt_size_bucket(size)]++;
+}
+
+void __mt_stats_free(MTContext *ctx, size_t size) {
+        ctx->stats.live_bytes -= size;
+        ctx->stats.nfrees++;
+}
+
+void *__mt_ctx_alloc(MTContext *ctx, size_t size, size_t align) {
+        void *p = ctx->allocator.alloc(ctx->allocator.user, size, align);
+        if (p == NULL) EXIT_WITH_ERROR("out of memory");
+        __mt_stats_alloc(ctx, size);
+        return p;
+}
+
+void *__mt_ctx_realloc(MTContext *ctx, void *ptr, size_t oldsize, size_t newsize) {
+        void *p = ctx->allocator.realloc(ctx->allocator.user, ptr, oldsize, newsize);
+        if (p == NULL) EXIT_WITH_ERROR("out of memory");
+        ctx->stats.live_bytes += newsize - oldsize;
+        ctx->stats.peak_bytes = __max(ctx->stats.peak_bytes, ctx->stats.live_bytes);
+        ctx->stats.nreallocs++;
+        return p;
+}
+
+void __mt_ctx_free(MTContext *ctx, void *ptr, size_t size) {
+        if (ptr == NULL) return;
+        ctx->allocator.free(ctx->allocator.user, ptr, size);
+        __mt_stats_free(ctx, size);
+}
+
+/**
+ * Tensor storage (data buffers and sparse index arrays) is aligned to
+ * MT_DATA_ALIGN bytes. Buffers of at least MT_HUGEPAGE_MIN bytes are backed
+ * by huge pages as the context's `hugepages` asks: HUGEPAGES_THP aligns them
+ * to a huge page and advises the kernel to use transparent huge pages,
+ * HUGEPAGES_HUGETLB maps them from the hugetlbfs pool and falls back to THP
+ * when the pool is exhausted (or a custom allocator is installed). The header
+ * in front of every buffer records how it must be released.
+ */
+#define MT_DATA_ALIGN 64
+#define MT_HUGEPAGE_SIZE (2L << 20)
+#define MT_HUGEPAGE_MIN (4L << 20)
+
+/* Bytes the pool of a new context may hold */
+#define MT_POOL_DEFAULT_LIMIT (1L << 30)
+
+/* `trace` is the index of the buffer in the plan being traced, -1 when none
+ * is; `planned` marks buffers placed in the workspace of a plan */
+typedef struct {
+        MTContext *ctx;
+        size_t     size;
+        size_t     maplen;
+        void      *next;
+        long       trace;
+        int        planned;
+} DataHeader;
+
+/**
+ * A buffer requested during the trace of a plan. It is live from the tick
+ * of its request, `birth`, until `death`; the clock ticks on every request,
+ * every free and at the end of every op.
+ */
+typedef struct {
+        size_t nbytes;
+        long   birth, death;
+        int    freed;
+        long   offset;
+} PlanBuffer;
+
+typedef enum { PLAN_IDLE,
+               PLAN_TRACE,
+               PLAN_REPLAY } PlanMode;
+
+struct MTPlan {
+        MTContext    *ctx;
+        MTForwardFunc forward;
+        void         *user;
+        PlanMode      mode;
+        /* the shapes of the inputs the plan was compiled for */
+        int           ninputs, noutputs;
+        int          *ndims, **shapes;
+        /* the buffers in request order */
+        PlanBuffer   *bufs;
+        long          nbufs, cap;
+        /* trace state: the clock, the nesting depth of ops and the first
+         * buffer requested by the outermost op in progress */
+        long          tick;
+        int           depth;
+        long          opfirst;
+        /* replay state: the next buffer to hand out */
+        long          next;
+        char         *workspace;
+        long          wsbytes;
+        MTTensor    **outputs;
+};
+
+/* Bytes a buffer of `nbytes` takes in a workspace, with its header */
+long __mt_plan_slot(size_t nbytes) {
+        return MT_DATA_ALIGN + (nbytes + MT_DATA_ALIGN - 1) / MT_DATA_ALIGN * MT_DATA_ALIGN;
+}
+
+/* Record a request of `nbytes` in the plan being traced, returning its index */
+long __mt_plan_trace_alloc(MTPlan *plan, size_t nbytes) {
+        if (plan->nbufs == plan->cap) {
+                plan->cap  = __max(2 * plan->cap, 64);
+                plan->bufs = realloc(plan->bufs, sizeof(PlanBuffer) * plan->cap);
+        }
+        plan->tick++;
+        plan->bufs[plan->nbufs] = (PlanBuffer){nbytes, plan->tick, plan->tick, 0, 0};
+        return plan->nbufs++;
+}
+
+/* Extend the lifetime of the traced buffer `p` to the current tick */
+void __mt_plan_touch(MTPlan *plan, void *p) {
+        if (p == NULL) return;
+        long id = ((DataHeader *)p - 1)->trace;
+        if (id >= 0 && id < plan->nbufs) plan->bufs[id].death = plan->tick;
+}
+
+void __mt_plan_touch_tensor(MTPlan *plan, MTTensor *t) {
+        if (t == NULL) return;
+        if (t->external == NULL) __mt_plan_touch(plan, t->data), __mt_plan_touch(plan, t->lpdata);
+        __mt_plan_touch(plan, t->rowptr);
+        __mt_plan_touch(plan, t->colidx);
+        __mt_plan_touch(plan, t->rowidx);
+}
+
+/* Hand out the next buffer of the plan being replayed */
+void *__mt_plan_alloc(MTPlan *plan, size_t nbytes, int zero) {
+        if (plan->next >= plan->nbufs || plan->bufs[plan->next].nbytes != nbytes)
+                EXIT_WITH_ERROR("the forward pass requested buffers its plan was not compiled for");
+        char       *p = plan->workspace + plan->bufs[plan->next++].offset + MT_DATA_ALIGN;
+        DataHeader *h = (DataHeader *)p - 1;
+        *h            = (DataHeader){.ctx = plan->ctx, .trace = -1, .planned = 1};
+        if (zero) memset(p, 0, nbytes);
+        return p;
+}
+
+/**
+ * The size class of a block of `n` bytes: blocks up to 64 bytes share class
+ * 0, larger ones are rounded up to a quarter of their power of two. Returns
+ * the class size and stores the class index in `cls`.
+ */
+size_t __mt_pool_class(size_t n, int *cls) {
+        if (n <= 64) {
+                *cls = 0;
+                return 64;
+        }
+        int    k = 63 - __builtin_clzl(n - 1);
+        size_t q = (size_t)1 << (k - 2);
+        size_t j = (n - 1 - ((size_t)1 << k)) / q;
+        *cls     = (k - 6) * 4 + j + 1;
+        return ((size_t)1 << k) + (j + 1) * q;
+}
+
+/**
+ * Allocate a data buffer of `nbytes`, zero-filled only when `zero` is set.
+ * Freed buffers of the same size class are reused before asking the
+ * allocator.
+ */
+void *__mt_data_alloc(MTContext *ctx, size_t nbytes, int zero) {
+        if (ctx->plan != NULL && ctx->plan->mode == PLAN_REPLAY)
+                return __mt_plan_alloc(ctx->plan, nbytes, zero);
+        long trace = ctx->plan != NULL ? __mt_plan_trace_alloc(ctx->plan, nbytes) : -1;
+        int  cls;
+        int    huge   = ctx->hugepages != HUGEPAGES_OFF && nbytes >= MT_HUGEPAGE_MIN;
+        size_t total  = __mt_pool_class(nbytes + MT_DATA_ALIGN, &cls);
+        size_t maplen = 0;
+        char  *base   = NULL;
+        ctx->stats.requested_bytes += nbytes;
+        if (ctx->pool.free[cls] != NULL) {
+                DataHeader *h       = (DataHeader *)ctx->pool.free[cls] - 1;
+                ctx->pool.free[cls] = h->next;
+                ctx->stats.cached_bytes -= h->size;
+                ctx->stats.pool_hits++;
+                h->trace = trace;
+                if (zero) memset((char *)h + sizeof(*h), 0, nbytes);
+                return (char *)h + sizeof(*h);
+        }
+#ifdef MAP_HUGETLB
+        if (huge && ctx->hugepages == HUGEPAGES_HUGETLB &&
+            ctx->allocator.alloc == __mt_default_alloc) {
+                maplen = (total + MT_HUGEPAGE_SIZE - 1) / MT_HUGEPAGE_SIZE * MT_HUGEPAGE_SIZE;
+                base   = mmap(NULL, maplen, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+                if (base == MAP_FAILED)
+                        base = NULL, maplen = 0;
+                else
+                        __mt_stats_alloc(ctx, maplen);
+        }
+#endif
+        if (base == NULL) {
+                base = __mt_ctx_alloc(ctx, total, huge ? MT_HUGEPAGE_SIZE : MT_DATA_ALIGN);
+#ifdef MADV_HUGEPAGE
+                if (huge) madvise(base, total / MT_HUGEPAGE_SIZE * MT_HUGEPAGE_SIZE, MADV_HUGEPAGE);
+#endif
+                /* fresh mappings are already zero, heap memory is not */
+                if (zero) memset(base + MT_DATA_ALIGN, 0, nbytes);
+        }
+        DataHeader *h = (DataHeader *)(base + MT_DATA_ALIGN) - 1;
+        h->ctx        = ctx;
+        h->size       = total;
+        h->maplen     = maplen;
+        h->trace      = trace;
+        h->planned    = 0;
+        return base + MT_DATA_ALIGN;
+}
+
+/* Hand a buffer back to its allocator, bypassing the pool */
+void __mt_data_release(void *p) {
+        DataHeader *h    = (DataHeader *)p - 1;
+        char       *base = (char *)p - MT_DATA_ALIGN;
+        if (h->maplen > 0) {
+                __mt_stats_free(h->ctx, h->maplen);
+                munmap(base, h->maplen);
+        } else {
+                __mt_ctx_free(h->ctx, base, h->size);
+        }
+}
+
+void __mt_data_free(void *p) {
+        if (p == NULL) return;
+        DataHeader *h   = (DataHeader *)p - 1;
+        MTContext  *ctx = h->ctx;
+        /* the workspace of a plan owns its buffers */
+        if (h->planned) return;
+        if (ctx->plan != NULL && ctx->plan->mode == PLAN_TRACE && h->trace >= 0 &&
+            h->trace < ctx->plan->nbufs) {
+                ctx->plan->tick++;
+                __mt_plan_touch(ctx->plan, p);
+                ctx->plan->bufs[h->trace].freed = 1;
+        }
+        if (h->maplen == 0 && ctx->stats.cached_bytes + (long)h->size <= ctx->pool.limit) {
+                int cls;
+                __mt_pool_class(h->size, &cls);
+                h->next             = ctx->pool.free[cls];
+                ctx->pool.free[cls] = p;
+                ctx->stats.cached_bytes += h->size;
+                return;
+        }
+        __mt_data_release(p);
+}
+
+/* Release every buffer cached in the pool of `ctx` */
+void mt_context_trim_pool(MTContext *ctx) {
+        for (int c = 0; c < MT_POOL_NCLASSES; c++)
+                while (ctx->pool.free[c] != NULL) {
+                        void *p           = ctx->pool.free[c];
+                        ctx->pool.free[c] = ((DataHeader *)p - 1)->next;
+                        ctx->stats.cached_bytes -= ((DataHeader *)p - 1)->size;
+                        __mt_data_release(p);
+                }
+}
+
+/**
+ * Bound the bytes the pool may hold (0 disables pooling), releasing the
+ * cached buffers when the pool is over the new limit.
+ */
+void mt_context_set_pool_limit(MTContext *ctx, long bytes) {
+        ctx->pool.limit = __max(bytes, 0);
+        if (ctx->stats.cached_bytes > ctx->pool.limit) mt_context_trim_pool(ctx);
+}
+
+/* Profiling */
+
+/* One recorded op or backward call */
+typedef struct {
+        const char   *name;
+        int           backward;
+        double        start, dur, self; /* seconds */
+        long          bytes;
+        long          tid;
+        char         *shapes;
+} ProfEvent;
+
+#define MT_PROF_MAXDEPTH 64
+
+/**
+ * The profiler of a context. Ops called from within other ops nest; the
+ * time of the nested ones is accumulated in `child` so that every event
+ * also gets its self time.
+ */
+struct MTProfiler {
+        int        active;
+        double     origin;
+        ProfEvent *events;
+        long       nevents, cap;
+        int        depth;
+        double     child[MT_PROF_MAXDEPTH];
+};
+
+/* An op in progress; `on` is unset when the profiler is not recording */
+typedef struct {
+        MTContext *ctx;
+        int        on;
+        double     start;
+        long       bytes;
+} ProfScope;
+
+double __mt_prof_now(void) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+ProfScope __mt_prof_begin(MTContext *ctx) {
+        ProfScope ps = {.ctx = ctx};
+        if (ctx->plan != NULL && ctx->plan->mode == PLAN_TRACE && ctx->plan->depth++ == 0)
+                ctx->plan->opfirst = ctx->plan->nbufs;
+        if (ctx->profiler == NULL || !ctx->profiler->active) return ps;
+        MTProfiler *p = ctx->profiler;
+        if (++p->depth < MT_PROF_MAXDEPTH) p->child[p->depth] = 0;
+        ps.on    = 1;
+        ps.bytes = ctx->stats.requested_bytes;
+        ps.start = __mt_prof_now();
+        return ps;
+}
+
+/**
+ * The end of an op in the plan being traced: its inputs are read until now,
+ * and so are the buffers an outermost op requested and did not free, as the
+ * op may have read them after they were last passed to another op.
+ */
+void __mt_plan_op_end(MTPlan *plan, MTTensor **inputs, int ninputs) {
+        plan->tick++;
+        for (int i = 0; i < ninputs; i++) __mt_plan_touch_tensor(plan, inputs[i]);
+        if (--plan->depth == 0)
+                for (long id = plan->opfirst; id < plan->nbufs; id++)
+                        if (!plan->bufs[id].freed) plan->bufs[id].death = plan->tick;
+}
+
+/* Append the shape of `t` to `buf` as [d0,d1,...] */
+int __mt_prof_shape(char *buf, size_t len, MTTensor *t) {
+        if (t == NULL) return snprintf(buf, len, "none");
+        int n = snprintf(buf, len, "[");
+        for (int i = 0; i < t->ndims && (size_t)n < len; i++)
+                n += snprintf(buf + n, len - n, i ? ",%d" : "%d", t->shape[i]);
+        return (size_t)n < len ? n + snprintf(buf + n, len - n, "]") : n;
+}
+
+/**
+ * Record the op `name` of `ps` with its `inputs` and output `res`, and
+ * return `res`. The name of the op is kept on `res` either way, so that its
+ * backward calls can be named after it.
+ */
+MTTensor *__mt_prof_end(ProfScope *ps, const char *name, MTTensor *res,
+                        MTTensor **inputs, int ninputs, int backward) {
+        if (res != NULL && !backward) res->op = name;
+        if (ps->ctx->plan != NULL && ps->ctx->plan->mode == PLAN_TRACE)
+                __mt_plan_op_end(ps->ctx->plan, inputs, ninputs);
+        if (!ps->on) return res;
+        MTContext  *ctx  = ps->ctx;
+        MTProfiler *p    = ctx->profiler;
+        double      dur  = __mt_prof_now() - ps->start;
+        double      self = dur - (p->depth < MT_PROF_MAXDEPTH ? p->child[p->depth] : 0);
+        if (--p->depth >= 0 && p->depth < MT_PROF_MAXDEPTH) p->child[p->depth] += dur;
+
+        char buf[256];
+        int  n = 0;
+        for (int i = 0; i < ninputs && (size_t)n < sizeof(buf); i++) {
+                if (i > 0) n += snprintf(buf + n, sizeof(buf) - n, " ");
+                if ((size_t)n < sizeof(buf)) n += __mt_prof_shape(buf + n, sizeof(buf) - n, inputs[i]);
+        }
+        if ((size_t)n < sizeof(buf)) n += snprintf(buf + n, sizeof(buf) - n, " -> ");
+        if ((size_t)n < sizeof(buf)) __mt_prof_shape(buf + n, sizeof(buf) - n, res);
+
+        if (p->nevents == p->cap) {
+                p->cap    = __max(2 * p->cap, 256);
+                p->events = realloc(p->events, sizeof(ProfEvent) * p->cap);
+        }
+#ifdef SYS_gettid
+        long tid = syscall(SYS_gettid);
+#else
+        long tid = (long)pthread_self();
+#endif
+        p->events[p->nevents++] = (ProfEvent){name, backward, ps->start - p->origin, dur, self,
+                                              ctx->stats.requested_bytes - ps->bytes, tid, strdup(buf)};
+        return res;
+}
+
+void __mt_prof_clear(MTProfiler *p) {
+        for (long i = 0; i < p->nevents; i++) free(p->events[i].shapes);
+        p->nevents = 0;
+}
+
+/* Start recording the ops of `ctx`, discarding what was recorded before */
+void mt_profiler_start(MTContext *ctx) {
+        if (ctx->profiler == NULL) ctx->profiler = __mt_newptr(MTProfiler, 1);
+        __mt_prof_clear(ctx->profiler);
+        ctx->profiler->active = 1;
+        ctx->profiler->depth  = 0;
+        ctx->profiler->origin = __mt_prof_now();
+}
+
+void mt_profiler_stop(MTContext *ctx) {
+        if (ctx->profiler != NULL) ctx->profiler->active = 0;
+}
+
+void __mt_profiler_free(MTContext *ctx) {
+        if (ctx->profiler == NULL) return;
+        __mt_prof_clear(ctx->profiler);
+        free(ctx->profiler->events);
+        free(ctx->profiler);
+        ctx->profiler = NULL;
+}
+
+/* Per-name totals for the table of mt_profiler_print */
+typedef struct {
+        const char *name;
+        int         backward;
+        long        calls, bytes;
+        double      total, self;
+} ProfRow;
+
+int __mt_prof_row_cmp(const void *a, const void *b) {
+        double x = ((const ProfRow *)a)->self, y = ((const ProfRow *)b)->self;
+        return (x < y) - (x > y);
+}
+
+/**
+ * Print the recorded events aggregated per op (backward calls separately),
+ * by decreasing self time: the time spent in the op itself rather than in
+ * the ops it called.
+ */
+void mt_profiler_print(MTContext *ctx) {
+        MTProfiler *p    = ctx->profiler;
+        long        n    = p == NULL ? 0 : p->nevents, nrows = 0;
+        ProfRow    *rows = __mt_newptr(ProfRow, __max(n, 1));
+        for (long i = 0; i < n; i++) {
+                ProfEvent *e = p->events + i;
+                long       r = 0;
+                while (r < nrows && (rows[r].backward != e->backward || strcmp(rows[r].name, e->name) != 0)) r++;
+                if (r == nrows) rows[nrows++] = (ProfRow){.name = e->name, .backward = e->backward};
+                rows[r].calls++;
+                rows[r].bytes += e->bytes;
+                rows[r].total += e->dur;
+                rows[r].self += e->self;
+        }
+        qsort(rows, nrows, sizeof(ProfRow), __mt_prof_row_cmp);
+
+        printf("%-28s %8s %12s %12s %12s %14s\n", "op", "calls", "total ms", "self ms", "avg us", "bytes");
+        for (long r = 0; r < nrows; r++) {
+                char name[64];
+                snprintf(name, sizeof(name), "%s%s", rows[r].name, rows[r].backward ? ".backward" : "");
+                printf("%-28s %8ld %12.3f %12.3f %12.2f %14ld\n", name, rows[r].calls, rows[r].total * 1e3,
+                       rows[r].self * 1e3, rows[r].total / rows[r].calls * 1e6, rows[r].bytes);
+        }
+        free(rows);
+}
+
+/* Write the recorded events as a Chrome trace_event file, to be opened in
+ * chrome://tracing or Perfetto */
+void mt_profiler_write_trace(MTContext *ctx, const char *path) {
+        FILE *f = fopen(path, "w");
+        if (f == NULL) EXIT_WITH_ERROR("failed to open the trace file for writing");
+        MTProfiler *p = ctx->profiler;
+        fprintf(f, "{\"traceEvents\": [");
+        for (long i = 0; p != NULL && i < p->nevents; i++) {
+                ProfEvent *e = p->events + i;
+                fprintf(f,
+                        "%s\n{\"name\": \"%s%s\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, "
+                        "\"dur\": %.3f, \"pid\": %ld, \"tid\": %ld, \"args\": {\"shapes\": \"%s\", "
+                        "\"bytes\": %ld, \"self_us\": %.3f}}",
+                        i ? "," : "", e->name, e->backward ? ".backward" : "", e->backward ? "backward" : "op",
+                        e->start * 1e6, e->dur * 1e6, (long)getpid(), e->tid, e->shapes, e->bytes,
+                        e->self * 1e6);
+        }
+        fprintf(f, "\n], \"displayTimeUnit\": \"ms\"}\n");
+        if (fclose(f) != 0) EXIT_WITH_ERROR("failed to write the trace file");
+}
+
+/* Memory plans */
+
+/* Whether `p` points into the workspace of `plan` */
+int __mt_plan_owns(MTPlan *plan, void *p) {
+        uintptr_t ws = (uintptr_t)plan->workspace;
+        return plan->workspace != NULL && (uintptr_t)p >= ws && (uintptr_t)p < ws + plan->wsbytes;
+}
+
+/**
+ * Free the tensors `ctx` tracks from `mark` on, except the `nkeep` of
+ * `keep`. Their storage in the workspace of `plan` is dropped first, as a
+ * buffer that died during the run may have its header overwritten.
+ */
+void __mt_plan_release(MTContext *ctx, MTPlan *plan, int mark, MTTensor **keep, int nkeep) {
+        for (int i = mark; i < ctx->ntracked; i++) {
+                MTTensor *t    = ctx->tracked[i];
+                int       kept = 0;
+                for (int k = 0; k < nkeep && !kept; k++) kept = keep[k] == t;
+                if (t == NULL || kept) continue;
+                if (plan != NULL) {
+                        if (__mt_plan_owns(plan, t->data)) t->data = NULL;
+                        if (__mt_plan_owns(plan, t->lpdata)) t->lpdata = NULL;
+                        if (__mt_plan_owns(plan, t->rowptr)) t->rowptr = NULL;
+                        if (__mt_plan_owns(plan, t->colidx)) t->colidx = NULL;
+                        if (__mt_plan_owns(plan, t->rowidx)) t->rowidx = NULL;
+                }
+                mt_tensor_free(t);
+        }
+        mt_context_defrag(ctx);
+}
+
+/* Largest buffers first, then by request */
+int __mt_plan_size_cmp(const void *a, const void *b) {
+        const PlanBuffer *x = *(PlanBuffer *const *)a, *y = *(PlanBuffer *const *)b;
+        if (x->nbytes != y->nbytes) return (x->nbytes < y->nbytes) - (x->nbytes > y->nbytes);
+        return (x->birth > y->birth) - (x->birth < y->birth);
+}
+
+int __mt_plan_offset_cmp(const void *a, const void *b) {
+        long x = (*(PlanBuffer *const *)a)->offset, y = (*(PlanBuffer *const *)b)->offset;
+        return (x > y) - (x < y);
+}
+
+/**
+ * Give every buffer of `plan` an offset in the workspace, the largest first:
+ * each goes to the lowest offset where it does not overlap any buffer
+ * already placed whose lifetime overlaps its own.
+ */
+void __mt_plan_place(MTPlan *plan) {
+        PlanBuffer **order = malloc(sizeof(PlanBuffer *) * __max(plan->nbufs, 1));
+        PlanBuffer **live  = malloc(sizeof(PlanBuffer *) * __max(plan->nbufs, 1));
+        for (long i = 0; i < plan->nbufs; i++) order[i] = plan->bufs + i;
+        qsort(order, plan->nbufs, sizeof(PlanBuffer *), __mt_plan_size_cmp);
+
+        plan->wsbytes = 0;
+        for (long i = 0; i < plan->nbufs; i++) {
+                PlanBuffer *b     = order[i];
+                long        nlive = 0;
+                for (long j = 0; j < i; j++)
+                        if (order[j]->birth <= b->death && b->birth <= order[j]->death) live[nlive++] = order[j];
+                qsort(live, nlive, sizeof(PlanBuffer *), __mt_plan_offset_cmp);
+
+                long off = 0, slot = __mt_plan_slot(b->nbytes);
+                for (long j = 0; j < nlive && off + slot > live[j]->offset; j++)
+                        off = __max(off, live[j]->offset + __mt_plan_slot(live[j]->nbytes));
+                b->offset     = off;
+                plan->wsbytes = __max(plan->wsbytes, off + slot);
+        }
+        free(order);
+        free(live);
+}
+
+/**
+ * Trace `forward` on `inputs` and plan the `noutputs` outputs and the
+ * intermediates it creates into one workspace. The tensors created by the
+ * trace are freed before returning.
+ */
+MTPlan *mt_plan_compile(MTContext *ctx, MTForwardFunc forward, MTTensor **inputs,
+                        int ninputs, int noutputs, void *user) {
+        if (ctx->plan != NULL)
+                EXIT_WITH_ERROR("plans cannot be compiled or run within a forward pass");
+        MTPlan *plan   = __mt_newptr(MTPlan, 1);
+        plan->ctx      = ctx;
+        plan->forward  = forward;
+        plan->user     = user;
+        plan->ninputs  = ninputs;
+        plan->noutputs = noutputs;
+        plan->ndims    = __mt_newptr(int, __max(ninputs, 1));
+        plan->shapes   = __mt_newptr(int *, __max(ninputs, 1));
+        plan->outputs  = __mt_newptr(MTTensor *, __max(noutputs, 1));
+        for (int i = 0; i < ninputs; i++) {
+                plan->ndims[i]  = inputs[i]->ndims;
+                plan->shapes[i] = __mt_newptr(int, __max(inputs[i]->ndims, 1));
+                __mt_memcpy(plan->shapes[i], inputs[i]->shape, inputs[i]->ndims);
+        }
+
+        mt_context_defrag(ctx);
+        int mark   = ctx->ntracked;
+        plan->mode = PLAN_TRACE;
+        ctx->plan  = plan;
+        forward(ctx, inputs, plan->outputs, user);
+        if (plan->depth != 0) EXIT_WITH_ERROR("the forward pass returned within an op");
+        plan->tick++;
+        for (int i = 0; i < noutputs; i++) __mt_plan_touch_tensor(plan, plan->outputs[i]);
+        ctx->plan  = NULL;
+        plan->mode = PLAN_IDLE;
+        __mt_plan_release(ctx, NULL, mark, NULL, 0);
+        memset(plan->outputs, 0, sizeof(MTTensor *) * noutputs);
+
+        __mt_plan_place(plan);
+        plan->workspace = __mt_ctx_alloc(ctx, __max(plan->wsbytes, MT_DATA_ALIGN), MT_DATA_ALIGN);
+        return plan;
+}
+
+/**
+ * Run the forward of `plan` on `inputs`, which must have the shapes it was
+ * compiled for, and store its outputs in `outputs` unless it is NULL. The
+ * outputs of the previous run are freed.
+ */
+void mt_plan_run(MTPlan *plan, MTTensor **inputs, MTTensor **outputs) {
+        MTContext *ctx = plan->ctx;
+        if (ctx->plan != NULL)
+                EXIT_WITH_ERROR("plans cannot be compiled or run within a forward pass");
+        for (int i = 0; i < plan->ninputs; i++)
+                if (inputs[i]->ndims != plan->ndims[i] ||
+                    memcmp(inputs[i]->shape, plan->shapes[i], sizeof(int) * plan->ndims[i]) != 0)
+                        EXIT_WITH_ERROR("the inputs do not have the shapes the plan was compiled for");
+        for (int i = 0; i < plan->noutputs; i++) {
+                mt_tensor_free(plan->outputs[i]);
+                plan->outputs[i] = NULL;
+        }
+
+        mt_context_defrag(ctx);
+        int mark   = ctx->ntracked;
+        plan->mode = PLAN_REPLAY;
+        plan->next = 0;
+        ctx->plan  = plan;
+        plan->forward(ctx, inputs, plan->outputs, plan->user);
+        ctx->plan  = NULL;
+        plan->mode = PLAN_IDLE;
+        if (plan->next != plan->nbufs)
+                EXIT_WITH_ERROR("the forward pass requested buffers its plan was not compiled for");
+        __mt_plan_release(ctx, plan, mark, plan->outputs, plan->noutputs);
+        if (outputs != NULL) memcpy(outputs, plan->outputs, sizeof(MTTensor *) * plan->noutputs);
+}
+
+MTPlanStats mt_plan_get_stats(MTPlan *plan) {
+        MTPlanStats st = {.workspace_bytes = plan->wsbytes, .nbuffers = plan->nbufs};
+        for (long i = 0; i < plan->nbufs; i++) st.buffer_bytes += __mt_plan_slot(plan->bufs[i].nbytes);
+        return st;
+}
+
+void mt_plan_free(MTPlan *plan) {
+        if (plan == NULL) return;
+        for (int i = 0; i < plan->noutputs; i++) mt_tensor_free(plan->outputs[i]);
+        for (int i = 0; i < plan->ninputs; i++) free(plan->shapes[i]);
+        __mt_ctx_free(plan->ctx, plan->workspace, __max(plan->wsbytes, MT_DATA_ALIGN));
+        free(plan->outputs);
+        free(plan->shapes);
+        free(plan->ndims);
+        free(plan->bufs);
+        free(plan);
+}
+
+/**
+ * Reduced-precision storage. Tensors of dtype DTYPE_FLOAT16 or DTYPE_BFLOAT16
+ * keep 16-bit elements in `lpdata`, and kernels widen them to float32 in
+ * stack-sized chunks, compute in float32, and narrow the results back. The
+ * conversions round to nearest even.
+ */
+int __mt_dtype_size(MtDtype dtype) {
+        switch (dtype) {
+                case DTYPE_FLOAT32:
+                        return sizeof(float);
+                case DTYPE_INT8:
+                        return sizeof(int8_t);
+                default:
+                        return sizeof(uint16_t);
+        }
+}
+
+/* The dtype kernels produce for an input of `dtype`. Int8 tensors carry
+ * quantization parameters that a generic kernel cannot pick for its output,
+ * so they compute into float32. */
+inline MtDtype __mt_result_dtype(MtDtype dtype) {
+        return dtype == DTYPE_INT8 ? DTYPE_FLOAT32 : dtype;
+}
+
+inline float __mt_bf16_to_f32(uint16_t h) {
+        uint32_t u = (uint32_t)h << 16;
+        float    f;
+        memcpy(&f, &u, sizeof(f));
+        return f;
+}
+
+inline uint16_t __mt_f32_to_bf16(float f) {
+        uint32_t u;
+        memcpy(&u, &f, sizeof(u));
+        if ((u & 0x7fffffff) > 0x7f800000) return (u >> 16) | 0x40; /* NaN */
+        return (u + 0x7fff + ((u >> 16) & 1)) >> 16;
+}
+
+inline float __mt_f16_to_f32(uint16_t h) {
+        uint32_t u   = (uint32_t)(h & 0x7fff) << 13;
+        uint32_t exp = u & (0x7c00 << 13);
+        float    f;
+        u += (127 - 15) << 23;
+        if (exp == 0x7c00 << 13) {
+                u += (128 - 16) << 23; /* inf or NaN */
+                memcpy(&f, &u, sizeof(f));
+        } else if (exp == 0) {
+                /* zero or subnormal: renormalize through float arithmetic */
+                u += 1 << 23;
+                memcpy(&f, &u, sizeof(f));
+                f -= 6.103515625e-05f;
+        } else {
+                memcpy(&f, &u, sizeof(f));
+        }
+        return (h & 0x8000) ? -f : f;
+}
+
+inline uint16_t __mt_f32_to_f16(float f) {
+        uint32_t u;
+        memcpy(&u, &f, sizeof(u));
+        uint32_t sign = (u >> 16) & 0x8000;
+        uint16_t o;
+        u &= 0x7fffffff;
+        if (u >= 0x47800000) {
+                o = u > 0x7f800000 ? 0x7e00 : 0x7c00; /* NaN or overflow */
+        } else if (u < 0x38800000) {
+                /* subnormal or zero: let float addition do the rounding */
+                float a;
+                memcpy(&a, &u, sizeof(a));
+                a += 0.5f;
+                memcpy(&u, &a, sizeof(u));
+                o = u - 0x3f000000;
+        } else {
+                u += ((uint32_t)(15 - 127) << 23) + 0xfff + ((u >> 13) & 1);
+                o = u >> 13;
+        }
+        return o | sign;
+}
+
+/* Widen `n` elements of a `dtype` buffer into float32 */
+void __mt_widen(const void *src, MtDtype dtype, float *dst, long n) {
+        const uint16_t *h = src;
+        switch (dtype) {
+                case DTYPE_FLOAT32:
+                        memcpy(dst, src, n * sizeof(float));
+                        break;
+                case DTYPE_FLOAT16:
+                        for (long i = 0; i < n; i++) dst[i] = __mt_f16_to_f32(h[i]);
+                        break;
+                case DTYPE_BFLOAT16:
+                        for (long i = 0; i < n; i++) dst[i] = __mt_bf16_to_f32(h[i]);
+                        break;
+                case DTYPE_INT8:
+                        EXIT_WITH_ERROR("int8 data cannot be widened without its tensor");
+        }
+}
+
+/* Narrow `n` float32 elements into a `dtype` buffer */
+void __mt_narrow(const float *src, void *dst, MtDtype dtype, long n) {
+        uint16_t *h = dst;
+        switch (dtype) {
+                case DTYPE_FLOAT32:
+                        memcpy(dst, src, n * sizeof(float));
+                        break;
+                case DTYPE_FLOAT16:
+                        for (long i = 0; i < n; i++) h[i] = __mt_f32_to_f16(src[i]);
+                        break;
+                case DTYPE_BFLOAT16:
+                        for (long i = 0; i < n; i++) h[i] = __mt_f32_to_bf16(src[i]);
+                        break;
+                case DTYPE_INT8:
+                        EXIT_WITH_ERROR("int8 tensors must be created by mt_tensor_quantize");
+        }
+}
+
+/* Exit unless `t` is a dense tensor, for the kernels that only handle those */
+inline void __mt_assert_dense(MTTensor *t) {
+        if (t->layout != LAYOUT_DENSE)
+                EXIT_WITH_ERROR("sparse tensors must be converted by mt_sparse_to_dense first");
+}
+
+/* The quantization channel of the element at linear offset `off` of `t` */
+inline long __mt_qchannel(MTTensor *t, long off) {
+        return t->qaxis < 0 ? 0 : (off / t->strides[t->qaxis]) % t->shape[t->qaxis];
+}
+
+/* The element at linear offset `off` of `t`, widened to float32 */
+float __mt_tensor_load(MTTensor *t, long off) {
+        if (t->dtype == DTYPE_FLOAT32) return t->data[off];
+        if (t->dtype == DTYPE_INT8) {
+                long c = __mt_qchannel(t, off);
+                return (((int8_t *)t->lpdata)[off] - t->qzero[c]) * t->qscale[c];
+        }
+        uint16_t h = ((uint16_t *)t->lpdata)[off];
+        return t->dtype == DTYPE_FLOAT16 ? __mt_f16_to_f32(h) : __mt_bf16_to_f32(h);
+}
+
+/**
+ * Return elements [off, off + n) of `t` as float32. Float32 tensors are
+ * returned in place; the others are widened into `buf`, which must hold `n`
+ * floats.
+ */
+const float *__mt_load_chunk(MTTensor *t, long off, long n, float *buf) {
+        if (t->dtype == DTYPE_FLOAT32) return t->data + off;
+        if (t->dtype == DTYPE_INT8) {
+                for (long i = 0; i < n; i++) buf[i] = __mt_tensor_load(t, off + i);
+                return buf;
+        }
+        __mt_widen((uint16_t *)t->lpdata + off, t->dtype, buf, n);
+        return buf;
+}
+
+/**
+ * The buffer a kernel should write elements [off, off + n) of `t` into: the
+ * tensor data itself for float32, otherwise `buf`, to be narrowed into the
+ * tensor by __mt_store_chunk.
+ */
+float *__mt_out_chunk(MTTensor *t, long off, float *buf) {
+        return t->dtype == DTYPE_FLOAT32 ? t->data + off : buf;
+}
+
+void __mt_store_chunk(MTTensor *t, long off, long n, const float *buf) {
+        if (t->dtype != DTYPE_FLOAT32)
+                __mt_narrow(buf, (uint16_t *)t->lpdata + off, t->dtype, n);
+}
+
+/* Convert the storage of `t` into `dtype` in place */
+void __mt_tensor_set_dtype(MTTensor *t, MtDtype dtype) {
+        if (t->dtype == dtype) return;
+        if (dtype == DTYPE_INT8)
+                EXIT_WITH_ERROR("int8 tensors must be created by mt_tensor_quantize");
+        mt_tensor_make_writable(t);
+
+        float *wide = t->data;
+        if (t->dtype != DTYPE_FLOAT32) {
+                wide = __mt_data_alloc(t->context, sizeof(float) * t->datalen, 0);
+                for (long i = 0; i < t->datalen; i++)
+                        wide[i] = __mt_tensor_load(t, i);
+                __mt_data_free(t->lpdata), free(t->qscale), free(t->qzero);
+                t->lpdata = NULL, t->qscale = NULL, t->qzero = NULL;
+        }
+        if (dtype == DTYPE_FLOAT32) {
+                t->data = wide;
+        } else {
+                t->lpdata = __mt_data_alloc(t->context, sizeof(uint16_t) * t->datalen, 0);
+                __mt_narrow(wide, t->lpdata, dtype, t->datalen);
+                __mt_data_free(wide);
+                t->data = NULL;
+        }
+        t->dtype = dtype;
+}
+
 MTTensor *mt_alloc_empty_tensor(MTContext *ctx) {
         MTTensor *t = __mt_newptr(MTTensor, 1);
         t->context  = ctx;
         t->data     = NULL;
         t->datalen  = 0;
+        t->dtype    = DTYPE_FLOAT32;
+        t->lpdata   = NULL;
+        t->qscale   = NULL;
+        t->qzero    = NULL;
+        t->qaxis    = -1;
+        t->layout   = LAYOUT_DENSE;
+        t->rowptr   = NULL;
+        t->colidx   = NULL;
+        t->rowidx   = NULL;
+        t->external = NULL;
+        t->storage  = NULL;
+        t->name     = NULL;
         t->deps     = __mt_newptr(Dependency *, INITIAL_N_DEPS);
         t->grad     = NULL;
         t->indices  = NULL;
@@ -72,14 +971,15 @@ MTTensor *mt_alloc_empty_tensor(MTContext *ctx) {
         t->req_grad = 0;
         t->shape    = NULL;
         t->strides  = NULL;
+        t->version  = ++ctx->version_clock;
         mt_context_push_tensor(ctx, t);
         return t;
 }
 
 inline void __init_strides(MTTensor *t) {
-        t->strides = __mt_newptr(int, t->ndims);
+        t->strides = __mt_newptr(long, t->ndims);
         for (int i = 0; i < t->ndims; i++) {
-                int prod = 1;
+                long prod = 1;
                 for (int j = i + 1; j < t->ndims; j++) {
                         prod *= t->shape[j];
                 }
@@ -106,34 +1006,101 @@ inline void __init_indices(MTTensor *t) {
         }
 }
 
-MTTensor *mt_new_tensor(MTContext *context,
-                        float *data, int *shape,
-                        int ndims) {
-        int datalen = __prod(shape, ndims, int);
-
+/* A tensor with the given shape and dtype, but no data attached yet */
+MTTensor *__mt_new_tensor_meta(MTContext *context, int *shape, int ndims,
+                               MtDtype dtype) {
         MTTensor *t = mt_alloc_empty_tensor(context);
-        t->data     = __mt_newptr(float, datalen);
-        t->datalen  = datalen;
+        t->dtype    = dtype;
+        t->datalen  = __prod(shape, ndims, long);
         t->ndims    = ndims;
         t->shape    = __mt_newptr(int, ndims);
-        __mt_memcpy(t->data, data, datalen);
         __mt_memcpy(t->shape, shape, ndims);
         __init_strides(t);
         __init_indices(t);
         return t;
 }
 
+MTTensor *__mt_new_tensor_alloc(MTContext *context, int *shape, int ndims,
+                                MtDtype dtype, int zero) {
+        MTTensor *t   = __mt_new_tensor_meta(context, shape, ndims, dtype);
+        void     *buf = __mt_data_alloc(context, t->datalen * __mt_dtype_size(dtype), zero);
+        if (dtype == DTYPE_FLOAT32)
+                t->data = buf;
+        else
+                t->lpdata = buf;
+        return t;
+}
+
+/**
+ * Allocate a tensor with the given shape and dtype whose data is left for the
+ * caller to fill. Kernels use this to write their results directly into the
+ * tensor instead of into a temporary buffer that mt_new_tensor would copy.
+ * The data is not initialized: kernels that accumulate into their result
+ * allocate it with __mt_new_tensor_zeros instead.
+ */
+MTTensor *__mt_new_tensor_uninit_dtype(MTContext *context, int *shape,
+                                       int ndims, MtDtype dtype) {
+        return __mt_new_tensor_alloc(context, shape, ndims, dtype, 0);
+}
+
+MTTensor *__mt_new_tensor_uninit(MTContext *context, int *shape, int ndims) {
+        return __mt_new_tensor_alloc(context, shape, ndims, DTYPE_FLOAT32, 0);
+}
+
+/* Allocate a zero-filled float32 tensor */
+MTTensor *__mt_new_tensor_zeros(MTContext *context, int *shape, int ndims) {
+        return __mt_new_tensor_alloc(context, shape, ndims, DTYPE_FLOAT32, 1);
+}
+
+MTTensor *mt_new_tensor(MTContext *context,
+                        float *data, int *shape,
+                        int ndims) {
+        MTTensor *t = __mt_new_tensor_uninit(context, shape, ndims);
+        __mt_memcpy(t->data, data, t->datalen);
+        return t;
+}
+
+/* Create a tensor of `dtype` from float32 `data`, narrowing it on the way */
+MTTensor *mt_new_tensor_dtype(MTContext *context, float *data, int *shape,
+                              int ndims, MtDtype dtype) {
+        MTTensor *t = __mt_new_tensor_uninit_dtype(context, shape, ndims, dtype);
+        __mt_narrow(data, dtype == DTYPE_FLOAT32 ? (void *)t->data : t->lpdata,
+                    dtype, t->datalen);
+        return t;
+}
+
+/* Return a copy of `t` converted into `dtype` */
+MTTensor *mt_tensor_to_dtype(MTTensor *t, MtDtype dtype) {
+        ProfScope prof = __mt_prof_begin(t->context);
+        __mt_assert_dense(t);
+        MTTensor *res = __mt_new_tensor_uninit_dtype(t->context, t->shape,
+                                                     t->ndims, dtype);
+        float     buf[MT_VEC_CHUNK];
+        for (long i0 = 0; i0 < t->datalen; i0 += MT_VEC_CHUNK) {
+                long         nc  = __min(MT_VEC_CHUNK, t->datalen - i0);
+                const float *src = __mt_load_chunk(t, i0, nc, buf);
+                float       *dst = __mt_out_chunk(res, i0, buf);
+                if (dst != src) memcpy(dst, src, nc * sizeof(float));
+                __mt_store_chunk(res, i0, nc, dst);
+        }
+        return __mt_prof_end(&prof, "to_dtype", res, Arr(MTTensor *, t), 1, 0);
+}
+
 MTTensor *mt_new_tensor_full(MTContext *ctx, float val,
                              int *shape, int ndims) {
-        int    datalen = __prod(shape, ndims, int);
-        float *data    = __mt_newptr(float, datalen);
-        for (long i = 0; i < datalen; i++) data[i] = val;
-        MTTensor *t = mt_new_tensor(ctx, data, shape, ndims);
-        free(data);
+        MTTensor *t = __mt_new_tensor_uninit(ctx, shape, ndims);
+        for (long i = 0; i < t->datalen; i++) t->data[i] = val;
         return t;
 }
 
-inline float mt_tensor_get(MTTensor *t, int *idx, int ndims) {
+/* The flat offset of the element at `idx` under `strides` */
+long __mt_strided_offset(const int *idx, const long *strides, int ndims) {
+        long off = 0;
+        for (int i = 0; i < ndims; i++) off += idx[i] * strides[i];
+        return off;
+}
+
+float mt_tensor_get(MTTensor *t, int *idx, int ndims) {
         switch (ndims) {
                 case 0:
                         return mt_tensor_get_v(t);
@@ -144,30 +1111,29 @@ inline float mt_tensor_get(MTTensor *t, int *idx, int ndims) {
                 case 3:
                         return mt_tensor_get_3(t, idx[0], idx[1], idx[2]);
                 default:
-                        EXIT_WITH_ERROR("tensor access for order >3 is unsupported yet");
-                        break;
+                        return __mt_tensor_load(t, __mt_strided_offset(idx, t->strides, ndims));
         }
-        return 0;
 }
 
 inline float mt_tensor_get_v(MTTensor *t) {
         if (t->ndims != 0) EXIT_WITH_ERROR("t must be 0-tensor");
-        return t->data[0];
+        return __mt_tensor_load(t, 0);
 }
 
 inline float mt_tensor_get_1(MTTensor *t, int i) {
         if (t->ndims != 1) EXIT_WITH_ERROR("t must be 1-tensor");
-        return t->data[i];
+        return __mt_tensor_load(t, i);
 }
 
 inline float mt_tensor_get_2(MTTensor *t, int i, int j) {
         if (t->ndims != 2) EXIT_WITH_ERROR("t must be 2-tensor");
-        return t->data[i * t->strides[0] + j * t->strides[1]];
+        return __mt_tensor_load(t, i * t->strides[0] + j * t->strides[1]);
 }
 
 inline float mt_tensor_get_3(MTTensor *t, int i, int j, int k) {
         if (t->ndims != 3) EXIT_WITH_ERROR("t must be 3-tensor");
-        return t->data[i * t->strides[0] + j * t->strides[1] + k * t->strides[2]];
+        return __mt_tensor_load(t, i * t->strides[0] + j * t->strides[1] +
+                                       k * t->strides[2]);
 }
 
 MTTensor *mt_new_scalar(MTContext *context, float val) {
@@ -238,78 +1204,226 @@ void mt_idxiterator_free(IdxIterator *it) {
         free(it);
 }
 
-MTTensor *mt_tensor_slice(MTContext *ctx, MTTensor *t, int dim,
-                          int *index, int indexlen) {
-        int **newindices = __mt_newptr(int *, t->ndims);
-        int  *newshape   = __mt_newptr(int, t->ndims);
-        for (int i = 0; i < t->ndims; i++) {
-                if (i == dim) {
-                        newshape[i]   = indexlen;
-                        newindices[i] = index;
-                } else {
-                        newshape[i]   = t->shape[i];
-                        newindices[i] = t->indices[i];
+/**
+ * StrideIterator walks two strided views of the same shape in lockstep, a
+ * source and a destination, one contiguous run at a time. Dimensions of
+ * size 1 are dropped and neighbouring dimensions that are laid out
+ * back-to-back in both views are collapsed into one, so a copy between
+ * views only loops over as many dimensions as the layouts really differ in.
+ * After each successful mt_strideiter_next, `offset` holds where the run
+ * starts in each view, and the run spans `inner` elements spaced
+ * `instride` apart.
+ */
+typedef struct {
+        long  *shape;
+        long  *strides[2];
+        long  *idx;
+        int    ndims;
+        long   offset[2];
+        long   inner;
+        long   instride[2];
+        long   remaining;
+} StrideIterator;
+
+StrideIterator *mt_new_strideiter(const int *shape, int ndims,
+                                  const long *sstrides, const long *dstrides) {
+        StrideIterator *it = __mt_newptr(StrideIterator, 1);
+        it->shape          = __mt_newptr(long, __max(ndims, 1));
+        it->strides[0]     = __mt_newptr(long, __max(ndims, 1));
+        it->strides[1]     = __mt_newptr(long, __max(ndims, 1));
+        it->idx            = __mt_newptr(long, __max(ndims, 1));
+
+        int  n      = 0;
+        long outlen = 1;
+        for (int i = 0; i < ndims; i++) {
+                outlen *= shape[i];
+                if (shape[i] == 1) continue;
+                if (n > 0 && it->strides[0][n - 1] == sstrides[i] * shape[i] &&
+                    it->strides[1][n - 1] == dstrides[i] * shape[i]) {
+                        /* dimension i continues the previous one in both views */
+                        it->shape[n - 1] *= shape[i];
+                        it->strides[0][n - 1] = sstrides[i];
+                        it->strides[1][n - 1] = dstrides[i];
+                        continue;
                 }
+                it->shape[n]      = shape[i];
+                it->strides[0][n] = sstrides[i];
+                it->strides[1][n] = dstrides[i];
+                n++;
         }
+        if (n == 0) it->shape[n] = 1, it->strides[0][n] = it->strides[1][n] = 0, n++;
+
+        it->ndims       = n;
+        it->inner       = it->shape[n - 1];
+        it->instride[0] = it->strides[0][n - 1];
+        it->instride[1] = it->strides[1][n - 1];
+        it->remaining   = outlen == 0 ? 0 : outlen / it->inner;
+        it->idx[n - 1]  = -1;
+        return it;
+}
 
-        int    newlen  = __prod(newshape, t->ndims, int);
-        float *newdata = __mt_newptr(float, newlen);
-
-        IdxIterator *it = mt_new_idxiterator(newindices, newshape, t->ndims);
-        for (int i = 0; i < newlen; i++) {
-                int *idxs  = mt_idxiterator_next(it);
-                newdata[i] = mt_tensor_get(t, idxs, t->ndims);
+/* Advance to the next contiguous run, returning 0 once all are visited */
+int mt_strideiter_next(StrideIterator *it) {
+        if (it->remaining-- <= 0) return 0;
+        if (it->idx[it->ndims - 1] < 0) {
+                it->idx[it->ndims - 1] = 0;
+                return 1;
         }
-        MTTensor *newtensor = mt_new_tensor(ctx, newdata, newshape, t->ndims);
-        newtensor->isleaf   = t->isleaf;
-        mt_idxiterator_free(it), free(newshape), free(newindices), free(newdata);
+        /* odometer step over the outer dimensions */
+        for (int i = it->ndims - 2; i >= 0; i--) {
+                it->offset[0] += it->strides[0][i];
+                it->offset[1] += it->strides[1][i];
+                if (++it->idx[i] < it->shape[i]) break;
+                it->offset[0] -= it->strides[0][i] * it->shape[i];
+                it->offset[1] -= it->strides[1][i] * it->shape[i];
+                it->idx[i] = 0;
+        }
+        return 1;
+}
 
-        return newtensor;
+void mt_strideiter_free(StrideIterator *it) {
+        free(it->shape);
+        free(it->strides[0]);
+        free(it->strides[1]);
+        free(it->idx);
+        free(it);
 }
 
 /**
- * Access the tensor data with customized indices, shape, strides, and ndims
- * constraints. This is useful for especially to access data of a tensor
- * without necessarily obeying contiguous order. For example, we can pass
- * swapped shape and swapped strides of a tensor into this function (and fix
- * the other variables) to get the tensor data in a transposed order.
+ * Copy the view of `t` at `offset` with `shape` and `strides` (in elements,
+ * zero for broadcast dimensions) into the float32 buffer `dst` laid out
+ * with `dstrides`. Contiguous runs are copied in bulk, broadcast runs are
+ * filled.
  */
-float *mt_tensor_get_all_data_constrained(MTTensor *t, int **indices,
-                                          int *shape, int *strides, int ndims) {
-        /* Temporarily alter the tensor's properties */
-        int **oldindices = t->indices;
-        int  *oldshape   = t->shape;
-        int  *oldstrides = t->strides;
-        int   oldndims   = t->ndims;
-
-        t->indices = indices;
-        t->shape   = shape;
-        t->strides = strides;
-        t->ndims   = ndims;
-
-        IdxIterator *it     = mt_new_idxiterator(indices, shape, ndims);
-        int          outlen = __prod(shape, ndims, int);
-        float       *res    = __mt_newptr(float, outlen);
-        for (int i = 0; i < outlen; i++) {
-                int *nextidx = mt_idxiterator_next(it);
-                res[i]       = mt_tensor_get(t, nextidx, ndims);
-        }
+void __mt_strided_copy(MTTensor *t, long offset, const int *shape,
+                       const long *strides, int ndims, float *dst,
+                       const long *dstrides) {
+        StrideIterator *it = mt_new_strideiter(shape, ndims, strides, dstrides);
+        long            n  = it->inner, ss = it->instride[0], ds = it->instride[1];
+        while (mt_strideiter_next(it)) {
+                long   soff = offset + it->offset[0];
+                float *out  = dst + it->offset[1];
+                if (ss == 1 && ds == 1 && t->dtype == DTYPE_FLOAT32) {
+                        memcpy(out, t->data + soff, sizeof(float) * n);
+                } else if (ss == 1 && ds == 1) {
+                        float buf[MT_VEC_CHUNK];
+                        for (long i0 = 0; i0 < n; i0 += MT_VEC_CHUNK) {
+                                long nc = __min(MT_VEC_CHUNK, n - i0);
+                                memcpy(out + i0, __mt_load_chunk(t, soff + i0, nc, buf),
+                                       sizeof(float) * nc);
+                        }
+                } else if (ss == 0) {
+                        float v = __mt_tensor_load(t, soff);
+                        for (long i = 0; i < n; i++) out[i * ds] = v;
+                } else if (t->dtype == DTYPE_FLOAT32) {
+                        const float *src = t->data + soff;
+                        for (long i = 0; i < n; i++) out[i * ds] = src[i * ss];
+                } else {
+                        for (long i = 0; i < n; i++) out[i * ds] = __mt_tensor_load(t, soff + i * ss);
+                }
+        }
+        mt_strideiter_free(it);
+}
 
-        mt_idxiterator_free(it);
+/* Row-major strides of `shape` */
+void __mt_contiguous_strides(const int *shape, int ndims, long *strides) {
+        long prod = 1;
+        for (int i = ndims - 1; i >= 0; i--) strides[i] = prod, prod *= shape[i];
+}
 
-        /* Restore the tensor's properties */
-        t->indices = oldindices;
-        t->shape   = oldshape;
-        t->strides = oldstrides;
-        t->ndims   = oldndims;
-        return res;
+/**
+ * Wrap `ptr` into a tensor without copying. `strides` (in elements, NULL for
+ * row-major) describe how `ptr` is laid out. `free_fn`, if not NULL, takes
+ * ownership: it is called with `ptr` once the tensor is freed; otherwise the
+ * memory must outlive the tensor. Kernels expect row-major data, so a buffer
+ * with other strides is gathered into an owned copy instead, and handed to
+ * `free_fn` right away.
+ */
+MTTensor *mt_tensor_from_buffer(MTContext *ctx, float *ptr, int *shape, int ndims,
+                                long *strides, void (*free_fn)(void *)) {
+        MTTensor *t      = __mt_new_tensor_meta(ctx, shape, ndims, DTYPE_FLOAT32);
+        int       rowmaj = 1;
+        for (int i = 0; strides != NULL && i < ndims; i++)
+                if (shape[i] > 1 && strides[i] != t->strides[i]) rowmaj = 0;
+
+        if (!rowmaj) {
+                MTTensor view = *t;
+                view.data     = ptr;
+                t->data       = __mt_data_alloc(ctx, sizeof(float) * t->datalen, 0);
+                __mt_strided_copy(&view, 0, shape, strides, ndims, t->data, t->strides);
+                if (free_fn != NULL) free_fn(ptr);
+                return t;
+        }
+
+        t->data              = ptr;
+        t->external          = __mt_newptr(MTExternal, 1);
+        t->external->refs    = 1;
+        t->external->release = free_fn;
+        t->external->user    = ptr;
+        return t;
+}
+
+/* The float32 slice of `t`, whatever the dtype of `t` is */
+MTTensor *__mt_tensor_slice(MTContext *ctx, MTTensor *t, int dim,
+                            int *index, int indexlen) {
+        __mt_assert_dense(t);
+        int *newshape = __mt_newptr(int, t->ndims);
+        for (int i = 0; i < t->ndims; i++)
+                newshape[i] = i == dim ? indexlen : t->shape[i];
+
+        /* each selected index is a strided view of t, copied in place */
+        MTTensor *newtensor = __mt_new_tensor_uninit(ctx, newshape, t->ndims);
+        int       shape1[t->ndims];
+        memcpy(shape1, newshape, sizeof(int) * t->ndims);
+        shape1[dim] = 1;
+        for (int i = 0; i < indexlen; i++)
+                __mt_strided_copy(t, index[i] * t->strides[dim], shape1, t->strides,
+                                  t->ndims, newtensor->data + i * newtensor->strides[dim],
+                                  newtensor->strides);
+        newtensor->isleaf = t->isleaf;
+        free(newshape);
+
+        return newtensor;
+}
+
+MTTensor *mt_tensor_slice(MTContext *ctx, MTTensor *t, int dim,
+                          int *index, int indexlen) {
+        ProfScope prof = __mt_prof_begin(ctx);
+        MTTensor *res = __mt_tensor_slice(ctx, t, dim, index, indexlen);
+        __mt_tensor_set_dtype(res, __mt_result_dtype(t->dtype));
+        return __mt_prof_end(&prof, "slice", res, Arr(MTTensor *, t), 1, 0);
 }
 
-int *__range(int start, int end) {
-        int *r = __mt_newptr(int, end - start);
-        for (int i = (start); i < (end); i++)
-                r[i] = i;
-        return r;
+/**
+ * Access the tensor data with customized indices, shape, strides, and ndims
+ * constraints. This is useful for especially to access data of a tensor
+ * without necessarily obeying contiguous order. For example, we can pass
+ * swapped shape and swapped strides of a tensor into this function (and fix
+ * the other variables) to get the tensor data in a transposed order.
+ */
+float *mt_tensor_get_all_data_constrained(MTTensor *t, int **indices,
+                                          int *shape, long *strides, int ndims) {
+        long   outlen = __prod(shape, ndims, long);
+        float *res    = __mt_newptr(float, outlen);
+
+        /* Plain ranges, the common case, make the request a strided view */
+        int isrange = 1;
+        for (int i = 0; i < ndims && isrange; i++)
+                for (int j = 0; j < shape[i] && isrange; j++) isrange = indices[i][j] == j;
+        if (isrange) {
+                long dstrides[__max(ndims, 1)];
+                __mt_contiguous_strides(shape, ndims, dstrides);
+                __mt_strided_copy(t, 0, shape, strides, ndims, res, dstrides);
+                return res;
+        }
+
+        IdxIterator *it = mt_new_idxiterator(indices, shape, ndims);
+        for (long i = 0; i < outlen; i++) {
+                int *nextidx = mt_idxiterator_next(it);
+                res[i]       = __mt_tensor_load(t, __mt_strided_offset(nextidx, strides, ndims));
+        }
+        mt_idxiterator_free(it);
+        return res;
 }
 
 BcastResult mt_broadcast_lr(MTTensor *left, MTTensor *right) {
@@ -334,13 +1448,11 @@ BcastResult mt_broadcast_lr(MTTensor *left, MTTensor *right) {
          * the tensors has less dims, prepend the shape array until both have
          * the same number of dimensions.
          */
-        int   outndims = __max(left->ndims, right->ndims);
-        int   lnewshape[outndims], ltmpstrides[outndims];
-        int   rnewshape[outndims], rtmpstrides[outndims];
-        int **lnewindices = __mt_newptr(int *, outndims);
-        int **rnewindices = __mt_newptr(int *, outndims);
-        int   lddiff      = abs(outndims - left->ndims);
-        int   rddiff      = abs(outndims - right->ndims);
+        int outndims = __max(left->ndims, right->ndims);
+        int  lnewshape[outndims], rnewshape[outndims];
+        long ltmpstrides[outndims], rtmpstrides[outndims], outstrides[outndims];
+        int  lddiff = abs(outndims - left->ndims);
+        int  rddiff = abs(outndims - right->ndims);
 
         for (int i = 0; i < outndims; i++) {
                 lnewshape[i]   = i < lddiff ? 1 : left->shape[i - lddiff];
@@ -360,10 +1472,8 @@ BcastResult mt_broadcast_lr(MTTensor *left, MTTensor *right) {
                                 return res;
                         }
                 }
-
-                lnewindices[i] = __range(0, lnewshape[i]);
-                rnewindices[i] = __range(0, rnewshape[i]);
         }
+        __mt_contiguous_strides(lnewshape, outndims, outstrides);
 
         /**
          * Determine whether we should allocate new tensor if left/right
@@ -385,48 +1495,105 @@ BcastResult mt_broadcast_lr(MTTensor *left, MTTensor *right) {
                 if (!__mt_arrsame(rnewshape, right->shape, right->ndims))
                         rshouldbc = 1;
 
-        float *ldata = NULL;
+        /* broadcast dimensions have zero strides, so the copies replicate */
         if (lshouldbc) {
-                ldata            = mt_tensor_get_all_data_constrained(left,
-                                                                      lnewindices,
-                                                                      lnewshape,
-                                                                      ltmpstrides,
-                                                                      outndims);
-                res.left         = mt_new_tensor(left->context, ldata,
-                                                 lnewshape, outndims);
+                res.left = __mt_new_tensor_uninit(left->context, lnewshape, outndims);
+                __mt_strided_copy(left, 0, lnewshape, ltmpstrides, outndims,
+                                  res.left->data, outstrides);
                 res.left->isleaf = left->isleaf;
         }
 
-        float *rdata = NULL;
         if (rshouldbc) {
-                rdata             = mt_tensor_get_all_data_constrained(right,
-                                                                       rnewindices,
-                                                                       rnewshape,
-                                                                       rtmpstrides,
-                                                                       outndims);
-                res.right         = mt_new_tensor(right->context, rdata,
-                                                  rnewshape, outndims);
+                res.right = __mt_new_tensor_uninit(right->context, rnewshape, outndims);
+                __mt_strided_copy(right, 0, rnewshape, rtmpstrides, outndims,
+                                  res.right->data, outstrides);
                 res.right->isleaf = right->isleaf;
         }
 
-        free(ldata), free(rdata);
-        for (int i = 0; i < outndims; i++) {
-                free(lnewindices[i]), free(rnewindices[i]);
-        }
-        free(lnewindices), free(rnewindices);
-
         res.status = BC_STATUS_SUCCESS;
         return res;
 }
 
-void mt_squeeze_at_dim(int targetdim, int *shape, int *strides, int **indices, int ndims) {
+void mt_squeeze_at_dim(int targetdim, int *shape, long *strides, int **indices, int ndims) {
         if (shape[targetdim] != 1) return;
         free(indices[targetdim]);
         for (int i = targetdim; i < ndims - 1; i++) {
-                shape[targetdim]   = shape[targetdim + 1];
-                strides[targetdim] = strides[targetdim + 1];
-                indices[targetdim] = indices[targetdim + 1];
+                shape[i]   = shape[i + 1];
+                strides[i] = strides[i + 1];
+                indices[i] = indices[i + 1];
+        }
+}
+
+/* Drop a tensor's reference to borrowed storage */
+void __mt_external_unref(MTExternal *e) {
+        if (--e->refs > 0) return;
+        if (e->release != NULL) e->release(e->user);
+        free(e);
+}
+
+/**
+ * Drop the share `t` has in its storage. The data is released with the
+ * last share, or, when it is borrowed, with the last borrowing tensor.
+ */
+void __mt_storage_unref(MTTensor *t) {
+        MTStorage *s = t->storage;
+        if (t->external != NULL)
+                __mt_external_unref(t->external);
+        else if (s->refs == 1)
+                __mt_data_free(t->data), __mt_data_free(t->lpdata);
+        if (--s->refs == 0) free(s);
+        t->storage = NULL;
+}
+
+/* Make the tensor `res`, without data yet, share the data of `t` */
+void __mt_tensor_share_storage(MTTensor *res, MTTensor *t) {
+        __mt_assert_dense(t);
+        if (t->storage == NULL) {
+                t->storage       = __mt_newptr(MTStorage, 1);
+                t->storage->refs = 1;
+        }
+        t->storage->refs++;
+        res->storage = t->storage;
+        res->data    = t->data;
+        res->lpdata  = t->lpdata;
+        if (t->external != NULL) res->external = t->external, t->external->refs++;
+        if (t->dtype == DTYPE_INT8) {
+                long nch    = t->qaxis < 0 ? 1 : t->shape[t->qaxis];
+                res->qaxis  = t->qaxis;
+                res->qscale = __mt_newptr(float, nch);
+                res->qzero  = __mt_newptr(int, nch);
+                __mt_memcpy(res->qscale, t->qscale, nch);
+                __mt_memcpy(res->qzero, t->qzero, nch);
+        }
+}
+
+/* A tensor of the shape of `t` sharing its data */
+MTTensor *mt_tensor_share(MTTensor *t) {
+        MTTensor *res = __mt_new_tensor_meta(t->context, t->shape, t->ndims, t->dtype);
+        __mt_tensor_share_storage(res, t);
+        return res;
+}
+
+/**
+ * Give `t` a copy of its data if other tensors share it, so that it can be
+ * written without them seeing the change.
+ */
+void mt_tensor_make_writable(MTTensor *t) {
+        if (t->storage == NULL) return;
+        if (t->storage->refs > 1) {
+                size_t nbytes = t->datalen * __mt_dtype_size(t->dtype);
+                void  *buf    = __mt_data_alloc(t->context, nbytes, 0);
+                memcpy(buf, t->dtype == DTYPE_FLOAT32 ? (void *)t->data : t->lpdata, nbytes);
+                t->storage->refs--;
+                if (t->external != NULL) __mt_external_unref(t->external), t->external = NULL;
+                if (t->dtype == DTYPE_FLOAT32)
+                        t->data = buf;
+                else
+                        t->lpdata = buf;
+        } else {
+                free(t->storage);
         }
+        t->storage = NULL;
 }
 
 void mt_tensor_free(MTTensor *t) {
@@ -441,9 +1608,20 @@ void mt_tensor_free(MTTensor *t) {
 
                 free(t->deps);
 
-                free(t->data);
+                if (t->storage != NULL)
+                        __mt_storage_unref(t);
+                else if (t->external != NULL)
+                        __mt_external_unref(t->external);
+                else
+                        __mt_data_free(t->data), __mt_data_free(t->lpdata);
+                free(t->qscale);
+                free(t->qzero);
+                __mt_data_free(t->rowptr);
+                __mt_data_free(t->colidx);
+                __mt_data_free(t->rowidx);
                 free(t->shape);
                 free(t->strides);
+                free(t->name);
                 __free_indices(t);
                 free(t);
         }
@@ -451,45 +1629,64 @@ void mt_tensor_free(MTTensor *t) {
 
 /* remove NULLs in the tracked list */
 void mt_context_defrag(MTContext *ctx) {
-        MTTensor **newtracked = __mt_newptr(MTTensor *, ctx->ntracked);
-
         int cnt = 0;
         for (int i = 0; i < ctx->ntracked; i++)
-                if (ctx->tracked[i] != NULL) newtracked[cnt++] = ctx->tracked[i];
-        // free the old `tracked` pointers
-        free(ctx->tracked);
+                if (ctx->tracked[i] != NULL) ctx->tracked[cnt++] = ctx->tracked[i];
+        for (int i = cnt; i < ctx->ntracked; i++) ctx->tracked[i] = NULL;
         ctx->ntracked = cnt;
-        ctx->tracked  = newtracked;
-        ctx->tracked  = realloc(ctx->tracked, ctx->cap * sizeof(*ctx->tracked));
 }
 
 void mt_context_free(MTContext *ctx) {
+        mt_checkpoint_release(ctx);
+        __mt_profiler_free(ctx);
+        free(ctx->bcast_cache);
         for (int i = 0; i < ctx->ntracked; i++) {
                 if (ctx->tracked[i] != NULL) {
                         mt_tensor_free(ctx->tracked[i]);
                         ctx->tracked[i] = NULL;
                 }
         }
-        free(ctx->tracked);
+        mt_context_trim_pool(ctx);
+        __mt_ctx_free(ctx, ctx->tracked, ctx->cap * sizeof(*ctx->tracked));
         free(ctx);
 }
 
-MTContext *mt_new_context(void) {
-        MTContext *ctx = __mt_newptr(MTContext, 1);
-        ctx->withgrads = CGM_OVERRIDE;
-        ctx->ntracked  = 0;
-        ctx->cap       = INITIAL_CAP;
-        ctx->tracked   = __mt_newptr(MTTensor *, INITIAL_CAP);
+/**
+ * Create a context whose tensor storage and bookkeeping go through
+ * `allocator`, or through the C library when it is NULL.
+ */
+MTContext *mt_new_context_with_allocator(const MTAllocator *allocator) {
+        MTContext *ctx  = __mt_newptr(MTContext, 1);
+        ctx->withgrads  = CGM_OVERRIDE;
+        ctx->mathmode   = MATH_EXACT;
+        ctx->nthreads   = __max(1, sysconf(_SC_NPROCESSORS_ONLN));
+        ctx->hugepages  = HUGEPAGES_THP;
+        ctx->pool.limit = MT_POOL_DEFAULT_LIMIT;
+        ctx->allocator  = allocator != NULL ? *allocator
+                                            : (MTAllocator){__mt_default_alloc, __mt_default_realloc,
+                                                            __mt_default_free, NULL};
+        ctx->ntracked   = 0;
+        ctx->cap        = INITIAL_CAP;
+        ctx->tracked    = __mt_ctx_alloc(ctx, INITIAL_CAP * sizeof(*ctx->tracked), sizeof(void *));
+        memset(ctx->tracked, 0, INITIAL_CAP * sizeof(*ctx->tracked));
         return ctx;
 }
 
+MTContext *mt_new_context(void) {
+        return mt_new_context_with_allocator(NULL);
+}
+
+MTAllocStats mt_context_get_stats(MTContext *ctx) {
+        return ctx->stats;
+}
+
 void mt_context_push_tensor(MTContext *ctx, MTTensor *t) {
         ctx->tracked[ctx->ntracked] = t;
         ctx->ntracked++;
         if (ctx->ntracked >= ctx->cap / 2) {
-                ctx->cap *= 2;
                 size_t sz    = sizeof(*ctx->tracked);
-                ctx->tracked = (MTTensor **)realloc(ctx->tracked, ctx->cap * sz);
+                ctx->tracked = __mt_ctx_realloc(ctx, ctx->tracked, ctx->cap * sz, 2 * ctx->cap * sz);
+                ctx->cap *= 2;
         }
 }
 
@@ -497,14 +1694,21 @@ void mt_tensor_print_debug(MTTensor *t) {
         printf("ndims   : %d\n", t->ndims);
         printf("ndeps   : %d\n", t->ndeps);
         printf("shape   : "), __printarr(t->shape, t->ndims, "%d"), printf("\n");
-        printf("strides : "), __printarr(t->strides, t->ndims, "%d"), printf("\n");
+        printf("strides : "), __printarr(t->strides, t->ndims, "%ld"), printf("\n");
         printf("data \n");
         printf("  - datalen : %ld\n", t->datalen);
         printf("  - content : ");
-        if (t->ndims > 0)
+        if (t->ndims > 0 && t->dtype == DTYPE_FLOAT32) {
                 __printarr(t->data, t->datalen, "%.2f");
-        else
+        } else if (t->ndims > 0) {
+                printf("{");
+                for (long i = 0; i < t->datalen; i++)
+                        printf("%.2f%s", __mt_tensor_load(t, i),
+                               i < t->datalen - 1 ? ", " : "");
+                printf("}");
+        } else {
                 printf("%f", mt_tensor_get_v(t));
+        }
         printf("\n");
         printf("\n");
 }
@@ -514,7 +1718,26 @@ int mt_is_tensor_eq(MTTensor *a, MTTensor *b) {
         if ((a == NULL) && (b != NULL)) return 0;
         if ((a != NULL) && (b == NULL)) return 0;
 
-        if (a->ndims != b->ndims) return 0;
+        if (a->ndims != b->ndims || a->dtype != b->dtype) return 0;
+        if (a->layout != b->layout || a->datalen != b->datalen) return 0;
+        if (a->layout == LAYOUT_CSR &&
+            (memcmp(a->rowptr, b->rowptr, (a->shape[0] + 1) * sizeof(long)) ||
+             memcmp(a->colidx, b->colidx, a->datalen * sizeof(int))))
+                return 0;
+        if (a->layout == LAYOUT_ROW_SPARSE && a->datalen > 0 &&
+            memcmp(a->rowidx, b->rowidx, a->datalen / a->strides[0] * sizeof(int)))
+                return 0;
+        if (a->dtype == DTYPE_INT8) {
+                long nch = a->qaxis < 0 ? 1 : a->shape[a->qaxis];
+                if (a->qaxis != b->qaxis ||
+                    memcmp(a->qscale, b->qscale, nch * sizeof(float)) ||
+                    memcmp(a->qzero, b->qzero, nch * sizeof(int)))
+                        return 0;
+        }
+        if (a->dtype != DTYPE_FLOAT32)
+                return memcmp(a->lpdata, b->lpdata,
+                              a->datalen * __mt_dtype_size(a->dtype)) == 0 &&
+                       __mt_arrsame(a->shape, b->shape, a->ndims);
         return __mt_arrsame(a->data, b->data, a->datalen) &&
                __mt_arrsame(a->shape, b->shape, a->ndims);
 }
@@ -524,7 +1747,8 @@ int mt_is_tensor_almost_eq(MTTensor *a, MTTensor *b) {
         if ((a == NULL) && (b != NULL)) return 0;
         if ((a != NULL) && (b == NULL)) return 0;
 
-        if (a->ndims != b->ndims) return 0;
+        if (a->ndims != b->ndims || a->dtype != b->dtype) return 0;
+        if (a->dtype != DTYPE_FLOAT32) return mt_is_tensor_eq(a, b);
         return __mt_arrsame_eps(a->data, b->data, a->datalen) &&
                __mt_arrsame_eps(a->shape, b->shape, a->ndims);
 }
@@ -533,12 +1757,11 @@ int mt_is_tensor_almost_eq(MTTensor *a, MTTensor *b) {
  * Math implementation
  */
 
-inline float __add(float a, float b) { return a + b; }
-inline float __sub(float a, float b) { return a - b; }
-inline float __mul(float a, float b) { return a * b; }
-inline float __div(float a, float b) { return a / b; }
-inline float __neg(float x) { return -x; }
-inline float __mt_log(float x) { return logf(x); }
+float __add(float a, float b) { return a + b; }
+float __sub(float a, float b) { return a - b; }
+float __mul(float a, float b) { return a * b; }
+float __div(float a, float b) { return a / b; }
+float __neg(float x) { return -x; }
 MTTensor    *__mt_tensor_sum(MTTensor *t, int dim, int keepdim);
 MTTensor    *__mt_tensor_add(MTTensor *a, MTTensor *b);
 MTTensor    *__mt_tensor_sub(MTTensor *a, MTTensor *b);
@@ -566,6 +1789,22 @@ inline void __mt_push_deps_at(MTTensor *t, MTTensor *t_dep, int at,
         t->ndeps++;
 }
 
+/**
+ * Stash tensors and integer arguments of the forward pass into every
+ * dependency of `t`, so that their grad_fn can access them. Call this after
+ * all dependencies of `t` are pushed.
+ */
+void __mt_save_for_backward(MTTensor *t, MTTensor **saved, int nsaved,
+                            long *args, int nargs) {
+        if (nsaved > MT_DEP_NSAVED || nargs > MT_DEP_NARGS)
+                EXIT_WITH_ERROR("too many values saved for backward");
+        for (int i = 0; i < t->ndeps; i++) {
+                if (t->deps[i] == NULL) continue;
+                for (int j = 0; j < nsaved; j++) t->deps[i]->saved[j] = saved[j];
+                for (int j = 0; j < nargs; j++) t->deps[i]->args[j] = args[j];
+        }
+}
+
 /**
  * The low-level implementation of general tensor reduce at a certain dimension
  * with reduce function `bfunc`. For example, if dim=0 and bfunc=mt_tensor_add,
@@ -573,11 +1812,12 @@ inline void __mt_push_deps_at(MTTensor *t, MTTensor *t_dep, int at,
  */
 MTTensor *mt_tensor_reduce(MTTensor *t, int dim, BFunc bfunc,
                            int keepdims) {
-        MTTensor *res = mt_tensor_slice(t->context, t, dim, Arr(int, 0), 1);
+        __mt_assert_dense(t);
+        MTTensor *res = __mt_tensor_slice(t->context, t, dim, Arr(int, 0), 1);
 
         for (long i = 1; i < t->shape[dim]; i++) {
-                MTTensor *sl = mt_tensor_slice(t->context, t,
-                                               dim, Arr(int, i), 1);
+                MTTensor *sl = __mt_tensor_slice(t->context, t,
+                                                 dim, Arr(int, i), 1);
 
                 float *sldata    = sl->data;
                 long   sldatalen = sl->datalen;
@@ -591,6 +1831,7 @@ MTTensor *mt_tensor_reduce(MTTensor *t, int dim, BFunc bfunc,
                                   res->indices, res->ndims);
                 res->ndims--;
         }
+        __mt_tensor_set_dtype(res, __mt_result_dtype(t->dtype));
 
         /* There will be possibly many allocations (and deallocations) inside
          * above loop, so we might better defrag the context here. */
@@ -599,6 +1840,202 @@ MTTensor *mt_tensor_reduce(MTTensor *t, int dim, BFunc bfunc,
         return res;
 }
 
+/**
+ * Broadcast plans. A plan describes, for the shapes and strides of the two
+ * operands of a binary op, the shape of the result and how each operand is
+ * read along it, so that broadcast operands are read in place rather than
+ * copied out first. Dimensions of size 1 are dropped and adjacent ones are
+ * merged wherever both operands allow it. Plans are cached per context in a
+ * direct-mapped table keyed by the operand shapes and strides.
+ */
+#define MT_BCAST_MAXDIMS 16
+#define MT_BCAST_CACHE_SIZE 64
+
+/* How an operand is read: element i of the result (in merged dimensions)
+ * reads the operand at offset */
+typedef enum { BK_FULL,    /* i */
+               BK_SCALAR,  /* 0 */
+               BK_ROW,     /* i % period, a trailing block repeated */
+               BK_COL,     /* i / period, each element repeated */
+               BK_STRIDED  /* the dot product of the index of i and strides */
+} BcastKind;
+
+typedef struct {
+        BcastKind kind;
+        long      period;
+        long      strides[MT_BCAST_MAXDIMS];
+} BcastOperand;
+
+typedef struct {
+        /* the key, valid when keyndims[0] >= 0 */
+        int  keyndims[2];
+        int  keyshape[2][MT_BCAST_MAXDIMS];
+        long keystrides[2][MT_BCAST_MAXDIMS];
+        /* the result, which the broadcast failed for when outndims < 0 */
+        int  outndims;
+        int  outshape[MT_BCAST_MAXDIMS];
+        /* the merged dimensions, and how the operands are read along them */
+        int          ndims;
+        long         shape[MT_BCAST_MAXDIMS];
+        BcastOperand op[2];
+} BcastPlan;
+
+struct MTBcastCache {
+        BcastPlan plans[MT_BCAST_CACHE_SIZE];
+};
+
+unsigned long __mt_bcast_hash(MTTensor *a, MTTensor *b) {
+        unsigned long h = 14695981039346656037UL;
+        for (int k = 0; k < 2; k++) {
+                MTTensor *t = k ? b : a;
+                h           = (h ^ t->ndims) * 1099511628211UL;
+                for (int i = 0; i < t->ndims; i++) {
+                        h = (h ^ t->shape[i]) * 1099511628211UL;
+                        h = (h ^ t->strides[i]) * 1099511628211UL;
+                }
+        }
+        return h;
+}
+
+int __mt_bcast_matches(BcastPlan *p, MTTensor *a, MTTensor *b) {
+        for (int k = 0; k < 2; k++) {
+                MTTensor *t = k ? b : a;
+                if (p->keyndims[k] != t->ndims ||
+                    memcmp(p->keyshape[k], t->shape, sizeof(int) * t->ndims) != 0 ||
+                    memcmp(p->keystrides[k], t->strides, sizeof(long) * t->ndims) != 0)
+                        return 0;
+        }
+        return 1;
+}
+
+/* Pick the cheapest way to read operand `op` along the merged dims of `p` */
+void __mt_bcast_classify(BcastPlan *p, BcastOperand *op) {
+        long cs[MT_BCAST_MAXDIMS];
+        int  n = p->ndims, first = n, last = -1, full = 1;
+        for (int i = n - 1; i >= 0; i--) cs[i] = i == n - 1 ? 1 : cs[i + 1] * p->shape[i + 1];
+        for (int i = 0; i < n; i++) {
+                if (op->strides[i] != 0) first = __min(first, i), last = i;
+                full &= op->strides[i] == cs[i];
+        }
+
+        int row = 1, col = 1;
+        for (int i = first; i < n; i++) row &= op->strides[i] == cs[i];
+        long inner = last < 0 ? 1 : cs[last];
+        for (int i = 0; i <= last; i++) col &= op->strides[i] * inner == cs[i];
+
+        op->kind   = last < 0 ? BK_SCALAR : full ? BK_FULL : row ? BK_ROW : col ? BK_COL : BK_STRIDED;
+        op->period = op->kind == BK_ROW ? cs[first] * p->shape[first] : inner;
+}
+
+/* Work out the plan of `a` and `b` into `p`, keyed by them */
+void __mt_bcast_plan_build(BcastPlan *p, MTTensor *a, MTTensor *b) {
+        int  n = __max(a->ndims, b->ndims);
+        long s[2][MT_BCAST_MAXDIMS];
+        p->outndims = n;
+        for (int k = 0; k < 2; k++) {
+                MTTensor *t = k ? b : a;
+                p->keyndims[k] = t->ndims;
+                __mt_memcpy(p->keyshape[k], t->shape, t->ndims);
+                __mt_memcpy(p->keystrides[k], t->strides, t->ndims);
+        }
+        for (int i = 0; i < n; i++) {
+                int  da = i - (n - a->ndims), db = i - (n - b->ndims);
+                int  sa = da < 0 ? 1 : a->shape[da], sb = db < 0 ? 1 : b->shape[db];
+                if (sa != sb && sa != 1 && sb != 1) {
+                        p->outndims = -1;
+                        return;
+                }
+                p->outshape[i] = __max(sa, sb);
+                s[0][i]        = sa == 1 ? 0 : a->strides[da];
+                s[1][i]        = sb == 1 ? 0 : b->strides[db];
+        }
+
+        /* drop the dims of size 1, then merge a dim into the previous one
+         * when both operands step over it contiguously */
+        p->ndims = 0;
+        for (int i = 0; i < n; i++) {
+                if (p->outshape[i] == 1) continue;
+                int m = p->ndims - 1;
+                if (m >= 0 && s[0][i] * p->outshape[i] == p->op[0].strides[m] &&
+                    s[1][i] * p->outshape[i] == p->op[1].strides[m]) {
+                        p->shape[m] *= p->outshape[i];
+                        p->op[0].strides[m] = s[0][i];
+                        p->op[1].strides[m] = s[1][i];
+                        continue;
+                }
+                p->shape[++m]       = p->outshape[i];
+                p->op[0].strides[m] = s[0][i];
+                p->op[1].strides[m] = s[1][i];
+                p->ndims++;
+        }
+        __mt_bcast_classify(p, &p->op[0]);
+        __mt_bcast_classify(p, &p->op[1]);
+}
+
+/* The broadcast plan of `a` and `b`, from the cache of their context */
+BcastPlan *__mt_bcast_plan(MTContext *ctx, MTTensor *a, MTTensor *b) {
+        if (a->ndims > MT_BCAST_MAXDIMS || b->ndims > MT_BCAST_MAXDIMS)
+                EXIT_WITH_ERROR("binary ops support tensors of up to 16 dimensions");
+        if (ctx->bcast_cache == NULL) {
+                ctx->bcast_cache = __mt_newptr(MTBcastCache, 1);
+                for (int i = 0; i < MT_BCAST_CACHE_SIZE; i++) ctx->bcast_cache->plans[i].keyndims[0] = -1;
+        }
+        BcastPlan *p = ctx->bcast_cache->plans + __mt_bcast_hash(a, b) % MT_BCAST_CACHE_SIZE;
+        if (!__mt_bcast_matches(p, a, b)) __mt_bcast_plan_build(p, a, b);
+        return p;
+}
+
+/**
+ * Elements [off, off + n) of operand `t` read along the result as `op`
+ * says, as float32: in place when they are contiguous float32 elements,
+ * otherwise gathered into `buf`.
+ */
+const float *__mt_bcast_load(MTTensor *t, BcastPlan *p, BcastOperand *op, long off, long n, float *buf) {
+        switch (op->kind) {
+        case BK_FULL:
+                return __mt_load_chunk(t, off, n, buf);
+        case BK_SCALAR:
+                return buf;
+        case BK_ROW:
+                if (off % op->period + n <= op->period) return __mt_load_chunk(t, off % op->period, n, buf);
+                for (long i = 0; i < n;) {
+                        long         r   = (off + i) % op->period, len = __min(op->period - r, n - i);
+                        const float *src = __mt_load_chunk(t, r, len, buf + i);
+                        if (src != buf + i) memcpy(buf + i, src, sizeof(float) * len);
+                        i += len;
+                }
+                return buf;
+        case BK_COL:
+                for (long i = 0; i < n;) {
+                        long  q   = (off + i) / op->period;
+                        long  len = __min((q + 1) * op->period - off - i, n - i);
+                        float v   = __mt_tensor_load(t, q);
+                        for (long j = 0; j < len; j++) buf[i + j] = v;
+                        i += len;
+                }
+                return buf;
+        default: {
+                /* walk the index of `off` along the merged dims */
+                long idx[MT_BCAST_MAXDIMS], src = 0, rem = off;
+                for (int d = p->ndims - 1; d >= 0; d--) {
+                        idx[d] = rem % p->shape[d];
+                        rem /= p->shape[d];
+                        src += idx[d] * op->strides[d];
+                }
+                for (long i = 0; i < n; i++) {
+                        buf[i] = __mt_tensor_load(t, src);
+                        for (int d = p->ndims - 1; d >= 0; d--) {
+                                src += op->strides[d];
+                                if (++idx[d] < p->shape[d]) break;
+                                src -= idx[d] * op->strides[d];
+                                idx[d] = 0;
+                        }
+                }
+                return buf;
+        }
+        }
+}
+
 /**
  * The low-level implementation of general binary functions. Typically we
  * don't use this directly (in the user's code). This function is used to
@@ -606,61 +2043,47 @@ MTTensor *mt_tensor_reduce(MTTensor *t, int dim, BFunc bfunc,
  * ion, division, etc.
  */
 MTTensor *mt_tensor_bfunc(MTTensor *a, MTTensor *b, BFunc bfunc) {
+        __mt_assert_dense(a), __mt_assert_dense(b);
         if (a->context != b->context)
                 EXIT_WITH_ERROR("a and b cannot be in different context");
 
-        /* We first attempt broadcasting and return early when broadcasting rule
-         * unfullfilled */
-        BcastResult bcr = mt_broadcast_lr(a, b);
-        if (bcr.status == BC_STATUS_FAILURE)
+        /* The broadcast plan tells the shape of the result and how to read
+         * each operand along it; it fails on incompatible shapes */
+        BcastPlan *plan = __mt_bcast_plan(a->context, a, b);
+        if (plan->outndims < 0)
                 EXIT_WITH_ERROR("a and b have incompatible sizes");
 
-        a = bcr.left == NULL ? a : bcr.left;
-        b = bcr.right == NULL ? b : bcr.right;
-
-        float *resdata = __mt_newptr(
-            float,
-            a->ndims > b->ndims ? a->datalen : b->datalen);
-
-        if (bcr.status == BC_STATUS_SKIP_SCALAR_HANDLING) {
-                /* Case 1, when the broadcasting result suggests tensor-scalar
-                 * or scalar-scalar binary operation */
-                if (a->ndims == 0) {
-                        float val = mt_tensor_get_v(a);
-                        for (long i = 0; i < b->datalen; i++)
-                                resdata[i] = bfunc(val, b->data[i]);
-                } else {
-                        float val = mt_tensor_get_v(b);
-                        for (long i = 0; i < a->datalen; i++)
-                                resdata[i] = bfunc(a->data[i], val);
-                }
-        } else {
-                /* Case 2, when the broadcasting result suggests tensor-tensor
-                 * binary operation */
-                for (long i = 0; i < a->datalen; i++)
-                        resdata[i] = bfunc(a->data[i], b->data[i]);
-        }
-
-        /* Reaching this line means that either broadcasting is successful or
-         * no broadcasting is required. We can use `resdata` to create a new
-         * tensor to return, while using the new shape and ndims. We can now
-         * assume that a->shape == b->shape and a->ndims == b->ndims, so using
-         * information only from a (or b) alone is fine. */
-        MTTensor *res = mt_new_tensor(
-            a->context,
-            resdata,
-            a->shape,
-            a->ndims);
-        res->isleaf = 0;
-
-        free(resdata);
-        mt_tensor_free(bcr.left), mt_tensor_free(bcr.right);
-
-        /**
-         * Defrag a->context, but no need to defrag b->context since they point
-         * to the same address */
-        mt_context_defrag(a->context);
-
+        /* Operands of the same reduced-precision dtype keep it, scalars
+         * adopt the dtype of the other operand, and mixed dtypes compute into
+         * float32. */
+        MtDtype outdtype = __mt_result_dtype(a->dtype == b->dtype ? a->dtype
+                                             : a->ndims == 0      ? b->dtype
+                                             : b->ndims == 0      ? a->dtype
+                                                                  : DTYPE_FLOAT32);
+
+        MTTensor *res = __mt_new_tensor_uninit_dtype(a->context, plan->outshape,
+                                                     plan->outndims, outdtype);
+        res->isleaf   = 0;
+
+        /* Operands are processed in chunks so that reduced-precision or
+         * broadcast ones can be widened or gathered on the stack. */
+        float abuf[MT_VEC_CHUNK], bbuf[MT_VEC_CHUNK], obuf[MT_VEC_CHUNK];
+        int   ascalar = plan->op[0].kind == BK_SCALAR, bscalar = plan->op[1].kind == BK_SCALAR;
+        float aval    = ascalar ? __mt_tensor_load(a, 0) : 0;
+        float bval    = bscalar ? __mt_tensor_load(b, 0) : 0;
+        for (long i0 = 0; i0 < res->datalen; i0 += MT_VEC_CHUNK) {
+                long         nc = __min(MT_VEC_CHUNK, res->datalen - i0);
+                float       *o  = __mt_out_chunk(res, i0, obuf);
+                const float *pa = __mt_bcast_load(a, plan, &plan->op[0], i0, nc, abuf);
+                const float *pb = __mt_bcast_load(b, plan, &plan->op[1], i0, nc, bbuf);
+                if (ascalar)
+                        for (long i = 0; i < nc; i++) o[i] = bfunc(aval, bscalar ? bval : pb[i]);
+                else if (bscalar)
+                        for (long i = 0; i < nc; i++) o[i] = bfunc(pa[i], bval);
+                else
+                        for (long i = 0; i < nc; i++) o[i] = bfunc(pa[i], pb[i]);
+                __mt_store_chunk(res, i0, nc, o);
+        }
         return res;
 }
 
@@ -671,15 +2094,194 @@ MTTensor *mt_tensor_bfunc(MTTensor *a, MTTensor *b, BFunc bfunc) {
  * rocation, exponentiation, etc.
  */
 MTTensor *mt_tensor_ufunc(MTTensor *t, UFunc ufunc) {
-        float *resdata = __mt_newptr(float, t->datalen);
-        for (int i = 0; i < t->datalen; i++)
-                resdata[i] = ufunc(t->data[i]);
+        __mt_assert_dense(t);
+        MTTensor *res = __mt_new_tensor_uninit_dtype(t->context, t->shape,
+                                                     t->ndims,
+                                                     __mt_result_dtype(t->dtype));
+        float     ibuf[MT_VEC_CHUNK], obuf[MT_VEC_CHUNK];
+        for (long i0 = 0; i0 < t->datalen; i0 += MT_VEC_CHUNK) {
+                long         nc = __min(MT_VEC_CHUNK, t->datalen - i0);
+                const float *in = __mt_load_chunk(t, i0, nc, ibuf);
+                float       *o  = __mt_out_chunk(res, i0, obuf);
+                for (long i = 0; i < nc; i++) o[i] = ufunc(in[i]);
+                __mt_store_chunk(res, i0, nc, o);
+        }
 
-        MTTensor *res = mt_new_tensor(t->context, resdata, t->shape, t->ndims);
         if (t->req_grad) {
                 mt_tensor_enable_grad(res);
         }
-        free(resdata);
+        res->isleaf = 0;
+        return res;
+}
+
+/**
+ * Vectorized transcendental functions. Every kernel maps `n` elements of `x`
+ * into `y` (which may alias `x`) and comes in two flavors: an exact one that
+ * calls libm, and a fast one built from branch-free polynomial approximations
+ * (after Cephes) that the compiler vectorizes. The fast kernels are accurate
+ * to a few ULPs over the whole float range. The context's `mathmode` selects
+ * which flavor the tensor ops use.
+ */
+typedef void (*VecFunc)(const float *, float *, long);
+
+inline float __mt_bits_to_float(int i) {
+        float f;
+        memcpy(&f, &i, sizeof(f));
+        return f;
+}
+
+inline int __mt_float_to_bits(float f) {
+        int i;
+        memcpy(&i, &f, sizeof(i));
+        return i;
+}
+
+/* Branch-free `cond ? a : b`. Plain ternaries on computed floats are kept as
+ * branches by the compiler (since float ops may trap), which blocks
+ * vectorization, so the fast kernels blend the bit patterns instead. */
+inline float __mt_select(int cond, float a, float b) {
+        int m = -cond;
+        return __mt_bits_to_float((__mt_float_to_bits(a) & m) |
+                                  (__mt_float_to_bits(b) & ~m));
+}
+
+inline float __mt_fast_expf(float x) {
+        float xc = __mt_select(x < -104.0f, -104.0f, x);
+        xc       = __mt_select(xc > 89.0f, 89.0f, xc);
+        /* x = n * ln2 + r, rounding n with the 1.5 * 2^23 trick */
+        float fn = (xc * 1.44269504088896341f + 12582912.0f) - 12582912.0f;
+        float r  = xc - fn * 0.693359375f + fn * 2.12194440e-4f;
+        float p  = 1.9875691500E-4f;
+        p        = p * r + 1.3981999507E-3f;
+        p        = p * r + 8.3334519073E-3f;
+        p        = p * r + 4.1665795894E-2f;
+        p        = p * r + 1.6666665459E-1f;
+        p        = p * r + 5.0000001201E-1f;
+        p        = p * r * r + r + 1.0f;
+        /* scale by 2^n in two steps so that subnormal results survive */
+        int   n1 = (int)fn / 2;
+        float y  = p * __mt_bits_to_float((n1 + 127) << 23) *
+                  __mt_bits_to_float(((int)fn - n1 + 127) << 23);
+        y        = __mt_select(x > 88.72283f, INFINITY, y);
+        return __mt_select(x != x, x, y);
+}
+
+inline float __mt_fast_logf(float x) {
+        /* scale subnormals into the normal range first */
+        int   sub = x < 1.17549435e-38f;
+        float xs  = __mt_select(sub, x * 8388608.0f, x);
+        int   b   = __mt_float_to_bits(xs);
+        float e   = (float)(((b >> 23) & 0xff) - 126 - 23 * sub);
+        float m   = __mt_bits_to_float((b & 0x007fffff) | 0x3f000000);
+        /* m in [sqrt(.5), sqrt(2)) after folding, so the series converges */
+        int lo = m < 0.707106781186547524f;
+        e      = e - (float)lo;
+        m      = __mt_select(lo, m + m - 1.0f, m - 1.0f);
+
+        float z = m * m;
+        float p = 7.0376836292E-2f;
+        p       = p * m - 1.1514610310E-1f;
+        p       = p * m + 1.1676998740E-1f;
+        p       = p * m - 1.2420140846E-1f;
+        p       = p * m + 1.4249322787E-1f;
+        p       = p * m - 1.6668057665E-1f;
+        p       = p * m + 2.0000714765E-1f;
+        p       = p * m - 2.4999993993E-1f;
+        p       = p * m + 3.3333331174E-1f;
+        p       = p * m * z;
+        p += -2.12194440e-4f * e;
+        p += -0.5f * z;
+        float y = m + p + 0.693359375f * e;
+        y       = __mt_select(x == INFINITY, x, y);
+        y       = __mt_select(x == 0.0f, -INFINITY, y);
+        return __mt_select((x < 0.0f) | (x != x), NAN, y);
+}
+
+inline float __mt_fast_tanhf(float x) {
+        float ax = fabsf(x);
+        /* small inputs: odd polynomial, large inputs: 1 - 2 / (exp(2x) + 1) */
+        float z = x * x;
+        float p = -5.70498872745E-3f;
+        p       = p * z + 2.06390887954E-2f;
+        p       = p * z - 5.37397155531E-2f;
+        p       = p * z + 1.33314422036E-1f;
+        p       = p * z - 3.33332819422E-1f;
+        p       = p * z * x + x;
+
+        float q = 1.0f - 2.0f / (__mt_fast_expf(2.0f * ax) + 1.0f);
+        q       = copysignf(q, x);
+        return __mt_select(ax < 0.625f, p, q);
+}
+
+/* exp(-|x|) never overflows, and sigmoid(x) = exp(x) * sigmoid(-x) for x < 0 */
+inline float __mt_fast_sigmoidf(float x) {
+        float e = __mt_fast_expf(-fabsf(x));
+        float s = 1.0f / (1.0f + e);
+        return __mt_select(x < 0, e * s, s);
+}
+
+void __mt_vexp_exact(const float *x, float *y, long n) {
+        for (long i = 0; i < n; i++) y[i] = expf(x[i]);
+}
+
+void __mt_vexp_fast(const float *x, float *y, long n) {
+        for (long i = 0; i < n; i++) y[i] = __mt_fast_expf(x[i]);
+}
+
+void __mt_vlog_exact(const float *x, float *y, long n) {
+        for (long i = 0; i < n; i++) y[i] = logf(x[i]);
+}
+
+void __mt_vlog_fast(const float *x, float *y, long n) {
+        for (long i = 0; i < n; i++) y[i] = __mt_fast_logf(x[i]);
+}
+
+void __mt_vtanh_exact(const float *x, float *y, long n) {
+        for (long i = 0; i < n; i++) y[i] = tanhf(x[i]);
+}
+
+void __mt_vtanh_fast(const float *x, float *y, long n) {
+        for (long i = 0; i < n; i++) y[i] = __mt_fast_tanhf(x[i]);
+}
+
+void __mt_vsigmoid_exact(const float *x, float *y, long n) {
+        for (long i = 0; i < n; i++) {
+                float e = expf(-fabsf(x[i]));
+                y[i]    = x[i] < 0 ? e / (1.0f + e) : 1.0f / (1.0f + e);
+        }
+}
+
+void __mt_vsigmoid_fast(const float *x, float *y, long n) {
+        for (long i = 0; i < n; i++) y[i] = __mt_fast_sigmoidf(x[i]);
+}
+
+/* The exp kernel matching the math mode of `ctx` */
+VecFunc __mt_vexp_for(MTContext *ctx) {
+        return ctx->mathmode == MATH_FAST ? __mt_vexp_fast : __mt_vexp_exact;
+}
+
+/**
+ * Like mt_tensor_ufunc, but maps the whole data buffer with a vector kernel,
+ * choosing between the exact and fast kernels according to the context.
+ */
+MTTensor *__mt_tensor_vfunc(MTTensor *t, VecFunc exact, VecFunc fast) {
+        __mt_assert_dense(t);
+        MTTensor *res = __mt_new_tensor_uninit_dtype(t->context, t->shape,
+                                                     t->ndims,
+                                                     __mt_result_dtype(t->dtype));
+        VecFunc   f   = t->context->mathmode == MATH_FAST ? fast : exact;
+        if (t->dtype == DTYPE_FLOAT32) {
+                f(t->data, res->data, t->datalen);
+        } else {
+                float buf[MT_VEC_CHUNK];
+                for (long i0 = 0; i0 < t->datalen; i0 += MT_VEC_CHUNK) {
+                        long         nc = __min(MT_VEC_CHUNK, t->datalen - i0);
+                        const float *in = __mt_load_chunk(t, i0, nc, buf);
+                        float       *o  = __mt_out_chunk(res, i0, buf);
+                        f(in, o, nc);
+                        __mt_store_chunk(res, i0, nc, o);
+                }
+        }
         res->isleaf = 0;
         return res;
 }
@@ -721,11 +2323,12 @@ MTTensor *__mt_tensor_add(MTTensor *a, MTTensor *b) {
 }
 
 MTTensor *mt_tensor_add(MTTensor *a, MTTensor *b) {
+        ProfScope prof = __mt_prof_begin(a->context);
         MTTensor *res = __mt_tensor_add(a, b);
         if (a->req_grad || b->req_grad) mt_tensor_enable_grad(res);
         __mt_push_deps_at(res, a, 0, __add_backward_a);
         __mt_push_deps_at(res, b, 1, __add_backward_b);
-        return res;
+        return __mt_prof_end(&prof, "add", res, Arr(MTTensor *, a, b), 2, 0);
 }
 
 /* subtraction operation */
@@ -744,11 +2347,12 @@ MTTensor *__mt_tensor_sub(MTTensor *a, MTTensor *b) {
 }
 
 MTTensor *mt_tensor_sub(MTTensor *a, MTTensor *b) {
+        ProfScope prof = __mt_prof_begin(a->context);
         MTTensor *res = __mt_tensor_sub(a, b);
         if (a->req_grad || b->req_grad) mt_tensor_enable_grad(res);
         __mt_push_deps_at(res, a, 0, __sub_backward_a);
         __mt_push_deps_at(res, b, 1, __sub_backward_b);
-        return res;
+        return __mt_prof_end(&prof, "sub", res, Arr(MTTensor *, a, b), 2, 0);
 }
 
 /* element-wise multiplication operation */
@@ -769,116 +2373,751 @@ MTTensor *__mt_tensor_mul(MTTensor *a, MTTensor *b) {
 }
 
 MTTensor *mt_tensor_mul(MTTensor *a, MTTensor *b) {
+        ProfScope prof = __mt_prof_begin(a->context);
         MTTensor *res = __mt_tensor_mul(a, b);
         if (a->req_grad || b->req_grad) mt_tensor_enable_grad(res);
         __mt_push_deps_at(res, a, 0, __mul_backward_a);
         __mt_push_deps_at(res, b, 1, __mul_backward_b);
-        return res;
+        return __mt_prof_end(&prof, "mul", res, Arr(MTTensor *, a, b), 2, 0);
 }
 
 /* matrix multiplication operation*/
-inline void __mt_axpy(float *resdata, MTTensor *a, MTTensor *b,
-                      int i, int j, int k) {
-        resdata[i * b->shape[1] + j] +=
-            mt_tensor_get_2(a, i, k) * mt_tensor_get_2(b, k, j);
-}
 
-MTTensor *__mt_tensor_matmul(MTTensor *a, MTTensor *b) {
-        if ((a->ndims != 2) || (b->ndims != 2))
-                EXIT_WITH_ERROR("both a and b must be 2-tensor");
-        if (a->shape[1] != b->shape[0])
-                EXIT_WITH_ERROR("the shapes of a and b are incompatible");
-
-        long   resdatalen = a->shape[0] * b->shape[1];
-        float *resdata    = __mt_newptr(float, resdatalen);
+/* Block sizes of __mt_sgemm, chosen so that a packed B panel (MT_GEMM_KC by
+ * MT_GEMM_NC floats) stays in L2 while the rows of A stream through it. */
+#define MT_GEMM_MC 64
+#define MT_GEMM_KC 128
+#define MT_GEMM_NC 256
 
-        for (long i = 0; i < resdatalen; i++) resdata[i] = 0.0;
+/**
+ * Blocked single-precision GEMM on raw row-major buffers:
+ * C (m by n) = op(A) (m by k) * op(B) (k by n), plus C itself when
+ * `accumulate` is nonzero. op(X) is X, or X transposed when the respective
+ * `trans` flag is set, in which case X is stored as (k by m) or (n by k).
+ * Blocks of A and B are packed into contiguous buffers so that the innermost
+ * loop runs over a contiguous row of C and vectorizes.
+ */
+/* Element `off` of a raw `dtype` buffer, widened to float32 */
+inline float __mt_load_elem(const void *p, MtDtype dtype, long off) {
+        switch (dtype) {
+                case DTYPE_FLOAT16:
+                        return __mt_f16_to_f32(((const uint16_t *)p)[off]);
+                case DTYPE_BFLOAT16:
+                        return __mt_bf16_to_f32(((const uint16_t *)p)[off]);
+                default:
+                        return ((const float *)p)[off];
+        }
+}
 
-        for (int i = 0; i < a->shape[0]; i++) {
-                for (int j = 0; j < b->shape[1]; j++) {
-                        for (int k = 0; k < a->shape[1]; k++) {
-                                __mt_axpy(resdata, a, b, i, j, k);
+/**
+ * GEMM with A and B stored as `adtype` and `btype` respectively. They are
+ * widened while being packed, so the inner kernel and C stay float32.
+ */
+void __mt_gemm_ex(int transa, int transb, long m, long n, long k,
+                  const void *a, MtDtype adtype, long lda,
+                  const void *b, MtDtype bdtype, long ldb,
+                  float *c, long ldc, int accumulate) {
+        if (!accumulate)
+                for (long i = 0; i < m; i++)
+                        for (long j = 0; j < n; j++) c[i * ldc + j] = 0;
+
+        /* Packing buffers are sized to the problem so that the small GEMMs
+         * of tiled kernels stay cheap; they are fully written before use. */
+        long   kc_max = __min(MT_GEMM_KC, k);
+        float *ap     = malloc(sizeof(float) * __max(__min(MT_GEMM_MC, m) * kc_max, 1));
+        float *bp     = malloc(sizeof(float) * __max(kc_max * __min(MT_GEMM_NC, n), 1));
+        for (long j0 = 0; j0 < n; j0 += MT_GEMM_NC) {
+                long nc = __min(MT_GEMM_NC, n - j0);
+                for (long p0 = 0; p0 < k; p0 += MT_GEMM_KC) {
+                        long kc = __min(MT_GEMM_KC, k - p0);
+                        for (long p = 0; p < kc; p++)
+                                for (long j = 0; j < nc; j++)
+                                        bp[p * nc + j] = __mt_load_elem(
+                                                b, bdtype,
+                                                transb ? (j0 + j) * ldb + p0 + p
+                                                       : (p0 + p) * ldb + j0 + j);
+
+                        for (long i0 = 0; i0 < m; i0 += MT_GEMM_MC) {
+                                long mc = __min(MT_GEMM_MC, m - i0);
+                                for (long i = 0; i < mc; i++)
+                                        for (long p = 0; p < kc; p++)
+                                                ap[i * kc + p] = __mt_load_elem(
+                                                        a, adtype,
+                                                        transa ? (p0 + p) * lda + i0 + i
+                                                               : (i0 + i) * lda + p0 + p);
+
+                                for (long i = 0; i < mc; i++) {
+                                        float *crow = c + (i0 + i) * ldc + j0;
+                                        for (long p = 0; p < kc; p++) {
+                                                float        aip  = ap[i * kc + p];
+                                                const float *brow = bp + p * nc;
+                                                for (long j = 0; j < nc; j++)
+                                                        crow[j] += aip * brow[j];
+                                        }
+                                }
                         }
                 }
         }
+        free(ap), free(bp);
+}
+
+void __mt_sgemm(int transa, int transb, long m, long n, long k,
+                const float *a, long lda, const float *b, long ldb,
+                float *c, long ldc, int accumulate) {
+        __mt_gemm_ex(transa, transb, m, n, k, a, DTYPE_FLOAT32, lda,
+                     b, DTYPE_FLOAT32, ldb, c, ldc, accumulate);
+}
 
-        MTTensor *res = mt_new_tensor(a->context, resdata,
-                                      Arr(int, a->shape[0], b->shape[1]), 2);
-        free(resdata);
+MTTensor *__mt_tensor_matmul_t(MTTensor *a, MTTensor *b, int transa,
+                               int transb) {
+        __mt_assert_dense(a), __mt_assert_dense(b);
+        if ((a->ndims != 2) || (b->ndims != 2))
+                EXIT_WITH_ERROR("both a and b must be 2-tensor");
+
+        long m  = transa ? a->shape[1] : a->shape[0];
+        long ka = transa ? a->shape[0] : a->shape[1];
+        long kb = transb ? b->shape[1] : b->shape[0];
+        long n  = transb ? b->shape[0] : b->shape[1];
+        if (ka != kb)
+                EXIT_WITH_ERROR("the shapes of a and b are incompatible");
+
+        /* Accumulation is always float32; the product is narrowed back only
+         * when both operands share a reduced-precision dtype. */
+        MtDtype   dtype = a->dtype == b->dtype ? a->dtype : DTYPE_FLOAT32;
+        MTTensor *res   = __mt_new_tensor_uninit_dtype(a->context,
+                                                       Arr(int, m, n), 2, dtype);
+        float    *c     = dtype == DTYPE_FLOAT32 ? res->data
+                                                 : __mt_newptr(float, m * n);
+        __mt_gemm_ex(transa, transb, m, n, ka,
+                     a->dtype == DTYPE_FLOAT32 ? (void *)a->data : a->lpdata,
+                     a->dtype, a->shape[1],
+                     b->dtype == DTYPE_FLOAT32 ? (void *)b->data : b->lpdata,
+                     b->dtype, b->shape[1], c, n, 0);
+        if (dtype != DTYPE_FLOAT32) {
+                __mt_narrow(c, res->lpdata, dtype, m * n);
+                free(c);
+        }
         return res;
 }
 
+MTTensor *__mt_tensor_matmul(MTTensor *a, MTTensor *b) {
+        return __mt_tensor_matmul_t(a, b, 0, 0);
+}
+
+/* The backward functions multiply by the transposed operand in place rather
+ * than materializing its transpose. */
 MTTensor *__matmul_backward_a(Dependency **prtdeps, MTTensor *grad) {
-        MTTensor *b = prtdeps[1]->tensor;
-        return __mt_tensor_matmul(grad, __mt_tensor_transpose(b));
+        MTTensor *b = prtdeps[0]->saved[1];
+        return __mt_tensor_matmul_t(grad, b, 0, 1);
 }
 
 MTTensor *__matmul_backward_b(Dependency **prtdeps, MTTensor *grad) {
-        MTTensor *a = prtdeps[0]->tensor;
-        return __mt_tensor_matmul(__mt_tensor_transpose(a), grad);
+        MTTensor *a = prtdeps[1]->saved[0];
+        return __mt_tensor_matmul_t(a, grad, 1, 0);
 }
 
 MTTensor *mt_tensor_matmul(MTTensor *a, MTTensor *b) {
+        /* int8 weights take the quantized path, int8 activations against
+         * float weights are simply dequantized. These paths are profiled as
+         * the ops they dispatch to, so they run outside the matmul scope. */
+        if (a->layout == LAYOUT_CSR) return mt_tensor_spmm(a, b);
+        if (b->dtype == DTYPE_INT8) return mt_tensor_qmatmul(a, b, NULL, 0, 0);
+        if (a->dtype == DTYPE_INT8) return mt_tensor_matmul(mt_tensor_dequantize(a), b);
+
+        ProfScope prof = __mt_prof_begin(a->context);
         MTTensor *res = __mt_tensor_matmul(a, b);
         if (a->req_grad || b->req_grad) mt_tensor_enable_grad(res);
         __mt_push_deps_at(res, a, 0, __matmul_backward_a);
         __mt_push_deps_at(res, b, 1, __matmul_backward_b);
-        return res;
-}
-
-/* division operation */
-MTTensor *__mt_tensor_div(MTTensor *a, MTTensor *b) {
-        return mt_tensor_bfunc(a, b, __div);
+        __mt_save_for_backward(res, Arr(MTTensor *, a, b), 2, NULL, 0);
+        return __mt_prof_end(&prof, "matmul", res, Arr(MTTensor *, a, b), 2, 0);
 }
 
-MTTensor *__div_backward_a(Dependency **prtdeps, MTTensor *grad) {
-        MTTensor *a = prtdeps[0]->tensor;
-        MTTensor *b = prtdeps[1]->tensor;
-        grad        = __mt_tensor_div(grad, b);
-        return __mt_grad_unbroadcast(grad, a);
-}
+/* Parallel loops */
 
-MTTensor *__div_backward_b(Dependency **prtdeps, MTTensor *grad) {
-        MTTensor *a = prtdeps[0]->tensor;
-        MTTensor *b = prtdeps[1]->tensor;
+/* The body of a parallel loop, run over the iterations [begin, end) */
+typedef void (*RangeFunc)(void *arg, long begin, long end);
 
-        /* unbroadcast((-grad * a) / (b * b)) w.r.t. b */
-        grad = __mt_tensor_mul(__mt_tensor_neg(grad), a);
-        grad = __mt_tensor_div(grad, __mt_tensor_mul(b, b));
-        return __mt_grad_unbroadcast(grad, b);
+typedef struct {
+        RangeFunc fn;
+        void     *arg;
+        long      begin, end;
+} RangeTask;
+
+void *__mt_range_task_run(void *p) {
+        RangeTask *task = p;
+        task->fn(task->arg, task->begin, task->end);
+        return NULL;
 }
 
-inline float __recip(float x) { return 1 / x; }
-
-MTTensor *mt_tensor_div(MTTensor *a, MTTensor *b) {
-        MTTensor *res = __mt_tensor_div(a, b);
-        if (a->req_grad || b->req_grad) mt_tensor_enable_grad(res);
-        __mt_push_deps_at(res, a, 0, __div_backward_a);
-        __mt_push_deps_at(res, b, 1, __div_backward_b);
+/**
+ * Run fn over [0, n) split into contiguous ranges of at least `grain`
+ * iterations, one per thread, using at most ctx->nthreads threads. The
+ * calling thread runs the first range, and the call returns once all ranges
+ * are done. Iterations in different ranges must not write to the same
+ * memory.
+ */
+void __mt_parallel_for(MTContext *ctx, long n, long grain, RangeFunc fn,
+                       void *arg) {
+        long nthreads = __min((long)ctx->nthreads, n / __max(grain, 1));
+        if (nthreads <= 1) {
+                if (n > 0) fn(arg, 0, n);
+                return;
+        }
 
-        // MTTensor *res = mt_tensor_mul(a, mt_tensor_ufunc(b, __recip));
-        return res;
+        RangeTask  tasks[nthreads];
+        pthread_t  threads[nthreads];
+        int        started[nthreads];
+        for (long i = 0; i < nthreads; i++) {
+                tasks[i] = (RangeTask){.fn = fn, .arg = arg,
+                                       .begin = n * i / nthreads,
+                                       .end   = n * (i + 1) / nthreads};
+                started[i] = i > 0 && pthread_create(threads + i, NULL,
+                                                     __mt_range_task_run,
+                                                     tasks + i) == 0;
+        }
+        /* Ranges whose thread could not be started run here */
+        for (long i = 0; i < nthreads; i++)
+                if (!started[i]) __mt_range_task_run(tasks + i);
+        for (long i = 1; i < nthreads; i++)
+                if (started[i]) pthread_join(threads[i], NULL);
 }
 
-/* exponentiation operation */
-inline float __expf(float x) { return expf(x); }
+/* Sparse tensors */
 
-MTTensor *__mt_tensor_exp(MTTensor *t) {
-        return mt_tensor_ufunc(t, __expf);
+/* Allocate a CSR tensor of the given shape with room for `nnz` nonzeros */
+MTTensor *__mt_new_csr(MTContext *ctx, int *shape, long nnz) {
+        MTTensor *t = mt_alloc_empty_tensor(ctx);
+        t->layout   = LAYOUT_CSR;
+        t->ndims    = 2;
+        t->shape    = __mt_newptr(int, 2);
+        __mt_memcpy(t->shape, shape, 2);
+        __init_strides(t);
+        t->datalen = nnz;
+        t->data    = __mt_data_alloc(ctx, sizeof(float) * nnz, 0);
+        t->colidx  = __mt_data_alloc(ctx, sizeof(int) * nnz, 0);
+        t->rowptr  = __mt_data_alloc(ctx, sizeof(long) * (shape[0] + 1), 1);
+        return t;
 }
 
-MTTensor *__exp_backward(Dependency **prtdeps, MTTensor *grad) {
-        MTTensor *t = prtdeps[0]->tensor;
-        return mt_tensor_mul(grad, __mt_tensor_exp(t));
+MTTensor *mt_sparse_from_dense(MTTensor *t) {
+        __mt_assert_dense(t);
+        if (t->ndims != 2)
+                EXIT_WITH_ERROR("only 2-tensors can be made sparse");
+
+        ProfScope prof = __mt_prof_begin(t->context);
+        long      m = t->shape[0], n = t->shape[1], nnz = 0;
+        for (long i = 0; i < t->datalen; i++) nnz += __mt_tensor_load(t, i) != 0;
+
+        MTTensor *res = __mt_new_csr(t->context, t->shape, nnz);
+        long      p   = 0;
+        for (long i = 0; i < m; i++) {
+                for (long j = 0; j < n; j++) {
+                        float v = __mt_tensor_load(t, i * n + j);
+                        if (v == 0) continue;
+                        res->data[p]   = v;
+                        res->colidx[p] = j;
+                        p++;
+                }
+                res->rowptr[i + 1] = p;
+        }
+        return __mt_prof_end(&prof, "sparse_from_dense", res, Arr(MTTensor *, t), 1, 0);
 }
 
-MTTensor *mt_tensor_exp(MTTensor *t) {
-        MTTensor *res = __mt_tensor_exp(t);
-        if (t->req_grad) mt_tensor_enable_grad(res);
-        __mt_push_deps_at(res, t, 0, __exp_backward);
+/**
+ * Build a CSR tensor from `nnz` coordinate triplets in any order. Duplicate
+ * coordinates are summed, as in a scatter-add.
+ */
+MTTensor *mt_sparse_from_coo(MTContext *ctx, int *rows, int *cols,
+                             float *vals, long nnz, int *shape) {
+        if (shape[0] < 0 || shape[1] < 0 || nnz < 0)
+                EXIT_WITH_ERROR("invalid shape or nonzero count");
+        long m = shape[0];
+        for (long p = 0; p < nnz; p++)
+                if (rows[p] < 0 || rows[p] >= m || cols[p] < 0 || cols[p] >= shape[1])
+                        EXIT_WITH_ERROR("coordinate out of bounds");
+
+        /* Counting sort of the triplets by row */
+        long *start = __mt_newptr(long, m + 1);
+        for (long p = 0; p < nnz; p++) start[rows[p] + 1]++;
+        for (long i = 0; i < m; i++) start[i + 1] += start[i];
+        long *next  = __mt_newptr(long, m);
+        int  *bycol = __mt_newptr(int, __max(nnz, 1));
+        float *byval = __mt_newptr(float, __max(nnz, 1));
+        for (long p = 0; p < nnz; p++) {
+                long q   = start[rows[p]] + next[rows[p]]++;
+                bycol[q] = cols[p];
+                byval[q] = vals[p];
+        }
+
+        /* Sort each row by column, merging duplicates */
+        MTTensor *res = __mt_new_csr(ctx, shape, nnz);
+        long      out = 0;
+        for (long i = 0; i < m; i++) {
+                for (long q = start[i] + 1; q < start[i + 1]; q++)
+                        for (long r = q; r > start[i] && bycol[r - 1] > bycol[r]; r--) {
+                                int   c      = bycol[r];
+                                float v      = byval[r];
+                                bycol[r]     = bycol[r - 1], byval[r] = byval[r - 1];
+                                bycol[r - 1] = c, byval[r - 1] = v;
+                        }
+                for (long q = start[i]; q < start[i + 1]; q++) {
+                        if (out > res->rowptr[i] && res->colidx[out - 1] == bycol[q]) {
+                                res->data[out - 1] += byval[q];
+                                continue;
+                        }
+                        res->colidx[out] = bycol[q];
+                        res->data[out++] = byval[q];
+                }
+                res->rowptr[i + 1] = out;
+        }
+        res->datalen = out;
+        free(start), free(next), free(bycol), free(byval);
+        return res;
+}
+
+MTTensor *mt_sparse_to_dense(MTTensor *t) {
+        if (t->layout == LAYOUT_DENSE)
+                EXIT_WITH_ERROR("t is not sparse");
+        ProfScope prof = __mt_prof_begin(t->context);
+        MTTensor *res  = __mt_new_tensor_zeros(t->context, t->shape, t->ndims);
+        if (t->layout == LAYOUT_ROW_SPARSE) {
+                long rowlen = t->strides[0];
+                for (long r = 0; r < t->datalen / __max(rowlen, 1); r++)
+                        memcpy(res->data + t->rowidx[r] * rowlen,
+                               t->data + r * rowlen, rowlen * sizeof(float));
+        } else {
+                long n = t->shape[1];
+                for (long i = 0; i < t->shape[0]; i++)
+                        for (long p = t->rowptr[i]; p < t->rowptr[i + 1]; p++)
+                                res->data[i * n + t->colidx[p]] = t->data[p];
+        }
+        return __mt_prof_end(&prof, "sparse_to_dense", res, Arr(MTTensor *, t), 1, 0);
+}
+
+/* Operands of the sparse-dense products, shared by the worker threads */
+typedef struct {
+        MTTensor    *a;
+        const float *b;
+        float       *c;
+        long         n;
+} SpmmArgs;
+
+/* Rows [begin, end) of C = A * B */
+void __mt_spmm_rows(void *p, long begin, long end) {
+        SpmmArgs *s = p;
+        for (long i = begin; i < end; i++) {
+                float *crow = s->c + i * s->n;
+                for (long q = s->a->rowptr[i]; q < s->a->rowptr[i + 1]; q++) {
+                        float        v    = s->a->data[q];
+                        const float *brow = s->b + (long)s->a->colidx[q] * s->n;
+                        for (long j = 0; j < s->n; j++) crow[j] += v * brow[j];
+                }
+        }
+}
+
+/**
+ * Columns [begin, end) of C = A^T * B. Every row of A scatters into several
+ * rows of C, so the work is split by columns instead, which keeps the
+ * threads' writes disjoint.
+ */
+void __mt_spmm_t_cols(void *p, long begin, long end) {
+        SpmmArgs *s = p;
+        for (long i = 0; i < s->a->shape[0]; i++) {
+                const float *brow = s->b + i * s->n;
+                for (long q = s->a->rowptr[i]; q < s->a->rowptr[i + 1]; q++) {
+                        float  v    = s->a->data[q];
+                        float *crow = s->c + (long)s->a->colidx[q] * s->n;
+                        for (long j = begin; j < end; j++) crow[j] += v * brow[j];
+                }
+        }
+}
+
+/* The minimum work, in multiply-adds, worth handing to a thread */
+#define MT_PARALLEL_GRAIN 32768
+
+MTTensor *__mt_tensor_spmm(MTTensor *a, MTTensor *b, int transa) {
+        __mt_assert_dense(b);
+        if (b->ndims != 2 || b->dtype != DTYPE_FLOAT32)
+                EXIT_WITH_ERROR("b must be a dense float32 2-tensor");
+        long m = transa ? a->shape[1] : a->shape[0];
+        long k = transa ? a->shape[0] : a->shape[1];
+        if (k != b->shape[0])
+                EXIT_WITH_ERROR("the shapes of a and b are incompatible");
+
+        long      n   = b->shape[1];
+        MTTensor *res = __mt_new_tensor_zeros(a->context, Arr(int, m, n), 2);
+        SpmmArgs  s   = {.a = a, .b = b->data, .c = res->data, .n = n};
+        if (transa) {
+                long grain = MT_PARALLEL_GRAIN / __max(a->datalen, 1) + 1;
+                __mt_parallel_for(a->context, n, grain, __mt_spmm_t_cols, &s);
+        } else {
+                long grain = MT_PARALLEL_GRAIN * __max(a->shape[0], 1) /
+                             __max(a->datalen * n, 1) + 1;
+                __mt_parallel_for(a->context, m, grain, __mt_spmm_rows, &s);
+        }
+        res->isleaf = 0;
         return res;
 }
 
+/* Only the dense operand receives a gradient, A^T * grad, which is dense */
+MTTensor *__spmm_backward_b(Dependency **prtdeps, MTTensor *grad) {
+        return __mt_tensor_spmm(prtdeps[0]->saved[0], grad, 1);
+}
+
+/* Sparse (CSR) by dense matrix multiplication */
+MTTensor *mt_tensor_spmm(MTTensor *a, MTTensor *b) {
+        ProfScope prof = __mt_prof_begin(a->context);
+        if (a->layout != LAYOUT_CSR)
+                EXIT_WITH_ERROR("a must be a sparse tensor");
+        if (a->context != b->context)
+                EXIT_WITH_ERROR("a and b cannot be in different context");
+        MTTensor *res = __mt_tensor_spmm(a, b, 0);
+        if (b->req_grad) mt_tensor_enable_grad(res);
+        __mt_push_deps_at(res, b, 0, __spmm_backward_b);
+        __mt_save_for_backward(res, Arr(MTTensor *, a), 1, NULL, 0);
+        return __mt_prof_end(&prof, "spmm", res, Arr(MTTensor *, a, b), 2, 0);
+}
+
+/* int8 quantization */
+
+/**
+ * Affine quantization parameters mapping [lo, hi] onto the integer range
+ * [qmin, qmax]. The range is widened to contain zero so that zero is exactly
+ * representable, which keeps zero padding and ReLU outputs exact.
+ */
+void __mt_qparams(float lo, float hi, int qmin, int qmax, float *scale,
+                  int *zero) {
+        lo = __min(lo, 0), hi = __max(hi, 0);
+        float s = (hi - lo) / (qmax - qmin);
+        if (!(s > 0)) s = 1;
+        long z = qmin - lrintf(lo / s);
+        *scale = s;
+        *zero  = __max(qmin, __min(qmax, z));
+}
+
+inline int __mt_qround(float x, float invscale, int zero, int qmin, int qmax) {
+        long q = lrintf(x * invscale) + zero;
+        return __max(qmin, __min(qmax, q));
+}
+
+MTTensor *mt_tensor_quantize(MTTensor *t, int axis) {
+        ProfScope prof = __mt_prof_begin(t->context);
+        __mt_assert_dense(t);
+        if (t->dtype == DTYPE_INT8)
+                EXIT_WITH_ERROR("t is already quantized");
+        if (axis < -1 || axis >= t->ndims)
+                EXIT_WITH_ERROR("invalid quantization axis");
+
+        MTTensor *res = __mt_new_tensor_uninit_dtype(t->context, t->shape,
+                                                     t->ndims, DTYPE_INT8);
+        long      nch = axis < 0 ? 1 : t->shape[axis];
+        res->qaxis    = axis;
+        res->qscale   = __mt_newptr(float, nch);
+        res->qzero    = __mt_newptr(int, nch);
+
+        float *lo = __mt_newptr(float, nch), *hi = __mt_newptr(float, nch);
+        for (long i = 0; i < t->datalen; i++) {
+                long  c = __mt_qchannel(res, i);
+                float x = __mt_tensor_load(t, i);
+                lo[c]   = __min(lo[c], x);
+                hi[c]   = __max(hi[c], x);
+        }
+        for (long c = 0; c < nch; c++)
+                __mt_qparams(lo[c], hi[c], -128, 127, res->qscale + c, res->qzero + c);
+        for (long c = 0; c < nch; c++) lo[c] = 1 / res->qscale[c];
+
+        int8_t *q = res->lpdata;
+        for (long i = 0; i < t->datalen; i++) {
+                long c = __mt_qchannel(res, i);
+                q[i]   = __mt_qround(__mt_tensor_load(t, i), lo[c], res->qzero[c],
+                                     -128, 127);
+        }
+        free(lo), free(hi);
+        return __mt_prof_end(&prof, "quantize", res, Arr(MTTensor *, t), 1, 0);
+}
+
+MTTensor *mt_tensor_dequantize(MTTensor *t) {
+        ProfScope prof = __mt_prof_begin(t->context);
+        if (t->dtype != DTYPE_INT8)
+                EXIT_WITH_ERROR("t is not quantized");
+        return __mt_prof_end(&prof, "dequantize", mt_tensor_to_dtype(t, DTYPE_FLOAT32), Arr(MTTensor *, t), 1, 0);
+}
+
+/**
+ * Int8 GEMM: C (m by n, int32) = A (m by k, uint8) * B (k by n, int8). B is
+ * packed into panels of MT_QGEMM_NR columns, each holding groups of
+ * MT_QGEMM_KU consecutive k per column, so that one 32-byte load feeds
+ * MT_QGEMM_NR dot products of MT_QGEMM_KU terms. A is packed into rows padded
+ * to a multiple of MT_QGEMM_KU, and its row count is padded to a multiple of
+ * MT_QGEMM_MR so that the kernels can always process MT_QGEMM_MR rows at
+ * once. The padding is zero and does not contribute to C.
+ */
+#define MT_QGEMM_MR 4
+#define MT_QGEMM_NR 8
+#define MT_QGEMM_KU 4
+
+/* C (mpad by nb * MT_QGEMM_NR) from A (mpad by kq * MT_QGEMM_KU) and nb
+ * packed panels of B */
+typedef void (*QGemmKernel)(const uint8_t *a, const int8_t *bp, int32_t *c,
+                            long mpad, long kq, long nb);
+
+void __mt_qgemm_kernel_scalar(const uint8_t *a, const int8_t *bp, int32_t *c,
+                              long mpad, long kq, long nb) {
+        long kpad = kq * MT_QGEMM_KU, ldc = nb * MT_QGEMM_NR;
+        for (long i = 0; i < mpad; i++)
+                for (long jb = 0; jb < nb; jb++) {
+                        const uint8_t *ar    = a + i * kpad;
+                        const int8_t  *panel = bp + jb * kpad * MT_QGEMM_NR;
+                        int32_t        acc[MT_QGEMM_NR] = {0};
+                        for (long q = 0; q < kq; q++)
+                                for (int j = 0; j < MT_QGEMM_NR; j++)
+                                        for (int u = 0; u < MT_QGEMM_KU; u++)
+                                                acc[j] += ar[q * MT_QGEMM_KU + u] *
+                                                          panel[(q * MT_QGEMM_NR + j) * MT_QGEMM_KU + u];
+                        memcpy(c + i * ldc + jb * MT_QGEMM_NR, acc, sizeof(acc));
+                }
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define MT_QGEMM_X86
+
+/**
+ * AVX2 kernel. pmaddubsw would multiply the uint8 and int8 bytes directly,
+ * but it saturates the pairwise sums to int16, so both operands are widened
+ * to int16 and multiplied with pmaddwd instead, which is exact. The pairwise
+ * int32 sums of the two column halves are folded together once per tile.
+ */
+__attribute__((target("avx2"))) void
+__mt_qgemm_kernel_avx2(const uint8_t *a, const int8_t *bp, int32_t *c,
+                       long mpad, long kq, long nb) {
+        long kpad = kq * MT_QGEMM_KU, ldc = nb * MT_QGEMM_NR;
+        for (long i0 = 0; i0 < mpad; i0 += MT_QGEMM_MR)
+                for (long jb = 0; jb < nb; jb++) {
+                        const int8_t *panel = bp + jb * kpad * MT_QGEMM_NR;
+                        __m256i       lo[MT_QGEMM_MR], hi[MT_QGEMM_MR];
+                        for (int r = 0; r < MT_QGEMM_MR; r++)
+                                lo[r] = hi[r] = _mm256_setzero_si256();
+                        for (long q = 0; q < kq; q++) {
+                                __m256i b   = _mm256_loadu_si256((const __m256i *)(panel + q * 32));
+                                __m256i blo = _mm256_cvtepi8_epi16(_mm256_castsi256_si128(b));
+                                __m256i bhi = _mm256_cvtepi8_epi16(_mm256_extracti128_si256(b, 1));
+                                for (int r = 0; r < MT_QGEMM_MR; r++) {
+                                        const uint8_t *aq = a + (i0 + r) * kpad + q * MT_QGEMM_KU;
+                                        __m256i        av = _mm256_set1_epi64x(
+                                            (long long)aq[0] | (long long)aq[1] << 16 |
+                                            (long long)aq[2] << 32 | (long long)aq[3] << 48);
+                                        lo[r] = _mm256_add_epi32(lo[r], _mm256_madd_epi16(blo, av));
+                                        hi[r] = _mm256_add_epi32(hi[r], _mm256_madd_epi16(bhi, av));
+                                }
+                        }
+                        for (int r = 0; r < MT_QGEMM_MR; r++) {
+                                __m256i s = _mm256_permute4x64_epi64(
+                                    _mm256_hadd_epi32(lo[r], hi[r]), 0xd8);
+                                _mm256_storeu_si256((__m256i *)(c + (i0 + r) * ldc + jb * MT_QGEMM_NR), s);
+                        }
+                }
+}
+
+/* VNNI kernel: vpdpbusd multiplies groups of four uint8 and int8 bytes and
+ * accumulates their sum into int32 without intermediate saturation. */
+__attribute__((target("avx2,avx512vl,avx512vnni"))) void
+__mt_qgemm_kernel_vnni(const uint8_t *a, const int8_t *bp, int32_t *c,
+                       long mpad, long kq, long nb) {
+        long kpad = kq * MT_QGEMM_KU, ldc = nb * MT_QGEMM_NR;
+        for (long i0 = 0; i0 < mpad; i0 += MT_QGEMM_MR)
+                for (long jb = 0; jb < nb; jb++) {
+                        const int8_t *panel = bp + jb * kpad * MT_QGEMM_NR;
+                        __m256i       acc[MT_QGEMM_MR];
+                        for (int r = 0; r < MT_QGEMM_MR; r++)
+                                acc[r] = _mm256_setzero_si256();
+                        for (long q = 0; q < kq; q++) {
+                                __m256i b = _mm256_loadu_si256((const __m256i *)(panel + q * 32));
+                                for (int r = 0; r < MT_QGEMM_MR; r++) {
+                                        int32_t aq;
+                                        memcpy(&aq, a + (i0 + r) * kpad + q * MT_QGEMM_KU, sizeof(aq));
+                                        acc[r] = _mm256_dpbusd_epi32(acc[r], _mm256_set1_epi32(aq), b);
+                                }
+                        }
+                        for (int r = 0; r < MT_QGEMM_MR; r++)
+                                _mm256_storeu_si256((__m256i *)(c + (i0 + r) * ldc + jb * MT_QGEMM_NR), acc[r]);
+                }
+}
+#endif
+
+/* The fastest int8 GEMM kernel the running CPU supports */
+QGemmKernel __mt_qgemm_kernel(void) {
+#ifdef MT_QGEMM_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512vnni") && __builtin_cpu_supports("avx512vl"))
+                return __mt_qgemm_kernel_vnni;
+        if (__builtin_cpu_supports("avx2"))
+                return __mt_qgemm_kernel_avx2;
+#endif
+        return __mt_qgemm_kernel_scalar;
+}
+
+/**
+ * Quantized matrix multiplication. The rows of `a` are quantized to uint8
+ * with one scale and zero point per row, unless `a` already is an int8
+ * tensor quantized per tensor or per row; `b` must be int8 quantized per
+ * tensor or per column (axis 1), and a float `b` is quantized that way on
+ * the fly. The int32 products are corrected for the zero points, rescaled,
+ * offset by the optional `bias`, and then either returned as float32 or,
+ * when `oscale` is positive, requantized to an int8 tensor with scale
+ * `oscale` and zero point `ozero`.
+ */
+MTTensor *mt_tensor_qmatmul(MTTensor *a, MTTensor *b, MTTensor *bias,
+                            float oscale, int ozero) {
+        ProfScope prof = __mt_prof_begin(a->context);
+        if ((a->ndims != 2) || (b->ndims != 2))
+                EXIT_WITH_ERROR("both a and b must be 2-tensor");
+        if (a->shape[1] != b->shape[0])
+                EXIT_WITH_ERROR("the shapes of a and b are incompatible");
+        if (a->req_grad || b->req_grad)
+                EXIT_WITH_ERROR("gradients are not supported for quantized matmul");
+        if (b->dtype == DTYPE_INT8 && b->qaxis == 0)
+                EXIT_WITH_ERROR("b must be quantized per tensor or along axis 1");
+
+        long m = a->shape[0], k = a->shape[1], n = b->shape[1];
+        if (bias != NULL && bias->datalen != n)
+                EXIT_WITH_ERROR("bias must have one element per column of b");
+
+        MTTensor *bq = b->dtype == DTYPE_INT8 ? b : mt_tensor_quantize(b, 1);
+        long      kq = (k + MT_QGEMM_KU - 1) / MT_QGEMM_KU, kpad = kq * MT_QGEMM_KU;
+        long      nb = (n + MT_QGEMM_NR - 1) / MT_QGEMM_NR, ldc = nb * MT_QGEMM_NR;
+        long      mpad = (m + MT_QGEMM_MR - 1) / MT_QGEMM_MR * MT_QGEMM_MR;
+
+        /* Pack B and take its column sums for the zero point correction */
+        int8_t *bp     = __mt_newptr(int8_t, ldc * kpad);
+        long   *bsum   = __mt_newptr(long, n);
+        int8_t *bdata  = bq->lpdata;
+        for (long p = 0; p < k; p++)
+                for (long j = 0; j < n; j++) {
+                        int8_t v = bdata[p * n + j];
+                        long   jb = j / MT_QGEMM_NR, jj = j % MT_QGEMM_NR;
+                        bp[((jb * kq + p / MT_QGEMM_KU) * MT_QGEMM_NR + jj) * MT_QGEMM_KU +
+                           p % MT_QGEMM_KU] = v;
+                        bsum[j] += v;
+                }
+
+        /* Quantize (or shift the already int8) rows of A into uint8 */
+        uint8_t *ap     = __mt_newptr(uint8_t, mpad * kpad);
+        long    *asum   = __mt_newptr(long, m);
+        float   *ascale = __mt_newptr(float, m);
+        int     *azero  = __mt_newptr(int, m);
+        int      direct = a->dtype == DTYPE_INT8 && a->qaxis != 1;
+        for (long i = 0; i < m; i++) {
+                uint8_t *row = ap + i * kpad;
+                if (direct) {
+                        long c    = a->qaxis < 0 ? 0 : i;
+                        ascale[i] = a->qscale[c];
+                        azero[i]  = a->qzero[c] + 128;
+                        for (long p = 0; p < k; p++)
+                                row[p] = ((int8_t *)a->lpdata)[i * k + p] + 128;
+                } else {
+                        float lo = 0, hi = 0;
+                        for (long p = 0; p < k; p++) {
+                                float x = __mt_tensor_load(a, i * k + p);
+                                lo      = __min(lo, x);
+                                hi      = __max(hi, x);
+                        }
+                        __mt_qparams(lo, hi, 0, 255, ascale + i, azero + i);
+                        float inv = 1 / ascale[i];
+                        for (long p = 0; p < k; p++)
+                                row[p] = __mt_qround(__mt_tensor_load(a, i * k + p), inv,
+                                                     azero[i], 0, 255);
+                }
+                for (long p = 0; p < k; p++) asum[i] += row[p];
+        }
+
+        int32_t *acc = __mt_newptr(int32_t, mpad * ldc);
+        __mt_qgemm_kernel()(ap, bp, acc, mpad, kq, nb);
+
+        /* Epilogue: zero point correction, rescaling, bias and requantization */
+        MTTensor *res = __mt_new_tensor_uninit_dtype(a->context, Arr(int, m, n), 2,
+                                                     oscale > 0 ? DTYPE_INT8
+                                                                : DTYPE_FLOAT32);
+        if (oscale > 0) {
+                res->qscale    = __mt_newptr(float, 1);
+                res->qzero     = __mt_newptr(int, 1);
+                res->qscale[0] = oscale;
+                res->qzero[0]  = ozero;
+        }
+        for (long i = 0; i < m; i++)
+                for (long j = 0; j < n; j++) {
+                        long  cb = bq->qaxis < 0 ? 0 : j;
+                        long  zb = bq->qzero[cb], za = azero[i];
+                        long  s  = acc[i * ldc + j] - zb * asum[i] - za * bsum[j] + k * za * zb;
+                        float y  = s * ascale[i] * bq->qscale[cb];
+                        if (bias != NULL) y += __mt_tensor_load(bias, j);
+                        if (oscale > 0)
+                                ((int8_t *)res->lpdata)[i * n + j] =
+                                    __mt_qround(y, 1 / oscale, ozero, -128, 127);
+                        else
+                                res->data[i * n + j] = y;
+                }
+
+        if (bq != b) mt_tensor_free(bq);
+        free(bp), free(bsum), free(ap), free(asum), free(ascale), free(azero), free(acc);
+        res->isleaf = 0;
+        return __mt_prof_end(&prof, "qmatmul", res, Arr(MTTensor *, a, b, bias), 3, 0);
+}
+
+/* division operation */
+MTTensor *__mt_tensor_div(MTTensor *a, MTTensor *b) {
+        return mt_tensor_bfunc(a, b, __div);
+}
+
+MTTensor *__div_backward_a(Dependency **prtdeps, MTTensor *grad) {
+        MTTensor *a = prtdeps[0]->tensor;
+        MTTensor *b = prtdeps[1]->tensor;
+        grad        = __mt_tensor_div(grad, b);
+        return __mt_grad_unbroadcast(grad, a);
+}
+
+MTTensor *__div_backward_b(Dependency **prtdeps, MTTensor *grad) {
+        MTTensor *a = prtdeps[0]->tensor;
+        MTTensor *b = prtdeps[1]->tensor;
+
+        /* unbroadcast((-grad * a) / (b * b)) w.r.t. b */
+        grad = __mt_tensor_mul(__mt_tensor_neg(grad), a);
+        grad = __mt_tensor_div(grad, __mt_tensor_mul(b, b));
+        return __mt_grad_unbroadcast(grad, b);
+}
+
+inline float __recip(float x) { return 1 / x; }
+
+MTTensor *mt_tensor_div(MTTensor *a, MTTensor *b) {
+        ProfScope prof = __mt_prof_begin(a->context);
+        MTTensor *res = __mt_tensor_div(a, b);
+        if (a->req_grad || b->req_grad) mt_tensor_enable_grad(res);
+        __mt_push_deps_at(res, a, 0, __div_backward_a);
+        __mt_push_deps_at(res, b, 1, __div_backward_b);
+
+        // MTTensor *res = mt_tensor_mul(a, mt_tensor_ufunc(b, __recip));
+        return __mt_prof_end(&prof, "div", res, Arr(MTTensor *, a, b), 2, 0);
+}
+
+/* exponentiation operation */
+MTTensor *__mt_tensor_exp(MTTensor *t) {
+        return __mt_tensor_vfunc(t, __mt_vexp_exact, __mt_vexp_fast);
+}
+
+MTTensor *__exp_backward(Dependency **prtdeps, MTTensor *grad) {
+        MTTensor *t = prtdeps[0]->tensor;
+        return mt_tensor_mul(grad, __mt_tensor_exp(t));
+}
+
+MTTensor *mt_tensor_exp(MTTensor *t) {
+        ProfScope prof = __mt_prof_begin(t->context);
+        MTTensor *res = __mt_tensor_exp(t);
+        if (t->req_grad) mt_tensor_enable_grad(res);
+        __mt_push_deps_at(res, t, 0, __exp_backward);
+        return __mt_prof_end(&prof, "exp", res, Arr(MTTensor *, t), 1, 0);
+}
+
 /* negation operation */
 MTTensor *__neg_backward(Dependency **prtdeps, MTTensor *grad) {
         return __mt_tensor_neg(grad);
@@ -889,15 +3128,16 @@ MTTensor *__mt_tensor_neg(MTTensor *t) {
 }
 
 MTTensor *mt_tensor_neg(MTTensor *t) {
+        ProfScope prof = __mt_prof_begin(t->context);
         MTTensor *res = __mt_tensor_neg(t);
         if (t->req_grad) mt_tensor_enable_grad(res);
         __mt_push_deps_at(res, t, 0, __neg_backward);
-        return res;
+        return __mt_prof_end(&prof, "neg", res, Arr(MTTensor *, t), 1, 0);
 }
 
 /* (natural) logarithm operation */
 MTTensor *__mt_tensor_log(MTTensor *t) {
-        return mt_tensor_ufunc(t, __mt_log);
+        return __mt_tensor_vfunc(t, __mt_vlog_exact, __mt_vlog_fast);
 }
 
 MTTensor *__log_backward(Dependency **prtdeps, MTTensor *grad) {
@@ -906,15 +3146,62 @@ MTTensor *__log_backward(Dependency **prtdeps, MTTensor *grad) {
 }
 
 MTTensor *mt_tensor_log(MTTensor *t) {
+        ProfScope prof = __mt_prof_begin(t->context);
         MTTensor *res = __mt_tensor_log(t);
         if (t->req_grad) mt_tensor_enable_grad(res);
         __mt_push_deps_at(res, t, 0, __log_backward);
+        return __mt_prof_end(&prof, "log", res, Arr(MTTensor *, t), 1, 0);
+}
+
+/* hyperbolic tangent operation */
+MTTensor *__mt_tensor_tanh(MTTensor *t) {
+        return __mt_tensor_vfunc(t, __mt_vtanh_exact, __mt_vtanh_fast);
+}
+
+/* d/dx tanh(x) = 1 - tanh(x)^2, with tanh(x) recomputed */
+MTTensor *__tanh_backward(Dependency **prtdeps, MTTensor *grad) {
+        MTTensor *res = __mt_tensor_tanh(prtdeps[0]->tensor);
+        if (grad->datalen != res->datalen)
+                EXIT_WITH_ERROR("grad must have the same shape as the tanh output");
+        for (long i = 0; i < res->datalen; i++)
+                res->data[i] = grad->data[i] * (1 - res->data[i] * res->data[i]);
+        return res;
+}
+
+MTTensor *mt_tensor_tanh(MTTensor *t) {
+        ProfScope prof = __mt_prof_begin(t->context);
+        MTTensor *res = __mt_tensor_tanh(t);
+        if (t->req_grad) mt_tensor_enable_grad(res);
+        __mt_push_deps_at(res, t, 0, __tanh_backward);
+        return __mt_prof_end(&prof, "tanh", res, Arr(MTTensor *, t), 1, 0);
+}
+
+/* sigmoid operation */
+MTTensor *__mt_tensor_sigmoid(MTTensor *t) {
+        return __mt_tensor_vfunc(t, __mt_vsigmoid_exact, __mt_vsigmoid_fast);
+}
+
+/* d/dx sigmoid(x) = sigmoid(x) * (1 - sigmoid(x)), with sigmoid(x) recomputed */
+MTTensor *__sigmoid_backward(Dependency **prtdeps, MTTensor *grad) {
+        MTTensor *res = __mt_tensor_sigmoid(prtdeps[0]->tensor);
+        if (grad->datalen != res->datalen)
+                EXIT_WITH_ERROR("grad must have the same shape as the sigmoid output");
+        for (long i = 0; i < res->datalen; i++)
+                res->data[i] = grad->data[i] * res->data[i] * (1 - res->data[i]);
         return res;
 }
 
+MTTensor *mt_tensor_sigmoid(MTTensor *t) {
+        ProfScope prof = __mt_prof_begin(t->context);
+        MTTensor *res = __mt_tensor_sigmoid(t);
+        if (t->req_grad) mt_tensor_enable_grad(res);
+        __mt_push_deps_at(res, t, 0, __sigmoid_backward);
+        return __mt_prof_end(&prof, "sigmoid", res, Arr(MTTensor *, t), 1, 0);
+}
+
 /* relu operation */
-inline float __relu(float x) { return __max(0, x); }
-inline float __drelu(float t, float g) { return t > 0 ? g : 0; }
+float __relu(float x) { return __max(0, x); }
+float __drelu(float t, float g) { return t > 0 ? g : 0; }
 
 MTTensor *__relu_backward(Dependency **prtdeps, MTTensor *grad) {
         MTTensor *t = prtdeps[0]->tensor;
@@ -922,42 +3209,59 @@ MTTensor *__relu_backward(Dependency **prtdeps, MTTensor *grad) {
 }
 
 MTTensor *mt_tensor_relu(MTTensor *t) {
+        ProfScope prof = __mt_prof_begin(t->context);
         MTTensor *res = mt_tensor_ufunc(t, __relu);
         if (t->req_grad) mt_tensor_enable_grad(res);
         __mt_push_deps_at(res, t, 0, __relu_backward);
-        return res;
+        return __mt_prof_end(&prof, "relu", res, Arr(MTTensor *, t), 1, 0);
 }
 
 /* transpose operation */
 MTTensor *__mt_tensor_transpose(MTTensor *t) {
-        int **indices_tr = __mt_newptr(int *, t->ndims);
-        for (int i = t->ndims; i > 0; i--) {
-                indices_tr[t->ndims - i] =
-                    t->indices[i - 1];
-        }
-        int shape_tr[t->ndims];
-        for (int i = t->ndims; i > 0; i--) {
-                shape_tr[t->ndims - i] = t->shape[i - 1];
-        }
-        int strides_tr[t->ndims];
-        for (int i = t->ndims; i > 0; i--) {
-                strides_tr[t->ndims - i] = t->strides[i - 1];
-        }
-
-        float *transposed_data =
-            mt_tensor_get_all_data_constrained(t, indices_tr, shape_tr,
-                                               strides_tr, t->ndims);
-        MTTensor *res = mt_new_tensor(t->context, transposed_data,
-                                      shape_tr, t->ndims);
-        free(transposed_data);
-        free(indices_tr);
+        __mt_assert_dense(t);
+        int  shape_tr[t->ndims];
+        long strides_tr[t->ndims];
+        for (int i = 0; i < t->ndims; i++) {
+                shape_tr[i]   = t->shape[t->ndims - 1 - i];
+                strides_tr[i] = t->strides[t->ndims - 1 - i];
+        }
+
+        MTTensor *res = __mt_new_tensor_uninit(t->context, shape_tr, t->ndims);
+        __mt_strided_copy(t, 0, shape_tr, strides_tr, t->ndims, res->data, res->strides);
+        __mt_tensor_set_dtype(res, __mt_result_dtype(t->dtype));
         return res;
 }
 MTTensor *mt_tensor_transpose(MTTensor *t) {
+        ProfScope prof = __mt_prof_begin(t->context);
         MTTensor *res = __mt_tensor_transpose(t);
+        return __mt_prof_end(&prof, "transpose", res, Arr(MTTensor *, t), 1, 0);
+}
+
+/* reshape operation */
+MTTensor *__mt_tensor_reshape(MTTensor *t, int *shape, int ndims) {
+        if (__prod(shape, ndims, long) != t->datalen)
+                EXIT_WITH_ERROR("the new shape must have as many elements as t");
+        if (t->dtype == DTYPE_INT8 && t->qaxis >= 0)
+                EXIT_WITH_ERROR("per-channel quantized tensors cannot be reshaped");
+        MTTensor *res = __mt_new_tensor_meta(t->context, shape, ndims, t->dtype);
+        __mt_tensor_share_storage(res, t);
         return res;
 }
 
+MTTensor *__reshape_backward(Dependency **prtdeps, MTTensor *grad) {
+        MTTensor *t = prtdeps[0]->tensor;
+        return __mt_tensor_reshape(grad, t->shape, t->ndims);
+}
+
+MTTensor *mt_tensor_reshape(MTTensor *t, int *shape, int ndims) {
+        ProfScope prof = __mt_prof_begin(t->context);
+        MTTensor *res  = __mt_tensor_reshape(t, shape, ndims);
+        res->isleaf    = 0;
+        if (t->req_grad) mt_tensor_enable_grad(res);
+        __mt_push_deps_at(res, t, 0, __reshape_backward);
+        return __mt_prof_end(&prof, "reshape", res, Arr(MTTensor *, t), 1, 0);
+}
+
 /* sum operation */
 MTTensor *__sum_backward(Dependency **prtdeps, MTTensor *grad) {
         MTTensor *self = prtdeps[0]->tensor;
@@ -967,11 +3271,15 @@ MTTensor *__sum_backward(Dependency **prtdeps, MTTensor *grad) {
 }
 
 MTTensor *__mt_tensor_sum(MTTensor *t, int dim, int keepdim) {
+        __mt_assert_dense(t);
         if (dim > -1) return mt_tensor_reduce(t, dim, __add, keepdim);
 
-        float sum = 0;
-        for (long i = 0; i < t->datalen; i++)
-                sum += t->data[i];
+        float sum = 0, buf[MT_VEC_CHUNK];
+        for (long i0 = 0; i0 < t->datalen; i0 += MT_VEC_CHUNK) {
+                long         nc = __min(MT_VEC_CHUNK, t->datalen - i0);
+                const float *in = __mt_load_chunk(t, i0, nc, buf);
+                for (long i = 0; i < nc; i++) sum += in[i];
+        }
 
         MTTensor *res = NULL;
         if (!keepdim) {
@@ -981,66 +3289,2679 @@ MTTensor *__mt_tensor_sum(MTTensor *t, int dim, int keepdim) {
                 for (int i = 0; i < t->ndims; i++) shape[i] = 1;
                 res = mt_new_tensor(t->context, Arr(float, sum), shape, t->ndims);
         }
+        __mt_tensor_set_dtype(res, __mt_result_dtype(t->dtype));
         res->isleaf = 0;
         return res;
 }
 MTTensor *mt_tensor_sum(MTTensor *t, int dim, int keepdim) {
+        ProfScope prof = __mt_prof_begin(t->context);
         MTTensor *res = __mt_tensor_sum(t, dim, keepdim);
         if (t->req_grad) {
                 mt_tensor_enable_grad(res);
                 __mt_push_deps_at(res, t, 0, __sum_backward);
         }
-        return res;
+        return __mt_prof_end(&prof, "sum", res, Arr(MTTensor *, t), 1, 0);
 }
 
+/* softmax, log-softmax and cross-entropy operations */
+
 /**
- * AUTOGRAD
+ * View `t` as (outer, n, inner) around dimension `dim`, where n is the length
+ * of `dim`. Element j of the (o, i)-th slice lives at o * n * inner + j * inner
+ * + i of the (contiguous) data.
  */
-void mt_tensor_enable_grad(MTTensor *t) {
-        t->req_grad = 1;
-        mt_tensor_zero_grad(t);
+void __mt_dim_split(MTTensor *t, int dim, long *outer, long *n, long *inner) {
+        if (dim < 0 || dim >= t->ndims)
+                EXIT_WITH_ERROR("dim is out of range");
+        int *trailing = t->shape + dim + 1;
+        *outer        = __prod(t->shape, dim, long);
+        *n            = t->shape[dim];
+        *inner        = __prod(trailing, t->ndims - dim - 1, long);
 }
 
-void mt_tensor_disable_grad(MTTensor *t) {
-        t->req_grad = 0;
-        if (t->grad != NULL) {
-                mt_tensor_free(t->grad);
-                t->grad = NULL;
-                mt_context_defrag(t->context);
+/**
+ * log(sum(exp(x))) of a contiguous row, shifted by the row max. The max and
+ * the sum are taken in a single pass over stack-sized chunks: the sum is kept
+ * relative to the running max of the chunks seen so far, and is rescaled by
+ * exp(old - new) whenever a chunk raises that max.
+ */
+float __mt_logsumexp_row(const float *x, long n, VecFunc vexp) {
+        float buf[MT_VEC_CHUNK], m = -INFINITY, s = 0;
+        for (long j0 = 0; j0 < n; j0 += MT_VEC_CHUNK) {
+                long  nc = __min(MT_VEC_CHUNK, n - j0);
+                float cm = m;
+                for (long j = 0; j < nc; j++) cm = __max(cm, x[j0 + j]);
+                if (isinf(cm)) {
+                        if (cm > 0) return cm;
+                        continue;
+                }
+                if (cm > m) s *= expf(m - cm), m = cm;
+                for (long j = 0; j < nc; j++) buf[j] = x[j0 + j] - m;
+                vexp(buf, buf, nc);
+                for (long j = 0; j < nc; j++) s += buf[j];
         }
+        return isinf(m) ? m : m + logf(s);
 }
 
-void mt_tensor_backward(MTTensor *t, MTTensor *grad) {
-        if (!t->req_grad) return;
+/**
+ * Compute the softmax (or the log-softmax when `logsm` is nonzero) along the
+ * middle dimension of an (outer, n, inner) view of `x`, writing into `y`. The
+ * inputs are shifted by their max before exponentiation so that large logits
+ * do not overflow. For inner == 1 the max and the exponentials are taken in
+ * one online pass, as in __mt_logsumexp_row: each chunk of the row is shifted
+ * by the running max it saw, which `cmax` records, and the normalization
+ * rescales the chunk to the final max. For inner > 1 the passes run over
+ * whole `inner`-long vectors instead, keeping the memory access contiguous.
+ */
+void __mt_softmax_kernel(const float *x, float *y, long outer, long n,
+                         long inner, int logsm, VecFunc vexp) {
+        if (inner == 1) {
+                long   nchunks = (n + MT_VEC_CHUNK - 1) / MT_VEC_CHUNK;
+                float *cmax    = logsm ? NULL : __mt_newptr(float, nchunks);
+                for (long o = 0; o < outer; o++) {
+                        const float *xr = x + o * n;
+                        float       *yr = y + o * n;
+                        if (logsm) {
+                                float lse = __mt_logsumexp_row(xr, n, vexp);
+                                for (long j = 0; j < n; j++) yr[j] = xr[j] - lse;
+                                continue;
+                        }
 
-        if (grad == NULL) {
-                if (t->ndims == 0)
-                        grad = mt_new_scalar(t->context, 1.0);
-                else
-                        EXIT_WITH_ERROR("grad must be specified for non scalar tensor");
+                        float m = -INFINITY, s = 0;
+                        for (long c = 0; c < nchunks; c++) {
+                                long  j0 = c * MT_VEC_CHUNK, nc = __min(MT_VEC_CHUNK, n - j0);
+                                float cm = m;
+                                for (long j = 0; j < nc; j++) cm = __max(cm, xr[j0 + j]);
+                                if (cm > m) s *= expf(m - cm), m = cm;
+                                cmax[c] = m;
+                                for (long j = 0; j < nc; j++) yr[j0 + j] = xr[j0 + j] - m;
+                                vexp(yr + j0, yr + j0, nc);
+                                for (long j = 0; j < nc; j++) s += yr[j0 + j];
+                        }
+                        float r = 1 / s;
+                        for (long c = 0; c < nchunks; c++) {
+                                long  j0 = c * MT_VEC_CHUNK, nc = __min(MT_VEC_CHUNK, n - j0);
+                                float f  = cmax[c] == m ? r : expf(cmax[c] - m) * r;
+                                for (long j = 0; j < nc; j++) yr[j0 + j] *= f;
+                        }
+                }
+                free(cmax);
+                return;
         }
-        t->grad = __mt_tensor_add(t->grad,
-                                  grad);
 
-        /* recursively compute gradient of t's non-null children */
-        for (int i = 0; i < t->ndeps; i++) {
-                if (t->deps[i] != NULL) {
-                        if (t->deps[i]->grad_fn == NULL)
-                                EXIT_WITH_ERROR("fatal: no grad_fn defined");
-                        MTTensor *bwgrad = t->deps[i]->grad_fn(t->deps, grad);
-                        mt_tensor_backward(t->deps[i]->tensor, bwgrad);
+        float *mx = __mt_newptr(float, inner);
+        float *sm = __mt_newptr(float, inner);
+        for (long o = 0; o < outer; o++) {
+                const float *xo = x + o * n * inner;
+                float       *yo = y + o * n * inner;
+                for (long i = 0; i < inner; i++) mx[i] = -INFINITY, sm[i] = 0;
+                for (long j = 0; j < n; j++)
+                        for (long i = 0; i < inner; i++)
+                                mx[i] = __max(mx[i], xo[j * inner + i]);
+                for (long j = 0; j < n; j++)
+                        for (long i = 0; i < inner; i++)
+                                yo[j * inner + i] = xo[j * inner + i] - mx[i];
+                vexp(yo, yo, n * inner);
+                for (long j = 0; j < n; j++)
+                        for (long i = 0; i < inner; i++) sm[i] += yo[j * inner + i];
+                if (logsm) {
+                        for (long i = 0; i < inner; i++) mx[i] += logf(sm[i]);
+                        for (long j = 0; j < n; j++)
+                                for (long i = 0; i < inner; i++)
+                                        yo[j * inner + i] = xo[j * inner + i] - mx[i];
+                } else {
+                        for (long i = 0; i < inner; i++) sm[i] = 1 / sm[i];
+                        for (long j = 0; j < n; j++)
+                                for (long i = 0; i < inner; i++)
+                                        yo[j * inner + i] *= sm[i];
                 }
         }
+        free(mx), free(sm);
 }
 
-void mt_remove_intermediary_nodes(MTContext *ctx) {
-        for (int i = 0; i < ctx->ntracked; i++) {
-                mt_tensor_free(ctx->tracked[i]);
-                ctx->tracked[i] = NULL;
+/**
+ * Fused backward of softmax and log-softmax. With y = softmax(x) the input
+ * gradient is y * (g - sum(g * y)), and with y = log_softmax(x) it is
+ * g - softmax(x) * sum(g). softmax(x) is recomputed from `x` instead of being
+ * kept alive since the forward pass.
+ */
+void __mt_softmax_backward_kernel(const float *x, const float *g, float *dx,
+                                  long outer, long n, long inner, int logsm,
+                                  VecFunc vexp) {
+        __mt_softmax_kernel(x, dx, outer, n, inner, 0, vexp);
+
+        float *acc = __mt_newptr(float, inner);
+        for (long o = 0; o < outer; o++) {
+                const float *go  = g + o * n * inner;
+                float       *dxo = dx + o * n * inner;
+                for (long i = 0; i < inner; i++) acc[i] = 0;
+                for (long j = 0; j < n; j++)
+                        for (long i = 0; i < inner; i++)
+                                acc[i] += logsm ? go[j * inner + i]
+                                                : go[j * inner + i] * dxo[j * inner + i];
+                for (long j = 0; j < n; j++)
+                        for (long i = 0; i < inner; i++) {
+                                long  k = j * inner + i;
+                                float y = dxo[k];
+                                dxo[k]  = logsm ? go[k] - y * acc[i]
+                                                : y * (go[k] - acc[i]);
+                        }
         }
+        free(acc);
 }
 
-void mt_tensor_zero_grad(MTTensor *t) {
-        mt_tensor_free(t->grad);
-        t->grad = mt_new_tensor_full(t->context, 0., t->shape, t->ndims);
+MTTensor *__mt_tensor_softmax(MTTensor *t, int dim, int logsm) {
+        __mt_assert_dense(t);
+        if (t->dtype != DTYPE_FLOAT32)
+                EXIT_WITH_ERROR("softmax only supports float32 tensors");
+        long outer, n, inner;
+        __mt_dim_split(t, dim, &outer, &n, &inner);
+
+        MTTensor *res = __mt_new_tensor_uninit(t->context, t->shape, t->ndims);
+        __mt_softmax_kernel(t->data, res->data, outer, n, inner, logsm,
+                            __mt_vexp_for(t->context));
+        res->isleaf = 0;
+        return res;
+}
+
+MTTensor *__mt_softmax_backward(Dependency *dep, MTTensor *grad, int logsm) {
+        MTTensor *t   = dep->tensor;
+        int       dim = dep->args[0];
+        if (grad->datalen != t->datalen)
+                EXIT_WITH_ERROR("grad must have the same shape as the softmax output");
+
+        long outer, n, inner;
+        __mt_dim_split(t, dim, &outer, &n, &inner);
+
+        MTTensor *res = __mt_new_tensor_uninit(t->context, t->shape, t->ndims);
+        __mt_softmax_backward_kernel(t->data, grad->data, res->data,
+                                     outer, n, inner, logsm,
+                                     __mt_vexp_for(t->context));
+        return res;
+}
+
+MTTensor *__softmax_backward(Dependency **prtdeps, MTTensor *grad) {
+        return __mt_softmax_backward(prtdeps[0], grad, 0);
+}
+
+MTTensor *__log_softmax_backward(Dependency **prtdeps, MTTensor *grad) {
+        return __mt_softmax_backward(prtdeps[0], grad, 1);
+}
+
+MTTensor *mt_tensor_softmax(MTTensor *t, int dim) {
+        ProfScope prof = __mt_prof_begin(t->context);
+        MTTensor *res = __mt_tensor_softmax(t, dim, 0);
+        if (t->req_grad) mt_tensor_enable_grad(res);
+        __mt_push_deps_at(res, t, 0, __softmax_backward);
+        __mt_save_for_backward(res, NULL, 0, Arr(long, dim), 1);
+        return __mt_prof_end(&prof, "softmax", res, Arr(MTTensor *, t), 1, 0);
+}
+
+MTTensor *mt_tensor_log_softmax(MTTensor *t, int dim) {
+        ProfScope prof = __mt_prof_begin(t->context);
+        MTTensor *res = __mt_tensor_softmax(t, dim, 1);
+        if (t->req_grad) mt_tensor_enable_grad(res);
+        __mt_push_deps_at(res, t, 0, __log_softmax_backward);
+        __mt_save_for_backward(res, NULL, 0, Arr(long, dim), 1);
+        return __mt_prof_end(&prof, "log_softmax", res, Arr(MTTensor *, t), 1, 0);
+}
+
+/* Validate the (N, C) logits against N class-index targets, returning C */
+long __mt_check_cross_entropy(MTTensor *logits, MTTensor *targets) {
+        if (logits->dtype != DTYPE_FLOAT32 || targets->dtype != DTYPE_FLOAT32)
+                EXIT_WITH_ERROR("cross-entropy only supports float32 tensors");
+        if (logits->ndims != 2)
+                EXIT_WITH_ERROR("logits must be a 2-tensor of shape (N, C)");
+        if (targets->datalen != logits->shape[0])
+                EXIT_WITH_ERROR("targets must hold one class index per row of logits");
+        long nclasses = logits->shape[1];
+        for (long i = 0; i < targets->datalen; i++)
+                if (targets->data[i] < 0 || targets->data[i] >= nclasses)
+                        EXIT_WITH_ERROR("target class index is out of range");
+        return nclasses;
+}
+
+/**
+ * The cross-entropy backward w.r.t. logits is (softmax(logits) - onehot) / N,
+ * scaled by the incoming scalar grad. It is computed directly from the logits
+ * without going through the log-softmax graph.
+ */
+MTTensor *__cross_entropy_backward(Dependency **prtdeps, MTTensor *grad) {
+        MTTensor *logits  = prtdeps[0]->tensor;
+        MTTensor *targets = prtdeps[0]->saved[0];
+        long      nrows   = logits->shape[0];
+        long      ncls    = logits->shape[1];
+        float     scale   = grad->data[0] / nrows;
+
+        MTTensor *res = __mt_new_tensor_uninit(logits->context, logits->shape,
+                                               logits->ndims);
+        __mt_softmax_kernel(logits->data, res->data, nrows, ncls, 1, 0,
+                            __mt_vexp_for(logits->context));
+        for (long i = 0; i < nrows; i++) {
+                float *r = res->data + i * ncls;
+                r[(long)targets->data[i]] -= 1;
+                for (long j = 0; j < ncls; j++) r[j] *= scale;
+        }
+        return res;
+}
+
+/**
+ * Mean cross-entropy between (N, C) logits and N class indices (stored as
+ * floats). Only the per-row logsumexp is computed, so no (N, C) intermediate
+ * is allocated in the forward pass.
+ */
+MTTensor *mt_tensor_cross_entropy(MTTensor *logits, MTTensor *targets) {
+        ProfScope prof = __mt_prof_begin(logits->context);
+        if (logits->context != targets->context)
+                EXIT_WITH_ERROR("logits and targets cannot be in different context");
+        long ncls  = __mt_check_cross_entropy(logits, targets);
+        long nrows = logits->shape[0];
+
+        VecFunc vexp = __mt_vexp_for(logits->context);
+        double  loss = 0;
+        for (long i = 0; i < nrows; i++) {
+                const float *r = logits->data + i * ncls;
+                loss += __mt_logsumexp_row(r, ncls, vexp) - r[(long)targets->data[i]];
+        }
+
+        MTTensor *res = mt_new_scalar(logits->context, loss / nrows);
+        res->isleaf   = 0;
+        if (logits->req_grad) mt_tensor_enable_grad(res);
+        __mt_push_deps_at(res, logits, 0, __cross_entropy_backward);
+        __mt_save_for_backward(res, Arr(MTTensor *, targets), 1, NULL, 0);
+        return __mt_prof_end(&prof, "cross_entropy", res, Arr(MTTensor *, logits, targets), 2, 0);
+}
+
+/* layer and batch normalization */
+
+/* Running mean and sum of squared deviations of `n` values (Welford) */
+typedef struct {
+        long  n;
+        float mean, m2;
+} Welford;
+
+/* Merge the statistics of another `n` values into `w` (Chan et al.) */
+inline void __mt_welford_merge(Welford *w, long n, float mean, float m2) {
+        if (n == 0) return;
+        long  total = w->n + n;
+        float delta = mean - w->mean;
+        w->mean += delta * n / total;
+        w->m2 += m2 + delta * delta * ((float)w->n * n / total);
+        w->n = total;
+}
+
+/**
+ * Fold `len` contiguous values into `w` in a single pass. Eight interleaved
+ * Welford accumulators, all holding the same count, run side by side in two
+ * SSE registers; they are merged into `w` at the end.
+ */
+void __mt_welford_update(Welford *w, const float *x, long len) {
+        float mean[8] = {0}, m2[8] = {0};
+        long  k = 0, j = 0;
+#ifdef __SSE__
+        __m128 mu[2] = {_mm_setzero_ps(), _mm_setzero_ps()}, ss[2] = {mu[0], mu[0]};
+        for (; j + 8 <= len; j += 8) {
+                __m128 inv = _mm_set1_ps(1.0f / ++k);
+                for (int h = 0; h < 2; h++) {
+                        __m128 v = _mm_loadu_ps(x + j + 4 * h);
+                        __m128 d = _mm_sub_ps(v, mu[h]);
+                        mu[h]    = _mm_add_ps(mu[h], _mm_mul_ps(d, inv));
+                        ss[h]    = _mm_add_ps(ss[h], _mm_mul_ps(d, _mm_sub_ps(v, mu[h])));
+                }
+        }
+        _mm_storeu_ps(mean, mu[0]), _mm_storeu_ps(mean + 4, mu[1]);
+        _mm_storeu_ps(m2, ss[0]), _mm_storeu_ps(m2 + 4, ss[1]);
+#else
+        for (; j + 8 <= len; j += 8) {
+                float inv = 1.0f / ++k;
+                for (int l = 0; l < 8; l++) {
+                        float d = x[j + l] - mean[l];
+                        mean[l] += d * inv;
+                        m2[l] += d * (x[j + l] - mean[l]);
+                }
+        }
+#endif
+        for (int l = 0; l < 8; l++) __mt_welford_merge(w, k, mean[l], m2[l]);
+        for (; j < len; j++) __mt_welford_merge(w, 1, x[j], 0);
+}
+
+/* y = (x - mean) * rstd * gamma + beta over `len` values, where a NULL gamma
+ * or beta stands for 1 or 0 */
+inline void __mt_norm_apply(const float *x, float *y, long len, float mean,
+                            float rstd, const float *gamma, const float *beta,
+                            long gstride) {
+        for (long j = 0; j < len; j++) {
+                float g = gamma == NULL ? 1 : gamma[j * gstride];
+                float b = beta == NULL ? 0 : beta[j * gstride];
+                y[j]    = (x[j] - mean) * rstd * g + b;
+        }
+}
+
+void __mt_check_norm_affine(MTTensor *x, MTTensor *p, long len) {
+        if (p == NULL) return;
+        if (p->context != x->context)
+                EXIT_WITH_ERROR("x, gamma and beta cannot be in different context");
+        if (p->datalen != len || p->dtype != DTYPE_FLOAT32)
+                EXIT_WITH_ERROR("gamma and beta must be float32 with one element per normalized feature");
+}
+
+/**
+ * Layer normalization over the last dimension. The per-row mean and
+ * reciprocal standard deviation are saved as a (rows, 2) tensor, from which
+ * the backward functions rebuild the normalized input.
+ */
+MTTensor *__mt_tensor_layer_norm(MTTensor *x, MTTensor *gamma, MTTensor *beta,
+                                 float eps, MTTensor **stats) {
+        __mt_assert_dense(x);
+        if (x->ndims < 1 || x->dtype != DTYPE_FLOAT32)
+                EXIT_WITH_ERROR("x must be a float32 tensor with at least one dimension");
+        long d = x->shape[x->ndims - 1], rows = x->datalen / __max(d, 1);
+        __mt_check_norm_affine(x, gamma, d), __mt_check_norm_affine(x, beta, d);
+
+        MTTensor *res = __mt_new_tensor_uninit(x->context, x->shape, x->ndims);
+        *stats        = __mt_new_tensor_uninit(x->context, Arr(int, rows, 2), 2);
+        for (long r = 0; r < rows; r++) {
+                Welford w = {0, 0, 0};
+                __mt_welford_update(&w, x->data + r * d, d);
+                float rstd                 = 1 / sqrtf(w.m2 / d + eps);
+                (*stats)->data[2 * r]     = w.mean;
+                (*stats)->data[2 * r + 1] = rstd;
+                __mt_norm_apply(x->data + r * d, res->data + r * d, d, w.mean, rstd,
+                                gamma == NULL ? NULL : gamma->data,
+                                beta == NULL ? NULL : beta->data, 1);
+        }
+        res->isleaf = 0;
+        return res;
+}
+
+/**
+ * The fused layer-norm backward. With xhat the normalized row and
+ * g = grad * gamma, the input gradient of a row is
+ * rstd * (g - mean(g) - xhat * mean(g * xhat)).
+ */
+MTTensor *__layer_norm_backward_x(Dependency **prtdeps, MTTensor *grad) {
+        Dependency *dep   = prtdeps[0];
+        MTTensor   *x     = dep->tensor;
+        MTTensor   *gamma = dep->saved[1], *stats = dep->saved[2];
+        long        d = x->shape[x->ndims - 1], rows = x->datalen / __max(d, 1);
+
+        MTTensor *res = __mt_new_tensor_uninit(x->context, x->shape, x->ndims);
+        for (long r = 0; r < rows; r++) {
+                const float *xr = x->data + r * d, *gr = grad->data + r * d;
+                float        mean = stats->data[2 * r], rstd = stats->data[2 * r + 1];
+                float        sg = 0, sgx = 0;
+                for (long j = 0; j < d; j++) {
+                        float g = gr[j] * (gamma == NULL ? 1 : gamma->data[j]);
+                        sg += g;
+                        sgx += g * (xr[j] - mean) * rstd;
+                }
+                sg /= d, sgx /= d;
+                for (long j = 0; j < d; j++) {
+                        float g           = gr[j] * (gamma == NULL ? 1 : gamma->data[j]);
+                        float xhat        = (xr[j] - mean) * rstd;
+                        res->data[r * d + j] = rstd * (g - sg - xhat * sgx);
+                }
+        }
+        return res;
+}
+
+/**
+ * Gradients of the affine parameters, summed over the rows: grad * xhat for
+ * gamma and grad for beta. Shared by layer and batch norm, which differ in
+ * how an element maps to its statistics and its parameter. Every dependency
+ * holds the same saved tensors, and gamma and beta do not have fixed
+ * positions since either may be omitted, so the first one present is used.
+ */
+MTTensor *__mt_norm_affine_grad(Dependency **prtdeps, MTTensor *grad,
+                                int of_gamma, int batch) {
+        Dependency *dep = prtdeps[0];
+        for (int i = 1; dep == NULL; i++) dep = prtdeps[i];
+        MTTensor *x = dep->saved[0], *stats = dep->saved[2];
+        long      outer, n, inner;
+        if (batch)
+                __mt_dim_split(x, 1, &outer, &n, &inner);
+        else
+                outer = x->datalen / x->shape[x->ndims - 1], n = x->shape[x->ndims - 1], inner = 1;
+
+        MTTensor *res = __mt_new_tensor_zeros(x->context, Arr(int, n), 1);
+        for (long o = 0; o < outer; o++)
+                for (long c = 0; c < n; c++) {
+                        long  s    = batch ? c : o;
+                        float mean = stats->data[2 * s], rstd = stats->data[2 * s + 1];
+                        long  base = (o * n + c) * inner;
+                        float acc  = 0;
+                        for (long i = 0; i < inner; i++)
+                                acc += grad->data[base + i] *
+                                       (of_gamma ? (x->data[base + i] - mean) * rstd : 1);
+                        res->data[c] += acc;
+                }
+        return res;
+}
+
+MTTensor *__layer_norm_backward_gamma(Dependency **prtdeps, MTTensor *grad) {
+        return __mt_norm_affine_grad(prtdeps, grad, 1, 0);
+}
+
+MTTensor *__layer_norm_backward_beta(Dependency **prtdeps, MTTensor *grad) {
+        return __mt_norm_affine_grad(prtdeps, grad, 0, 0);
+}
+
+/* Layer normalization of `x` over its last dimension, with optional
+ * elementwise affine parameters `gamma` and `beta` (NULL to omit) */
+MTTensor *mt_tensor_layer_norm(MTTensor *x, MTTensor *gamma, MTTensor *beta,
+                               float eps) {
+        ProfScope prof = __mt_prof_begin(x->context);
+        MTTensor *stats;
+        MTTensor *res = __mt_tensor_layer_norm(x, gamma, beta, eps, &stats);
+        if (x->req_grad || (gamma != NULL && gamma->req_grad) || (beta != NULL && beta->req_grad))
+                mt_tensor_enable_grad(res);
+        __mt_push_deps_at(res, x, 0, __layer_norm_backward_x);
+        if (gamma != NULL) __mt_push_deps_at(res, gamma, res->ndeps, __layer_norm_backward_gamma);
+        if (beta != NULL) __mt_push_deps_at(res, beta, res->ndeps, __layer_norm_backward_beta);
+        __mt_save_for_backward(res, Arr(MTTensor *, x, gamma, stats), 3, NULL, 0);
+        return __mt_prof_end(&prof, "layer_norm", res, Arr(MTTensor *, x, gamma, beta), 3, 0);
+}
+
+/**
+ * Batch normalization of an (N, C, ...) tensor per channel C. In training
+ * mode the statistics come from the batch, in one Welford pass per channel,
+ * and the running statistics (if given) are moved towards them by
+ * `momentum`, using the unbiased variance. Otherwise the running statistics
+ * are used. Per-channel mean and reciprocal standard deviation are saved as a
+ * (C, 2) tensor.
+ */
+MTTensor *__mt_tensor_batch_norm(MTTensor *x, MTTensor *gamma, MTTensor *beta,
+                                 MTTensor *rmean, MTTensor *rvar, int training,
+                                 float momentum, float eps, MTTensor **stats) {
+        __mt_assert_dense(x);
+        if (x->ndims < 2 || x->dtype != DTYPE_FLOAT32)
+                EXIT_WITH_ERROR("x must be a float32 tensor of shape (N, C, ...)");
+        long outer, c, inner;
+        __mt_dim_split(x, 1, &outer, &c, &inner);
+        __mt_check_norm_affine(x, gamma, c), __mt_check_norm_affine(x, beta, c);
+        __mt_check_norm_affine(x, rmean, c), __mt_check_norm_affine(x, rvar, c);
+        if (!training && (rmean == NULL || rvar == NULL))
+                EXIT_WITH_ERROR("inference mode needs the running mean and variance");
+
+        MTTensor *res = __mt_new_tensor_uninit(x->context, x->shape, x->ndims);
+        *stats        = __mt_new_tensor_uninit(x->context, Arr(int, c, 2), 2);
+        /* the running statistics are updated in place */
+        if (training && rmean != NULL) mt_tensor_make_writable(rmean);
+        if (training && rvar != NULL) mt_tensor_make_writable(rvar);
+        for (long ch = 0; ch < c; ch++) {
+                float mean, var;
+                if (training) {
+                        Welford w = {0, 0, 0};
+                        for (long o = 0; o < outer; o++)
+                                __mt_welford_update(&w, x->data + (o * c + ch) * inner, inner);
+                        mean = w.mean, var = w.m2 / __max(w.n, 1);
+                        if (rmean != NULL)
+                                rmean->data[ch] = (1 - momentum) * rmean->data[ch] + momentum * mean;
+                        if (rvar != NULL)
+                                rvar->data[ch] = (1 - momentum) * rvar->data[ch] +
+                                                 momentum * w.m2 / __max(w.n - 1, 1);
+                } else {
+                        mean = rmean->data[ch], var = rvar->data[ch];
+                }
+                float rstd                   = 1 / sqrtf(var + eps);
+                (*stats)->data[2 * ch]     = mean;
+                (*stats)->data[2 * ch + 1] = rstd;
+                for (long o = 0; o < outer; o++) {
+                        long off = (o * c + ch) * inner;
+                        __mt_norm_apply(x->data + off, res->data + off, inner, mean, rstd,
+                                        gamma == NULL ? NULL : gamma->data + ch,
+                                        beta == NULL ? NULL : beta->data + ch, 0);
+                }
+        }
+        /* the running statistics were updated in place */
+        if (training && rmean != NULL) mt_tensor_bump_version(rmean);
+        if (training && rvar != NULL) mt_tensor_bump_version(rvar);
+        res->isleaf = 0;
+        return res;
+}
+
+/**
+ * The fused batch-norm backward. In training mode, with M elements per
+ * channel, xhat the normalized input and g = grad * gamma, the input gradient
+ * is rstd * (g - sum(g) / M - xhat * sum(g * xhat) / M). In inference mode the
+ * statistics are constants and it is just rstd * g.
+ */
+MTTensor *__batch_norm_backward_x(Dependency **prtdeps, MTTensor *grad) {
+        Dependency *dep   = prtdeps[0];
+        MTTensor   *x     = dep->tensor;
+        MTTensor   *gamma = dep->saved[1], *stats = dep->saved[2];
+        int         training = dep->args[0];
+        long        outer, c, inner;
+        __mt_dim_split(x, 1, &outer, &c, &inner);
+
+        MTTensor *res = __mt_new_tensor_uninit(x->context, x->shape, x->ndims);
+        for (long ch = 0; ch < c; ch++) {
+                float mean = stats->data[2 * ch], rstd = stats->data[2 * ch + 1];
+                float gm = gamma == NULL ? 1 : gamma->data[ch];
+                float sg = 0, sgx = 0;
+                if (training) {
+                        for (long o = 0; o < outer; o++) {
+                                long off = (o * c + ch) * inner;
+                                for (long i = 0; i < inner; i++) {
+                                        float g = grad->data[off + i] * gm;
+                                        sg += g;
+                                        sgx += g * (x->data[off + i] - mean) * rstd;
+                                }
+                        }
+                        sg /= outer * inner, sgx /= outer * inner;
+                }
+                for (long o = 0; o < outer; o++) {
+                        long off = (o * c + ch) * inner;
+                        for (long i = 0; i < inner; i++) {
+                                float g    = grad->data[off + i] * gm;
+                                float xhat = (x->data[off + i] - mean) * rstd;
+                                res->data[off + i] = rstd * (g - sg - xhat * sgx);
+                        }
+                }
+        }
+        return res;
+}
+
+MTTensor *__batch_norm_backward_gamma(Dependency **prtdeps, MTTensor *grad) {
+        return __mt_norm_affine_grad(prtdeps, grad, 1, 1);
+}
+
+MTTensor *__batch_norm_backward_beta(Dependency **prtdeps, MTTensor *grad) {
+        return __mt_norm_affine_grad(prtdeps, grad, 0, 1);
+}
+
+MTTensor *mt_tensor_batch_norm(MTTensor *x, MTTensor *gamma, MTTensor *beta,
+                               MTTensor *running_mean, MTTensor *running_var,
+                               int training, float momentum, float eps) {
+        ProfScope prof = __mt_prof_begin(x->context);
+        MTTensor *stats;
+        MTTensor *res = __mt_tensor_batch_norm(x, gamma, beta, running_mean,
+                                               running_var, training, momentum,
+                                               eps, &stats);
+        if (x->req_grad || (gamma != NULL && gamma->req_grad) || (beta != NULL && beta->req_grad))
+                mt_tensor_enable_grad(res);
+        __mt_push_deps_at(res, x, 0, __batch_norm_backward_x);
+        if (gamma != NULL) __mt_push_deps_at(res, gamma, res->ndeps, __batch_norm_backward_gamma);
+        if (beta != NULL) __mt_push_deps_at(res, beta, res->ndeps, __batch_norm_backward_beta);
+        __mt_save_for_backward(res, Arr(MTTensor *, x, gamma, stats), 3,
+                               Arr(long, training), 1);
+        return __mt_prof_end(&prof, "batch_norm", res, Arr(MTTensor *, x, gamma, beta), 3, 0);
+}
+
+/* scaled dot-product attention */
+
+/* Query and key block sizes of the attention tiles */
+#define MT_ATTN_BR 64
+#define MT_ATTN_BC 64
+/* The saved slot through which the first attention backward function hands
+ * the gradients it computed alongside its own to the later ones */
+#define MT_ATTN_STASH (MT_DEP_NSAVED - 1)
+
+/* Attention operands, flattened to `bh` (batch and heads) slices of
+ * (sq, d), (sk, d) and (sk, dv). A mask is shared across the slices when
+ * `maskstride` is 0. */
+typedef struct {
+        const float *q, *k, *v, *mask, *out, *lse, *dout;
+        float       *o, *l, *dq, *dk, *dv;
+        long         nqb, sq, sk, d, ldv, maskstride;
+        int          causal;
+        float        scale;
+        VecFunc      vexp;
+} AttnArgs;
+
+/**
+ * Scaled scores of query rows [i0, i0 + br) against key rows [j0, j0 + bc)
+ * of slice `bh` into s (br by bc), with the mask added and future keys set
+ * to -inf when causal. Queries are aligned to the last keys, so query i may
+ * attend keys up to i + sk - sq.
+ */
+void __mt_attn_scores(AttnArgs *a, long bh, long i0, long br, long j0, long bc,
+                      float *s) {
+        __mt_sgemm(0, 1, br, bc, a->d, a->q + (bh * a->sq + i0) * a->d, a->d,
+                   a->k + (bh * a->sk + j0) * a->d, a->d, s, bc, 0);
+        const float *mask = a->mask == NULL ? NULL : a->mask + bh * a->maskstride;
+        for (long r = 0; r < br; r++)
+                for (long c = 0; c < bc; c++) {
+                        float x = s[r * bc + c] * a->scale;
+                        if (mask != NULL) x += mask[(i0 + r) * a->sk + j0 + c];
+                        if (a->causal && j0 + c > i0 + r + a->sk - a->sq) x = -INFINITY;
+                        s[r * bc + c] = x;
+                }
+}
+
+/* Whether a causal mask hides every key of block j0 from query block i0 */
+int __mt_attn_skip(AttnArgs *a, long i0, long br, long j0) {
+        return a->causal && j0 > i0 + br - 1 + a->sk - a->sq;
+}
+
+/**
+ * Forward over query blocks [begin, end) (across all slices). The key blocks
+ * are folded in with an online softmax: the running row max m and row sum l
+ * rescale the partial output whenever the max grows, so only a br by bc
+ * tile of scores exists at a time. The log-sum-exp m + log(l) of each row is
+ * kept for the backward.
+ */
+void __mt_attn_forward_blocks(void *p, long begin, long end) {
+        AttnArgs *a   = p;
+        float    *s   = malloc(sizeof(float) * MT_ATTN_BR * MT_ATTN_BC);
+        float    *acc = malloc(sizeof(float) * MT_ATTN_BR * a->ldv);
+        float     m[MT_ATTN_BR], l[MT_ATTN_BR];
+        for (long t = begin; t < end; t++) {
+                long bh = t / a->nqb, i0 = t % a->nqb * MT_ATTN_BR;
+                long br = __min(MT_ATTN_BR, a->sq - i0);
+                for (long r = 0; r < br; r++) m[r] = -INFINITY, l[r] = 0;
+                memset(acc, 0, sizeof(float) * br * a->ldv);
+
+                for (long j0 = 0; j0 < a->sk && !__mt_attn_skip(a, i0, br, j0); j0 += MT_ATTN_BC) {
+                        long bc = __min(MT_ATTN_BC, a->sk - j0);
+                        __mt_attn_scores(a, bh, i0, br, j0, bc, s);
+                        for (long r = 0; r < br; r++) {
+                                float *row = s + r * bc, mnew = m[r];
+                                for (long c = 0; c < bc; c++) mnew = __max(mnew, row[c]);
+                                if (mnew == -INFINITY) {
+                                        /* every key so far is masked */
+                                        memset(row, 0, sizeof(float) * bc);
+                                        continue;
+                                }
+                                for (long c = 0; c < bc; c++) row[c] -= mnew;
+                                a->vexp(row, row, bc);
+                                float alpha = expf(m[r] - mnew), sum = 0;
+                                for (long c = 0; c < bc; c++) sum += row[c];
+                                for (long c = 0; c < a->ldv; c++) acc[r * a->ldv + c] *= alpha;
+                                l[r] = l[r] * alpha + sum;
+                                m[r] = mnew;
+                        }
+                        __mt_sgemm(0, 0, br, a->ldv, bc, s, bc,
+                                   a->v + (bh * a->sk + j0) * a->ldv, a->ldv,
+                                   acc, a->ldv, 1);
+                }
+
+                for (long r = 0; r < br; r++) {
+                        float *o   = a->o + (bh * a->sq + i0 + r) * a->ldv;
+                        float  inv = l[r] > 0 ? 1 / l[r] : 0;
+                        for (long c = 0; c < a->ldv; c++) o[c] = acc[r * a->ldv + c] * inv;
+                        a->l[bh * a->sq + i0 + r] = l[r] > 0 ? m[r] + logf(l[r]) : -INFINITY;
+                }
+        }
+        free(s), free(acc);
+}
+
+/**
+ * Backward over slices [begin, end), recomputing the probabilities tile by
+ * tile from the saved log-sum-exp instead of storing them. With
+ * P = exp(S - lse) and Di = rowsum(dO * O):
+ * dV += P^T dO, dS = P * (dO V^T - Di), dQ += dS K * scale and
+ * dK += dS^T Q * scale.
+ */
+void __mt_attn_backward_slices(void *p, long begin, long end) {
+        AttnArgs *a   = p;
+        float    *s   = malloc(sizeof(float) * MT_ATTN_BR * MT_ATTN_BC);
+        float    *dp  = malloc(sizeof(float) * MT_ATTN_BR * MT_ATTN_BC);
+        float    *di  = malloc(sizeof(float) * __max(a->sq, 1));
+        for (long bh = begin; bh < end; bh++) {
+                const float *q = a->q + bh * a->sq * a->d, *k = a->k + bh * a->sk * a->d;
+                const float *v = a->v + bh * a->sk * a->ldv;
+                const float *dout = a->dout + bh * a->sq * a->ldv, *lse = a->lse + bh * a->sq;
+                float       *dq = a->dq + bh * a->sq * a->d, *dk = a->dk + bh * a->sk * a->d;
+                float       *dv = a->dv + bh * a->sk * a->ldv;
+                for (long i = 0; i < a->sq; i++) {
+                        const float *o = a->out + (bh * a->sq + i) * a->ldv;
+                        di[i]          = 0;
+                        for (long c = 0; c < a->ldv; c++) di[i] += dout[i * a->ldv + c] * o[c];
+                }
+
+                for (long j0 = 0; j0 < a->sk; j0 += MT_ATTN_BC) {
+                        long bc = __min(MT_ATTN_BC, a->sk - j0);
+                        for (long i0 = 0; i0 < a->sq; i0 += MT_ATTN_BR) {
+                                long br = __min(MT_ATTN_BR, a->sq - i0);
+                                if (__mt_attn_skip(a, i0, br, j0)) continue;
+                                __mt_attn_scores(a, bh, i0, br, j0, bc, s);
+                                for (long r = 0; r < br; r++) {
+                                        float *row = s + r * bc;
+                                        float  off = lse[i0 + r] == -INFINITY ? INFINITY : lse[i0 + r];
+                                        for (long c = 0; c < bc; c++) row[c] -= off;
+                                        a->vexp(row, row, bc);
+                                }
+                                __mt_sgemm(1, 0, bc, a->ldv, br, s, bc, dout + i0 * a->ldv, a->ldv,
+                                           dv + j0 * a->ldv, a->ldv, 1);
+                                __mt_sgemm(0, 1, br, bc, a->ldv, dout + i0 * a->ldv, a->ldv,
+                                           v + j0 * a->ldv, a->ldv, dp, bc, 0);
+                                for (long r = 0; r < br; r++)
+                                        for (long c = 0; c < bc; c++) {
+                                                long x = r * bc + c;
+                                                dp[x]  = s[x] * (dp[x] - di[i0 + r]) * a->scale;
+                                        }
+                                __mt_sgemm(0, 0, br, a->d, bc, dp, bc, k + j0 * a->d, a->d,
+                                           dq + i0 * a->d, a->d, 1);
+                                __mt_sgemm(1, 0, bc, a->d, br, dp, bc, q + i0 * a->d, a->d,
+                                           dk + j0 * a->d, a->d, 1);
+                        }
+                }
+        }
+        free(s), free(dp), free(di);
+}
+
+/* Validate the attention operands, returning the number of slices */
+long __mt_attn_args(MTTensor *q, MTTensor *k, MTTensor *v, MTTensor *mask,
+                    int causal, AttnArgs *a) {
+        MTTensor *ts[4] = {q, k, v, mask};
+        for (int i = 0; i < 4; i++) {
+                if (ts[i] == NULL) continue;
+                __mt_assert_dense(ts[i]);
+                if (ts[i]->dtype != DTYPE_FLOAT32)
+                        EXIT_WITH_ERROR("attention only supports float32 tensors");
+                if (ts[i]->context != q->context)
+                        EXIT_WITH_ERROR("attention operands cannot be in different context");
+        }
+        int nd = q->ndims;
+        if (nd < 2 || k->ndims != nd || v->ndims != nd)
+                EXIT_WITH_ERROR("q, k and v must have the same number (at least 2) of dimensions");
+        if (!__mt_arrsame(q->shape, k->shape, nd - 2) || !__mt_arrsame(q->shape, v->shape, nd - 2))
+                EXIT_WITH_ERROR("q, k and v must have the same leading dimensions");
+        if (q->shape[nd - 1] != k->shape[nd - 1] || k->shape[nd - 2] != v->shape[nd - 2])
+                EXIT_WITH_ERROR("q and k must share the feature size, k and v the length");
+
+        *a = (AttnArgs){.q = q->data, .k = k->data, .v = v->data, .causal = causal};
+        a->sq = q->shape[nd - 2], a->sk = k->shape[nd - 2];
+        a->d = q->shape[nd - 1], a->ldv = v->shape[nd - 1];
+        a->nqb   = (a->sq + MT_ATTN_BR - 1) / MT_ATTN_BR;
+        a->scale = 1 / sqrtf(__max(a->d, 1));
+        a->vexp  = __mt_vexp_for(q->context);
+        long bh  = q->datalen / __max(a->sq * a->d, 1);
+        if (mask != NULL) {
+                if (mask->datalen != a->sq * a->sk && mask->datalen != bh * a->sq * a->sk)
+                        EXIT_WITH_ERROR("mask must be (sq, sk), or (sq, sk) per slice");
+                a->mask       = mask->data;
+                a->maskstride = mask->datalen == a->sq * a->sk ? 0 : a->sq * a->sk;
+        }
+        return bh;
+}
+
+/**
+ * Compute the attention gradients of all operands that need one. The first
+ * backward function to run does this and stashes the others' results in
+ * their dependencies, where the later functions pick them up.
+ */
+MTTensor *__attention_backward(Dependency **prtdeps, MTTensor *grad, int which) {
+        if (prtdeps[which]->saved[MT_ATTN_STASH] != NULL) {
+                MTTensor *res                         = prtdeps[which]->saved[MT_ATTN_STASH];
+                prtdeps[which]->saved[MT_ATTN_STASH] = NULL;
+                return res;
+        }
+
+        MTTensor **sv = prtdeps[which]->saved;
+        AttnArgs   a;
+        long       bh = __mt_attn_args(sv[0], sv[1], sv[2], sv[3], prtdeps[which]->args[0], &a);
+        a.out = sv[4]->data, a.lse = sv[5]->data, a.dout = grad->data;
+
+        MTTensor *g[3];
+        for (int i = 0; i < 3; i++) g[i] = __mt_new_tensor_zeros(grad->context, sv[i]->shape, sv[i]->ndims);
+        a.dq = g[0]->data, a.dk = g[1]->data, a.dv = g[2]->data;
+        __mt_parallel_for(grad->context, bh, 1, __mt_attn_backward_slices, &a);
+
+        for (int i = 0; i < 3; i++) {
+                if (i == which) continue;
+                if (prtdeps[i] != NULL && i > which)
+                        prtdeps[i]->saved[MT_ATTN_STASH] = g[i];
+                else
+                        mt_tensor_free(g[i]);
+        }
+        return g[which];
+}
+
+MTTensor *__attention_backward_q(Dependency **prtdeps, MTTensor *grad) {
+        return __attention_backward(prtdeps, grad, 0);
+}
+
+MTTensor *__attention_backward_k(Dependency **prtdeps, MTTensor *grad) {
+        return __attention_backward(prtdeps, grad, 1);
+}
+
+MTTensor *__attention_backward_v(Dependency **prtdeps, MTTensor *grad) {
+        return __attention_backward(prtdeps, grad, 2);
+}
+
+/**
+ * Scaled dot-product attention softmax(q k^T / sqrt(d) + mask) v over the
+ * last two dimensions, with any leading (batch, head) dimensions shared by q,
+ * k and v. `mask` (NULL to omit) is added to the scores; `causal` hides keys
+ * after each query. The score matrix is never materialized: working memory
+ * is O(seq * d), and query blocks of all slices run in parallel.
+ */
+MTTensor *mt_tensor_attention(MTTensor *q, MTTensor *k, MTTensor *v,
+                              MTTensor *mask, int causal) {
+        ProfScope prof = __mt_prof_begin(q->context);
+        AttnArgs a;
+        long     bh = __mt_attn_args(q, k, v, mask, causal, &a);
+
+        int shape[q->ndims];
+        memcpy(shape, q->shape, q->ndims * sizeof(int));
+        shape[q->ndims - 1] = a.ldv;
+        MTTensor *res       = __mt_new_tensor_uninit(q->context, shape, q->ndims);
+        MTTensor *lse       = __mt_new_tensor_uninit(q->context, Arr(int, bh * a.sq), 1);
+        a.o = res->data, a.l = lse->data;
+        __mt_parallel_for(q->context, bh * a.nqb, 1, __mt_attn_forward_blocks, &a);
+        res->isleaf = 0;
+
+        if (q->req_grad || k->req_grad || v->req_grad) mt_tensor_enable_grad(res);
+        __mt_push_deps_at(res, q, 0, __attention_backward_q);
+        __mt_push_deps_at(res, k, 1, __attention_backward_k);
+        __mt_push_deps_at(res, v, 2, __attention_backward_v);
+        __mt_save_for_backward(res, Arr(MTTensor *, q, k, v, mask, res, lse), 6,
+                               Arr(long, causal), 1);
+        return __mt_prof_end(&prof, "attention", res, Arr(MTTensor *, q, k, v, mask), 4, 0);
+}
+
+/* max, min and top-k operations */
+
+/**
+ * Max (or min, when `largest` is zero) of the (o, i)-th slices of `x` viewed
+ * as (outer, n, inner), writing the values and the positions of their first
+ * occurrence as floats. Slices along the last dimension are reduced by a
+ * vectorized pass for the value and a scan for its position; otherwise the
+ * slices are reduced side by side, with the inner loop running across them.
+ */
+void __mt_max_kernel(const float *x, float *val, float *pos, long outer,
+                     long n, long inner, int largest) {
+        float sign = largest ? 1 : -1;
+        for (long o = 0; o < outer; o++) {
+                const float *xo = x + o * n * inner;
+                float       *vo = val + o * inner, *po = pos + o * inner;
+                if (inner == 1) {
+                        float lanes[8];
+                        long  j = 0;
+#ifdef __SSE__
+                        __m128 s = _mm_set1_ps(sign), b0 = _mm_set1_ps(sign * xo[0]), b1 = b0;
+                        for (; j + 8 <= n; j += 8) {
+                                b0 = _mm_max_ps(_mm_mul_ps(s, _mm_loadu_ps(xo + j)), b0);
+                                b1 = _mm_max_ps(_mm_mul_ps(s, _mm_loadu_ps(xo + j + 4)), b1);
+                        }
+                        _mm_storeu_ps(lanes, b0), _mm_storeu_ps(lanes + 4, b1);
+#else
+                        for (int l = 0; l < 8; l++) lanes[l] = sign * xo[0];
+                        for (; j + 8 <= n; j += 8)
+                                for (int l = 0; l < 8; l++) lanes[l] = __max(lanes[l], sign * xo[j + l]);
+#endif
+                        float best = lanes[0];
+                        for (int l = 1; l < 8; l++) best = __max(best, lanes[l]);
+                        for (; j < n; j++) best = __max(best, sign * xo[j]);
+                        for (j = 0; j < n - 1 && sign * xo[j] != best; j++)
+                                ;
+                        vo[0] = xo[j], po[0] = j;
+                        continue;
+                }
+                for (long i = 0; i < inner; i++) vo[i] = xo[i], po[i] = 0;
+                for (long j = 1; j < n; j++)
+                        for (long i = 0; i < inner; i++) {
+                                float v  = xo[j * inner + i];
+                                int   gt = sign * v > sign * vo[i];
+                                vo[i]    = __mt_select(gt, v, vo[i]);
+                                po[i]    = __mt_select(gt, j, po[i]);
+                        }
+        }
+}
+
+/* The values and positions of the max (or min) of `t` along `dim` */
+MTTensor *__mt_tensor_max(MTTensor *t, int dim, int keepdims, int largest,
+                          MTTensor **indices) {
+        __mt_assert_dense(t);
+        if (t->dtype != DTYPE_FLOAT32)
+                EXIT_WITH_ERROR("max and min only support float32 tensors");
+        long outer, n, inner;
+        __mt_dim_split(t, dim, &outer, &n, &inner);
+        if (n == 0)
+                EXIT_WITH_ERROR("cannot reduce an empty dimension");
+        if (n > MT_INDEX_LIMIT)
+                EXIT_WITH_ERROR("float positions cannot address more than 2^24 entries");
+
+        int shape[t->ndims], ndims = 0;
+        for (int d = 0; d < t->ndims; d++)
+                if (d != dim || keepdims) shape[ndims++] = d == dim ? 1 : t->shape[d];
+        MTTensor *val = __mt_new_tensor_uninit(t->context, shape, ndims);
+        MTTensor *pos = __mt_new_tensor_uninit(t->context, shape, ndims);
+        __mt_max_kernel(t->data, val->data, pos->data, outer, n, inner, largest);
+        val->isleaf = 0;
+        *indices    = pos;
+        return val;
+}
+
+/**
+ * Scatter the gradient of a selection back to the selected positions. The
+ * positions are saved in saved[0], and the selected dimension in args[0].
+ */
+MTTensor *__select_backward(Dependency **prtdeps, MTTensor *grad) {
+        MTTensor *t   = prtdeps[0]->tensor;
+        MTTensor *pos = prtdeps[0]->saved[0];
+        long      outer, n, inner;
+        __mt_dim_split(t, prtdeps[0]->args[0], &outer, &n, &inner);
+
+        long      k   = pos->datalen / (outer * inner);
+        MTTensor *res = __mt_new_tensor_zeros(t->context, t->shape, t->ndims);
+        for (long o = 0; o < outer; o++)
+                for (long r = 0; r < k; r++)
+                        for (long i = 0; i < inner; i++) {
+                                long q = (o * k + r) * inner + i;
+                                res->data[(o * n + (long)pos->data[q]) * inner + i] += grad->data[q];
+                        }
+        return res;
+}
+
+MTTensor *__mt_tensor_max_op(MTTensor *t, int dim, int keepdims, int largest,
+                             MTTensor **indices) {
+        MTTensor *pos;
+        MTTensor *res = __mt_tensor_max(t, dim, keepdims, largest, &pos);
+        if (t->req_grad) mt_tensor_enable_grad(res);
+        __mt_push_deps_at(res, t, 0, __select_backward);
+        __mt_save_for_backward(res, Arr(MTTensor *, pos), 1, Arr(long, dim), 1);
+        if (indices != NULL) *indices = pos;
+        return res;
+}
+
+/* Max of `t` along `dim`. The positions of the maxima are stored into
+ * `indices` unless it is NULL. The gradient flows to those positions. */
+MTTensor *mt_tensor_max(MTTensor *t, int dim, int keepdims, MTTensor **indices) {
+        ProfScope prof = __mt_prof_begin(t->context);
+        return __mt_prof_end(&prof, "max", __mt_tensor_max_op(t, dim, keepdims, 1, indices), Arr(MTTensor *, t), 1, 0);
+}
+
+MTTensor *mt_tensor_min(MTTensor *t, int dim, int keepdims, MTTensor **indices) {
+        ProfScope prof = __mt_prof_begin(t->context);
+        return __mt_prof_end(&prof, "min", __mt_tensor_max_op(t, dim, keepdims, 0, indices), Arr(MTTensor *, t), 1, 0);
+}
+
+MTTensor *mt_tensor_argmax(MTTensor *t, int dim, int keepdims) {
+        ProfScope prof = __mt_prof_begin(t->context);
+        MTTensor *pos;
+        mt_tensor_free(__mt_tensor_max(t, dim, keepdims, 1, &pos));
+        return __mt_prof_end(&prof, "argmax", pos, Arr(MTTensor *, t), 1, 0);
+}
+
+MTTensor *mt_tensor_argmin(MTTensor *t, int dim, int keepdims) {
+        ProfScope prof = __mt_prof_begin(t->context);
+        MTTensor *pos;
+        mt_tensor_free(__mt_tensor_max(t, dim, keepdims, 0, &pos));
+        return __mt_prof_end(&prof, "argmin", pos, Arr(MTTensor *, t), 1, 0);
+}
+
+/* Whether candidate (va, a) ranks below (vb, b): smaller values rank lower,
+ * and among equal values the later position does */
+inline int __mt_topk_below(float va, long a, float vb, long b) {
+        return va < vb || (va == vb && a > b);
+}
+
+/* Restore the min-heap property of heap[0, k) (by rank) below node r */
+void __mt_topk_sift(float *hv, long *hp, long k, long r) {
+        for (;;) {
+                long l = 2 * r + 1, m = r;
+                if (l < k && __mt_topk_below(hv[l], hp[l], hv[m], hp[m])) m = l;
+                if (l + 1 < k && __mt_topk_below(hv[l + 1], hp[l + 1], hv[m], hp[m])) m = l + 1;
+                if (m == r) return;
+                float v = hv[r];
+                long  p = hp[r];
+                hv[r] = hv[m], hp[r] = hp[m];
+                hv[m] = v, hp[m] = p;
+                r = m;
+        }
+}
+
+/**
+ * The k largest entries of `t` along `dim`, in decreasing order, with ties
+ * going to the earlier position. Each slice is scanned once against a min-heap
+ * of the best k so far, which costs O(n log k) instead of a full sort. The
+ * positions are stored into `indices` unless it is NULL, and the gradient
+ * flows to them.
+ */
+MTTensor *mt_tensor_topk(MTTensor *t, int k, int dim, MTTensor **indices) {
+        ProfScope prof = __mt_prof_begin(t->context);
+        __mt_assert_dense(t);
+        if (t->dtype != DTYPE_FLOAT32)
+                EXIT_WITH_ERROR("topk only supports float32 tensors");
+        long outer, n, inner;
+        __mt_dim_split(t, dim, &outer, &n, &inner);
+        if (k < 1 || k > n)
+                EXIT_WITH_ERROR("k must be between 1 and the length of dim");
+        if (n > MT_INDEX_LIMIT)
+                EXIT_WITH_ERROR("float positions cannot address more than 2^24 entries");
+
+        int shape[t->ndims];
+        memcpy(shape, t->shape, t->ndims * sizeof(int));
+        shape[dim]    = k;
+        MTTensor *val = __mt_new_tensor_uninit(t->context, shape, t->ndims);
+        MTTensor *pos = __mt_new_tensor_uninit(t->context, shape, t->ndims);
+
+        float *hv = __mt_newptr(float, k);
+        long  *hp = __mt_newptr(long, k);
+        for (long o = 0; o < outer; o++)
+                for (long i = 0; i < inner; i++) {
+                        const float *x = t->data + o * n * inner + i;
+                        for (long j = 0; j < k; j++) hv[j] = x[j * inner], hp[j] = j;
+                        for (long r = k / 2 - 1; r >= 0; r--) __mt_topk_sift(hv, hp, k, r);
+                        for (long j = k; j < n; j++) {
+                                float v = x[j * inner];
+                                if (!__mt_topk_below(hv[0], hp[0], v, j)) continue;
+                                hv[0] = v, hp[0] = j;
+                                __mt_topk_sift(hv, hp, k, 0);
+                        }
+                        /* Pop the heap from the lowest rank, filling the
+                         * output from its end */
+                        for (long r = k - 1; r >= 0; r--) {
+                                long q         = (o * k + r) * inner + i;
+                                val->data[q]   = hv[0];
+                                pos->data[q]   = hp[0];
+                                hv[0] = hv[r], hp[0] = hp[r];
+                                __mt_topk_sift(hv, hp, r, 0);
+                        }
+                }
+        free(hv), free(hp);
+
+        val->isleaf = 0;
+        if (t->req_grad) mt_tensor_enable_grad(val);
+        __mt_push_deps_at(val, t, 0, __select_backward);
+        __mt_save_for_backward(val, Arr(MTTensor *, pos), 1, Arr(long, dim), 1);
+        if (indices != NULL) *indices = pos;
+        return __mt_prof_end(&prof, "topk", val, Arr(MTTensor *, t), 1, 0);
+}
+
+/* 2-d convolution operation */
+
+/* Upper bound of the im2col tile, in bytes. Convolutions lower at most this
+ * much of their input at a time, however large the image is. */
+#define MT_CONV_TILE_BYTES (1 << 20)
+
+/**
+ * Geometry of a conv2d call: input (n, c, h, w), weight (k, c, r, s), output
+ * (n, k, p, q). `crs` is the row count of the lowered input matrix and `tile`
+ * the number of output pixels lowered at a time.
+ */
+typedef struct {
+        long n, c, h, w, k, r, s, p, q;
+        long stride, padding, dilation;
+        long crs, tile;
+} ConvGeom;
+
+ConvGeom __mt_conv_geom(MTTensor *input, MTTensor *weight, long stride,
+                        long padding, long dilation) {
+        __mt_assert_dense(input), __mt_assert_dense(weight);
+        if (input->dtype != DTYPE_FLOAT32 || weight->dtype != DTYPE_FLOAT32)
+                EXIT_WITH_ERROR("conv2d only supports float32 tensors");
+        if (input->ndims != 4 || weight->ndims != 4)
+                EXIT_WITH_ERROR("input and weight must be 4-tensors (NCHW and KCRS)");
+        if (input->shape[1] != weight->shape[1])
+                EXIT_WITH_ERROR("input and weight must have the same number of channels");
+        if (stride < 1 || dilation < 1 || padding < 0)
+                EXIT_WITH_ERROR("invalid stride, padding or dilation");
+
+        ConvGeom g = {.n        = input->shape[0],
+                      .c        = input->shape[1],
+                      .h        = input->shape[2],
+                      .w        = input->shape[3],
+                      .k        = weight->shape[0],
+                      .r        = weight->shape[2],
+                      .s        = weight->shape[3],
+                      .stride   = stride,
+                      .padding  = padding,
+                      .dilation = dilation};
+        g.p = (g.h + 2 * padding - dilation * (g.r - 1) - 1) / stride + 1;
+        g.q = (g.w + 2 * padding - dilation * (g.s - 1) - 1) / stride + 1;
+        if (g.p < 1 || g.q < 1)
+                EXIT_WITH_ERROR("the convolution output would be empty");
+
+        g.crs  = g.c * g.r * g.s;
+        g.tile = __max(1, MT_CONV_TILE_BYTES / (long)sizeof(float) / g.crs);
+        g.tile = __min(g.tile, g.p * g.q);
+        return g;
+}
+
+/**
+ * Lower output pixels [q0, q0 + nt) of one image `x` (c, h, w) into `col`,
+ * a (crs by nt) row-major matrix. Out-of-bound (padded) taps read zero. When
+ * `scatter` is set the direction is reversed: `col` is accumulated back into
+ * `x`, which is the col2im step of the input gradient.
+ */
+void __mt_im2col_tile(ConvGeom *g, float *x, float *col, long q0, long nt,
+                      int scatter) {
+        for (long row = 0; row < g->crs; row++) {
+                long   ch = row / (g->r * g->s);
+                long   ry = row / g->s % g->r;
+                long   sx = row % g->s;
+                float *xc = x + ch * g->h * g->w;
+                float *cr = col + row * nt;
+                for (long t = 0; t < nt; t++) {
+                        long oy = (q0 + t) / g->q, ox = (q0 + t) % g->q;
+                        long iy = oy * g->stride - g->padding + ry * g->dilation;
+                        long ix = ox * g->stride - g->padding + sx * g->dilation;
+                        int  in = iy >= 0 && iy < g->h && ix >= 0 && ix < g->w;
+                        if (scatter) {
+                                if (in) xc[iy * g->w + ix] += cr[t];
+                        } else {
+                                cr[t] = in ? xc[iy * g->w + ix] : 0;
+                        }
+                }
+        }
+}
+
+MTTensor *__mt_tensor_conv2d(MTTensor *input, MTTensor *weight, MTTensor *bias,
+                             ConvGeom *g) {
+        MTTensor *res = __mt_new_tensor_uninit(input->context,
+                                               Arr(int, g->n, g->k, g->p, g->q), 4);
+        long      npix = g->p * g->q;
+        float    *col  = __mt_newptr(float, g->crs * g->tile);
+        for (long n = 0; n < g->n; n++) {
+                float *x = input->data + n * g->c * g->h * g->w;
+                float *y = res->data + n * g->k * npix;
+                for (long q0 = 0; q0 < npix; q0 += g->tile) {
+                        long nt = __min(g->tile, npix - q0);
+                        __mt_im2col_tile(g, x, col, q0, nt, 0);
+                        /* y[:, q0:q0+nt] = weight (k by crs) * col (crs by nt) */
+                        __mt_sgemm(0, 0, g->k, nt, g->crs, weight->data, g->crs,
+                                   col, nt, y + q0, npix, 0);
+                }
+                if (bias != NULL)
+                        for (long k = 0; k < g->k; k++)
+                                for (long i = 0; i < npix; i++)
+                                        y[k * npix + i] += bias->data[k];
+        }
+        free(col);
+        res->isleaf = 0;
+        return res;
+}
+
+ConvGeom __mt_conv_geom_from_dep(Dependency *dep) {
+        return __mt_conv_geom(dep->saved[0], dep->saved[1], dep->args[0],
+                              dep->args[1], dep->args[2]);
+}
+
+/* d(input) = col2im(weight^T * grad), one lowered tile at a time */
+MTTensor *__conv2d_backward_input(Dependency **prtdeps, MTTensor *grad) {
+        ConvGeom  g      = __mt_conv_geom_from_dep(prtdeps[0]);
+        MTTensor *input  = prtdeps[0]->saved[0];
+        MTTensor *weight = prtdeps[0]->saved[1];
+        MTTensor *res    = mt_new_tensor_full(input->context, 0, input->shape,
+                                              input->ndims);
+        long      npix   = g.p * g.q;
+        float    *col    = __mt_newptr(float, g.crs * g.tile);
+        for (long n = 0; n < g.n; n++) {
+                float *dx = res->data + n * g.c * g.h * g.w;
+                float *dy = grad->data + n * g.k * npix;
+                for (long q0 = 0; q0 < npix; q0 += g.tile) {
+                        long nt = __min(g.tile, npix - q0);
+                        __mt_sgemm(1, 0, g.crs, nt, g.k, weight->data, g.crs,
+                                   dy + q0, npix, col, nt, 0);
+                        __mt_im2col_tile(&g, dx, col, q0, nt, 1);
+                }
+        }
+        free(col);
+        return res;
+}
+
+/* d(weight) = sum over images of grad * im2col(input)^T */
+MTTensor *__conv2d_backward_weight(Dependency **prtdeps, MTTensor *grad) {
+        ConvGeom  g      = __mt_conv_geom_from_dep(prtdeps[1]);
+        MTTensor *input  = prtdeps[1]->saved[0];
+        MTTensor *weight = prtdeps[1]->saved[1];
+        MTTensor *res    = mt_new_tensor_full(weight->context, 0, weight->shape,
+                                              weight->ndims);
+        long      npix   = g.p * g.q;
+        float    *col    = __mt_newptr(float, g.crs * g.tile);
+        for (long n = 0; n < g.n; n++) {
+                float *x  = input->data + n * g.c * g.h * g.w;
+                float *dy = grad->data + n * g.k * npix;
+                for (long q0 = 0; q0 < npix; q0 += g.tile) {
+                        long nt = __min(g.tile, npix - q0);
+                        __mt_im2col_tile(&g, x, col, q0, nt, 0);
+                        __mt_sgemm(0, 1, g.k, g.crs, nt, dy + q0, npix,
+                                   col, nt, res->data, g.crs, 1);
+                }
+        }
+        free(col);
+        return res;
+}
+
+/* d(bias) = grad summed over images and pixels */
+MTTensor *__conv2d_backward_bias(Dependency **prtdeps, MTTensor *grad) {
+        ConvGeom  g    = __mt_conv_geom_from_dep(prtdeps[2]);
+        MTTensor *bias = prtdeps[2]->tensor;
+        MTTensor *res  = mt_new_tensor_full(bias->context, 0, bias->shape,
+                                            bias->ndims);
+        long      npix = g.p * g.q;
+        for (long n = 0; n < g.n; n++)
+                for (long k = 0; k < g.k; k++) {
+                        float *dy = grad->data + (n * g.k + k) * npix;
+                        float  s  = 0;
+                        for (long i = 0; i < npix; i++) s += dy[i];
+                        res->data[k] += s;
+                }
+        return res;
+}
+
+/**
+ * 2-d convolution (cross-correlation) of an NCHW `input` with a KCRS `weight`
+ * and an optional K-sized `bias` (may be NULL). The input is lowered with
+ * im2col in bounded tiles of output pixels and multiplied with the blocked
+ * GEMM, so the full lowered matrix is never materialized.
+ */
+MTTensor *mt_tensor_conv2d(MTTensor *input, MTTensor *weight, MTTensor *bias,
+                           int stride, int padding, int dilation) {
+        ProfScope prof = __mt_prof_begin(input->context);
+        if (input->context != weight->context ||
+            (bias != NULL && bias->context != input->context))
+                EXIT_WITH_ERROR("input, weight and bias cannot be in different context");
+
+        ConvGeom g = __mt_conv_geom(input, weight, stride, padding, dilation);
+        if (bias != NULL && bias->datalen != g.k)
+                EXIT_WITH_ERROR("bias must have one element per output channel");
+        if (bias != NULL && bias->dtype != DTYPE_FLOAT32)
+                EXIT_WITH_ERROR("conv2d only supports float32 tensors");
+
+        MTTensor *res = __mt_tensor_conv2d(input, weight, bias, &g);
+        if (input->req_grad || weight->req_grad || (bias != NULL && bias->req_grad))
+                mt_tensor_enable_grad(res);
+        __mt_push_deps_at(res, input, 0, __conv2d_backward_input);
+        __mt_push_deps_at(res, weight, 1, __conv2d_backward_weight);
+        if (bias != NULL) __mt_push_deps_at(res, bias, 2, __conv2d_backward_bias);
+        __mt_save_for_backward(res, Arr(MTTensor *, input, weight), 2,
+                               Arr(long, stride, padding, dilation), 3);
+        return __mt_prof_end(&prof, "conv2d", res, Arr(MTTensor *, input, weight, bias), 3, 0);
+}
+
+/* gather and embedding operations */
+
+/* Allocate a row-sparse tensor of the given shape with room for `nrows` rows */
+MTTensor *__mt_new_row_sparse(MTContext *ctx, int *shape, int ndims, long nrows) {
+        MTTensor *t = mt_alloc_empty_tensor(ctx);
+        t->layout   = LAYOUT_ROW_SPARSE;
+        t->ndims    = ndims;
+        t->shape    = __mt_newptr(int, ndims);
+        __mt_memcpy(t->shape, shape, ndims);
+        __init_strides(t);
+        t->datalen = nrows * t->strides[0];
+        t->data    = __mt_data_alloc(ctx, sizeof(float) * t->datalen, 1);
+        t->rowidx  = __mt_data_alloc(ctx, sizeof(int) * nrows, 1);
+        return t;
+}
+
+/* The indices held by the float tensor `index`, checked against `n` */
+long *__mt_index_values(MTTensor *index, long n) {
+        if (n > MT_INDEX_LIMIT)
+                EXIT_WITH_ERROR("float positions cannot address more than 2^24 entries");
+        long *ids = __mt_newptr(long, __max(index->datalen, 1));
+        for (long i = 0; i < index->datalen; i++) {
+                float v = __mt_tensor_load(index, i);
+                if (v < 0 || v >= n || v != (long)v)
+                        EXIT_WITH_ERROR("index holds an invalid position");
+                ids[i] = v;
+        }
+        return ids;
+}
+
+/* The slices of `t` along `dim` at the `nids` positions `ids` */
+MTTensor *__mt_tensor_gather(MTTensor *t, int dim, const long *ids, long nids) {
+        __mt_assert_dense(t);
+        long outer, n, inner;
+        __mt_dim_split(t, dim, &outer, &n, &inner);
+
+        int shape[t->ndims];
+        memcpy(shape, t->shape, t->ndims * sizeof(int));
+        shape[dim] = nids;
+
+        /* Rows are copied in their storage format, except that int8 rows are
+         * dequantized since the result cannot share t's per-channel scales */
+        MtDtype   dtype = __mt_result_dtype(t->dtype);
+        MTTensor *res   = __mt_new_tensor_uninit_dtype(t->context, shape,
+                                                       t->ndims, dtype);
+        int       esize = __mt_dtype_size(dtype);
+        char     *dst   = dtype == DTYPE_FLOAT32 ? (char *)res->data : res->lpdata;
+        char     *src   = t->dtype == DTYPE_FLOAT32 ? (char *)t->data : t->lpdata;
+        for (long o = 0; o < outer; o++)
+                for (long j = 0; j < nids; j++) {
+                        long from = (o * n + ids[j]) * inner, to = (o * nids + j) * inner;
+                        if (t->dtype == DTYPE_INT8)
+                                for (long i = 0; i < inner; i++)
+                                        res->data[to + i] = __mt_tensor_load(t, from + i);
+                        else
+                                memcpy(dst + to * esize, src + from * esize, inner * esize);
+                }
+        res->isleaf = 0;
+        return res;
+}
+
+int __mt_cmp_long_pairs(const void *a, const void *b) {
+        const long *x = a, *y = b;
+        return x[0] < y[0] ? -1 : x[0] > y[0] ? 1 : x[1] < y[1] ? -1 : x[1] > y[1];
+}
+
+/**
+ * The gradient of `t` from the gradient of its gather at `ids`. Along
+ * dimension 0 the gradient only has nonzero rows at the gathered positions,
+ * so it is returned row-sparse: the positions are sorted, and the gradient
+ * rows of repeated positions are summed. Along the other dimensions the
+ * gradient is scatter-added into a dense tensor.
+ */
+MTTensor *__mt_gather_grad(MTTensor *t, int dim, const long *ids, long nids, MTTensor *grad) {
+        long outer, n, inner;
+        __mt_dim_split(t, dim, &outer, &n, &inner);
+
+        if (dim > 0) {
+                MTTensor *res = __mt_new_tensor_zeros(t->context, t->shape, t->ndims);
+                for (long o = 0; o < outer; o++)
+                        for (long j = 0; j < nids; j++) {
+                                float       *to   = res->data + (o * n + ids[j]) * inner;
+                                const float *from = grad->data + (o * nids + j) * inner;
+                                for (long i = 0; i < inner; i++) to[i] += from[i];
+                        }
+                return res;
+        }
+
+        /* (position, gradient row) pairs, sorted by position */
+        long *order = __mt_newptr(long, 2 * __max(nids, 1)), nrows = 0;
+        for (long j = 0; j < nids; j++) order[2 * j] = ids[j], order[2 * j + 1] = j;
+        qsort(order, nids, 2 * sizeof(long), __mt_cmp_long_pairs);
+        for (long j = 0; j < nids; j++) nrows += j == 0 || order[2 * j] != order[2 * j - 2];
+
+        MTTensor *res = __mt_new_row_sparse(t->context, t->shape, t->ndims, nrows);
+        long      r   = -1;
+        for (long j = 0; j < nids; j++) {
+                if (j == 0 || order[2 * j] != order[2 * j - 2]) res->rowidx[++r] = order[2 * j];
+                float       *to   = res->data + r * inner;
+                const float *from = grad->data + order[2 * j + 1] * inner;
+                for (long i = 0; i < inner; i++) to[i] += from[i];
+        }
+        free(order);
+        return res;
+}
+
+MTTensor *__gather_backward(Dependency **prtdeps, MTTensor *grad) {
+        MTTensor *t     = prtdeps[0]->tensor;
+        MTTensor *index = prtdeps[0]->saved[0];
+        int       dim   = prtdeps[0]->args[0];
+        long      outer, n, inner;
+        __mt_dim_split(t, dim, &outer, &n, &inner);
+        long     *ids = __mt_index_values(index, n);
+        MTTensor *res = __mt_gather_grad(t, dim, ids, index->datalen, grad);
+        free(ids);
+        return res;
+}
+
+/**
+ * Select the slices of `t` along `dim` at the positions held by `index`, a
+ * float tensor of integral values (as with the targets of cross-entropy).
+ * The result has t's shape, with dimension `dim` replaced by the number of
+ * positions. Positions may repeat. Since a float holds every integer only up
+ * to 2^24, `dim` may not be longer than that.
+ */
+MTTensor *mt_tensor_gather(MTTensor *t, int dim, MTTensor *index) {
+        ProfScope prof = __mt_prof_begin(t->context);
+        if (t->context != index->context)
+                EXIT_WITH_ERROR("t and index cannot be in different context");
+        long outer, n, inner;
+        __mt_dim_split(t, dim, &outer, &n, &inner);
+        long     *ids = __mt_index_values(index, n);
+        MTTensor *res = __mt_tensor_gather(t, dim, ids, index->datalen);
+        free(ids);
+        if (t->req_grad) mt_tensor_enable_grad(res);
+        __mt_push_deps_at(res, t, 0, __gather_backward);
+        __mt_save_for_backward(res, Arr(MTTensor *, index), 1, Arr(long, dim), 1);
+        return __mt_prof_end(&prof, "gather", res, Arr(MTTensor *, t, index), 2, 0);
+}
+
+/* The ids of an embedding are saved for backward in the `rowidx` of a
+ * tensor without data, in their order and with their repeats */
+MTTensor *__embedding_backward(Dependency **prtdeps, MTTensor *grad) {
+        MTTensor *ids  = prtdeps[0]->saved[0];
+        long      nids = ids->shape[0];
+        long     *pos  = __mt_newptr(long, __max(nids, 1));
+        for (long j = 0; j < nids; j++) pos[j] = ids->rowidx[j];
+        MTTensor *res = __mt_gather_grad(prtdeps[0]->tensor, 0, pos, nids, grad);
+        free(pos);
+        return res;
+}
+
+/**
+ * Look up the rows of `table` at `ids`. This is a gather along dimension 0,
+ * so the gradient of the table is row-sparse. The ids index the table
+ * directly, so the table may have as many rows as an int can address.
+ */
+MTTensor *mt_tensor_embedding(MTTensor *table, int *ids, int nids) {
+        ProfScope prof = __mt_prof_begin(table->context);
+        if (table->ndims < 1)
+                EXIT_WITH_ERROR("table must have at least one dimension");
+        long *pos = __mt_newptr(long, __max(nids, 1));
+        for (int i = 0; i < nids; i++) {
+                if (ids[i] < 0 || ids[i] >= table->shape[0])
+                        EXIT_WITH_ERROR("ids hold an invalid row");
+                pos[i] = ids[i];
+        }
+        MTTensor *res = __mt_tensor_gather(table, 0, pos, nids);
+        free(pos);
+
+        MTTensor *saved = mt_alloc_empty_tensor(table->context);
+        saved->ndims    = 1;
+        saved->shape    = __mt_newptr(int, 1);
+        saved->shape[0] = nids;
+        saved->rowidx   = __mt_data_alloc(table->context, sizeof(int) * __max(nids, 1), 0);
+        __mt_memcpy(saved->rowidx, ids, nids);
+        if (table->req_grad) mt_tensor_enable_grad(res);
+        __mt_push_deps_at(res, table, 0, __embedding_backward);
+        __mt_save_for_backward(res, Arr(MTTensor *, saved), 1, NULL, 0);
+        return __mt_prof_end(&prof, "embedding", res, Arr(MTTensor *, table), 1, 0);
+}
+
+/* saving and loading */
+
+/**
+ * The file layout, in native (little-endian) byte order:
+ *
+ *   "MTTENSOR", u32 version, u32 ntensors, u64 data start
+ *   per tensor: u32 name length, name, u32 dtype, u32 ndims, i32 qaxis,
+ *               u32 reserved, i32 shape[ndims], u64 offset, u64 nbytes
+ *   data of every tensor at its offset, a multiple of MT_FILE_ALIGN
+ *
+ * The data of an int8 tensor is followed by its float scales and int zero
+ * points, one per channel, starting at the next multiple of 4 bytes.
+ */
+#define MT_FILE_MAGIC "MTTENSOR"
+#define MT_FILE_VERSION 1
+#define MT_FILE_ALIGN 64
+
+/* Bytes of the elements of a dense tensor, and of its quantization data */
+long __mt_tensor_nbytes(MTTensor *t, long *qbytes) {
+        long nch = t->qaxis < 0 ? 1 : t->shape[t->qaxis];
+        long raw = t->datalen * __mt_dtype_size(t->dtype);
+        *qbytes  = t->dtype == DTYPE_INT8 ? (raw + 3) / 4 * 4 - raw + nch * (sizeof(float) + sizeof(int)) : 0;
+        return raw;
+}
+
+void __mt_write(FILE *f, const void *p, size_t n) {
+        if (fwrite(p, 1, n, f) != n) EXIT_WITH_ERROR("failed to write the tensor file");
+}
+
+/**
+ * Tensor files are written to `tmp` (`path` with a .tmp suffix, which must
+ * have room for it) and renamed over `path` once complete. Tensors loaded
+ * from `path` may still map it, and truncating it in place would take their
+ * pages from under them; a reader of `path` sees either file, never a mix.
+ */
+FILE *__mt_open_replacement(const char *path, char *tmp) {
+        sprintf(tmp, "%s.tmp", path);
+        FILE *f = fopen(tmp, "wb");
+        if (f == NULL) EXIT_WITH_ERROR("failed to open the tensor file for writing");
+        return f;
+}
+
+void __mt_replace_file(FILE *f, const char *tmp, const char *path) {
+        if (fclose(f) != 0) EXIT_WITH_ERROR("failed to write the tensor file");
+        if (rename(tmp, path) != 0) EXIT_WITH_ERROR("failed to replace the tensor file");
+}
+
+void mt_tensor_set_name(MTTensor *t, const char *name) {
+        free(t->name);
+        t->name = name == NULL ? NULL : strdup(name);
+}
+
+/**
+ * Write the header and index of a file holding `tensors` to `f`, and where
+ * the data of each of them goes to `offsets`. Returns the file length.
+ */
+uint64_t __mt_write_index(FILE *f, MTContext *ctx, MTTensor **tensors, int n,
+                          uint64_t *offsets) {
+        /* the index is laid out first to learn where the data starts */
+        long  index = 8 + 2 * sizeof(uint32_t) + sizeof(uint64_t);
+        char  names[__max(n, 1)][16];
+        char *name[__max(n, 1)];
+        for (int i = 0; i < n; i++) {
+                __mt_assert_dense(tensors[i]);
+                if (tensors[i]->context != ctx)
+                        EXIT_WITH_ERROR("tensors to save must belong to the context");
+                snprintf(names[i], sizeof(names[i]), "%d", i);
+                name[i] = tensors[i]->name != NULL ? tensors[i]->name : names[i];
+                index += sizeof(uint32_t) * 5 + strlen(name[i]) +
+                         sizeof(int32_t) * tensors[i]->ndims + sizeof(uint64_t) * 2;
+        }
+
+        uint64_t start   = (index + MT_FILE_ALIGN - 1) / MT_FILE_ALIGN * MT_FILE_ALIGN;
+        uint32_t head[2] = {MT_FILE_VERSION, n};
+        __mt_write(f, MT_FILE_MAGIC, 8);
+        __mt_write(f, head, sizeof(head));
+        __mt_write(f, &start, sizeof(start));
+
+        uint64_t off = start, end = start;
+        for (int i = 0; i < n; i++) {
+                MTTensor *t = tensors[i];
+                long      qbytes, raw = __mt_tensor_nbytes(t, &qbytes);
+                uint32_t  len     = strlen(name[i]);
+                uint32_t  meta[4] = {t->dtype, t->ndims, t->qaxis, 0};
+                uint64_t  loc[2]  = {off, raw + qbytes};
+                __mt_write(f, &len, sizeof(len));
+                __mt_write(f, name[i], len);
+                __mt_write(f, meta, sizeof(meta));
+                __mt_write(f, t->shape, sizeof(int32_t) * t->ndims);
+                __mt_write(f, loc, sizeof(loc));
+                offsets[i] = off;
+                end        = off + loc[1];
+                off        = (end + MT_FILE_ALIGN - 1) / MT_FILE_ALIGN * MT_FILE_ALIGN;
+        }
+        return end;
+}
+
+void mt_save(MTContext *ctx, const char *path, MTTensor **tensors, int n) {
+        char     tmp[strlen(path) + 5];
+        FILE    *f = __mt_open_replacement(path, tmp);
+        uint64_t offsets[__max(n, 1)];
+        __mt_write_index(f, ctx, tensors, n, offsets);
+
+        char zeros[MT_FILE_ALIGN] = {0};
+        for (int i = 0; i < n; i++) {
+                MTTensor *t = tensors[i];
+                long      qbytes, raw = __mt_tensor_nbytes(t, &qbytes);
+                __mt_write(f, zeros, offsets[i] - ftell(f));
+                __mt_write(f, t->dtype == DTYPE_FLOAT32 ? (void *)t->data : t->lpdata, raw);
+                if (t->dtype == DTYPE_INT8) {
+                        long nch = t->qaxis < 0 ? 1 : t->shape[t->qaxis];
+                        __mt_write(f, zeros, (4 - raw % 4) % 4);
+                        __mt_write(f, t->qscale, sizeof(float) * nch);
+                        __mt_write(f, t->qzero, sizeof(int) * nch);
+                }
+        }
+        __mt_replace_file(f, tmp, path);
+}
+
+typedef struct {
+        void  *addr;
+        size_t len;
+} FileMapping;
+
+void __mt_unmap_file(void *user) {
+        FileMapping *m = user;
+        munmap(m->addr, m->len);
+        free(m);
+}
+
+/* Read `n` bytes at `*pos` of the mapping, checking the bounds */
+const void *__mt_map_read(const char *base, size_t len, size_t *pos, size_t n) {
+        if (*pos + n > len) EXIT_WITH_ERROR("truncated tensor file");
+        const void *p = base + *pos;
+        *pos += n;
+        return p;
+}
+
+MTTensor **mt_load_mmap(MTContext *ctx, const char *path, int *n) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) EXIT_WITH_ERROR("failed to open the tensor file");
+        struct stat st;
+        if (fstat(fd, &st) != 0) EXIT_WITH_ERROR("failed to stat the tensor file");
+        size_t len = st.st_size;
+        /* a private writable mapping: pages stay shared with the page cache
+         * until a tensor is written to, which then gets its own copy */
+        char *base = len == 0 ? MAP_FAILED
+                              : mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (base == MAP_FAILED) EXIT_WITH_ERROR("failed to map the tensor file");
+
+        size_t pos = 0;
+        if (memcmp(__mt_map_read(base, len, &pos, 8), MT_FILE_MAGIC, 8) != 0)
+                EXIT_WITH_ERROR("not a minitensor tensor file");
+        uint32_t head[2];
+        memcpy(head, __mt_map_read(base, len, &pos, sizeof(head)), sizeof(head));
+        if (head[0] != MT_FILE_VERSION) EXIT_WITH_ERROR("unsupported tensor file version");
+        pos += sizeof(uint64_t);
+
+        FileMapping *m   = __mt_newptr(FileMapping, 1);
+        MTExternal  *ext = __mt_newptr(MTExternal, 1);
+        m->addr = base, m->len = len;
+        ext->release = __mt_unmap_file, ext->user = m;
+
+        *n             = head[1];
+        MTTensor **res = __mt_newptr(MTTensor *, __max(*n, 1));
+        for (int i = 0; i < *n; i++) {
+                uint32_t namelen, meta[4];
+                uint64_t loc[2];
+                memcpy(&namelen, __mt_map_read(base, len, &pos, sizeof(namelen)), sizeof(namelen));
+                const char *name = __mt_map_read(base, len, &pos, namelen);
+                memcpy(meta, __mt_map_read(base, len, &pos, sizeof(meta)), sizeof(meta));
+                if (meta[0] > DTYPE_INT8 || meta[1] > len / sizeof(int32_t))
+                        EXIT_WITH_ERROR("corrupt tensor file");
+
+                int ndims = meta[1], shape[__max(ndims, 1)];
+                memcpy(shape, __mt_map_read(base, len, &pos, sizeof(int32_t) * ndims),
+                       sizeof(int32_t) * ndims);
+                memcpy(loc, __mt_map_read(base, len, &pos, sizeof(loc)), sizeof(loc));
+                for (int d = 0; d < ndims; d++)
+                        if (shape[d] < 0) EXIT_WITH_ERROR("corrupt tensor file");
+                if (meta[0] == DTYPE_INT8 && (int32_t)meta[2] >= ndims)
+                        EXIT_WITH_ERROR("corrupt tensor file");
+
+                MTTensor *t = __mt_new_tensor_meta(ctx, shape, ndims, meta[0]);
+                t->qaxis    = (int32_t)meta[2];
+                t->name     = __mt_newptr(char, namelen + 1);
+                memcpy(t->name, name, namelen);
+
+                long qbytes, raw = __mt_tensor_nbytes(t, &qbytes);
+                if (loc[0] % MT_FILE_ALIGN != 0 || loc[1] != (uint64_t)(raw + qbytes) ||
+                    loc[0] + loc[1] > len)
+                        EXIT_WITH_ERROR("corrupt tensor file");
+                if (t->dtype == DTYPE_FLOAT32)
+                        t->data = (float *)(base + loc[0]);
+                else
+                        t->lpdata = base + loc[0];
+                if (t->dtype == DTYPE_INT8) {
+                        long        nch = t->qaxis < 0 ? 1 : t->shape[t->qaxis];
+                        const char *q   = base + loc[0] + (raw + 3) / 4 * 4;
+                        t->qscale       = __mt_newptr(float, nch);
+                        t->qzero        = __mt_newptr(int, nch);
+                        memcpy(t->qscale, q, sizeof(float) * nch);
+                        memcpy(t->qzero, q + sizeof(float) * nch, sizeof(int) * nch);
+                }
+                t->external = ext;
+                ext->refs++;
+                res[i] = t;
+        }
+        if (ext->refs == 0) ext->refs = 1, __mt_external_unref(ext);
+        return res;
+}
+
+/* checkpoints */
+
+/* A write of the `len` bytes of tensor `tensor`, staged at `pos`, to `off` */
+typedef struct {
+        int      tensor;
+        size_t   pos, len;
+        uint64_t off;
+} StagedWrite;
+
+/**
+ * The checkpoint state of a context. `index` and `saved` describe the last
+ * save to `path`, taken at version `clock`, which the next save compares
+ * against to decide whether it can be incremental.
+ */
+struct MTCheckpoint {
+        char      *path;
+        char      *index;
+        size_t     indexlen;
+        MTTensor **saved;
+        int        nsaved;
+        long       clock;
+
+        /* the save in flight */
+        pthread_t    thread;
+        int          running, full;
+        char        *staging;
+        size_t       stagingcap;
+        StagedWrite *writes;
+        int          nwrites;
+        uint64_t     filelen;
+};
+
+/* Copy the file image of `t` (its data, then any quantization data) to `dst` */
+void __mt_tensor_image(MTTensor *t, char *dst) {
+        long qbytes, raw = __mt_tensor_nbytes(t, &qbytes);
+        memcpy(dst, t->dtype == DTYPE_FLOAT32 ? (void *)t->data : t->lpdata, raw);
+        if (t->dtype == DTYPE_INT8) {
+                long nch = t->qaxis < 0 ? 1 : t->shape[t->qaxis];
+                char *q  = dst + (raw + 3) / 4 * 4;
+                memset(dst + raw, 0, q - (dst + raw));
+                memcpy(q, t->qscale, sizeof(float) * nch);
+                memcpy(q + sizeof(float) * nch, t->qzero, sizeof(int) * nch);
+        }
+}
+
+void __mt_pwrite(int fd, const char *p, size_t n, uint64_t off) {
+        for (size_t done = 0; done < n;) {
+                ssize_t w = pwrite(fd, p + done, n - done, off + done);
+                if (w <= 0) EXIT_WITH_ERROR("failed to write the checkpoint");
+                done += w;
+        }
+}
+
+/* Copy the file at `path` into `fd`, sharing its blocks where the file
+ * system supports reflinks */
+void __mt_copy_file(const char *path, int fd) {
+        int src = open(path, O_RDONLY);
+        if (src < 0) EXIT_WITH_ERROR("failed to read the previous checkpoint");
+#ifdef FICLONE
+        if (ioctl(fd, FICLONE, src) == 0) {
+                close(src);
+                return;
+        }
+#endif
+        char *buf = malloc(MT_STREAM_CHUNK);
+        for (ssize_t r; (r = read(src, buf, MT_STREAM_CHUNK)) != 0;) {
+                if (r < 0) EXIT_WITH_ERROR("failed to read the previous checkpoint");
+                for (ssize_t done = 0; done < r;) {
+                        ssize_t w = write(fd, buf + done, r - done);
+                        if (w <= 0) EXIT_WITH_ERROR("failed to write the checkpoint");
+                        done += w;
+                }
+        }
+        free(buf);
+        close(src);
+}
+
+/**
+ * Write the staged tensors to `path`.tmp and rename it over `path`. A full
+ * save starts the file from its index; an incremental one from a copy of
+ * the previous checkpoint, which it patches. `path` thus always holds one
+ * complete save, and mappings of the previous file keep their contents.
+ */
+void *__mt_checkpoint_run(void *arg) {
+        MTCheckpoint *ck = arg;
+        char          tmp[strlen(ck->path) + 5];
+        snprintf(tmp, sizeof(tmp), "%s.tmp", ck->path);
+
+        int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) EXIT_WITH_ERROR("failed to open the checkpoint for writing");
+        if (ck->full) {
+                /* the gaps between tensors read back as zeros */
+                __mt_pwrite(fd, ck->index, ck->indexlen, 0);
+                if (ftruncate(fd, ck->filelen) != 0) EXIT_WITH_ERROR("failed to write the checkpoint");
+        } else {
+                __mt_copy_file(ck->path, fd);
+        }
+        for (int i = 0; i < ck->nwrites; i++)
+                __mt_pwrite(fd, ck->staging + ck->writes[i].pos, ck->writes[i].len, ck->writes[i].off);
+        if (fdatasync(fd) != 0 || close(fd) != 0) EXIT_WITH_ERROR("failed to write the checkpoint");
+        if (rename(tmp, ck->path) != 0) EXIT_WITH_ERROR("failed to replace the checkpoint");
+        return NULL;
+}
+
+void mt_checkpoint_wait(MTContext *ctx) {
+        MTCheckpoint *ck = ctx->checkpoint;
+        if (ck != NULL && ck->running) {
+                pthread_join(ck->thread, NULL);
+                ck->running = 0;
+        }
+}
+
+void mt_checkpoint_release(MTContext *ctx) {
+        MTCheckpoint *ck = ctx->checkpoint;
+        if (ck == NULL) return;
+        mt_checkpoint_wait(ctx);
+        free(ck->path), free(ck->index), free(ck->saved), free(ck->staging), free(ck->writes), free(ck);
+        ctx->checkpoint = NULL;
+}
+
+/**
+ * Snapshot `tensors` and hand them to a background writer. The previous
+ * save must be on disk first, since its staging buffer is reused and an
+ * incremental save copies the file it wrote.
+ */
+void mt_checkpoint_save_async(MTContext *ctx, const char *path, MTTensor **tensors, int n) {
+        mt_checkpoint_wait(ctx);
+        if (ctx->checkpoint == NULL) ctx->checkpoint = __mt_newptr(MTCheckpoint, 1);
+        MTCheckpoint *ck = ctx->checkpoint;
+
+        char    *index;
+        size_t   indexlen;
+        uint64_t offsets[__max(n, 1)];
+        FILE    *f  = open_memstream(&index, &indexlen);
+        uint64_t end = __mt_write_index(f, ctx, tensors, n, offsets);
+        fclose(f);
+
+        ck->full = ck->path == NULL || strcmp(ck->path, path) != 0 || ck->nsaved != n ||
+                   ck->indexlen != indexlen || memcmp(ck->index, index, indexlen) != 0;
+        ck->filelen = __max(end, (uint64_t)indexlen);
+        ck->writes  = realloc(ck->writes, sizeof(StagedWrite) * __max(n, 1));
+        ck->nwrites = 0;
+
+        size_t need = 0;
+        for (int i = 0; i < n; i++) {
+                MTTensor *t = tensors[i];
+                long      qbytes, raw = __mt_tensor_nbytes(t, &qbytes);
+                if (!ck->full && ck->saved[i] == t && t->version <= ck->clock) continue;
+                ck->writes[ck->nwrites++] = (StagedWrite){i, need, raw + qbytes, offsets[i]};
+                need += (raw + qbytes + MT_FILE_ALIGN - 1) / MT_FILE_ALIGN * MT_FILE_ALIGN;
+        }
+        if (need > ck->stagingcap) {
+                free(ck->staging);
+                ck->staging    = malloc(need);
+                ck->stagingcap = need;
+        }
+        for (int w = 0; w < ck->nwrites; w++)
+                __mt_tensor_image(tensors[ck->writes[w].tensor], ck->staging + ck->writes[w].pos);
+
+        free(ck->index), free(ck->path);
+        ck->index    = index;
+        ck->indexlen = indexlen;
+        ck->path     = strdup(path);
+        ck->saved    = realloc(ck->saved, sizeof(MTTensor *) * __max(n, 1));
+        ck->nsaved   = n;
+        ck->clock    = ctx->version_clock;
+        memcpy(ck->saved, tensors, sizeof(MTTensor *) * n);
+
+        if (pthread_create(&ck->thread, NULL, __mt_checkpoint_run, ck) != 0)
+                __mt_checkpoint_run(ck);
+        else
+                ck->running = 1;
+}
+
+void mt_tensor_bump_version(MTTensor *t) {
+        t->version = ++t->context->version_clock;
+}
+
+/* numpy and safetensors files */
+
+/**
+ * Element types of foreign files. Those with an MtDtype of their own load
+ * as that dtype; the others are converted to float32.
+ */
+typedef enum { FT_F32,
+               FT_F16,
+               FT_BF16,
+               FT_F64,
+               FT_I8,
+               FT_U8,
+               FT_I16,
+               FT_I32,
+               FT_I64,
+               FT_BOOL } ForeignType;
+
+static const struct {
+        const char *npy, *st;
+        int         size;
+} foreign_types[] = {
+    [FT_F32] = {"f4", "F32", 4},  [FT_F16] = {"f2", "F16", 2}, [FT_BF16] = {NULL, "BF16", 2},
+    [FT_F64] = {"f8", "F64", 8},  [FT_I8] = {"i1", "I8", 1},   [FT_U8] = {"u1", "U8", 1},
+    [FT_I16] = {"i2", "I16", 2},  [FT_I32] = {"i4", "I32", 4}, [FT_I64] = {"i8", "I64", 8},
+    [FT_BOOL] = {"b1", "BOOL", 1},
+};
+
+/* The dtype a tensor of foreign type `ft` loads as */
+MtDtype __mt_foreign_dtype(ForeignType ft) {
+        return ft == FT_F16 ? DTYPE_FLOAT16 : ft == FT_BF16 ? DTYPE_BFLOAT16 : DTYPE_FLOAT32;
+}
+
+#define __mt_widen_as(type) ({                                      \
+        for (long i = 0; i < n; i++) {                              \
+                type v;                                             \
+                memcpy(&v, src + i * sizeof(type), sizeof(type));   \
+                dst[i] = v;                                         \
+        }                                                           \
+})
+
+/* Convert `n` elements of foreign type `ft` to float32 */
+void __mt_foreign_widen(const char *src, ForeignType ft, float *dst, long n) {
+        switch (ft) {
+                case FT_F32: memcpy(dst, src, n * sizeof(float)); break;
+                case FT_F16:
+                case FT_BF16:
+                        for (long i = 0; i < n; i++) {
+                                uint16_t h;
+                                memcpy(&h, src + 2 * i, 2);
+                                dst[i] = ft == FT_F16 ? __mt_f16_to_f32(h) : __mt_bf16_to_f32(h);
+                        }
+                        break;
+                case FT_F64: __mt_widen_as(double); break;
+                case FT_I8: __mt_widen_as(int8_t); break;
+                case FT_U8: __mt_widen_as(uint8_t); break;
+                case FT_I16: __mt_widen_as(int16_t); break;
+                case FT_I32: __mt_widen_as(int32_t); break;
+                case FT_I64: __mt_widen_as(int64_t); break;
+                case FT_BOOL:
+                        for (long i = 0; i < n; i++) dst[i] = src[i] != 0;
+                        break;
+        }
+}
+
+/**
+ * An open foreign file. The whole file is mapped when possible; tensors
+ * whose data can be used as is point into the mapping and share `ext`.
+ */
+typedef struct {
+        int         fd;
+        size_t      len;
+        char       *base; /* NULL when the file could not be mapped */
+        MTExternal *ext;
+} ForeignFile;
+
+ForeignFile __mt_foreign_open(const char *path) {
+        ForeignFile ff = {.fd = open(path, O_RDONLY)};
+        if (ff.fd < 0) EXIT_WITH_ERROR("failed to open the tensor file");
+        struct stat st;
+        if (fstat(ff.fd, &st) != 0) EXIT_WITH_ERROR("failed to stat the tensor file");
+        ff.len  = st.st_size;
+        ff.base = ff.len == 0 ? MAP_FAILED
+                              : mmap(NULL, ff.len, PROT_READ | PROT_WRITE, MAP_PRIVATE, ff.fd, 0);
+        if (ff.base == MAP_FAILED) {
+                ff.base = NULL;
+                return ff;
+        }
+        FileMapping *m = __mt_newptr(FileMapping, 1);
+        m->addr = ff.base, m->len = ff.len;
+        ff.ext          = __mt_newptr(MTExternal, 1);
+        ff.ext->release = __mt_unmap_file, ff.ext->user = m;
+        return ff;
+}
+
+/* Close `ff`, unmapping the file unless a tensor still points into it */
+void __mt_foreign_close(ForeignFile *ff) {
+        close(ff->fd);
+        if (ff->ext != NULL && ff->ext->refs == 0) ff->ext->refs = 1, __mt_external_unref(ff->ext);
+}
+
+/* Read exactly `n` bytes at `off` of `ff` */
+void __mt_foreign_read(ForeignFile *ff, void *dst, size_t n, uint64_t off) {
+        if (off > ff->len || n > ff->len - off) EXIT_WITH_ERROR("truncated tensor file");
+        for (size_t done = 0; done < n;) {
+                ssize_t r = pread(ff->fd, (char *)dst + done, n - done, off + done);
+                if (r <= 0) EXIT_WITH_ERROR("failed to read the tensor file");
+                done += r;
+        }
+}
+
+/**
+ * The tensor stored at `off` of `ff`. Data of a native dtype, suitably
+ * aligned and in row-major order is used in place; anything else is read in
+ * chunks of MT_STREAM_CHUNK bytes into a tensor allocated up front.
+ * Column-major (fortran order) data is read and then transposed.
+ */
+MTTensor *__mt_foreign_tensor(MTContext *ctx, ForeignFile *ff, uint64_t off,
+                              ForeignType ft, int *shape, int ndims, int fortran) {
+        MtDtype   dtype = fortran ? DTYPE_FLOAT32 : __mt_foreign_dtype(ft);
+        MTTensor *t     = __mt_new_tensor_meta(ctx, shape, ndims, dtype);
+        long      size  = foreign_types[ft].size;
+        if (off > ff->len || t->datalen > (long)((ff->len - off) / size))
+                EXIT_WITH_ERROR("truncated tensor file");
+
+        int native = !fortran && (ft == FT_F32 || ft == FT_F16 || ft == FT_BF16);
+        if (native && ff->base != NULL && off % size == 0) {
+                if (dtype == DTYPE_FLOAT32)
+                        t->data = (float *)(ff->base + off);
+                else
+                        t->lpdata = ff->base + off;
+                t->external = ff->ext;
+                ff->ext->refs++;
+                return t;
+        }
+
+        void *buf = __mt_data_alloc(ctx, t->datalen * __mt_dtype_size(dtype), 0);
+        if (native) {
+                __mt_foreign_read(ff, buf, t->datalen * size, off);
+        } else {
+                long  chunk = MT_STREAM_CHUNK / size;
+                char *raw   = malloc(chunk * size);
+                for (long i = 0; i < t->datalen; i += chunk) {
+                        long n = __min(chunk, t->datalen - i);
+                        __mt_foreign_read(ff, raw, n * size, off + i * size);
+                        __mt_foreign_widen(raw, ft, (float *)buf + i, n);
+                }
+                free(raw);
+        }
+        if (dtype == DTYPE_FLOAT32)
+                t->data = buf;
+        else
+                t->lpdata = buf;
+
+        if (fortran) {
+                long  cstrides[__max(ndims, 1)], prod = 1;
+                float *src = t->data;
+                for (int i = 0; i < ndims; i++) cstrides[i] = prod, prod *= shape[i];
+                t->data = __mt_data_alloc(ctx, t->datalen * sizeof(float), 0);
+                MTTensor view = *t;
+                view.data     = src;
+                __mt_strided_copy(&view, 0, shape, cstrides, ndims, t->data, t->strides);
+                __mt_data_free(src);
+        }
+        return t;
+}
+
+/**
+ * Write the elements of `t` to `f`, as float32 when `widen` is set. Widened
+ * data is converted and written MT_STREAM_CHUNK bytes at a time.
+ */
+void __mt_foreign_write(FILE *f, MTTensor *t, int widen) {
+        if (!widen) {
+                long qbytes;
+                __mt_write(f, t->dtype == DTYPE_FLOAT32 ? (void *)t->data : t->lpdata,
+                           __mt_tensor_nbytes(t, &qbytes));
+                return;
+        }
+        long   chunk = MT_STREAM_CHUNK / sizeof(float);
+        float *buf   = malloc(MT_STREAM_CHUNK);
+        for (long i = 0; i < t->datalen; i += chunk) {
+                long n = __min(chunk, t->datalen - i);
+                __mt_write(f, __mt_load_chunk(t, i, n, buf), n * sizeof(float));
+        }
+        free(buf);
+}
+
+/**
+ * npy files hold one array: "\x93NUMPY", a version, the length of a header
+ * dict such as {'descr': '<f4', 'fortran_order': False, 'shape': (2, 3), }
+ * padded with spaces and a newline, then the data.
+ */
+#define MT_NPY_MAGIC "\x93NUMPY"
+
+/* The value text of `key` in the npy header dict `h` */
+const char *__mt_npy_field(const char *h, const char *key) {
+        const char *p = strstr(h, key);
+        if (p == NULL || (p = strchr(p + strlen(key), ':')) == NULL)
+                EXIT_WITH_ERROR("corrupt npy header");
+        while (*++p == ' ');
+        return p;
+}
+
+MTTensor *mt_load_npy(MTContext *ctx, const char *path) {
+        ForeignFile ff = __mt_foreign_open(path);
+        char        pre[12];
+        __mt_foreign_read(&ff, pre, 10, 0);
+        if (memcmp(pre, MT_NPY_MAGIC, 6) != 0) EXIT_WITH_ERROR("not an npy file");
+        uint32_t hlen = 0, hoff = pre[6] == 1 ? 10 : 12;
+        if (pre[6] < 1 || pre[6] > 3) EXIT_WITH_ERROR("unsupported npy version");
+        if (pre[6] == 1) {
+                hlen = (uint8_t)pre[8] | (uint8_t)pre[9] << 8;
+        } else {
+                __mt_foreign_read(&ff, pre + 10, 2, 10);
+                memcpy(&hlen, pre + 8, sizeof(hlen));
+        }
+        if (hlen > ff.len) EXIT_WITH_ERROR("truncated tensor file");
+        char *h = __mt_newptr(char, hlen + 1);
+        __mt_foreign_read(&ff, h, hlen, hoff);
+
+        const char *descr = __mt_npy_field(h, "'descr'");
+        int         ft    = -1;
+        if (descr[0] != '\'' || (descr[1] != '<' && descr[1] != '|'))
+                EXIT_WITH_ERROR("only little-endian npy files are supported");
+        for (int i = 0; i <= FT_BOOL; i++)
+                if (foreign_types[i].npy != NULL && !strncmp(descr + 2, foreign_types[i].npy, 2) &&
+                    descr[4] == '\'')
+                        ft = i;
+        if (ft < 0) EXIT_WITH_ERROR("unsupported npy dtype");
+        int fortran = !strncmp(__mt_npy_field(h, "'fortran_order'"), "True", 4);
+
+        int         ndims = 0, shape[32];
+        const char *p     = __mt_npy_field(h, "'shape'");
+        if (*p != '(') EXIT_WITH_ERROR("corrupt npy header");
+        for (p++; *p != ')';) {
+                char *end;
+                long  d = strtol(p, &end, 10);
+                if (end == p || d < 0 || d > INT32_MAX || ndims == 32)
+                        EXIT_WITH_ERROR("corrupt npy header");
+                shape[ndims++] = d;
+                for (p = end; *p == ',' || *p == ' '; p++);
+        }
+        free(h);
+
+        MTTensor *t = __mt_foreign_tensor(ctx, &ff, hoff + hlen, ft, shape, ndims, fortran);
+        __mt_foreign_close(&ff);
+        return t;
+}
+
+/* Save `t` as an npy file. Bfloat16 and int8 tensors, which numpy has no
+ * type for, are written as float32. */
+void mt_save_npy(MTTensor *t, const char *path) {
+        __mt_assert_dense(t);
+        int  widen = t->dtype == DTYPE_BFLOAT16 || t->dtype == DTYPE_INT8;
+        char shape[12 * t->ndims + 2], h[sizeof(shape) + 128];
+        shape[0] = '\0';
+        for (int i = 0, len = 0; i < t->ndims; i++)
+                len += snprintf(shape + len, sizeof(shape) - len, i ? ", %d" : "%d", t->shape[i]);
+        if (t->ndims == 1) strcat(shape, ",");
+        int len = snprintf(h, sizeof(h), "{'descr': '<%s', 'fortran_order': False, 'shape': (%s), }",
+                           t->dtype == DTYPE_FLOAT16 && !widen ? "f2" : "f4", shape);
+        /* pad with spaces and a newline so the data starts 64-byte aligned */
+        int hlen = (10 + len + 1 + MT_FILE_ALIGN - 1) / MT_FILE_ALIGN * MT_FILE_ALIGN - 10;
+        memset(h + len, ' ', hlen - len - 1);
+        h[hlen - 1] = '\n';
+
+        char    tmp[strlen(path) + 5];
+        FILE   *f       = __mt_open_replacement(path, tmp);
+        uint8_t pre[10] = {0x93, 'N', 'U', 'M', 'P', 'Y', 1, 0, hlen & 0xff, hlen >> 8};
+        __mt_write(f, pre, sizeof(pre));
+        __mt_write(f, h, hlen);
+        __mt_foreign_write(f, t, widen);
+        __mt_replace_file(f, tmp, path);
+}
+
+/**
+ * safetensors files start with the u64 length of a JSON header mapping each
+ * tensor name to {"dtype": "F32", "shape": [2, 3], "data_offsets": [b, e]},
+ * offsets relative to the end of the header, then the data of all tensors.
+ */
+typedef struct {
+        const char *p, *end;
+} JsonCursor;
+
+void __mt_json_ws(JsonCursor *c) {
+        while (c->p < c->end && (*c->p == ' ' || *c->p == '\t' || *c->p == '\n' || *c->p == '\r'))
+                c->p++;
+}
+
+int __mt_json_eat(JsonCursor *c, char ch) {
+        __mt_json_ws(c);
+        if (c->p == c->end || *c->p != ch) return 0;
+        c->p++;
+        return 1;
+}
+
+void __mt_json_expect(JsonCursor *c, char ch) {
+        if (!__mt_json_eat(c, ch)) EXIT_WITH_ERROR("corrupt safetensors header");
+}
+
+/* Parse a string into a malloc'd, UTF-8 encoded copy */
+char *__mt_json_string(JsonCursor *c) {
+        __mt_json_expect(c, '"');
+        char *s = __mt_newptr(char, c->end - c->p + 1), *o = s;
+        while (c->p < c->end && *c->p != '"') {
+                if (*c->p != '\\') {
+                        *o++ = *c->p++;
+                        continue;
+                }
+                if (++c->p == c->end) break;
+                char e = *c->p++;
+                if (e == 'u') {
+                        unsigned cp;
+                        if (c->end - c->p < 4 || sscanf(c->p, "%4x", &cp) != 1)
+                                EXIT_WITH_ERROR("corrupt safetensors header");
+                        c->p += 4;
+                        if (cp < 0x80) {
+                                *o++ = cp;
+                        } else if (cp < 0x800) {
+                                *o++ = 0xc0 | cp >> 6, *o++ = 0x80 | (cp & 0x3f);
+                        } else {
+                                *o++ = 0xe0 | cp >> 12, *o++ = 0x80 | (cp >> 6 & 0x3f);
+                                *o++ = 0x80 | (cp & 0x3f);
+                        }
+                } else {
+                        const char *from = "bfnrt", *to = "\b\f\n\r\t", *at = strchr(from, e);
+                        *o++ = e != '\0' && at != NULL ? to[at - from] : e;
+                }
+        }
+        __mt_json_expect(c, '"');
+        return s;
+}
+
+uint64_t __mt_json_uint(JsonCursor *c) {
+        __mt_json_ws(c);
+        if (c->p == c->end || *c->p < '0' || *c->p > '9') EXIT_WITH_ERROR("corrupt safetensors header");
+        uint64_t v = 0;
+        while (c->p < c->end && *c->p >= '0' && *c->p <= '9') {
+                if (v > (UINT64_MAX - 9) / 10) EXIT_WITH_ERROR("corrupt safetensors header");
+                v = v * 10 + (*c->p++ - '0');
+        }
+        return v;
+}
+
+/* Skip a value of any kind */
+void __mt_json_skip(JsonCursor *c) {
+        __mt_json_ws(c);
+        if (c->p < c->end && *c->p == '"') {
+                free(__mt_json_string(c));
+        } else if (__mt_json_eat(c, '{') || __mt_json_eat(c, '[')) {
+                char close = c->p[-1] == '{' ? '}' : ']';
+                while (!__mt_json_eat(c, close)) {
+                        if (close == '}') __mt_json_skip(c), __mt_json_expect(c, ':');
+                        __mt_json_skip(c);
+                        if (!__mt_json_eat(c, ',') && (c->p == c->end || *c->p != close))
+                                EXIT_WITH_ERROR("corrupt safetensors header");
+                }
+        } else {
+                const char *start = c->p;
+                while (c->p < c->end && !strchr(",}] \t\n\r", *c->p)) c->p++;
+                if (c->p == start) EXIT_WITH_ERROR("corrupt safetensors header");
+        }
+}
+
+MTTensor **mt_load_safetensors(MTContext *ctx, const char *path, int *n) {
+        ForeignFile ff = __mt_foreign_open(path);
+        uint64_t    hlen;
+        __mt_foreign_read(&ff, &hlen, sizeof(hlen), 0);
+        if (hlen > ff.len) EXIT_WITH_ERROR("truncated tensor file");
+        char *h = malloc(hlen);
+        __mt_foreign_read(&ff, h, hlen, sizeof(hlen));
+
+        JsonCursor c   = {h, h + hlen};
+        int        cap = 16;
+        MTTensor **res = __mt_newptr(MTTensor *, cap);
+        *n             = 0;
+        __mt_json_expect(&c, '{');
+        for (int first = 1; !__mt_json_eat(&c, '}'); first = 0) {
+                if (!first) __mt_json_expect(&c, ',');
+                char *name = __mt_json_string(&c);
+                __mt_json_expect(&c, ':');
+                if (!strcmp(name, "__metadata__")) {
+                        __mt_json_skip(&c);
+                        free(name);
+                        continue;
+                }
+
+                int      ft = -1, ndims = -1, shape[32];
+                uint64_t loc[2] = {0, 0};
+                __mt_json_expect(&c, '{');
+                for (int field = 0; !__mt_json_eat(&c, '}'); field++) {
+                        if (field > 0) __mt_json_expect(&c, ',');
+                        char *key = __mt_json_string(&c);
+                        __mt_json_expect(&c, ':');
+                        if (!strcmp(key, "dtype")) {
+                                char *dt = __mt_json_string(&c);
+                                for (int i = 0; i <= FT_BOOL; i++)
+                                        if (!strcmp(dt, foreign_types[i].st)) ft = i;
+                                if (ft < 0) EXIT_WITH_ERROR("unsupported safetensors dtype");
+                                free(dt);
+                        } else if (!strcmp(key, "shape")) {
+                                __mt_json_expect(&c, '[');
+                                for (ndims = 0; !__mt_json_eat(&c, ']');) {
+                                        if (ndims > 0) __mt_json_expect(&c, ',');
+                                        uint64_t d = __mt_json_uint(&c);
+                                        if (d > INT32_MAX || ndims == 32)
+                                                EXIT_WITH_ERROR("corrupt safetensors header");
+                                        shape[ndims++] = d;
+                                }
+                        } else if (!strcmp(key, "data_offsets")) {
+                                __mt_json_expect(&c, '[');
+                                loc[0] = __mt_json_uint(&c);
+                                __mt_json_expect(&c, ',');
+                                loc[1] = __mt_json_uint(&c);
+                                __mt_json_expect(&c, ']');
+                        } else {
+                                __mt_json_skip(&c);
+                        }
+                        free(key);
+                }
+                if (ft < 0 || ndims < 0 || loc[1] < loc[0] ||
+                    (loc[1] - loc[0]) % foreign_types[ft].size != 0 ||
+                    (loc[1] - loc[0]) / foreign_types[ft].size != (uint64_t)__prod(shape, ndims, long))
+                        EXIT_WITH_ERROR("corrupt safetensors header");
+
+                if (*n == cap) res = realloc(res, sizeof(MTTensor *) * (cap *= 2));
+                MTTensor *t = __mt_foreign_tensor(ctx, &ff, sizeof(hlen) + hlen + loc[0], ft, shape, ndims, 0);
+                t->name     = name;
+                res[(*n)++] = t;
+        }
+        free(h);
+        __mt_foreign_close(&ff);
+        return res;
+}
+
+/* Write `s` as a JSON string */
+void __mt_json_write_string(FILE *f, const char *s) {
+        fputc('"', f);
+        for (; *s != '\0'; s++) {
+                if (*s == '"' || *s == '\\')
+                        fprintf(f, "\\%c", *s);
+                else if ((unsigned char)*s < 0x20)
+                        fprintf(f, "\\u%04x", *s);
+                else
+                        fputc(*s, f);
+        }
+        fputc('"', f);
+}
+
+/**
+ * Save `tensors` as a safetensors file. Int8 tensors, which the format has
+ * no quantization parameters for, are written as float32. Tensors are laid
+ * out by decreasing element size so every one of them stays aligned to it.
+ */
+void mt_save_safetensors(MTContext *ctx, const char *path, MTTensor **tensors, int n) {
+        int   order[__max(n, 1)], norder = 0;
+        char  names[__max(n, 1)][16];
+        char *name[__max(n, 1)];
+        for (int size = 4; size >= 2; size /= 2)
+                for (int i = 0; i < n; i++) {
+                        MTTensor *t = tensors[i];
+                        int       s = t->dtype == DTYPE_FLOAT16 || t->dtype == DTYPE_BFLOAT16 ? 2 : 4;
+                        if (s == size) order[norder++] = i;
+                }
+
+        char  *h;
+        size_t hlen;
+        FILE  *hs  = open_memstream(&h, &hlen);
+        uint64_t off = 0;
+        fputc('{', hs);
+        for (int k = 0; k < n; k++) {
+                MTTensor *t = tensors[order[k]];
+                __mt_assert_dense(t);
+                if (t->context != ctx) EXIT_WITH_ERROR("tensors to save must belong to the context");
+                int widen = t->dtype == DTYPE_INT8;
+                snprintf(names[k], sizeof(names[k]), "%d", order[k]);
+                name[k] = t->name != NULL ? t->name : names[k];
+
+                uint64_t nbytes = (size_t)t->datalen * (widen ? sizeof(float) : (size_t)__mt_dtype_size(t->dtype));
+                fputs(k ? "," : "", hs);
+                __mt_json_write_string(hs, name[k]);
+                fprintf(hs, ":{\"dtype\":\"%s\",\"shape\":[",
+                        t->dtype == DTYPE_FLOAT16 ? "F16" : t->dtype == DTYPE_BFLOAT16 ? "BF16" : "F32");
+                for (int d = 0; d < t->ndims; d++) fprintf(hs, d ? ",%d" : "%d", t->shape[d]);
+                fprintf(hs, "],\"data_offsets\":[%lu,%lu]}", (unsigned long)off, (unsigned long)(off + nbytes));
+                off += nbytes;
+        }
+        fputc('}', hs);
+        /* pad with spaces so the data starts 64-byte aligned */
+        while ((sizeof(uint64_t) + ftell(hs)) % MT_FILE_ALIGN != 0) fputc(' ', hs);
+        fclose(hs);
+
+        char     tmp[strlen(path) + 5];
+        FILE    *f   = __mt_open_replacement(path, tmp);
+        uint64_t len = hlen;
+        __mt_write(f, &len, sizeof(len));
+        __mt_write(f, h, hlen);
+        free(h);
+        for (int k = 0; k < n; k++) __mt_foreign_write(f, tensors[order[k]], tensors[order[k]]->dtype == DTYPE_INT8);
+        __mt_replace_file(f, tmp, path);
+}
+
+/* Streaming datasets */
+
+/**
+ * A data loader streams the samples of a file into a ring of `nslots`
+ * preallocated batch tensors. A background thread fills the slots ahead of
+ * the consumer; `counts` holds the samples in each filled slot, zero marking
+ * the end of an epoch. The occupied slots are [head, head + held + nfilled),
+ * the first of them held by the consumer when `held` is set.
+ */
+struct MTDataLoader {
+        FILE        *file;
+        MtDataFormat format;
+        long         sample; /* floats per sample */
+        int          batch;
+        int          nslots;
+        MTTensor   **batches;
+        int         *counts;
+        int          head, nfilled, held, stop;
+        /* samples waiting to be drawn at random when shuffling */
+        int      window, nshuf;
+        float   *shufbuf;
+        uint64_t rng;
+        /* the current line of a CSV file, and whether it is the first one */
+        char  *line;
+        size_t linecap;
+        int    firstline;
+
+        pthread_t       thread;
+        pthread_mutex_t lock;
+        pthread_cond_t  ready, space;
+};
+
+/* xorshift64* */
+uint64_t __mt_loader_rand(MTDataLoader *dl) {
+        dl->rng ^= dl->rng >> 12;
+        dl->rng ^= dl->rng << 25;
+        dl->rng ^= dl->rng >> 27;
+        return dl->rng * 2685821657736338717ULL;
+}
+
+/* Read the next sample of the file into `dst`, returning 0 at its end */
+int __mt_loader_read(MTDataLoader *dl, float *dst) {
+        if (dl->format == DATA_FORMAT_BINARY) {
+                size_t got = fread(dst, sizeof(float), dl->sample, dl->file);
+                if (got != 0 && got != (size_t)dl->sample) EXIT_WITH_ERROR("truncated data file");
+                return got != 0;
+        }
+        while (getline(&dl->line, &dl->linecap, dl->file) >= 0) {
+                char *p = dl->line, *end;
+                long  n = 0;
+                for (; n < dl->sample; n++, p = end + (*end == ',')) {
+                        dst[n] = strtof(p, &end);
+                        if (end == p) break;
+                }
+                while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') p++;
+                int first     = dl->firstline;
+                dl->firstline = 0;
+                if (n == dl->sample && *p == '\0') return 1;
+                /* blank lines and a header line are skipped */
+                int blank = dl->line[strspn(dl->line, " \t\r\n")] == '\0';
+                if (!blank && !(first && n == 0)) EXIT_WITH_ERROR("malformed CSV data file");
+        }
+        return 0;
+}
+
+/* Fill `dst` with the next sample, drawn at random from the shuffle window
+ * when there is one. Returns 0 at the end of the epoch. */
+int __mt_loader_next_sample(MTDataLoader *dl, float *dst) {
+        if (dl->window <= 1) return __mt_loader_read(dl, dst);
+        while (dl->nshuf < dl->window && __mt_loader_read(dl, dl->shufbuf + dl->nshuf * dl->sample))
+                dl->nshuf++;
+        if (dl->nshuf == 0) return 0;
+        long j = __mt_loader_rand(dl) % dl->nshuf;
+        dl->nshuf--;
+        memcpy(dst, dl->shufbuf + j * dl->sample, sizeof(float) * dl->sample);
+        memcpy(dl->shufbuf + j * dl->sample, dl->shufbuf + dl->nshuf * dl->sample,
+               sizeof(float) * dl->sample);
+        return 1;
+}
+
+void *__mt_loader_run(void *arg) {
+        MTDataLoader *dl = arg;
+        for (int slot = 0;; slot = (slot + 1) % dl->nslots) {
+                pthread_mutex_lock(&dl->lock);
+                while (dl->nfilled + dl->held == dl->nslots && !dl->stop)
+                        pthread_cond_wait(&dl->space, &dl->lock);
+                int stop = dl->stop;
+                pthread_mutex_unlock(&dl->lock);
+                if (stop) break;
+
+                MTTensor *t = dl->batches[slot];
+                int       n = 0;
+                while (n < dl->batch && __mt_loader_next_sample(dl, t->data + n * dl->sample)) n++;
+                t->shape[0] = __max(n, 1);
+                t->datalen  = t->shape[0] * dl->sample;
+                if (n == 0) {
+                        /* the end of an epoch: the next one starts over */
+                        rewind(dl->file);
+                        dl->firstline = 1;
+                }
+
+                pthread_mutex_lock(&dl->lock);
+                dl->counts[slot] = n;
+                dl->nfilled++;
+                pthread_cond_signal(&dl->ready);
+                pthread_mutex_unlock(&dl->lock);
+        }
+        return NULL;
+}
+
+MTDataLoader *mt_new_dataloader(MTContext *ctx, const char *path, MtDataFormat format,
+                                int *shape, int ndims, int batch_size, int prefetch,
+                                int window, unsigned long seed) {
+        if (batch_size < 1 || prefetch < 1)
+                EXIT_WITH_ERROR("batch size and prefetch depth must be positive");
+        MTDataLoader *dl = __mt_newptr(MTDataLoader, 1);
+        dl->file         = fopen(path, format == DATA_FORMAT_BINARY ? "rb" : "r");
+        if (dl->file == NULL) EXIT_WITH_ERROR("failed to open the data file");
+        setvbuf(dl->file, NULL, _IOFBF, MT_STREAM_CHUNK);
+        dl->format    = format;
+        dl->sample    = __prod(shape, ndims, long);
+        dl->batch     = batch_size;
+        dl->nslots    = prefetch + 1;
+        dl->window    = window;
+        dl->shufbuf   = window > 1 ? malloc(sizeof(float) * window * dl->sample) : NULL;
+        dl->rng       = seed != 0 ? seed : 0x9e3779b97f4a7c15ULL;
+        dl->firstline = 1;
+
+        int bshape[ndims + 1];
+        bshape[0] = batch_size;
+        memcpy(bshape + 1, shape, sizeof(int) * ndims);
+        dl->batches = __mt_newptr(MTTensor *, dl->nslots);
+        dl->counts  = __mt_newptr(int, dl->nslots);
+        /* the loader owns the ring: the context must not free it while the
+         * thread fills it, so it is taken off the tracked list */
+        for (int i = 0; i < dl->nslots; i++) {
+                dl->batches[i] = __mt_new_tensor_uninit(ctx, bshape, ndims + 1);
+                int idx        = __find_in_list(ctx->tracked, dl->batches[i], ctx->ntracked);
+                if (idx > -1) ctx->tracked[idx] = NULL;
+        }
+        mt_context_defrag(ctx);
+
+        pthread_mutex_init(&dl->lock, NULL);
+        pthread_cond_init(&dl->ready, NULL);
+        pthread_cond_init(&dl->space, NULL);
+        if (pthread_create(&dl->thread, NULL, __mt_loader_run, dl) != 0)
+                EXIT_WITH_ERROR("failed to start the data loader thread");
+        return dl;
+}
+
+MTTensor *mt_dataloader_next(MTDataLoader *dl) {
+        pthread_mutex_lock(&dl->lock);
+        if (dl->held) {
+                /* the slot is refilled in place: tensors sharing the batch
+                 * keep their copy. The copy covers the whole slot, since a
+                 * short batch has a smaller datalen than its buffer. */
+                MTTensor *b = dl->batches[dl->head];
+                b->datalen  = (long)dl->batch * dl->sample;
+                mt_tensor_make_writable(b);
+                dl->held = 0;
+                dl->head = (dl->head + 1) % dl->nslots;
+                pthread_cond_signal(&dl->space);
+        }
+        while (dl->nfilled == 0) pthread_cond_wait(&dl->ready, &dl->lock);
+        dl->nfilled--;
+        MTTensor *t = dl->counts[dl->head] > 0 ? dl->batches[dl->head] : NULL;
+        if (t != NULL) {
+                dl->held = 1;
+        } else {
+                dl->head = (dl->head + 1) % dl->nslots;
+                pthread_cond_signal(&dl->space);
+        }
+        pthread_mutex_unlock(&dl->lock);
+        return t;
+}
+
+void mt_dataloader_free(MTDataLoader *dl) {
+        pthread_mutex_lock(&dl->lock);
+        dl->stop = 1;
+        pthread_cond_signal(&dl->space);
+        pthread_mutex_unlock(&dl->lock);
+        pthread_join(dl->thread, NULL);
+        pthread_mutex_destroy(&dl->lock);
+        pthread_cond_destroy(&dl->ready);
+        pthread_cond_destroy(&dl->space);
+
+        for (int i = 0; i < dl->nslots; i++) mt_tensor_free(dl->batches[i]);
+        fclose(dl->file);
+        free(dl->batches), free(dl->counts), free(dl->shufbuf), free(dl->line), free(dl);
+}
+
+/**
+ * AUTOGRAD
+ */
+void mt_tensor_enable_grad(MTTensor *t) {
+        if (t->layout != LAYOUT_DENSE)
+                EXIT_WITH_ERROR("gradients are only supported for dense tensors");
+        if (t->dtype != DTYPE_FLOAT32)
+                EXIT_WITH_ERROR("gradients are only supported for float32 tensors");
+        t->req_grad = 1;
+        mt_tensor_zero_grad(t);
+}
+
+void mt_tensor_disable_grad(MTTensor *t) {
+        t->req_grad = 0;
+        if (t->grad != NULL) {
+                mt_tensor_free(t->grad);
+                t->grad = NULL;
+                mt_context_defrag(t->context);
+        }
+}
+
+/* Sum of two row-sparse tensors, merging their sorted row lists */
+MTTensor *__mt_row_sparse_add(MTTensor *a, MTTensor *b) {
+        long rowlen = a->strides[0];
+        long na = a->datalen / rowlen, nb = b->datalen / rowlen, n = 0;
+        for (long i = 0, j = 0; i < na || j < nb; n++) {
+                if (j == nb || (i < na && a->rowidx[i] < b->rowidx[j])) i++;
+                else if (i == na || b->rowidx[j] < a->rowidx[i]) j++;
+                else i++, j++;
+        }
+
+        MTTensor *res = __mt_new_row_sparse(a->context, a->shape, a->ndims, n);
+        for (long i = 0, j = 0, r = 0; r < n; r++) {
+                float *to   = res->data + r * rowlen;
+                int    takea = j == nb || (i < na && a->rowidx[i] <= b->rowidx[j]);
+                int    takeb = i == na || (j < nb && b->rowidx[j] <= a->rowidx[i]);
+                res->rowidx[r] = takea ? a->rowidx[i] : b->rowidx[j];
+                if (takea) memcpy(to, a->data + i++ * rowlen, rowlen * sizeof(float));
+                if (takeb)
+                        for (long k = 0; k < rowlen; k++) to[k] += b->data[j * rowlen + k];
+                j += takeb;
+        }
+        return res;
+}
+
+/**
+ * Add `grad` into the accumulated gradient `acc`. Row-sparse gradients stay
+ * row-sparse while everything accumulated is, and are scattered into a copy
+ * of `acc` otherwise.
+ */
+MTTensor *__mt_grad_accumulate(MTTensor *acc, MTTensor *grad) {
+        if (acc->layout == LAYOUT_DENSE && grad->layout == LAYOUT_DENSE)
+                return __mt_tensor_add(acc, grad);
+        if (acc->layout == LAYOUT_ROW_SPARSE && grad->layout == LAYOUT_ROW_SPARSE)
+                return __mt_row_sparse_add(acc, grad);
+        MTTensor *dense  = acc->layout == LAYOUT_DENSE ? acc : grad;
+        MTTensor *sparse = acc->layout == LAYOUT_DENSE ? grad : acc;
+        return __mt_tensor_add(dense, mt_sparse_to_dense(sparse));
+}
+
+void mt_tensor_backward(MTTensor *t, MTTensor *grad) {
+        if (!t->req_grad) return;
+
+        if (grad == NULL) {
+                if (t->ndims == 0)
+                        grad = mt_new_scalar(t->context, 1.0);
+                else
+                        EXIT_WITH_ERROR("grad must be specified for non scalar tensor");
+        }
+        t->grad = __mt_grad_accumulate(t->grad, grad);
+
+        /* The backward functions of t's dependencies expect a dense grad */
+        if (grad->layout != LAYOUT_DENSE && t->ndeps > 0)
+                grad = mt_sparse_to_dense(grad);
+
+        /* recursively compute gradient of t's non-null children */
+        for (int i = 0; i < t->ndeps; i++) {
+                if (t->deps[i] != NULL) {
+                        if (t->deps[i]->grad_fn == NULL)
+                                EXIT_WITH_ERROR("fatal: no grad_fn defined");
+                        ProfScope prof   = __mt_prof_begin(t->context);
+                        MTTensor *bwgrad = t->deps[i]->grad_fn(t->deps, grad);
+                        __mt_prof_end(&prof, t->op != NULL ? t->op : "unknown", bwgrad,
+                                      Arr(MTTensor *, grad), 1, 1);
+                        mt_tensor_backward(t->deps[i]->tensor, bwgrad);
+                }
+        }
+}
+
+void mt_remove_intermediary_nodes(MTContext *ctx) {
+        for (int i = 0; i < ctx->ntracked; i++) {
+                mt_tensor_free(ctx->tracked[i]);
+                ctx->tracked[i] = NULL;
+        }
+}
+
+void mt_tensor_zero_grad(MTTensor *t) {
+        int sparse = t->grad != NULL && t->grad->layout == LAYOUT_ROW_SPARSE;
+        mt_tensor_free(t->grad);
+        t->grad = sparse ? __mt_new_row_sparse(t->context, t->shape, t->ndims, 0)
+                         : mt_new_tensor_full(t->context, 0., t->shape, t->ndims);
+}
+
+/**
+ * Like mt_tensor_enable_grad, but the gradient starts out row-sparse and
+ * stays so as long as only gathers along dimension 0 contribute to it.
+ * Meant for large embedding tables, of which a step touches few rows.
+ */
+void mt_tensor_enable_sparse_grad(MTTensor *t) {
+        if (t->ndims < 1)
+                EXIT_WITH_ERROR("sparse gradients need at least one dimension");
+        mt_tensor_enable_grad(t);
+        mt_tensor_free(t->grad);
+        t->grad = __mt_new_row_sparse(t->context, t->shape, t->ndims, 0);
+}
+
+/* Plain SGD update t -= lr * grad. A row-sparse gradient only updates the
+ * rows it holds. */
+void mt_tensor_sgd_step(MTTensor *t, float lr) {
+        if (!t->req_grad)
+                EXIT_WITH_ERROR("t does not require grad");
+        MTTensor *g = t->grad;
+        mt_tensor_make_writable(t);
+        if (g->layout == LAYOUT_ROW_SPARSE) {
+                long rowlen = t->strides[0];
+                for (long r = 0; r < g->datalen / rowlen; r++) {
+                        float *row = t->data + g->rowidx[r] * rowlen;
+                        for (long k = 0; k < rowlen; k++) row[k] -= lr * g->data[r * rowlen + k];
+                }
+        } else {
+                if (g->datalen != t->datalen)
+                        EXIT_WITH_ERROR("grad must have the same shape as t");
+                for (long i = 0; i < t->datalen; i++) t->data[i] -= lr * g->data[i];
+        }
+        mt_tensor_bump_version(t);
 }
\ No newline at end of file
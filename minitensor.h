@@ -16,15 +16,36 @@
 #ifndef MINITENSOR_H_
 #define MINITENSOR_H_
 
-typedef struct MTTensor    MTTensor;
-typedef struct MTContext   MTContext;
-typedef struct BcastResult BcastResult;
-typedef struct Dependency  Dependency;
+#include <stddef.h>
+
+typedef struct MTTensor     MTTensor;
+typedef struct MTContext    MTContext;
+typedef struct BcastResult  BcastResult;
+typedef struct Dependency   Dependency;
+typedef struct MTDataLoader MTDataLoader;
+typedef struct MTCheckpoint MTCheckpoint;
+typedef struct MTProfiler   MTProfiler;
+typedef struct MTPlan       MTPlan;
+typedef struct MTBcastCache MTBcastCache;
 typedef enum { CGM_REQUIRE_GRAD,
                CGM_NO_REQUIRE_GRAD,
                CGM_OVERRIDE } MtContextGradMode;
 typedef enum { DEVICE_CPU,
                DEVICE_GPU } MtDevice;
+typedef enum { MATH_EXACT,
+               MATH_FAST } MtMathMode;
+typedef enum { DTYPE_FLOAT32,
+               DTYPE_FLOAT16,
+               DTYPE_BFLOAT16,
+               DTYPE_INT8 } MtDtype;
+typedef enum { LAYOUT_DENSE,
+               LAYOUT_CSR,
+               LAYOUT_ROW_SPARSE } MtLayout;
+typedef enum { HUGEPAGES_OFF,
+               HUGEPAGES_THP,
+               HUGEPAGES_HUGETLB } MtHugePages;
+typedef enum { DATA_FORMAT_BINARY,
+               DATA_FORMAT_CSV } MtDataFormat;
 
 /**
  * BFunc: the float-float binary function, alias for float(float, float)
@@ -50,12 +71,85 @@ typedef MTTensor *(*TensorBFunc)(MTTensor *, MTTensor *);
  */
 typedef MTTensor *(*TensorBackwardFunc)(Dependency **, MTTensor *);
 
+/**
+ * MTForwardFunc: a forward pass that can be planned, see mt_plan_compile.
+ * It computes `outputs` from `inputs` with ops on `ctx`; `user` is passed
+ * through, e.g., for the weights of a model.
+ */
+typedef void (*MTForwardFunc)(MTContext *ctx, MTTensor **inputs, MTTensor **outputs, void *user);
+
 /**
  * A context manages information of underlying allocated tensors it tracks.
  * It handles memory management in users' stead to avoid overly convoluted
  * APIs. Any tensor belongs to exactly one context. Two (or more) tensors must
  * operate under the same context.
  */
+/**
+ * MTAllocator routes the memory of a context: tensor storage with `alloc`
+ * (which must honor the requested power-of-two alignment) and `free`, and
+ * the growing bookkeeping arrays with `realloc`, which needs no particular
+ * alignment. `user` is passed back to every call.
+ */
+typedef struct {
+        void *(*alloc)(void *user, size_t size, size_t align);
+        void *(*realloc)(void *user, void *ptr, size_t oldsize, size_t newsize);
+        void (*free)(void *user, void *ptr, size_t size);
+        void *user;
+} MTAllocator;
+
+#define MT_ALLOC_NBUCKETS 48
+
+/**
+ * Allocation statistics of a context, in bytes obtained from its allocator.
+ * histogram[i] counts the allocations of [2^i, 2^(i+1)) bytes (the first
+ * bucket also holds empty ones and the last everything larger). Buffers held
+ * by the pool count as live; `cached_bytes` of them are free for reuse, and
+ * `pool_hits` counts the requests the pool served without the allocator.
+ * `requested_bytes` sums the sizes of all tensor buffer requests.
+ */
+typedef struct {
+        long live_bytes;
+        long peak_bytes;
+        long nallocs;
+        long nfrees;
+        long nreallocs;
+        long histogram[MT_ALLOC_NBUCKETS];
+        long cached_bytes;
+        long pool_hits;
+        long requested_bytes;
+} MTAllocStats;
+
+#define MT_POOL_NCLASSES 176
+
+/**
+ * The pool caches freed tensor buffers per size class (four classes per
+ * power of two) for reuse by the next request of the same class, holding at
+ * most `limit` bytes; 0 disables it.
+ */
+typedef struct {
+        void *free[MT_POOL_NCLASSES];
+        long  limit;
+} MTPool;
+
+/**
+ * MTExternal is a reference-counted handle on memory that tensors borrow.
+ * `release(user)` runs when the last tensor referring to it is freed.
+ */
+typedef struct {
+        long refs;
+        void (*release)(void *user);
+        void *user;
+} MTExternal;
+
+/**
+ * MTStorage is the reference count of data several tensors share, see
+ * mt_tensor_share. The tensors point at the same elements, which are
+ * released with the last of them.
+ */
+typedef struct {
+        long refs;
+} MTStorage;
+
 struct MTContext {
         /**
          * `withgrads` marks whether the tensors it track require gradients
@@ -72,6 +166,40 @@ struct MTContext {
         int cap;
         /* The device where tensor data is allocated: CPU or GPU */
         MtDevice device;
+        /**
+         * `mathmode` selects how transcendental ops (exp, log, tanh, sigmoid,
+         * softmax) are evaluated: MATH_EXACT (the default) calls libm per
+         * element, MATH_FAST uses vectorized polynomial approximations
+         * accurate to a few ULPs.
+         */
+        MtMathMode mathmode;
+        /* Number of threads parallel kernels may use. It defaults to the
+         * number of online processors; set it to 1 to run single-threaded. */
+        int nthreads;
+        /**
+         * `hugepages` selects how large tensor data buffers (4 MiB and up)
+         * are backed: HUGEPAGES_THP (the default) advises the kernel to use
+         * transparent huge pages, HUGEPAGES_HUGETLB maps them from the
+         * reserved hugetlbfs pool, and HUGEPAGES_OFF uses regular pages.
+         */
+        MtHugePages hugepages;
+        /* The allocator, fixed at creation, and its statistics */
+        MTAllocator  allocator;
+        MTAllocStats stats;
+        /* Freed tensor buffers kept for reuse, see mt_context_set_pool_limit */
+        MTPool pool;
+        /* Source of tensor versions, advanced on every tensor update */
+        long version_clock;
+        /* The state of asynchronous checkpoints, see mt_checkpoint_save_async */
+        MTCheckpoint *checkpoint;
+        /* The op profiler, NULL until mt_profiler_start is first called */
+        MTProfiler *profiler;
+        /* The plan being traced or replayed, NULL outside of mt_plan_compile
+         * and mt_plan_run */
+        MTPlan *plan;
+        /* Broadcast plans of binary ops by operand shapes, NULL until the
+         * first binary op */
+        MTBcastCache *bcast_cache;
 };
 
 /**
@@ -106,11 +234,12 @@ struct MTTensor {
          * not (0). */
         int req_grad;
         /* Tracks the shape of a tensor, or the number of elements of every di-
-         * mension. */
+         * mension. Products of the shape (element counts, strides and offsets)
+         * are always computed as long. */
         int *shape;
         /* The stride, an array with length of `ndims`, each element describing
          * how much "jumps" need to be made to move into the next dimension. */
-        int *strides;
+        long *strides;
         /* The reference to a context */
         MTContext *context;
         /* A list of tensors dependent on this tensor (in computational
@@ -120,6 +249,50 @@ struct MTTensor {
         MTTensor *grad;
         /* A reference to parent node */
         MTTensor *parent;
+        /* The storage type of the elements. Reduced-precision tensors keep
+         * their elements in `lpdata` and have `data` set to NULL; arithmetic
+         * on them is still carried out in float32. */
+        MtDtype dtype;
+        /* The 16-bit elements of a float16 or bfloat16 tensor, or the 8-bit
+         * elements of an int8 tensor. NULL for float32 tensors */
+        void *lpdata;
+        /* Quantization parameters of an int8 tensor: element x along channel
+         * c of dimension `qaxis` represents (x - qzero[c]) * qscale[c]. A
+         * `qaxis` of -1 means a single scale and zero point for the whole
+         * tensor. Both arrays are NULL for the other dtypes. */
+        float *qscale;
+        int   *qzero;
+        int    qaxis;
+        /* The storage layout. A LAYOUT_CSR tensor is a sparse 2-tensor in
+         * compressed sparse row form: `data` holds its `datalen` nonzero
+         * values row by row, `colidx` their columns, and the nonzeros of row
+         * i are at positions rowptr[i] until rowptr[i + 1]. `rowptr` and
+         * `colidx` are NULL for dense tensors.
+         * A LAYOUT_ROW_SPARSE tensor is a tensor whose rows (slices along
+         * the first dimension) are all zero except those listed, in
+         * increasing order, in `rowidx`. `data` holds those rows back to
+         * back. Gathers produce such tensors as gradients. */
+        MtLayout layout;
+        long    *rowptr;
+        int     *colidx;
+        int     *rowidx;
+        /* Storage the tensor borrows instead of owning, such as a mapped
+         * file: `data` or `lpdata` points into it, and it is released once
+         * the last tensor borrowing it is freed. NULL for owned storage. */
+        MTExternal *external;
+        /* The storage the tensor shares with other tensors, NULL while it
+         * has its data to itself. Shared data is copied before it is
+         * written, see mt_tensor_make_writable. */
+        MTStorage *storage;
+        /* An optional name, used as the key when saving tensors */
+        char *name;
+        /* The name of the op that produced the tensor, NULL for tensors
+         * created directly. Backward calls are profiled under it. */
+        const char *op;
+        /* Taken from the context's version clock when the tensor is created
+         * and whenever its data is updated in place, so that incremental
+         * checkpoints can tell which tensors changed since the last one */
+        long version;
 };
 
 /**
@@ -128,9 +301,16 @@ struct MTTensor {
 MTTensor *mt_alloc_empty_tensor(MTContext *ctx);
 MTTensor *mt_new_tensor(MTContext *context, float *data,
                         int *shape, int ndim);
+MTTensor *mt_tensor_from_buffer(MTContext *ctx, float *ptr, int *shape, int ndims,
+                                long *strides, void (*free_fn)(void *));
 MTTensor *mt_new_tensor_full(MTContext *context,
                              float val, int *shape,
                              int ndim);
+MTTensor *mt_new_tensor_dtype(MTContext *context, float *data,
+                              int *shape, int ndim, MtDtype dtype);
+MTTensor *mt_tensor_to_dtype(MTTensor *t, MtDtype dtype);
+MTTensor *mt_tensor_quantize(MTTensor *t, int axis);
+MTTensor *mt_tensor_dequantize(MTTensor *t);
 float     mt_tensor_get(MTTensor *t, int *idx, int ndims);
 float     mt_tensor_get_v(MTTensor *t);
 float     mt_tensor_get_1(MTTensor *t, int i);
@@ -160,16 +340,187 @@ MTTensor *mt_tensor_exp(MTTensor *t);
 MTTensor *mt_tensor_neg(MTTensor *t);
 MTTensor *mt_tensor_log(MTTensor *t);
 MTTensor *mt_tensor_relu(MTTensor *t);
+MTTensor *mt_tensor_tanh(MTTensor *t);
+MTTensor *mt_tensor_sigmoid(MTTensor *t);
 MTTensor *mt_tensor_transpose(MTTensor *t);
 
+/**
+ * Shared storage. mt_tensor_share returns a tensor sharing the data of `t`,
+ * and mt_tensor_reshape one sharing it under another shape with as many
+ * elements; neither copies the data. A tensor whose data is shared is
+ * copied on write: ops that update a tensor in place call
+ * mt_tensor_make_writable first, which gives it a copy of its own while
+ * other tensors share its data, and so must code that writes tensor data
+ * directly.
+ */
+MTTensor *mt_tensor_share(MTTensor *t);
+MTTensor *mt_tensor_reshape(MTTensor *t, int *shape, int ndims);
+void      mt_tensor_make_writable(MTTensor *t);
+
+/* Attention */
+MTTensor *mt_tensor_attention(MTTensor *q, MTTensor *k, MTTensor *v,
+                              MTTensor *mask, int causal);
+
+/* Selections along a dimension. Positions are returned as float, so `dim`
+ * may hold at most 2^24 entries. */
+MTTensor *mt_tensor_max(MTTensor *t, int dim, int keepdims, MTTensor **indices);
+MTTensor *mt_tensor_min(MTTensor *t, int dim, int keepdims, MTTensor **indices);
+MTTensor *mt_tensor_argmax(MTTensor *t, int dim, int keepdims);
+MTTensor *mt_tensor_argmin(MTTensor *t, int dim, int keepdims);
+MTTensor *mt_tensor_topk(MTTensor *t, int k, int dim, MTTensor **indices);
+
+/* Fused normalization and loss functions */
+MTTensor *mt_tensor_softmax(MTTensor *t, int dim);
+MTTensor *mt_tensor_log_softmax(MTTensor *t, int dim);
+MTTensor *mt_tensor_cross_entropy(MTTensor *logits, MTTensor *targets);
+MTTensor *mt_tensor_layer_norm(MTTensor *x, MTTensor *gamma, MTTensor *beta,
+                               float eps);
+MTTensor *mt_tensor_batch_norm(MTTensor *x, MTTensor *gamma, MTTensor *beta,
+                               MTTensor *running_mean, MTTensor *running_var,
+                               int training, float momentum, float eps);
+
+/* Sparse tensors */
+MTTensor *mt_sparse_from_dense(MTTensor *t);
+MTTensor *mt_sparse_from_coo(MTContext *ctx, int *rows, int *cols,
+                             float *vals, long nnz, int *shape);
+MTTensor *mt_sparse_to_dense(MTTensor *t);
+MTTensor *mt_tensor_spmm(MTTensor *a, MTTensor *b);
+
+/* Gather and embedding lookup. mt_tensor_gather takes its positions as a
+ * float index tensor, so the gathered dimension may hold at most 2^24
+ * slices; the int ids of mt_tensor_embedding index the table directly. */
+MTTensor *mt_tensor_gather(MTTensor *t, int dim, MTTensor *index);
+MTTensor *mt_tensor_embedding(MTTensor *table, int *ids, int nids);
+
+/* Quantized inference */
+MTTensor *mt_tensor_qmatmul(MTTensor *a, MTTensor *b, MTTensor *bias,
+                            float oscale, int ozero);
+
+/**
+ * Saving and loading. mt_save writes dense tensors into one file with their
+ * names, dtypes and shapes, every tensor's data aligned to 64 bytes.
+ * mt_load_mmap maps such a file and returns its tensors (`*n` of them, in a
+ * malloc'd array) with their data pointing into the mapping; pages are only
+ * read from disk when touched and are shared between processes until
+ * written. mt_save writes a new file and renames it over `path`, so the
+ * tensors loaded from a file can be saved back to it.
+ */
+void       mt_save(MTContext *ctx, const char *path, MTTensor **tensors, int n);
+MTTensor **mt_load_mmap(MTContext *ctx, const char *path, int *n);
+void       mt_tensor_set_name(MTTensor *t, const char *name);
+
+/**
+ * numpy (.npy) and safetensors files. The readers map the file and use the
+ * data in place when its dtype is float32, float16 or bfloat16 and it is
+ * aligned; other dtypes are converted to float32 and, like files that cannot
+ * be mapped, read in chunks into a preallocated tensor. As with
+ * mt_load_mmap, a mapped file must not be rewritten in place while its
+ * tensors are alive. Writers stream the tensors' data without buffering the
+ * file, into a new file renamed over `path`, so loaded tensors can be saved
+ * back to the file they came from.
+ */
+MTTensor  *mt_load_npy(MTContext *ctx, const char *path);
+void       mt_save_npy(MTTensor *t, const char *path);
+MTTensor **mt_load_safetensors(MTContext *ctx, const char *path, int *n);
+void       mt_save_safetensors(MTContext *ctx, const char *path, MTTensor **tensors, int n);
+
+/**
+ * Streaming datasets. A data loader reads samples of `shape` from a file of
+ * raw float32 records (DATA_FORMAT_BINARY) or of comma-separated lines, with
+ * an optional header line (DATA_FORMAT_CSV). A background thread parses up
+ * to `prefetch` batches of `batch_size` samples ahead into preallocated
+ * tensors of shape (batch_size, shape...). With `window` > 1 samples are
+ * drawn at random from a window of that many, seeded by `seed`.
+ *
+ * mt_dataloader_next returns the next batch, valid until the following call;
+ * the last batch of an epoch may be smaller. It returns NULL at the end of
+ * every epoch, after which the next epoch starts. Loaders must be freed
+ * before their context.
+ */
+MTDataLoader *mt_new_dataloader(MTContext *ctx, const char *path, MtDataFormat format,
+                                int *shape, int ndims, int batch_size, int prefetch,
+                                int window, unsigned long seed);
+MTTensor     *mt_dataloader_next(MTDataLoader *dl);
+void          mt_dataloader_free(MTDataLoader *dl);
+
+/**
+ * Checkpoints. mt_checkpoint_save_async copies `tensors` into a staging
+ * buffer and returns, leaving a background thread to write them to `path`
+ * in the format of mt_save. A save to the same path as the previous one,
+ * with the same names, dtypes and shapes, is incremental: only the tensors
+ * whose version changed since then are snapshotted, and written over a copy
+ * of the previous file (a reflink where the file system supports it). Every
+ * save goes to `path`.tmp and is renamed over `path` once on disk, so a
+ * crash leaves `path` holding a complete save, and tensors loaded from it
+ * keep their data. One save is in flight at a time;
+ * mt_checkpoint_wait blocks until it is on disk. Code that writes tensor
+ * data directly must call mt_tensor_bump_version for it to be saved.
+ */
+void mt_checkpoint_save_async(MTContext *ctx, const char *path, MTTensor **tensors, int n);
+void mt_checkpoint_wait(MTContext *ctx);
+void mt_tensor_bump_version(MTTensor *t);
+
+/**
+ * Profiling. Between mt_profiler_start and mt_profiler_stop, every op and
+ * every backward call on the context is recorded with its input and output
+ * shapes, wall time, bytes of tensor buffers requested and thread id. When
+ * the profiler is not recording an op costs one extra branch.
+ * mt_profiler_print prints a table of the events aggregated per op, and
+ * mt_profiler_write_trace writes them as a Chrome trace_event JSON file.
+ */
+void mt_profiler_start(MTContext *ctx);
+void mt_profiler_stop(MTContext *ctx);
+void mt_profiler_print(MTContext *ctx);
+void mt_profiler_write_trace(MTContext *ctx, const char *path);
+
+/**
+ * Memory plans for fixed-shape inference. mt_plan_compile runs `forward`
+ * once on `inputs` to trace the tensor buffers it requests and how long each
+ * is used: until it is freed, until the end of the op that created it, or
+ * until the end of the last op that reads it, while the outputs live to the
+ * end. Buffers whose lifetimes do not overlap are then given the same place
+ * in one workspace, the largest buffers first. mt_plan_run replays
+ * `forward` on inputs of the same shapes with every buffer taken from the
+ * workspace, so that a run allocates no tensor storage. The forward must be
+ * deterministic and pass intermediates only through ops: data of an
+ * intermediate it reads directly may already hold another tensor. Its
+ * outputs belong to the plan and stay valid until the next run. Plans must
+ * be freed before their context, and runs do not support backward.
+ */
+typedef struct {
+        /* bytes of the workspace, and of the buffers it holds when they
+         * are allocated separately */
+        long workspace_bytes;
+        long buffer_bytes;
+        long nbuffers;
+} MTPlanStats;
+
+MTPlan     *mt_plan_compile(MTContext *ctx, MTForwardFunc forward, MTTensor **inputs,
+                            int ninputs, int noutputs, void *user);
+void        mt_plan_run(MTPlan *plan, MTTensor **inputs, MTTensor **outputs);
+MTPlanStats mt_plan_get_stats(MTPlan *plan);
+void        mt_plan_free(MTPlan *plan);
+
+/* Convolution */
+MTTensor *mt_tensor_conv2d(MTTensor *input, MTTensor *weight, MTTensor *bias,
+                           int stride, int padding, int dilation);
+
 MTContext *mt_new_context(void);
 void       mt_context_free(MTContext *ctx);
 void       mt_tensor_enable_grad(MTTensor *t);
 void       mt_tensor_disable_grad(MTTensor *t);
 void       mt_tensor_backward(MTTensor *t, MTTensor *grad);
 void       mt_tensor_zero_grad(MTTensor *t);
+void       mt_tensor_enable_sparse_grad(MTTensor *t);
+void       mt_tensor_sgd_step(MTTensor *t, float lr);
 void       mt_tensor_print_debug(MTTensor *t);
 
+/* Contexts with a custom allocator, and their allocation statistics */
+MTContext   *mt_new_context_with_allocator(const MTAllocator *allocator);
+MTAllocStats mt_context_get_stats(MTContext *ctx);
+void         mt_context_set_pool_limit(MTContext *ctx, long bytes);
+void         mt_context_trim_pool(MTContext *ctx);
+
 /**
  * Internal API
  */
@@ -185,9 +536,18 @@ struct BcastResult {
         BcastStatus status;
 };
 
+/* Capacity of the per-dependency storage used by __mt_save_for_backward */
+#define MT_DEP_NSAVED 8
+#define MT_DEP_NARGS 8
+
 struct Dependency {
         MTTensor          *tensor;
         TensorBackwardFunc grad_fn;
+        /* Tensors and integer arguments the forward pass stashes for grad_fn,
+         * e.g., the targets of a loss function. Fused ops need these since
+         * grad_fn only receives the dependencies of the result. */
+        MTTensor *saved[MT_DEP_NSAVED];
+        long      args[MT_DEP_NARGS];
 };
 
 /**
@@ -209,7 +569,7 @@ void mt_context_push_tensor(MTContext *ctx, MTTensor *t);
  * strides and indices arrays (as arguments). This function modifies shape,
  * strides, and indices arguments.
  */
-void mt_squeeze_at_dim(int targetdim, int *shape, int *strides,
+void mt_squeeze_at_dim(int targetdim, int *shape, long *strides,
                        int **indices, int ndims);
 
 /**
@@ -219,6 +579,9 @@ void mt_context_defrag(MTContext *ctx);
 
 void mt_remove_intermediary_nodes(MTContext *ctx);
 
+/* Wait for the checkpoint in flight and release the checkpoint state of ctx */
+void mt_checkpoint_release(MTContext *ctx);
+
 /**
  * Access the tensor data with customized indices, shape, strides, and ndims
  * constraints. This is useful for especially to access data of a tensor
@@ -227,7 +590,7 @@ void mt_remove_intermediary_nodes(MTContext *ctx);
  * the other variables) to get the tensor data in a transposed order.
  */
 float *mt_tensor_get_all_data_constrained(MTTensor *t, int **indices,
-                                          int *shape, int *strides, int ndims);
+                                          int *shape, long *strides, int ndims);
 
 /* helper macros */
 /*  inline expression literal for stack-allocated array */
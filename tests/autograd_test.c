@@ -1,5 +1,6 @@
 #include <math.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "../minitensor.h"
 #include "test.h"
@@ -323,4 +324,318 @@ void run_autograd_relu_tests(Test *t) {
             "should be {0.5, 1, 1}");
 
         mt_context_free(ctx);
-}
\ No newline at end of file
+}
+void run_autograd_softmax_tests(Test *t) {
+        MTContext *ctx = mt_new_context();
+        MTTensor  *x   = mt_new_tensor(ctx, Arr(float, 1, 2, 3), Arr(int, 3), 1);
+        mt_tensor_enable_grad(x);
+
+        MTTensor *res = mt_tensor_softmax(x, 0);
+        mt_tensor_backward(res, mt_new_tensor(ctx, Arr(float, 1, 0, 0), Arr(int, 3), 1));
+        mt_assert_true(
+            t,
+            __mt_arrclose(x->grad->data, Arr(float, 0.08192507, -0.02203304, -0.05989202), 3, 1e-6),
+            "test grad softmax",
+            "should be {0.0819, -0.0220, -0.0599}");
+
+        /* log_softmax then sum: grad = 1 - n * softmax(x) */
+        mt_tensor_zero_grad(x);
+        res = mt_tensor_sum(mt_tensor_log_softmax(x, 0), -1, 0);
+        mt_tensor_backward(res, NULL);
+        mt_assert_true(
+            t,
+            __mt_arrclose(x->grad->data, Arr(float, 1 - 3 * 0.09003057, 1 - 3 * 0.24472847, 1 - 3 * 0.66524096), 3, 1e-6),
+            "test grad sum(log_softmax(x))",
+            "should be {0.730, 0.266, -0.996}");
+
+        /* cross-entropy grad is (softmax - onehot) / N */
+        MTTensor *logits  = mt_new_tensor(ctx, Arr(float, 1, 2, 3, 1, 2, 3), Arr(int, 2, 3), 2);
+        MTTensor *targets = mt_new_tensor(ctx, Arr(float, 2, 0), Arr(int, 2), 1);
+        mt_tensor_enable_grad(logits);
+        mt_tensor_backward(mt_tensor_cross_entropy(logits, targets), NULL);
+        mt_assert_true(
+            t,
+            __mt_arrclose(logits->grad->data,
+                          Arr(float, 0.0450153, 0.1223642, -0.1673795, -0.4549847, 0.1223642, 0.3326205),
+                          6, 1e-6),
+            "test grad cross-entropy",
+            "should be {{0.045, 0.122, -0.167}, {-0.455, 0.122, 0.333}}");
+
+        mt_context_free(ctx);
+}
+
+void run_autograd_conv2d_tests(Test *t) {
+        MTContext *ctx = mt_new_context();
+        MTTensor  *x   = mt_new_tensor(ctx, Arr(float, 1, 2, 3, 4, 5, 6, 7, 8, 9), Arr(int, 1, 1, 3, 3), 4);
+        MTTensor  *w   = mt_new_tensor_full(ctx, 1, Arr(int, 1, 1, 2, 2), 4);
+        MTTensor  *b   = mt_new_tensor(ctx, Arr(float, 1), Arr(int, 1), 1);
+        mt_tensor_enable_grad(x), mt_tensor_enable_grad(w), mt_tensor_enable_grad(b);
+
+        MTTensor *res = mt_tensor_conv2d(x, w, b, 1, 0, 1);
+        mt_tensor_backward(res, mt_new_tensor_full(ctx, 1, Arr(int, 1, 1, 2, 2), 4));
+        mt_assert_true(
+            t,
+            mt_is_tensor_eq(x->grad, mt_new_tensor(ctx, Arr(float, 1, 2, 1, 2, 4, 2, 1, 2, 1), Arr(int, 1, 1, 3, 3), 4)),
+            "test conv2d grad wrt input",
+            "should be {{1, 2, 1}, {2, 4, 2}, {1, 2, 1}}");
+        mt_assert_true(
+            t,
+            mt_is_tensor_eq(w->grad, mt_new_tensor(ctx, Arr(float, 12, 16, 24, 28), Arr(int, 1, 1, 2, 2), 4)),
+            "test conv2d grad wrt weight",
+            "should be {{12, 16}, {24, 28}}");
+        mt_assert_true(
+            t,
+            mt_is_tensor_eq(b->grad, mt_new_tensor(ctx, Arr(float, 4), Arr(int, 1), 1)),
+            "test conv2d grad wrt bias",
+            "should be {4}");
+
+        mt_context_free(ctx);
+}
+
+void run_autograd_tanh_sigmoid_tests(Test *t) {
+        MTContext *ctx = mt_new_context();
+        MTTensor  *x   = mt_new_tensor(ctx, Arr(float, -1, 0, 2), Arr(int, 3), 1);
+        mt_tensor_enable_grad(x);
+
+        mt_tensor_backward(mt_tensor_tanh(x), mt_new_tensor(ctx, Arr(float, 1, 1, 1), Arr(int, 3), 1));
+        mt_assert_true(
+            t,
+            __mt_arrclose(x->grad->data, Arr(float, 0.41997434, 1, 0.07065082), 3, 1e-6),
+            "test grad tanh",
+            "should be {0.420, 1, 0.071}");
+
+        mt_tensor_zero_grad(x);
+        mt_tensor_backward(mt_tensor_sigmoid(x), mt_new_tensor(ctx, Arr(float, 1, 1, 2), Arr(int, 3), 1));
+        mt_assert_true(
+            t,
+            __mt_arrclose(x->grad->data, Arr(float, 0.19661193, 0.25, 2 * 0.10499359), 3, 1e-6),
+            "test grad sigmoid",
+            "should be {0.197, 0.25, 0.210}");
+
+        mt_context_free(ctx);
+}
+
+void run_autograd_spmm_tests(Test *t) {
+        MTContext *ctx = mt_new_context();
+
+        MTTensor *a = mt_new_tensor(ctx, Arr(float, 0, 2, 0, 1, 0, 3), Arr(int, 2, 3), 2);
+        MTTensor *b = mt_new_tensor(ctx, Arr(float, 1, 2, 3, 4, 5, 6), Arr(int, 3, 2), 2);
+        mt_tensor_enable_grad(b);
+        MTTensor *z    = mt_tensor_spmm(mt_sparse_from_dense(a), b);
+        MTTensor *grad = mt_new_tensor(ctx, Arr(float, -1, -2, 1, 3), Arr(int, 2, 2), 2);
+        mt_tensor_backward(z, grad);
+
+        mt_assert_true(t, mt_is_tensor_eq(z, mt_tensor_matmul(a, b)), "test spmm forward", "-");
+        mt_assert_true(
+            t,
+            mt_is_tensor_eq(b->grad, mt_tensor_matmul(mt_tensor_transpose(a), grad)),
+            "test spmm grad",
+            "should be dense a^T * grad");
+
+        mt_context_free(ctx);
+}
+
+void run_autograd_embedding_tests(Test *t) {
+        MTContext *ctx = mt_new_context();
+
+        MTTensor *table = mt_new_tensor(ctx, Arr(float, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9), Arr(int, 5, 2), 2);
+        mt_tensor_enable_sparse_grad(table);
+        MTTensor *e = mt_tensor_embedding(table, Arr(int, 3, 1, 3), 3);
+        mt_tensor_backward(e, mt_new_tensor(ctx, Arr(float, 1, 2, 3, 4, 5, 6), Arr(int, 3, 2), 2));
+        mt_assert_true(t, table->grad->layout == LAYOUT_ROW_SPARSE && table->grad->datalen == 4 &&
+                              table->grad->rowidx[0] == 1 && table->grad->rowidx[1] == 3,
+                       "test embedding sparse grad", "should only hold rows 1 and 3");
+
+        /* a second lookup accumulates into the row-sparse gradient */
+        e = mt_tensor_embedding(table, Arr(int, 0, 1), 2);
+        mt_tensor_backward(e, mt_new_tensor(ctx, Arr(float, 1, 1, 1, 1), Arr(int, 2, 2), 2));
+        mt_assert_true(t,
+                       mt_is_tensor_eq(mt_sparse_to_dense(table->grad),
+                                       mt_new_tensor(ctx, Arr(float, 1, 1, 4, 5, 0, 0, 6, 8, 0, 0), Arr(int, 5, 2), 2)),
+                       "test embedding grad accumulation", "should merge the touched rows");
+
+        mt_tensor_sgd_step(table, 0.5);
+        mt_assert_true(t,
+                       mt_is_tensor_eq(table,
+                                       mt_new_tensor(ctx, Arr(float, -0.5, 0.5, 0, 0.5, 4, 5, 3, 3, 8, 9), Arr(int, 5, 2), 2)),
+                       "test sparse sgd step", "should only update the touched rows");
+
+        mt_tensor_zero_grad(table);
+        mt_assert_true(t, table->grad->layout == LAYOUT_ROW_SPARSE && table->grad->datalen == 0,
+                       "test sparse zero grad", "should stay row-sparse");
+
+        /* ids beyond 2^24, which a float index would round */
+        int       big   = (1 << 24) + 1;
+        MTTensor *large = mt_new_tensor_full(ctx, 0, Arr(int, big + 1, 1), 2);
+        large->data[big] = 7;
+        mt_tensor_enable_sparse_grad(large);
+        e = mt_tensor_embedding(large, Arr(int, big, big - 1), 2);
+        mt_tensor_backward(e, mt_new_tensor(ctx, Arr(float, 1, 2), Arr(int, 2, 1), 2));
+        mt_assert_true(t, e->data[0] == 7 && e->data[1] == 0 && large->grad->rowidx[0] == big - 1 &&
+                              large->grad->rowidx[1] == big && large->grad->data[1] == 1,
+                       "test embedding of large tables", "should index rows beyond 2^24 exactly");
+        mt_tensor_free(large);
+
+        /* gathering along another dimension gives a dense gradient */
+        MTTensor *x = mt_new_tensor(ctx, Arr(float, 1, 2, 3, 4, 5, 6), Arr(int, 2, 3), 2);
+        mt_tensor_enable_grad(x);
+        MTTensor *g = mt_tensor_gather(x, 1, mt_new_tensor(ctx, Arr(float, 2, 2), Arr(int, 2), 1));
+        mt_tensor_backward(g, mt_new_tensor(ctx, Arr(float, 1, 2, 3, 4), Arr(int, 2, 2), 2));
+        mt_assert_true(t, mt_is_tensor_eq(x->grad, mt_new_tensor(ctx, Arr(float, 0, 0, 3, 0, 0, 7), Arr(int, 2, 3), 2)),
+                       "test gather grad", "should scatter-add into column 2");
+
+        mt_context_free(ctx);
+}
+
+void run_autograd_max_topk_tests(Test *t) {
+        MTContext *ctx = mt_new_context();
+
+        MTTensor *x = mt_new_tensor(ctx, Arr(float, 1, 5, 2, 7, 0, 7), Arr(int, 2, 3), 2);
+        mt_tensor_enable_grad(x);
+        MTTensor *m = mt_tensor_max(x, 0, 0, NULL);
+        mt_tensor_backward(m, mt_new_tensor(ctx, Arr(float, 1, 2, 3), Arr(int, 3), 1));
+        mt_assert_true(t, mt_is_tensor_eq(x->grad, mt_new_tensor(ctx, Arr(float, 0, 2, 0, 1, 0, 3), Arr(int, 2, 3), 2)),
+                       "test max grad", "should flow to the maxima only");
+
+        MTTensor *y = mt_new_tensor(ctx, Arr(float, 4, 8, 6, 2), Arr(int, 4), 1);
+        mt_tensor_enable_grad(y);
+        MTTensor *k = mt_tensor_topk(y, 2, 0, NULL);
+        mt_tensor_backward(k, mt_new_tensor(ctx, Arr(float, 10, 20), Arr(int, 2), 1));
+        mt_assert_true(t, mt_is_tensor_eq(y->grad, mt_new_tensor(ctx, Arr(float, 0, 10, 20, 0), Arr(int, 4), 1)),
+                       "test topk grad", "should flow to the selected positions");
+
+        mt_context_free(ctx);
+}
+
+/* sum(norm(x) * w), the loss of the finite-difference checks below */
+float norm_loss(int batch, MTTensor *x, MTTensor *g, MTTensor *b, MTTensor *w) {
+        MTTensor *y    = batch ? mt_tensor_batch_norm(x, g, b, NULL, NULL, 1, 0, 1e-5)
+                               : mt_tensor_layer_norm(x, g, b, 1e-5);
+        float     loss = 0;
+        for (long i = 0; i < y->datalen; i++) loss += y->data[i] * w->data[i];
+        return loss;
+}
+
+/* Compare the gradient of every element of `p` with central differences */
+int norm_grad_close(int batch, MTTensor *p, MTTensor *x, MTTensor *g, MTTensor *b, MTTensor *w) {
+        int ok = 1;
+        for (long i = 0; i < p->datalen; i++) {
+                float v    = p->data[i], h = 1e-2;
+                p->data[i] = v + h;
+                float up   = norm_loss(batch, x, g, b, w);
+                p->data[i] = v - h;
+                float down = norm_loss(batch, x, g, b, w);
+                p->data[i] = v;
+                ok         = ok && fabs((up - down) / (2 * h) - p->grad->data[i]) < 2e-2;
+        }
+        return ok;
+}
+
+void run_autograd_norm_tests(Test *t) {
+        MTContext *ctx = mt_new_context();
+
+        for (int batch = 0; batch < 2; batch++) {
+                MTTensor *x = mt_new_tensor(ctx, Arr(float, 0.5, -1, 2, 0.3, 1.5, -0.7, 0.9, 2.2, -1.2, 0.1, 0.4, 1.1),
+                                            Arr(int, 2, 3, 2), 3);
+                int       c = batch ? 3 : 2;
+                MTTensor *g = mt_new_tensor(ctx, Arr(float, 1.5, 0.5, -1), Arr(int, c), 1);
+                MTTensor *b = mt_new_tensor(ctx, Arr(float, 0.1, -0.2, 0.3), Arr(int, c), 1);
+                MTTensor *w = mt_new_tensor(ctx, Arr(float, 1, -2, 0.5, 3, -1, 0.2, 2, 1, -0.5, -3, 0.7, 1.5),
+                                            Arr(int, 2, 3, 2), 3);
+                mt_tensor_enable_grad(x), mt_tensor_enable_grad(g), mt_tensor_enable_grad(b);
+                MTTensor *y = batch ? mt_tensor_batch_norm(x, g, b, NULL, NULL, 1, 0, 1e-5)
+                                    : mt_tensor_layer_norm(x, g, b, 1e-5);
+                mt_tensor_backward(y, w);
+
+                int ok = norm_grad_close(batch, x, x, g, b, w) && norm_grad_close(batch, g, x, g, b, w) &&
+                         norm_grad_close(batch, b, x, g, b, w);
+                mt_assert_true(t, ok, batch ? "test batch norm grads" : "test layer norm grads",
+                               "should match finite differences");
+        }
+
+        mt_context_free(ctx);
+}
+
+/* sum(attention(q, k, v) * w), the loss of the finite-difference check below */
+float attention_loss(MTTensor *q, MTTensor *k, MTTensor *v, MTTensor *m, MTTensor *w) {
+        MTTensor *y    = mt_tensor_attention(q, k, v, m, 1);
+        float     loss = 0;
+        for (long i = 0; i < y->datalen; i++) loss += y->data[i] * w->data[i];
+        return loss;
+}
+
+void run_autograd_attention_tests(Test *t) {
+        MTContext *ctx = mt_new_context();
+
+        /* two slices of 3 queries over 4 keys, causal and with a mask */
+        float     qd[24], kd[32], vd[24], wd[18];
+        for (int i = 0; i < 32; i++) kd[i] = cosf(i * 0.7f);
+        for (int i = 0; i < 24; i++) qd[i] = sinf(i * 0.9f), vd[i] = sinf(i * 0.5f + 1);
+        for (int i = 0; i < 18; i++) wd[i] = cosf(i * 1.3f);
+        MTTensor *q = mt_new_tensor(ctx, qd, Arr(int, 2, 3, 4), 3);
+        MTTensor *k = mt_new_tensor(ctx, kd, Arr(int, 2, 4, 4), 3);
+        MTTensor *v = mt_new_tensor(ctx, vd, Arr(int, 2, 4, 3), 3);
+        MTTensor *w = mt_new_tensor(ctx, wd, Arr(int, 2, 3, 3), 3);
+        MTTensor *m = mt_new_tensor(ctx, Arr(float, 0, 0.5, -1, 0, 0.2, 0, 0, 0, -0.3, 1, 0, 0), Arr(int, 3, 4), 2);
+        mt_tensor_enable_grad(q), mt_tensor_enable_grad(k), mt_tensor_enable_grad(v);
+        mt_tensor_backward(mt_tensor_attention(q, k, v, m, 1), w);
+
+        int       ok = 1;
+        MTTensor *ps[3] = {q, k, v};
+        for (int p = 0; p < 3; p++)
+                for (long i = 0; i < ps[p]->datalen; i++) {
+                        float x = ps[p]->data[i], h = 1e-2;
+                        ps[p]->data[i] = x + h;
+                        float up       = attention_loss(q, k, v, m, w);
+                        ps[p]->data[i] = x - h;
+                        float down     = attention_loss(q, k, v, m, w);
+                        ps[p]->data[i] = x;
+                        ok             = ok && fabs((up - down) / (2 * h) - ps[p]->grad->data[i]) < 1e-2;
+                }
+        mt_assert_true(t, ok, "test attention grads", "should match finite differences");
+
+        /* only the operands that require grad receive one */
+        MTTensor *k2 = mt_new_tensor(ctx, kd, Arr(int, 2, 4, 4), 3);
+        mt_tensor_enable_grad(k2);
+        mt_tensor_backward(mt_tensor_attention(mt_new_tensor(ctx, qd, Arr(int, 2, 3, 4), 3), k2,
+                                               mt_new_tensor(ctx, vd, Arr(int, 2, 4, 3), 3), m, 1),
+                           w);
+        mt_assert_true(t, mt_is_tensor_eq(k2->grad, k->grad), "test attention grad of k alone",
+                       "should equal the grad computed alongside q and v");
+
+        mt_context_free(ctx);
+}
+
+void run_autograd_profiler_tests(Test *t) {
+        MTContext *ctx = mt_new_context();
+        MTTensor  *x   = mt_new_tensor(ctx, Arr(float, 1, 2, 3, 4, 5, 6), Arr(int, 2, 3), 2);
+        MTTensor  *w   = mt_new_tensor(ctx, Arr(float, 1, -1, 2, 0, 1, 1), Arr(int, 3, 2), 2);
+        mt_tensor_enable_grad(w);
+
+        mt_profiler_start(ctx);
+        MTTensor *y    = mt_tensor_matmul(x, w);
+        MTTensor *loss = mt_tensor_sum(mt_tensor_relu(y), -1, 0);
+        mt_tensor_backward(loss, NULL);
+        mt_profiler_stop(ctx);
+        mt_tensor_matmul(x, w);
+
+        mt_profiler_write_trace(ctx, "mt_test_trace.json");
+        FILE *f = fopen("mt_test_trace.json", "r");
+        char  buf[8192];
+        size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+        fclose(f);
+        buf[n] = '\0';
+        remove("mt_test_trace.json");
+
+        int matmuls = 0;
+        for (char *p = buf; (p = strstr(p, "\"name\": \"matmul\"")) != NULL; p++) matmuls++;
+        mt_assert_true(t, y->op != NULL && !strcmp(y->op, "matmul") && matmuls == 1,
+                       "test profiler ops", "should record each op while started, and only then");
+        mt_assert_true(t, strstr(buf, "\"name\": \"matmul.backward\"") != NULL &&
+                              strstr(buf, "\"name\": \"relu.backward\"") != NULL &&
+                              strstr(buf, "\"shapes\": \"[2,3] [3,2] -> [2,2]\"") != NULL &&
+                              strstr(buf, "\"ph\": \"X\"") != NULL,
+                       "test profiler trace", "should write backward calls and shapes as trace events");
+
+        mt_context_free(ctx);
+}
@@ -1,5 +1,9 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "../minitensor.h"
 #include "test.h"
@@ -29,6 +33,13 @@ void run_tensor_creation_tests(Test *t) {
         mt_assert_true(t, x->strides[0] == 3, "test 1st stride of (3,3) tensor", "1st stride must be 3");
         mt_assert_true(t, x->strides[1] == 1, "test 2nd stride of (3,3) tensor", "2nd stride must be 1");
 
+        // data buffers are 64-byte aligned, huge-page backed ones included
+        mt_assert_true(t, (uintptr_t)x->data % 64 == 0, "test data alignment", "data must be 64-byte aligned");
+        ctx->hugepages = HUGEPAGES_HUGETLB;
+        MTTensor *big  = mt_new_tensor_full(ctx, 2, Arr(int, 1024, 2048), 2);
+        mt_assert_true(t, (uintptr_t)big->data % 64 == 0 && big->data[big->datalen - 1] == 2,
+                       "test huge-page backed tensor", "should fall back when no huge pages are reserved");
+
         mt_context_free(ctx);
 }
 
@@ -70,6 +81,52 @@ void run_tensor_slice_tests(Test *t) {
         mt_context_free(ctx);
 }
 
+void run_tensor_nd_tests(Test *t) {
+        MTContext *ctx = mt_new_context();
+
+        /* a (2, 3, 4, 5) tensor holding 1000a + 100b + 10c + d at (a, b, c, d) */
+        float data[120];
+        for (int i = 0; i < 120; i++) data[i] = i / 60 * 1000 + i / 20 % 3 * 100 + i / 5 % 4 * 10 + i % 5;
+        MTTensor *x = mt_new_tensor(ctx, data, Arr(int, 2, 3, 4, 5), 4);
+        mt_assert_true(t, mt_tensor_get(x, Arr(int, 1, 2, 3, 4), 4) == 1234, "test getval from 4-tensor", "the value should be 1234");
+
+        MTTensor *s  = mt_tensor_slice(ctx, x, 2, Arr(int, 3, 1), 2);
+        int       ok = s->shape[2] == 2;
+        for (int a = 0; a < 2; a++)
+                for (int b = 0; b < 3; b++)
+                        for (int d = 0; d < 5; d++)
+                                ok = ok && mt_tensor_get(s, Arr(int, a, b, 1, d), 4) == 1000 * a + 100 * b + 10 + d;
+        mt_assert_true(t, ok, "test slice 4-tensor", "should pick the indices along the sliced dimension");
+
+        MTTensor *tr = mt_tensor_transpose(x);
+        mt_assert_true(t, tr->shape[0] == 5 && tr->shape[3] == 2 &&
+                              mt_tensor_get(tr, Arr(int, 4, 3, 2, 1), 4) == 1234 &&
+                              mt_tensor_get(tr, Arr(int, 1, 0, 2, 0), 4) == 201,
+                       "test transpose 4-tensor", "should reverse the dimensions");
+
+        /* (2, 1, 4, 1, 3) + (3, 1, 2, 1) broadcasts to (2, 3, 4, 2, 3) */
+        float ld[24], rd[6];
+        for (int i = 0; i < 24; i++) ld[i] = i;
+        for (int i = 0; i < 6; i++) rd[i] = 100 * i;
+        MTTensor *sum = mt_tensor_add(mt_new_tensor(ctx, ld, Arr(int, 2, 1, 4, 1, 3), 5),
+                                      mt_new_tensor(ctx, rd, Arr(int, 3, 1, 2, 1), 4));
+        ok            = sum->ndims == 5 && sum->datalen == 144;
+        for (int a = 0; a < 2; a++)
+                for (int b = 0; b < 3; b++)
+                        for (int c = 0; c < 4; c++)
+                                for (int d = 0; d < 2; d++)
+                                        for (int e = 0; e < 3; e++)
+                                                ok = ok && mt_tensor_get(sum, Arr(int, a, b, c, d, e), 5) ==
+                                                               ld[a * 12 + c * 3 + e] + rd[b * 2 + d];
+        mt_assert_true(t, ok, "test broadcast 5-tensor", "should replicate along unit dimensions");
+
+        MTTensor *red = mt_tensor_sum(x, 1, 0);
+        mt_assert_true(t, red->ndims == 3 && mt_tensor_get(red, Arr(int, 1, 2, 3), 3) == 3 * 1023 + 300,
+                       "test sum of 4-tensor", "should reduce the middle dimension");
+
+        mt_context_free(ctx);
+}
+
 void f(int *arr) {
 }
 
@@ -99,6 +156,505 @@ void run_context_tests(Test *t) {
         mt_context_free(ctx);
 }
 
+/* An allocator that counts the calls made to it through its user pointer */
+void *counting_alloc(void *user, size_t size, size_t align) {
+        ((long *)user)[0]++;
+        void *p = NULL;
+        return posix_memalign(&p, align, size) == 0 ? p : NULL;
+}
+
+void *counting_realloc(void *user, void *ptr, size_t oldsize, size_t newsize) {
+        ((long *)user)[1]++;
+        return realloc(ptr, newsize);
+}
+
+void counting_free(void *user, void *ptr, size_t size) {
+        ((long *)user)[2]++;
+        free(ptr);
+}
+
+void run_allocator_tests(Test *t) {
+        long        calls[3] = {0, 0, 0};
+        MTAllocator a        = {counting_alloc, counting_realloc, counting_free, calls};
+        MTContext  *ctx      = mt_new_context_with_allocator(&a);
+
+        MTAllocStats s0 = mt_context_get_stats(ctx);
+        MTTensor    *x  = mt_new_tensor_full(ctx, 1, Arr(int, 100, 10), 2);
+        MTAllocStats s1 = mt_context_get_stats(ctx);
+        mt_assert_true(t, calls[0] == s1.nallocs && s1.live_bytes - s0.live_bytes >= 4000 &&
+                              s1.histogram[12] - s0.histogram[12] == 1,
+                       "test allocator stats", "should count the tensor data through the custom allocator");
+
+        for (int i = 0; i < 20; i++) mt_new_scalar(ctx, i);
+        mt_tensor_free(x);
+        MTAllocStats s2 = mt_context_get_stats(ctx);
+        mt_assert_true(t, calls[1] > 0 && s2.nreallocs == calls[1] && s2.peak_bytes >= s1.live_bytes &&
+                              s2.cached_bytes >= 4096 && s2.nfrees == calls[2],
+                       "test allocator stats after free", "should track reallocs, frees and the pool");
+
+        mt_context_free(ctx);
+        mt_assert_true(t, calls[0] == calls[2], "test allocator balance", "every allocation should be freed");
+}
+
+/* One step of a toy training loop, whose buffers are all freed afterwards */
+void pool_step(MTContext *ctx, MTTensor *w) {
+        MTTensor *x    = mt_new_tensor_full(ctx, 0.5, Arr(int, 32, 16), 2);
+        MTTensor *loss = mt_tensor_sum(mt_tensor_relu(mt_tensor_matmul(x, w)), 0, 0);
+        mt_tensor_backward(loss, mt_new_tensor_full(ctx, 1, Arr(int, 8), 1));
+        mt_tensor_zero_grad(w);
+        for (int i = 0; i < ctx->ntracked; i++)
+                if (ctx->tracked[i] != w && ctx->tracked[i] != w->grad) mt_tensor_free(ctx->tracked[i]);
+        mt_context_defrag(ctx);
+}
+
+void run_pool_tests(Test *t) {
+        MTContext *ctx = mt_new_context();
+        MTTensor  *w   = mt_new_tensor_full(ctx, 0.1, Arr(int, 16, 8), 2);
+        mt_tensor_enable_grad(w);
+
+        pool_step(ctx, w), pool_step(ctx, w);
+        MTAllocStats s0 = mt_context_get_stats(ctx);
+        for (int i = 0; i < 5; i++) pool_step(ctx, w);
+        MTAllocStats s1 = mt_context_get_stats(ctx);
+        mt_assert_true(t, s1.nallocs == s0.nallocs && s1.pool_hits > s0.pool_hits,
+                       "test pool steady state", "should serve every buffer from the pool");
+
+        mt_context_trim_pool(ctx);
+        MTAllocStats s2 = mt_context_get_stats(ctx);
+        mt_assert_true(t, s2.cached_bytes == 0 && s2.live_bytes < s1.live_bytes,
+                       "test pool trim", "should release the cached buffers");
+
+        mt_context_set_pool_limit(ctx, 0);
+        pool_step(ctx, w);
+        MTAllocStats s3 = mt_context_get_stats(ctx);
+        mt_assert_true(t, s3.cached_bytes == 0 && s3.nallocs > s2.nallocs,
+                       "test pool limit", "should not cache past the limit");
+
+        mt_context_free(ctx);
+}
+
+void run_serialization_tests(Test *t) {
+        MTContext *ctx = mt_new_context();
+        MTTensor  *a   = mt_new_tensor(ctx, Arr(float, 1, 2, 3, 4, 5, 6), Arr(int, 2, 3), 2);
+        MTTensor  *b   = mt_new_tensor_dtype(ctx, Arr(float, 0.5, -2, 8), Arr(int, 3), 1, DTYPE_BFLOAT16);
+        MTTensor  *q   = mt_tensor_quantize(a, 0);
+        MTTensor  *s   = mt_new_scalar(ctx, 42);
+        mt_tensor_set_name(a, "weight");
+        mt_tensor_set_name(q, "weight.q");
+        mt_save(ctx, "mt_save_test.bin", Arr(MTTensor *, a, b, q, s), 4);
+
+        int        n;
+        MTTensor **ld = mt_load_mmap(ctx, "mt_save_test.bin", &n);
+        mt_assert_true(t, n == 4 && !strcmp(ld[0]->name, "weight") && !strcmp(ld[1]->name, "1") &&
+                              !strcmp(ld[2]->name, "weight.q"),
+                       "test load names", "should keep names and number the unnamed tensors");
+        mt_assert_true(t, mt_is_tensor_eq(ld[0], a) && mt_is_tensor_eq(ld[1], b) && mt_is_tensor_eq(ld[2], q) &&
+                              mt_is_tensor_eq(ld[3], s),
+                       "test load contents", "should round-trip every dtype and shape");
+        mt_assert_true(t, (uintptr_t)ld[0]->data % 64 == 0 && (uintptr_t)ld[1]->lpdata % 64 == 0 &&
+                              mt_is_tensor_eq(mt_tensor_add(ld[0], ld[0]), mt_tensor_add(a, a)),
+                       "test load mapped data", "should be aligned and usable by kernels");
+
+        /* writes go to a private copy of the page, not to the file */
+        ld[0]->data[0] = 100;
+        int        m;
+        MTTensor **again = mt_load_mmap(ctx, "mt_save_test.bin", &m);
+        mt_assert_true(t, again[0]->data[0] == 1, "test load private mapping", "should leave the file intact");
+
+        /* saving loaded tensors back to their file leaves their mapping alone */
+        mt_save(ctx, "mt_save_test.bin", ld, n);
+        MTTensor **saved = mt_load_mmap(ctx, "mt_save_test.bin", &m);
+        mt_assert_true(t, m == 4 && saved[0]->data[0] == 100 && mt_is_tensor_eq(saved[2], q) &&
+                              mt_is_tensor_eq(again[3], s) && mt_is_tensor_eq(ld[1], b),
+                       "test save over loaded file", "should replace the file without touching the old mapping");
+
+        free(ld), free(again), free(saved);
+        remove("mt_save_test.bin");
+        mt_context_free(ctx);
+}
+
+static void write_file(const char *path, const void *head, size_t hlen, const void *data, size_t dlen) {
+        FILE *f = fopen(path, "wb");
+        fwrite(head, 1, hlen, f);
+        fwrite(data, 1, dlen, f);
+        fclose(f);
+}
+
+void run_foreign_format_tests(Test *t) {
+        MTContext *ctx = mt_new_context();
+        MTTensor  *e   = mt_new_tensor(ctx, Arr(float, 1, 2, 3, 4, 5, 6), Arr(int, 2, 3), 2);
+
+        /* npy headers as numpy writes them: padded so the data starts at 128 */
+        char npy[128];
+        memcpy(npy, "\x93NUMPY\x01\x00\x76\x00", 10);
+        int len = snprintf(npy + 10, 118, "{'descr': '<f4', 'fortran_order': False, 'shape': (2, 3), }");
+        memset(npy + 10 + len, ' ', 117 - len), npy[127] = '\n';
+        write_file("mt_test.npy", npy, 128, Arr(float, 1, 2, 3, 4, 5, 6), 6 * sizeof(float));
+        MTTensor *x = mt_load_npy(ctx, "mt_test.npy");
+        mt_assert_true(t, mt_is_tensor_eq(x, e) && x->external != NULL, "test npy load",
+                       "should map float32 data in place");
+
+        len = snprintf(npy + 10, 118, "{'descr': '<i4', 'fortran_order': True, 'shape': (2, 3), }");
+        memset(npy + 10 + len, ' ', 117 - len);
+        write_file("mt_test_i4.npy", npy, 128, Arr(int32_t, 1, 4, 2, 5, 3, 6), 6 * sizeof(int32_t));
+        MTTensor *y = mt_load_npy(ctx, "mt_test_i4.npy");
+        mt_assert_true(t, mt_is_tensor_eq(y, e) && y->external == NULL, "test npy convert",
+                       "should read int32 column-major data into row-major float32");
+
+        MTTensor *b = mt_tensor_to_dtype(e, DTYPE_BFLOAT16);
+        mt_save_npy(b, "mt_test_bf16.npy");
+        MTTensor *bl = mt_load_npy(ctx, "mt_test_bf16.npy");
+        MTTensor *h  = mt_tensor_to_dtype(mt_new_tensor(ctx, Arr(float, 0.5, -2), Arr(int, 2), 1), DTYPE_FLOAT16);
+        mt_save_npy(h, "mt_test_f16.npy");
+        MTTensor *hl = mt_load_npy(ctx, "mt_test_f16.npy");
+        mt_assert_true(t, mt_is_tensor_eq(bl, e) && bl->dtype == DTYPE_FLOAT32 && mt_is_tensor_eq(hl, h) &&
+                              hl->dtype == DTYPE_FLOAT16,
+                       "test npy round trip", "should keep float16 and widen bfloat16");
+        mt_save_npy(x, "mt_test.npy");
+        mt_save_npy(hl, "mt_test_f16.npy");
+        mt_assert_true(t, mt_is_tensor_eq(mt_load_npy(ctx, "mt_test.npy"), e) && mt_is_tensor_eq(x, e) &&
+                              mt_is_tensor_eq(mt_load_npy(ctx, "mt_test_f16.npy"), h) && mt_is_tensor_eq(hl, h),
+                       "test npy save over loaded file", "should replace the file without touching the old mapping");
+        remove("mt_test.npy"), remove("mt_test_i4.npy"), remove("mt_test_bf16.npy"), remove("mt_test_f16.npy");
+
+        MTTensor *q = mt_tensor_quantize(e, 0);
+        mt_tensor_set_name(e, "w\"1");
+        mt_save_safetensors(ctx, "mt_test.safetensors", Arr(MTTensor *, h, e, q), 3);
+        int        n;
+        MTTensor **ld = mt_load_safetensors(ctx, "mt_test.safetensors", &n);
+        mt_assert_true(t, n == 3 && !strcmp(ld[0]->name, "w\"1") && !strcmp(ld[1]->name, "2") &&
+                              !strcmp(ld[2]->name, "0"),
+                       "test safetensors names", "should keep names, widest dtypes first");
+        mt_assert_true(t, mt_is_tensor_eq(ld[0], e) && mt_is_tensor_eq(ld[1], mt_tensor_dequantize(q)) &&
+                              mt_is_tensor_eq(ld[2], h) && ld[0]->external != NULL && ld[2]->external != NULL,
+                       "test safetensors round trip", "should map the data in place");
+        mt_save_safetensors(ctx, "mt_test.safetensors", ld, n);
+        MTTensor **again = mt_load_safetensors(ctx, "mt_test.safetensors", &n);
+        mt_assert_true(t, n == 3 && mt_is_tensor_eq(again[0], e) && mt_is_tensor_eq(again[2], h) &&
+                              mt_is_tensor_eq(ld[0], e) && mt_is_tensor_eq(ld[2], h),
+                       "test safetensors save over loaded file",
+                       "should replace the file without touching the old mapping");
+        free(ld), free(again);
+
+        /* a file from elsewhere: metadata, integers and a misaligned float32 tensor */
+        char     file[256];
+        uint64_t hl64 = snprintf(file + 8, sizeof(file) - 8, "%s%s",
+                                 "{\"__metadata__\":{\"format\":\"pt\"},\"i\":{\"dtype\":\"U8\",\"shape\":[2],"
+                                 "\"data_offsets\":[0,2]},",
+                                 "\"f\":{\"shape\":[2],\"dtype\":\"F32\",\"data_offsets\":[2,10]}}");
+        memcpy(file, &hl64, 8);
+        unsigned char data[10] = {7, 255};
+        memcpy(data + 2, Arr(float, 1.5, -3), 8);
+        write_file("mt_test_ext.safetensors", file, 8 + hl64, data, sizeof(data));
+        ld = mt_load_safetensors(ctx, "mt_test_ext.safetensors", &n);
+        mt_assert_true(t, n == 2 && mt_is_tensor_eq(ld[0], mt_new_tensor(ctx, Arr(float, 7, 255), Arr(int, 2), 1)) &&
+                              mt_is_tensor_eq(ld[1], mt_new_tensor(ctx, Arr(float, 1.5, -3), Arr(int, 2), 1)),
+                       "test safetensors convert", "should convert integers and read misaligned data");
+        free(ld);
+        remove("mt_test.safetensors"), remove("mt_test_ext.safetensors");
+        mt_context_free(ctx);
+}
+
+void run_dataloader_tests(Test *t) {
+        MTContext *ctx = mt_new_context();
+        float      samples[20];
+        for (int i = 0; i < 10; i++) samples[2 * i] = i, samples[2 * i + 1] = i + 0.5;
+        write_file("mt_test_data.bin", samples, sizeof(samples), "", 0);
+
+        /* 10 samples in batches of 4: 4, 4, 2, end of epoch, then over again */
+        MTDataLoader *dl = mt_new_dataloader(ctx, "mt_test_data.bin", DATA_FORMAT_BINARY, Arr(int, 2), 1, 4, 2, 0, 0);
+        int           ok = 1, sizes[4] = {4, 4, 2, 0};
+        for (int epoch = 0; epoch < 2; epoch++)
+                for (int b = 0, seen = 0; b < 4; b++) {
+                        MTTensor *x = mt_dataloader_next(dl);
+                        ok          = ok && (x == NULL) == (sizes[b] == 0);
+                        if (x == NULL) continue;
+                        ok = ok && x->ndims == 2 && x->shape[0] == sizes[b] && x->shape[1] == 2 &&
+                             !memcmp(x->data, samples + 2 * seen, sizeof(float) * x->datalen);
+                        seen += x->shape[0];
+                }
+        mt_assert_true(t, ok, "test dataloader batches", "should stream the file in order, epoch after epoch");
+        mt_dataloader_free(dl);
+
+        /* freeing what the context tracks leaves the ring of the loader alone */
+        dl = mt_new_dataloader(ctx, "mt_test_data.bin", DATA_FORMAT_BINARY, Arr(int, 2), 1, 4, 2, 0, 0);
+        ok = 1;
+        for (int b = 0, seen = 0; b < 3; b++) {
+                mt_remove_intermediary_nodes(ctx);
+                MTTensor *x = mt_dataloader_next(dl);
+                ok          = ok && x != NULL && x->shape[0] == sizes[b] &&
+                     !memcmp(x->data, samples + 2 * seen, sizeof(float) * x->datalen);
+                seen += sizes[b];
+        }
+        mt_assert_true(t, ok, "test dataloader ownership", "should keep its batches when the context is cleared");
+        mt_dataloader_free(dl);
+
+        /* a batch shared by the caller survives the refill of its slot */
+        dl              = mt_new_dataloader(ctx, "mt_test_data.bin", DATA_FORMAT_BINARY, Arr(int, 2), 1, 4, 1, 0, 0);
+        MTTensor *first = mt_tensor_share(mt_dataloader_next(dl));
+        mt_dataloader_next(dl), mt_dataloader_next(dl);
+        mt_assert_true(t, first->shape[0] == 4 && !memcmp(first->data, samples, sizeof(float) * first->datalen),
+                       "test dataloader copy on write", "should not overwrite batches shared by the caller");
+        mt_dataloader_free(dl);
+
+        /* shuffling visits every sample once per epoch, out of order */
+        dl          = mt_new_dataloader(ctx, "mt_test_data.bin", DATA_FORMAT_BINARY, Arr(int, 2), 1, 3, 1, 5, 42);
+        int seen[10] = {0}, inorder = 1, k = 0;
+        for (MTTensor *x; (x = mt_dataloader_next(dl)) != NULL;)
+                for (int i = 0; i < x->shape[0]; i++, k++) {
+                        int s = x->data[2 * i];
+                        seen[s] += x->data[2 * i + 1] == s + 0.5;
+                        inorder = inorder && s == k;
+                }
+        ok = k == 10 && !inorder;
+        for (int i = 0; i < 10; i++) ok = ok && seen[i] == 1;
+        mt_assert_true(t, ok, "test dataloader shuffle", "should yield a permutation of the samples");
+        mt_dataloader_free(dl);
+
+        const char *csv = "x,y,z\n1,2,3\n\n4, 5, 6\r\n7,8,9";
+        write_file("mt_test_data.csv", csv, strlen(csv), "", 0);
+        dl           = mt_new_dataloader(ctx, "mt_test_data.csv", DATA_FORMAT_CSV, Arr(int, 3), 1, 2, 3, 0, 0);
+        MTTensor *b1 = mt_dataloader_next(dl);
+        ok           = mt_is_tensor_eq(b1, mt_new_tensor(ctx, Arr(float, 1, 2, 3, 4, 5, 6), Arr(int, 2, 3), 2));
+        MTTensor *b2 = mt_dataloader_next(dl);
+        ok           = ok && mt_is_tensor_eq(b2, mt_new_tensor(ctx, Arr(float, 7, 8, 9), Arr(int, 1, 3), 2));
+        mt_assert_true(t, ok && mt_dataloader_next(dl) == NULL, "test dataloader CSV",
+                       "should skip the header and blank lines");
+        mt_dataloader_free(dl);
+
+        remove("mt_test_data.bin"), remove("mt_test_data.csv");
+        mt_context_free(ctx);
+}
+
+static void *buffer_released;
+static void  buffer_release(void *p) { buffer_released = p, free(p); }
+
+void run_buffer_tests(Test *t) {
+        MTContext *ctx = mt_new_context();
+        float     *buf = malloc(6 * sizeof(float));
+        for (int i = 0; i < 6; i++) buf[i] = i + 1;
+        MTTensor *x = mt_tensor_from_buffer(ctx, buf, Arr(int, 2, 3), 2, NULL, buffer_release);
+        MTTensor *e = mt_new_tensor(ctx, Arr(float, 1, 2, 3, 4, 5, 6), Arr(int, 2, 3), 2);
+        mt_assert_true(t, x->data == buf && mt_is_tensor_eq(mt_tensor_add(x, x), mt_tensor_add(e, e)),
+                       "test buffer wrap", "should use the buffer in place");
+        mt_tensor_free(x);
+        mt_assert_true(t, buffer_released == buf, "test buffer release", "should hand the buffer to free_fn");
+
+        /* a column-major view is gathered, and the borrowed buffer released at once */
+        float *col = malloc(6 * sizeof(float));
+        memcpy(col, Arr(float, 1, 4, 2, 5, 3, 6), 6 * sizeof(float));
+        MTTensor *y = mt_tensor_from_buffer(ctx, col, Arr(int, 2, 3), 2, Arr(long, 1, 2), buffer_release);
+        mt_assert_true(t, mt_is_tensor_eq(y, e) && buffer_released == col, "test strided buffer",
+                       "should gather into row-major order");
+
+        /* without free_fn the memory stays with the caller */
+        float     stack[3] = {7, 8, 9};
+        MTTensor *z        = mt_tensor_from_buffer(ctx, stack, Arr(int, 3), 1, Arr(long, 1), NULL);
+        z->data[0]         = 0;
+        mt_tensor_free(z);
+        mt_assert_true(t, stack[0] == 0 && buffer_released == col, "test borrowed buffer",
+                       "should write through and not release");
+
+        mt_context_free(ctx);
+}
+
+void run_checkpoint_tests(Test *t) {
+        MTContext *ctx = mt_new_context();
+        MTTensor  *w   = mt_new_tensor(ctx, Arr(float, 1, 2, 3), Arr(int, 3), 1);
+        MTTensor  *b   = mt_new_tensor(ctx, Arr(float, 10, 20), Arr(int, 2), 1);
+        mt_tensor_enable_grad(w);
+        for (int i = 0; i < 3; i++) w->grad->data[i] = 1;
+
+        /* the tensors are snapshotted when the save starts */
+        mt_checkpoint_save_async(ctx, "mt_test.ckpt", Arr(MTTensor *, w, b), 2);
+        w->data[0] = 100;
+        mt_checkpoint_wait(ctx);
+        int        n;
+        MTTensor **ld = mt_load_mmap(ctx, "mt_test.ckpt", &n);
+        mt_assert_true(t, n == 2 && ld[0]->data[0] == 1 && mt_is_tensor_eq(ld[1], b), "test checkpoint snapshot",
+                       "should save the tensors as they were when the save started");
+        free(ld);
+
+        /* an incremental save only writes the tensors updated since the last one */
+        MTTensor **old = mt_load_mmap(ctx, "mt_test.ckpt", &n);
+        mt_tensor_sgd_step(w, 0.5);
+        b->data[0] = -1;
+        mt_checkpoint_save_async(ctx, "mt_test.ckpt", Arr(MTTensor *, w, b), 2);
+        mt_checkpoint_wait(ctx);
+        ld = mt_load_mmap(ctx, "mt_test.ckpt", &n);
+        mt_assert_true(t, mt_is_tensor_eq(ld[0], w) && ld[1]->data[0] == 10, "test incremental checkpoint",
+                       "should skip the tensors whose version did not change");
+        mt_assert_true(t, old[0]->data[0] == 1 && old[0]->data[2] == 3 && access("mt_test.ckpt.tmp", F_OK) != 0,
+                       "test incremental checkpoint replace",
+                       "should write a new file and leave the mapping of the previous one alone");
+        free(ld), free(old);
+
+        mt_tensor_bump_version(b);
+        mt_checkpoint_save_async(ctx, "mt_test.ckpt", Arr(MTTensor *, w, b), 2);
+        mt_checkpoint_wait(ctx);
+        ld = mt_load_mmap(ctx, "mt_test.ckpt", &n);
+        mt_assert_true(t, mt_is_tensor_eq(ld[0], w) && mt_is_tensor_eq(ld[1], b), "test checkpoint version bump",
+                       "should save directly written tensors once their version is bumped");
+        free(ld);
+
+        /* a different set of tensors rewrites the whole file */
+        mt_checkpoint_save_async(ctx, "mt_test.ckpt", Arr(MTTensor *, b, w, w->grad), 3);
+        mt_checkpoint_wait(ctx);
+        ld = mt_load_mmap(ctx, "mt_test.ckpt", &n);
+        mt_assert_true(t, n == 3 && mt_is_tensor_eq(ld[0], b) && mt_is_tensor_eq(ld[1], w) &&
+                              mt_is_tensor_eq(ld[2], w->grad),
+                       "test full checkpoint", "should rewrite the file when the tensors change");
+        free(ld);
+
+        /* the running statistics of a batch norm are updated in place */
+        MTTensor *rm = mt_new_tensor(ctx, Arr(float, 0, 0), Arr(int, 2), 1);
+        MTTensor *rv = mt_new_tensor(ctx, Arr(float, 1, 1), Arr(int, 2), 1);
+        mt_checkpoint_save_async(ctx, "mt_test.ckpt", Arr(MTTensor *, rm, rv), 2);
+        mt_checkpoint_wait(ctx);
+        mt_tensor_batch_norm(mt_new_tensor(ctx, Arr(float, 1, 2, 3, 6), Arr(int, 2, 2), 2), NULL, NULL, rm, rv,
+                             1, 0.5, 1e-5);
+        mt_checkpoint_save_async(ctx, "mt_test.ckpt", Arr(MTTensor *, rm, rv), 2);
+        mt_checkpoint_wait(ctx);
+        ld = mt_load_mmap(ctx, "mt_test.ckpt", &n);
+        mt_assert_true(t, rm->data[0] != 0 && mt_is_tensor_eq(ld[0], rm) && mt_is_tensor_eq(ld[1], rv),
+                       "test checkpoint running statistics", "should save the statistics batch norm updated");
+        free(ld);
+
+        remove("mt_test.ckpt");
+        mt_context_free(ctx);
+}
+
+void run_storage_tests(Test *t) {
+        MTContext *ctx = mt_new_context();
+        MTTensor  *x   = mt_new_tensor(ctx, Arr(float, 1, 2, 3, 4, 5, 6), Arr(int, 2, 3), 2);
+        MTTensor  *e   = mt_new_tensor(ctx, Arr(float, 1, 2, 3, 4, 5, 6), Arr(int, 3, 2), 2);
+
+        MTAllocStats before = mt_context_get_stats(ctx);
+        MTTensor    *s      = mt_tensor_share(x);
+        MTTensor    *r      = mt_tensor_reshape(x, Arr(int, 3, 2), 2);
+        MTAllocStats after  = mt_context_get_stats(ctx);
+        mt_assert_true(t, s->data == x->data && r->data == x->data && mt_is_tensor_eq(r, e) &&
+                              after.pool_hits == before.pool_hits && after.nallocs == before.nallocs,
+                       "test shared storage", "should share the data without copying it");
+
+        /* the data outlives the tensor it was shared from */
+        mt_tensor_free(x);
+        mt_assert_true(t, mt_is_tensor_eq(r, e) && s->storage->refs == 2, "test shared storage release",
+                       "should keep the data while it is shared");
+
+        /* a write copies the data of the writer only */
+        mt_tensor_enable_grad(s);
+        for (int i = 0; i < 6; i++) s->grad->data[i] = 1;
+        mt_tensor_sgd_step(s, 1);
+        mt_assert_true(t, s->data != r->data && s->data[0] == 0 && r->data[0] == 1 && s->storage == NULL &&
+                              r->storage->refs == 1,
+                       "test copy on write", "should copy the shared data before updating it");
+        mt_tensor_make_writable(r);
+        mt_assert_true(t, r->storage == NULL && mt_is_tensor_eq(r, e), "test last share",
+                       "should own the data once it is no longer shared");
+
+        /* borrowed data is released with the last tensor sharing it */
+        float *buf = malloc(4 * sizeof(float));
+        for (int i = 0; i < 4; i++) buf[i] = i;
+        buffer_released = NULL;
+        MTTensor *b     = mt_tensor_from_buffer(ctx, buf, Arr(int, 4), 1, NULL, buffer_release);
+        MTTensor *bs    = mt_tensor_reshape(b, Arr(int, 2, 2), 2);
+        mt_tensor_free(b);
+        mt_assert_true(t, buffer_released == NULL && bs->data[3] == 3, "test shared borrowed storage",
+                       "should not release the buffer while it is shared");
+        mt_tensor_free(bs);
+        mt_assert_true(t, buffer_released == buf, "test shared borrowed release",
+                       "should release the buffer with the last tensor");
+
+        /* gradients flow back through a reshape to the original shape */
+        MTTensor *w = mt_new_tensor(ctx, Arr(float, 1, 2, 3, 4), Arr(int, 4), 1);
+        mt_tensor_enable_grad(w);
+        MTTensor *c = mt_new_tensor(ctx, Arr(float, 5, 6, 7, 8), Arr(int, 2, 2), 2);
+        mt_tensor_enable_grad(c);
+        MTTensor *y = mt_tensor_mul(mt_tensor_reshape(w, Arr(int, 2, 2), 2), c);
+        mt_tensor_backward(y, mt_new_tensor_full(ctx, 1, Arr(int, 2, 2), 2));
+        mt_assert_true(t, mt_is_tensor_eq(w->grad, mt_new_tensor(ctx, Arr(float, 5, 6, 7, 8), Arr(int, 4), 1)),
+                       "test reshape backward", "should reshape the gradient back");
+
+        /* batch norm copies shared running statistics before updating them */
+        MTTensor *rm  = mt_new_tensor(ctx, Arr(float, 0, 0), Arr(int, 2), 1);
+        MTTensor *rms = mt_tensor_share(rm);
+        MTTensor *bx  = mt_new_tensor(ctx, Arr(float, 1, 2, 3, 6), Arr(int, 2, 2), 2);
+        mt_tensor_batch_norm(bx, NULL, NULL, rm, NULL, 1, 0.5, 1e-5);
+        mt_assert_true(t, rms->data[0] == 0 && rms->data[1] == 0 && rm->data[0] == 1 && rm->data[1] == 2,
+                       "test batch norm copy on write", "should leave tensors sharing the statistics unchanged");
+
+        mt_context_free(ctx);
+}
+
+/* A two-layer MLP over a (4, 8) input; `user` holds its four weights */
+static void mlp_forward(MTContext *ctx, MTTensor **inputs, MTTensor **outputs, void *user) {
+        MTTensor **w = user;
+        MTTensor  *h = inputs[0];
+        for (int i = 0; i < 3; i++) h = mt_tensor_relu(mt_tensor_add(h, w[3]));
+        h          = mt_tensor_relu(mt_tensor_add(mt_tensor_matmul(h, w[0]), w[1]));
+        outputs[0] = mt_tensor_softmax(mt_tensor_add(mt_tensor_matmul(h, w[2]), w[1]), 1);
+}
+
+/* Quantized and sparse matmuls, which matmul dispatches to other ops */
+static void qmlp_forward(MTContext *ctx, MTTensor **inputs, MTTensor **outputs, void *user) {
+        MTTensor **w = user;
+        MTTensor  *h = mt_tensor_relu(mt_tensor_matmul(inputs[0], mt_tensor_quantize(w[0], 1)));
+        outputs[0]   = mt_tensor_matmul(w[1], h);
+}
+
+void run_plan_tests(Test *t) {
+        MTContext *ctx = mt_new_context();
+        float      xs[32], ws[88];
+        for (int i = 0; i < 88; i++) ws[i] = ((i * 37) % 17 - 8) / 8.0f;
+        for (int i = 0; i < 32; i++) xs[i] = ((i * 11) % 13 - 6) / 4.0f;
+        MTTensor *w[4] = {mt_new_tensor(ctx, ws, Arr(int, 8, 8), 2), mt_new_tensor(ctx, ws, Arr(int, 8), 1),
+                          mt_new_tensor(ctx, ws + 16, Arr(int, 8, 8), 2), mt_new_tensor(ctx, ws + 80, Arr(int, 8), 1)};
+        MTTensor *x    = mt_new_tensor(ctx, xs, Arr(int, 4, 8), 2);
+
+        MTTensor *expected[1];
+        mlp_forward(ctx, &x, expected, w);
+        MTPlan     *plan = mt_plan_compile(ctx, mlp_forward, &x, 1, 1, w);
+        MTPlanStats st   = mt_plan_get_stats(plan);
+        mt_assert_true(t, st.nbuffers >= 12 && st.workspace_bytes * 3 <= st.buffer_bytes, "test plan reuse",
+                       "should share the workspace between buffers that are not live together");
+
+        MTTensor *out[1];
+        long      allocs = mt_context_get_stats(ctx).nallocs, hits = mt_context_get_stats(ctx).pool_hits;
+        mt_plan_run(plan, &x, out);
+        mt_assert_true(t, mt_is_tensor_eq(out[0], expected[0]), "test plan run", "should match the eager forward");
+        mt_assert_true(t, mt_context_get_stats(ctx).nallocs == allocs && mt_context_get_stats(ctx).pool_hits == hits,
+                       "test plan allocations", "should take every buffer from the workspace");
+
+        /* a second run on other values, with the first outputs given back */
+        for (int i = 0; i < 32; i++) x->data[i] = -x->data[i];
+        mlp_forward(ctx, &x, expected, w);
+        mt_plan_run(plan, &x, out);
+        mt_assert_true(t, mt_is_tensor_eq(out[0], expected[0]), "test plan rerun", "should match the eager forward");
+        mt_plan_free(plan);
+
+        /* the dispatching matmuls close their scope, traced and profiled */
+        MTTensor *qw[2] = {w[0], mt_sparse_from_dense(mt_new_tensor(ctx, Arr(float, 1, 0, 0, 2, 0, 0, 3, 0, 0, 0, 0, 4),
+                                                                    Arr(int, 3, 4), 2))};
+        qmlp_forward(ctx, &x, expected, qw);
+        mt_profiler_start(ctx);
+        plan = mt_plan_compile(ctx, qmlp_forward, &x, 1, 1, qw);
+        mt_plan_run(plan, &x, out);
+        mt_profiler_stop(ctx);
+        mt_profiler_write_trace(ctx, "mt_test_trace.json");
+        FILE  *f = fopen("mt_test_trace.json", "r");
+        char   buf[16384];
+        size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+        fclose(f), remove("mt_test_trace.json");
+        buf[n] = '\0';
+        mt_assert_true(t, mt_is_tensor_eq(out[0], expected[0]) && strstr(buf, "\"name\": \"qmatmul\"") != NULL &&
+                              strstr(buf, "\"name\": \"spmm\"") != NULL && strstr(buf, "\"name\": \"matmul\"") == NULL,
+                       "test plan dispatching matmul", "should trace and profile the ops matmul dispatches to");
+
+        mt_plan_free(plan);
+        mt_context_free(ctx);
+}
+
 void run_broadcast_tests(Test *t) {
         MTContext *ctx = mt_new_context();
 
@@ -149,12 +705,12 @@ void run_get_data_by_constrain(Test *t) {
 
         /* "duplicate" row */
         MTTensor *x   = mt_new_tensor(ctx, Arr(float, 1, 2), Arr(int, 2), 1);
-        float    *arr = mt_tensor_get_all_data_constrained(x, two_by_two->indices, Arr(int, 2, 2), Arr(int, 0, 1), 2);
+        float    *arr = mt_tensor_get_all_data_constrained(x, two_by_two->indices, Arr(int, 2, 2), Arr(long, 0, 1), 2);
         mt_assert_true(t, __mt_arrsame(arr, Arr(float, 1, 2, 1, 2), 4), "test get data by constrain, 1 to 2 dims", "should be {1, 2, 1, 2}");
         free(arr);
 
         MTTensor *y = mt_new_tensor(ctx, Arr(float, 1, 2, 3, 4, 5, 6), Arr(int, 3, 2), 2);
-        arr         = mt_tensor_get_all_data_constrained(y, two_by_three->indices, Arr(int, 2, 3), Arr(int, 1, 2), 2);
+        arr         = mt_tensor_get_all_data_constrained(y, two_by_three->indices, Arr(int, 2, 3), Arr(long, 1, 2), 2);
         mt_assert_true(t, __mt_arrsame(arr, Arr(float, 1, 3, 5, 2, 4, 6), 6), "test transpose with stride manipulation", "should be {1, 3, 5, 2, 4, 6}");
         free(arr);
 
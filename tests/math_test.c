@@ -1,4 +1,8 @@
+#include <math.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "../minitensor.h"
 #include "test.h"
@@ -44,6 +48,49 @@ void run_tensor_addition_tests(Test *t) {
         mt_context_free(ctx);
 }
 
+/* A (pseudo-random) tensor of `shape`, of `dtype` */
+static MTTensor *bcast_operand(MTContext *ctx, int *shape, int ndims, MtDtype dtype) {
+        long n = 1;
+        for (int i = 0; i < ndims; i++) n *= shape[i];
+        float data[n];
+        for (long i = 0; i < n; i++) data[i] = (float)((i * 7919) % 101) / 8;
+        return mt_new_tensor_dtype(ctx, data, shape, ndims, dtype);
+}
+
+void run_tensor_broadcast_plan_tests(Test *t) {
+        MTContext *ctx = mt_new_context();
+        /* rows and columns spanning several chunks, both operands broadcast,
+         * and dims that merge */
+        int shapes[][2][4] = {{{300, 7}, {7}},       {{300, 7}, {300, 1}}, {{7}, {300, 7}},
+                              {{5, 1, 6}, {1, 70, 1}}, {{4, 1, 3}, {3}},     {{1, 1}, {2, 3}}};
+        int ndims[][2]     = {{2, 1}, {2, 2}, {1, 2}, {3, 3}, {3, 1}, {2, 2}};
+        for (int dt = 0; dt < 2; dt++) {
+                MtDtype dtype = dt ? DTYPE_FLOAT16 : DTYPE_FLOAT32;
+                int     ok    = 1;
+                for (int c = 0; c < 6; c++) {
+                        MTTensor   *a   = bcast_operand(ctx, shapes[c][0], ndims[c][0], dtype);
+                        MTTensor   *b   = bcast_operand(ctx, shapes[c][1], ndims[c][1], dtype);
+                        BcastResult bcr = mt_broadcast_lr(a, b);
+                        MTTensor   *ref = mt_tensor_sub(bcr.left ? bcr.left : a, bcr.right ? bcr.right : b);
+                        /* the materialized copies are float32 */
+                        ref = mt_tensor_to_dtype(ref, dtype);
+                        /* a second op on the same shapes goes through the cached plan */
+                        ok &= mt_is_tensor_eq(mt_tensor_sub(a, b), ref) && mt_is_tensor_eq(mt_tensor_sub(a, b), ref);
+                }
+                mt_assert_true(t, ok, dt ? "test broadcast plans float16" : "test broadcast plans",
+                               "should match the materialized broadcast");
+        }
+
+        MTTensor    *x      = bcast_operand(ctx, Arr(int, 64, 64), 2, DTYPE_FLOAT32);
+        MTTensor    *row    = bcast_operand(ctx, Arr(int, 64), 1, DTYPE_FLOAT32);
+        MTAllocStats before = mt_context_get_stats(ctx);
+        mt_tensor_add(x, row);
+        MTAllocStats after = mt_context_get_stats(ctx);
+        mt_assert_true(t, after.nallocs + after.pool_hits - before.nallocs - before.pool_hits == 1,
+                       "test broadcast in place", "should only allocate the result");
+        mt_context_free(ctx);
+}
+
 void run_tensor_sum_tests(Test *t) {
         MTContext *ctx  = mt_new_context();
         MTTensor  *x    = mt_new_tensor(ctx, Arr(float, 1, 2, 3, 4, 5, 6), Arr(int, 3, 2), 2);
@@ -186,4 +233,459 @@ void run_tensor_matrix_multiplication_tests(Test *t) {
             "test matmul 1",
             "should be {{3, 3}, {7, 7}, {11, 11}}");
         mt_context_free(ctx);
-}
\ No newline at end of file
+}
+void run_tensor_softmax_tests(Test *t) {
+        MTContext *ctx = mt_new_context();
+        MTTensor  *x   = mt_new_tensor(ctx, Arr(float, 1, 2, 3), Arr(int, 3), 1);
+        MTTensor  *big = mt_new_tensor(ctx, Arr(float, 1000, 1001, 1002), Arr(int, 3), 1);
+        float      sm[] = {0.09003057, 0.24472847, 0.66524096};
+        float      ls[] = {-2.40760596, -1.40760596, -0.40760596};
+
+        mt_assert_true(t, __mt_arrclose(mt_tensor_softmax(x, 0)->data, sm, 3, 1e-6),
+                       "test softmax", "should be {0.090, 0.245, 0.665}");
+        mt_assert_true(t, __mt_arrclose(mt_tensor_softmax(big, 0)->data, sm, 3, 1e-6),
+                       "test softmax does not overflow on large inputs", "should be {0.090, 0.245, 0.665}");
+        mt_assert_true(t, __mt_arrclose(mt_tensor_log_softmax(big, 0)->data, ls, 3, 1e-4),
+                       "test log-softmax", "should be {-2.408, -1.408, -0.408}");
+
+        /* softmax along a non-contiguous dimension */
+        MTTensor *y = mt_new_tensor(ctx, Arr(float, 1, 2, 3, 4), Arr(int, 2, 2), 2);
+        mt_assert_true(t,
+                       __mt_arrclose(mt_tensor_softmax(y, 0)->data,
+                                     Arr(float, 0.11920292, 0.11920292, 0.88079708, 0.88079708), 4, 1e-6),
+                       "test softmax along dim 0", "should be {{0.119, 0.119}, {0.881, 0.881}}");
+
+        /* rows spanning several chunks, whose max grows from chunk to chunk */
+        float  lx[700], lsm[700], lls[700];
+        double lmax = 500 + 699 / 10.0, lsum = 0;
+        for (int j = 0; j < 700; j++) lx[j] = 500 + j / 10.0, lsum += exp(lx[j] - lmax);
+        for (int j = 0; j < 700; j++)
+                lsm[j] = exp(lx[j] - lmax) / lsum, lls[j] = lx[j] - lmax - log(lsum);
+        MTTensor *lr = mt_new_tensor(ctx, lx, Arr(int, 700), 1);
+        mt_assert_true(t, __mt_arrclose(mt_tensor_softmax(lr, 0)->data, lsm, 700, 1e-6),
+                       "test softmax of long rows", "should rescale the earlier chunks to the final max");
+        mt_assert_true(t, __mt_arrclose(mt_tensor_log_softmax(lr, 0)->data, lls, 700, 1e-3),
+                       "test log-softmax of long rows", "should rescale the earlier chunks to the final max");
+
+        MTTensor *logits  = mt_new_tensor(ctx, Arr(float, 1, 2, 3, 1, 2, 3), Arr(int, 2, 3), 2);
+        MTTensor *targets = mt_new_tensor(ctx, Arr(float, 2, 0), Arr(int, 2), 1);
+        MTTensor *loss    = mt_tensor_cross_entropy(logits, targets);
+        mt_assert_true(t, loss->ndims == 0 && fabs(loss->data[0] - 1.40760596) < 1e-6,
+                       "test cross-entropy", "should be 1.4076");
+
+        mt_context_free(ctx);
+}
+
+/* direct (sliding window) convolution of a single image as a reference */
+float naive_conv_at(MTTensor *x, MTTensor *w, int k, int oy, int ox, int stride, int pad) {
+        float s = 0;
+        for (int c = 0; c < x->shape[1]; c++)
+                for (int r = 0; r < w->shape[2]; r++)
+                        for (int q = 0; q < w->shape[3]; q++) {
+                                int iy = oy * stride - pad + r, ix = ox * stride - pad + q;
+                                if (iy < 0 || ix < 0 || iy >= x->shape[2] || ix >= x->shape[3]) continue;
+                                s += x->data[(c * x->shape[2] + iy) * x->shape[3] + ix] *
+                                     w->data[((k * w->shape[1] + c) * w->shape[2] + r) * w->shape[3] + q];
+                        }
+        return s;
+}
+
+void run_tensor_conv2d_tests(Test *t) {
+        MTContext *ctx  = mt_new_context();
+        MTTensor  *x    = mt_new_tensor(ctx, Arr(float, 1, 2, 3, 4, 5, 6, 7, 8, 9), Arr(int, 1, 1, 3, 3), 4);
+        MTTensor  *w    = mt_new_tensor_full(ctx, 1, Arr(int, 1, 1, 2, 2), 4);
+        MTTensor  *b    = mt_new_tensor(ctx, Arr(float, 1), Arr(int, 1), 1);
+        MTTensor  *res1 = mt_tensor_conv2d(x, w, b, 1, 0, 1);
+        MTTensor  *res2 = mt_tensor_conv2d(x, w, b, 2, 1, 1);
+        MTTensor  *res3 = mt_tensor_conv2d(x, w, NULL, 1, 0, 2);
+
+        mt_assert_true(t, mt_is_tensor_eq(res1, mt_new_tensor(ctx, Arr(float, 13, 17, 25, 29), Arr(int, 1, 1, 2, 2), 4)),
+                       "test conv2d", "should be {{13, 17}, {25, 29}}");
+        mt_assert_true(t, mt_is_tensor_eq(res2, mt_new_tensor(ctx, Arr(float, 2, 6, 12, 29), Arr(int, 1, 1, 2, 2), 4)),
+                       "test conv2d with stride and padding", "should be {{2, 6}, {12, 29}}");
+        mt_assert_true(t, mt_is_tensor_eq(res3, mt_new_tensor(ctx, Arr(float, 20), Arr(int, 1, 1, 1, 1), 4)),
+                       "test conv2d with dilation", "should be {{20}}");
+
+        /* large enough for the lowered input to be split into several tiles */
+        int    c = 64, h = 24, k = 3;
+        float *xd = malloc(sizeof(float) * c * h * h), *wd = malloc(sizeof(float) * k * c * 9);
+        for (int i = 0; i < c * h * h; i++) xd[i] = (i % 13) - 6;
+        for (int i = 0; i < k * c * 9; i++) wd[i] = ((i % 7) - 3) * 0.5;
+        MTTensor *bx  = mt_new_tensor(ctx, xd, Arr(int, 1, c, h, h), 4);
+        MTTensor *bw  = mt_new_tensor(ctx, wd, Arr(int, k, c, 3, 3), 4);
+        MTTensor *res = mt_tensor_conv2d(bx, bw, NULL, 1, 1, 1);
+        int       ok  = res->shape[2] == h && res->shape[3] == h;
+        for (int kk = 0; kk < k && ok; kk++)
+                for (int i = 0; i < h * h && ok; i++)
+                        ok = res->data[kk * h * h + i] == naive_conv_at(bx, bw, kk, i / h, i % h, 1, 1);
+        mt_assert_true(t, ok, "test tiled conv2d against direct convolution", "should match direct convolution");
+        free(xd), free(wd);
+
+        mt_context_free(ctx);
+}
+
+/* relative error, in units of float epsilon, between fast and exact results */
+int fast_math_close(MTTensor *fast, MTTensor *exact) {
+        for (long i = 0; i < exact->datalen; i++)
+                if (fabs(fast->data[i] - exact->data[i]) > 4 * 1.1920929e-7 * fabs(exact->data[i]) + 1e-30)
+                        return 0;
+        return 1;
+}
+
+void run_tensor_fast_math_tests(Test *t) {
+        MTContext *ctx = mt_new_context();
+        int        n   = 4001;
+        float     *xd  = malloc(sizeof(float) * n), *pd = malloc(sizeof(float) * n);
+        for (int i = 0; i < n; i++) xd[i] = (i - n / 2) * 0.02, pd[i] = expf((i - n / 2) * 0.04);
+        MTTensor *x   = mt_new_tensor(ctx, xd, Arr(int, n), 1);
+        MTTensor *pos = mt_new_tensor(ctx, pd, Arr(int, n), 1);
+
+        MTTensor *exp_exact = mt_tensor_exp(x), *log_exact = mt_tensor_log(pos);
+        MTTensor *tanh_exact = mt_tensor_tanh(x), *sigm_exact = mt_tensor_sigmoid(x);
+        mt_assert_true(t, fabs(tanh_exact->data[n / 2 + 50] - tanhf(1)) < 1e-7, "test tanh", "should be tanh(1)");
+        mt_assert_true(t, fabs(sigm_exact->data[n / 2 + 50] - 0.7310586) < 1e-7, "test sigmoid", "should be 0.7311");
+
+        ctx->mathmode = MATH_FAST;
+        mt_assert_true(t, fast_math_close(mt_tensor_exp(x), exp_exact), "test fast exp accuracy", "should be within 4 ulps of expf");
+        mt_assert_true(t, fast_math_close(mt_tensor_log(pos), log_exact), "test fast log accuracy", "should be within 4 ulps of logf");
+        mt_assert_true(t, fast_math_close(mt_tensor_tanh(x), tanh_exact), "test fast tanh accuracy", "should be within 4 ulps of tanhf");
+        mt_assert_true(t, fast_math_close(mt_tensor_sigmoid(x), sigm_exact), "test fast sigmoid accuracy", "should be within 4 ulps of exact sigmoid");
+
+        MTTensor *special = mt_new_tensor(ctx, Arr(float, -INFINITY, 0, 100, -200), Arr(int, 4), 1);
+        MTTensor *e       = mt_tensor_exp(special);
+        mt_assert_true(t, e->data[0] == 0 && e->data[1] == 1 && isinf(e->data[2]) && e->data[3] == 0,
+                       "test fast exp special values", "should be {0, 1, inf, 0}");
+        MTTensor *l = mt_tensor_log(mt_new_tensor(ctx, Arr(float, 0, 1, -1), Arr(int, 3), 1));
+        mt_assert_true(t, isinf(l->data[0]) && l->data[0] < 0 && l->data[1] == 0 && isnan(l->data[2]),
+                       "test fast log special values", "should be {-inf, 0, nan}");
+
+        free(xd), free(pd);
+        mt_context_free(ctx);
+}
+
+void run_tensor_dtype_tests(Test *t) {
+        MTContext *ctx = mt_new_context();
+
+        /* values exactly representable in both 16-bit formats survive */
+        float     *exact = Arr(float, 1, -2, 0.5, 3.75, 0, -0.125);
+        MTTensor  *bf    = mt_new_tensor_dtype(ctx, exact, Arr(int, 2, 3), 2, DTYPE_BFLOAT16);
+        MTTensor  *hf    = mt_new_tensor_dtype(ctx, exact, Arr(int, 2, 3), 2, DTYPE_FLOAT16);
+        MTTensor  *back  = mt_tensor_to_dtype(hf, DTYPE_FLOAT32);
+        mt_assert_true(t, bf->data == NULL && bf->lpdata != NULL, "test bfloat16 storage", "should only hold 16-bit data");
+        mt_assert_true(t, __mt_arrsame(back->data, exact, 6), "test float16 roundtrip", "should be exact");
+        mt_assert_true(t, mt_tensor_get_2(bf, 1, 0) == 3.75, "test bfloat16 access", "should be 3.75");
+
+        /* rounding to nearest even, overflow and subnormals */
+        MTTensor *r = mt_new_tensor_dtype(ctx, Arr(float, 1.00390625, 1.01171875, 70000, 1e-7),
+                                          Arr(int, 4), 1, DTYPE_FLOAT16);
+        mt_assert_true(t, mt_tensor_get_1(r, 0) == 1.00390625 && isinf(mt_tensor_get_1(r, 2)) &&
+                              fabs(mt_tensor_get_1(r, 3) - 1e-7) < 3e-8,
+                       "test float16 rounding", "should keep 1+2^-8, overflow to inf and keep subnormals");
+        MTTensor *rb = mt_new_tensor_dtype(ctx, Arr(float, 1.00390625, 1.01171875), Arr(int, 2), 1, DTYPE_BFLOAT16);
+        mt_assert_true(t, mt_tensor_get_1(rb, 0) == 1 && mt_tensor_get_1(rb, 1) == 1.015625,
+                       "test bfloat16 rounding", "should round half to even");
+
+        /* elementwise ops keep the dtype, mixing dtypes widens to float32 */
+        MTTensor *s = mt_tensor_add(bf, mt_new_scalar(ctx, 1));
+        MTTensor *m = mt_tensor_mul(bf, mt_new_tensor(ctx, exact, Arr(int, 2, 3), 2));
+        mt_assert_true(t, s->dtype == DTYPE_BFLOAT16 && mt_tensor_get_2(s, 0, 1) == -1,
+                       "test bfloat16 addition", "should stay bfloat16");
+        mt_assert_true(t, m->dtype == DTYPE_FLOAT32 && m->data[3] == 3.75 * 3.75,
+                       "test mixed dtype multiplication", "should be float32");
+
+        /* matmul and sum accumulate in float32 */
+        MTTensor *a  = mt_new_tensor_dtype(ctx, Arr(float, 1, 2, 3, 4), Arr(int, 2, 2), 2, DTYPE_FLOAT16);
+        MTTensor *mm = mt_tensor_matmul(a, a);
+        mt_assert_true(t, mm->dtype == DTYPE_FLOAT16 &&
+                              mt_is_tensor_eq(mt_tensor_to_dtype(mm, DTYPE_FLOAT32),
+                                              mt_new_tensor(ctx, Arr(float, 7, 10, 15, 22), Arr(int, 2, 2), 2)),
+                       "test float16 matmul", "should be {7, 10, 15, 22}");
+        MTTensor *sum = mt_tensor_sum(a, 0, 0);
+        mt_assert_true(t, sum->dtype == DTYPE_FLOAT16 && mt_tensor_get_1(sum, 1) == 6,
+                       "test float16 sum", "should be {4, 6}");
+
+        mt_context_free(ctx);
+}
+
+/* The int8 GEMM kernels of minitensor.c, checked against the scalar one */
+void __mt_qgemm_kernel_scalar(const uint8_t *a, const int8_t *bp, int32_t *c,
+                              long mpad, long kq, long nb);
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define QGEMM_X86
+void __mt_qgemm_kernel_avx2(const uint8_t *a, const int8_t *bp, int32_t *c,
+                            long mpad, long kq, long nb);
+void __mt_qgemm_kernel_vnni(const uint8_t *a, const int8_t *bp, int32_t *c,
+                            long mpad, long kq, long nb);
+#endif
+
+void run_tensor_quantize_tests(Test *t) {
+        MTContext *ctx = mt_new_context();
+
+        /* per-column quantization: the roundtrip error is at most half a step */
+        float    *wd = Arr(float, 1, -0.5, 0, 0.25, -2, 0.1, 3, 1, 0.02);
+        MTTensor *w  = mt_new_tensor(ctx, wd, Arr(int, 3, 3), 2);
+        MTTensor *wq = mt_tensor_quantize(w, 1);
+        MTTensor *wr = mt_tensor_dequantize(wq);
+        int       ok = wq->dtype == DTYPE_INT8 && wq->qaxis == 1;
+        for (int i = 0; i < 9; i++)
+                ok = ok && fabs(wr->data[i] - wd[i]) <= wq->qscale[i % 3] / 2 + 1e-6;
+        mt_assert_true(t, ok, "test int8 quantize roundtrip", "should be within half a step");
+        mt_assert_true(t, mt_tensor_get_2(wq, 0, 2) == 0, "test int8 zero", "should be exactly representable");
+
+        /* quantized matmul against the float32 product */
+        MTTensor *x  = mt_new_tensor(ctx, Arr(float, 1, 2, 3, -1, 0.5, 4), Arr(int, 2, 3), 2);
+        MTTensor *y  = mt_tensor_matmul(x, w);
+        MTTensor *yq = mt_tensor_matmul(x, wq);
+        mt_assert_true(t, yq->dtype == DTYPE_FLOAT32 && __mt_arrclose(yq->data, y->data, 6, 0.05),
+                       "test int8 matmul", "should match the float32 product");
+
+        /* bias and requantizing epilogue */
+        MTTensor *bias = mt_new_tensor(ctx, Arr(float, 1, 0, -1), Arr(int, 3), 1);
+        MTTensor *yb   = mt_tensor_qmatmul(x, wq, bias, 0.1, 3);
+        int       okb  = yb->dtype == DTYPE_INT8 && yb->qscale[0] == 0.1f && yb->qzero[0] == 3;
+        for (int i = 0; i < 6; i++) {
+                float want = fmaxf(-13.1, fminf(12.4, y->data[i] + bias->data[i % 3]));
+                okb        = okb && fabs(mt_tensor_get_2(yb, i / 3, i % 3) - want) < 0.15;
+        }
+        mt_assert_true(t, okb, "test int8 requantized matmul", "should saturate to [-13.1, 12.4]");
+
+        /* pre-quantized activations */
+        MTTensor *yx = mt_tensor_matmul(mt_tensor_quantize(x, -1), wq);
+        mt_assert_true(t, __mt_arrclose(yx->data, y->data, 6, 0.1),
+                       "test int8 by int8 matmul", "should match the float32 product");
+
+        /* every kernel the CPU supports matches the scalar one over two row
+         * tiles, three groups of k and three column panels, including the
+         * extreme byte values */
+        long    mpad = 8, kq = 3, nb = 3, kpad = kq * 4, ldc = nb * 8;
+        uint8_t qa[mpad * kpad];
+        int8_t  qb[ldc * kpad];
+        int32_t want[mpad * ldc], got[mpad * ldc];
+        for (long i = 0; i < mpad * kpad; i++) qa[i] = i % 5 == 0 ? 255 : (i * 7919) % 256;
+        for (long i = 0; i < ldc * kpad; i++) qb[i] = i % 7 == 0 ? -128 : (i * 104729) % 256 - 128;
+        __mt_qgemm_kernel_scalar(qa, qb, want, mpad, kq, nb);
+        int okk = 1;
+#ifdef QGEMM_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+                memset(got, 0, sizeof(got));
+                __mt_qgemm_kernel_avx2(qa, qb, got, mpad, kq, nb);
+                okk = okk && !memcmp(got, want, sizeof(got));
+        }
+        if (__builtin_cpu_supports("avx512vnni") && __builtin_cpu_supports("avx512vl")) {
+                memset(got, 0, sizeof(got));
+                __mt_qgemm_kernel_vnni(qa, qb, got, mpad, kq, nb);
+                okk = okk && !memcmp(got, want, sizeof(got));
+        }
+#endif
+        mt_assert_true(t, okk, "test int8 gemm kernels", "should match the scalar kernel exactly");
+
+        /* shapes that are not multiples of the tiles go through the padding */
+        float xd[5 * 7], wd2[7 * 11];
+        for (int i = 0; i < 5 * 7; i++) xd[i] = (float)((i * 7919) % 101) / 50 - 1;
+        for (int i = 0; i < 7 * 11; i++) wd2[i] = (float)((i * 104729) % 97) / 48 - 1;
+        MTTensor *xp = mt_new_tensor(ctx, xd, Arr(int, 5, 7), 2);
+        MTTensor *wp = mt_new_tensor(ctx, wd2, Arr(int, 7, 11), 2);
+        mt_assert_true(t, __mt_arrclose(mt_tensor_qmatmul(xp, wp, NULL, 0, 0)->data,
+                                        mt_tensor_matmul(xp, wp)->data, 5 * 11, 0.05),
+                       "test int8 matmul padding", "should match the float32 product");
+
+        mt_context_free(ctx);
+}
+
+void run_tensor_sparse_tests(Test *t) {
+        MTContext *ctx = mt_new_context();
+
+        MTTensor *d = mt_new_tensor(ctx, Arr(float, 0, 2, 0, 0, 0, 0, 1, 0, 3), Arr(int, 3, 3), 2);
+        MTTensor *s = mt_sparse_from_dense(d);
+        mt_assert_true(t, s->layout == LAYOUT_CSR && s->datalen == 3 && s->rowptr[1] == 1 && s->rowptr[2] == 1,
+                       "test sparse from dense", "should keep the 3 nonzeros");
+        mt_assert_true(t, mt_is_tensor_eq(mt_sparse_to_dense(s), d), "test sparse to dense", "should roundtrip");
+
+        /* unsorted triplets with a duplicate coordinate */
+        MTTensor *c = mt_sparse_from_coo(ctx, Arr(int, 2, 0, 2, 2), Arr(int, 2, 1, 0, 2),
+                                         Arr(float, 1, 2, 1, 2), 4, Arr(int, 3, 3));
+        mt_assert_true(t, mt_is_tensor_eq(c, s), "test sparse from coo", "should sort and merge duplicates");
+
+        /* a larger product, split over several threads */
+        int    m = 200, k = 300, n = 64;
+        float *ad = calloc(m * k, sizeof(float)), *bd = malloc(sizeof(float) * k * n);
+        for (int i = 0; i < m * k; i++) ad[i] = i % 11 == 0 ? (i % 7) - 3 : 0;
+        for (int i = 0; i < k * n; i++) bd[i] = (i % 13) * 0.25 - 1;
+        MTTensor *a = mt_new_tensor(ctx, ad, Arr(int, m, k), 2);
+        MTTensor *b = mt_new_tensor(ctx, bd, Arr(int, k, n), 2);
+        ctx->nthreads = 3;
+        MTTensor *y   = mt_tensor_matmul(mt_sparse_from_dense(a), b);
+        MTTensor *ref = mt_tensor_matmul(a, b);
+        mt_assert_true(t, __mt_arrclose(y->data, ref->data, m * n, 1e-3), "test sparse matmul",
+                       "should match the dense product");
+
+        free(ad), free(bd);
+        mt_context_free(ctx);
+}
+
+void run_tensor_gather_tests(Test *t) {
+        MTContext *ctx = mt_new_context();
+
+        MTTensor *x = mt_new_tensor(ctx, Arr(float, 1, 2, 3, 4, 5, 6), Arr(int, 2, 3), 2);
+        MTTensor *g = mt_tensor_gather(x, 1, mt_new_tensor(ctx, Arr(float, 2, 0, 2), Arr(int, 3), 1));
+        mt_assert_true(t, mt_is_tensor_eq(g, mt_new_tensor(ctx, Arr(float, 3, 1, 3, 6, 4, 6), Arr(int, 2, 3), 2)),
+                       "test gather columns", "should be {3, 1, 3, 6, 4, 6}");
+
+        MTTensor *table = mt_new_tensor_dtype(ctx, Arr(float, 1, 2, 3, 4, 5, 6), Arr(int, 3, 2), 2, DTYPE_BFLOAT16);
+        MTTensor *e     = mt_tensor_embedding(table, Arr(int, 2, 2, 0), 3);
+        mt_assert_true(t, e->dtype == DTYPE_BFLOAT16 && mt_tensor_get_2(e, 1, 1) == 6 && mt_tensor_get_2(e, 2, 0) == 1,
+                       "test bfloat16 embedding", "should copy rows {2, 2, 0}");
+
+        mt_context_free(ctx);
+}
+
+void run_tensor_max_tests(Test *t) {
+        MTContext *ctx = mt_new_context();
+
+        MTTensor *x = mt_new_tensor(ctx, Arr(float, 1, 5, 2, 7, 0, 7), Arr(int, 2, 3), 2);
+        MTTensor *idx;
+        MTTensor *m = mt_tensor_max(x, 1, 0, &idx);
+        mt_assert_true(t, mt_is_tensor_eq(m, mt_new_tensor(ctx, Arr(float, 5, 7), Arr(int, 2), 1)) &&
+                              mt_is_tensor_eq(idx, mt_new_tensor(ctx, Arr(float, 1, 0), Arr(int, 2), 1)),
+                       "test max along rows", "should be {5, 7} at the first occurrences {1, 0}");
+        mt_assert_true(t, mt_is_tensor_eq(mt_tensor_min(x, 0, 1, NULL), mt_new_tensor(ctx, Arr(float, 1, 0, 2), Arr(int, 1, 3), 2)),
+                       "test min along columns", "should be {{1, 0, 2}}");
+        mt_assert_true(t, mt_is_tensor_eq(mt_tensor_argmax(x, 0, 0), mt_new_tensor(ctx, Arr(float, 1, 0, 1), Arr(int, 3), 1)) &&
+                              mt_is_tensor_eq(mt_tensor_argmin(x, 1, 0), mt_new_tensor(ctx, Arr(float, 0, 1), Arr(int, 2), 1)),
+                       "test argmax and argmin", "should be {1, 0, 1} and {0, 1}");
+
+        /* a long row exercising the vectorized path */
+        int    n  = 1001;
+        float *xd = malloc(sizeof(float) * n);
+        for (int i = 0; i < n; i++) xd[i] = -((i * 37) % 1001);
+        MTTensor *row = mt_new_tensor(ctx, xd, Arr(int, n), 1);
+        mt_assert_true(t, mt_tensor_get_v(mt_tensor_argmin(row, 0, 0)) == 514 && mt_tensor_get_v(mt_tensor_argmax(row, 0, 0)) == 0,
+                       "test argmax of a long row", "should be 0, with the min at 514");
+
+        MTTensor *v = mt_tensor_topk(row, 3, 0, &idx);
+        mt_assert_true(t, mt_is_tensor_eq(v, mt_new_tensor(ctx, Arr(float, 0, -1, -2), Arr(int, 3), 1)) &&
+                              mt_is_tensor_eq(idx, mt_new_tensor(ctx, Arr(float, 0, 487, 974), Arr(int, 3), 1)),
+                       "test topk", "should be {0, -1, -2} in decreasing order");
+
+        MTTensor *ties = mt_new_tensor(ctx, Arr(float, 3, 1, 3, 2, 3, 9, 1, 2), Arr(int, 2, 4), 2);
+        v              = mt_tensor_topk(ties, 2, 1, &idx);
+        mt_assert_true(t, mt_is_tensor_eq(v, mt_new_tensor(ctx, Arr(float, 3, 3, 9, 3), Arr(int, 2, 2), 2)) &&
+                              mt_is_tensor_eq(idx, mt_new_tensor(ctx, Arr(float, 0, 2, 1, 0), Arr(int, 2, 2), 2)),
+                       "test topk ties", "should prefer earlier positions");
+
+        free(xd);
+        mt_context_free(ctx);
+}
+
+void run_tensor_norm_tests(Test *t) {
+        MTContext *ctx = mt_new_context();
+
+        /* each row is normalized to zero mean and unit variance */
+        MTTensor *x  = mt_new_tensor(ctx, Arr(float, 1, 2, 3, 4, 10, 20, 30, 40, 5, 5, 5, 5), Arr(int, 3, 4), 2);
+        MTTensor *ln = mt_tensor_layer_norm(x, NULL, NULL, 0);
+        float     z  = 1.3416408;
+        mt_assert_true(t, __mt_arrclose(ln->data, Arr(float, -z, -z / 3, z / 3, z, -z, -z / 3, z / 3, z), 8, 1e-5),
+                       "test layer norm", "should standardize every row");
+        ln = mt_tensor_layer_norm(x, mt_new_tensor(ctx, Arr(float, 2, 2, 2, 2), Arr(int, 4), 1),
+                                  mt_new_tensor(ctx, Arr(float, 1, 1, 1, 1), Arr(int, 4), 1), 1e-5);
+        mt_assert_true(t, __mt_arrclose((ln->data + 8), Arr(float, 1, 1, 1, 1), 4, 1e-5),
+                       "test layer norm affine", "should map a constant row to beta");
+
+        /* a row long enough for the interleaved Welford accumulators */
+        int    n  = 1003;
+        float *xd = malloc(sizeof(float) * n), mean = 0, var = 0;
+        for (int i = 0; i < n; i++) xd[i] = 1000 + (i % 17) * 0.5, mean += xd[i] / n;
+        for (int i = 0; i < n; i++) var += (xd[i] - mean) * (xd[i] - mean) / n;
+        MTTensor *row = mt_tensor_layer_norm(mt_new_tensor(ctx, xd, Arr(int, 1, n), 2), NULL, NULL, 0);
+        mt_assert_true(t, fabs(row->data[5] - (xd[5] - mean) / sqrtf(var)) < 1e-3,
+                       "test layer norm of a long row", "should be stable around a large mean");
+
+        /* batch norm over (N, C, L) = (2, 2, 2) */
+        MTTensor *b  = mt_new_tensor(ctx, Arr(float, 1, 3, 10, 10, 5, 7, 20, 30), Arr(int, 2, 2, 2), 3);
+        MTTensor *rm = mt_new_tensor(ctx, Arr(float, 0, 0), Arr(int, 2), 1);
+        MTTensor *rv = mt_new_tensor(ctx, Arr(float, 1, 1), Arr(int, 2), 1);
+        MTTensor *bn = mt_tensor_batch_norm(b, NULL, NULL, rm, rv, 1, 0.1, 0);
+        float     s  = sqrtf(5);
+        mt_assert_true(t, __mt_arrclose(bn->data, Arr(float, -3 / s, -1 / s), 2, 1e-5) &&
+                              __mt_arrclose((bn->data + 4), Arr(float, 1 / s, 3 / s), 2, 1e-5),
+                       "test batch norm training", "should standardize every channel");
+        mt_assert_true(t, __mt_arrclose(rm->data, Arr(float, 0.4, 1.75), 2, 1e-5) &&
+                              __mt_arrclose(rv->data, Arr(float, 0.9 + 0.1 * 20 / 3, 0.9 + 0.1 * 275 / 3), 2, 1e-4),
+                       "test batch norm running stats", "should move by momentum with unbiased variance");
+
+        bn = mt_tensor_batch_norm(b, NULL, mt_new_tensor(ctx, Arr(float, 0, 1), Arr(int, 2), 1), rm, rv, 0, 0.1, 0);
+        mt_assert_true(t, fabs(bn->data[0] - (1 - 0.4) / sqrtf(0.9 + 2.0 / 3)) < 1e-5 &&
+                              fabs(bn->data[2] - (1 + (10 - 1.75) / sqrtf(0.9 + 27.5 / 3))) < 1e-5,
+                       "test batch norm inference", "should use the running stats");
+
+        free(xd);
+        mt_context_free(ctx);
+}
+
+/* Naive attention over (bh, sq, d) x (bh, sk, d) x (bh, sk, dv) slices */
+void naive_attention(const float *q, const float *k, const float *v, const float *mask,
+                     int causal, int bh, int sq, int sk, int d, int dv, float *out) {
+        float *p = malloc(sizeof(float) * sk);
+        for (int b = 0; b < bh; b++)
+                for (int i = 0; i < sq; i++) {
+                        float mx = -INFINITY, sum = 0;
+                        for (int j = 0; j < sk; j++) {
+                                float s = 0;
+                                for (int c = 0; c < d; c++) s += q[(b * sq + i) * d + c] * k[(b * sk + j) * d + c];
+                                p[j] = s / sqrtf(d) + (mask ? mask[i * sk + j] : 0);
+                                if (causal && j > i + sk - sq) p[j] = -INFINITY;
+                                mx = fmaxf(mx, p[j]);
+                        }
+                        for (int j = 0; j < sk; j++) p[j] = expf(p[j] - mx), sum += p[j];
+                        for (int c = 0; c < dv; c++) {
+                                float o = 0;
+                                for (int j = 0; j < sk; j++) o += p[j] / sum * v[(b * sk + j) * dv + c];
+                                out[(b * sq + i) * dv + c] = o;
+                        }
+                }
+        free(p);
+}
+
+/* A tensor of deterministic values in [-1, 1] */
+MTTensor *attention_input(MTContext *ctx, int *shape, int ndims, int seed) {
+        long n = 1;
+        for (int i = 0; i < ndims; i++) n *= shape[i];
+        float *data = malloc(sizeof(float) * n);
+        for (long i = 0; i < n; i++) data[i] = sinf(i * 0.37f + seed);
+        MTTensor *res = mt_new_tensor(ctx, data, shape, ndims);
+        free(data);
+        return res;
+}
+
+void run_tensor_attention_tests(Test *t) {
+        MTContext *ctx = mt_new_context();
+
+        /* sizes that leave partial query and key tiles */
+        int       bh = 2, sq = 70, sk = 130, d = 8, dv = 5;
+        MTTensor *q  = attention_input(ctx, Arr(int, 1, bh, sq, d), 4, 0);
+        MTTensor *k  = attention_input(ctx, Arr(int, 1, bh, sk, d), 4, 1);
+        MTTensor *v  = attention_input(ctx, Arr(int, 1, bh, sk, dv), 4, 2);
+        MTTensor *m  = attention_input(ctx, Arr(int, sq, sk), 2, 3);
+        float    *ref = malloc(sizeof(float) * bh * sq * dv);
+
+        MTTensor *o = mt_tensor_attention(q, k, v, NULL, 0);
+        naive_attention(q->data, k->data, v->data, NULL, 0, bh, sq, sk, d, dv, ref);
+        mt_assert_true(t, o->ndims == 4 && o->shape[3] == dv && __mt_arrclose(o->data, ref, o->datalen, 1e-4),
+                       "test attention", "should match the unfused computation");
+
+        o = mt_tensor_attention(q, k, v, m, 1);
+        naive_attention(q->data, k->data, v->data, m->data, 1, bh, sq, sk, d, dv, ref);
+        mt_assert_true(t, __mt_arrclose(o->data, ref, o->datalen, 1e-4),
+                       "test attention with mask", "should add the mask and hide future keys");
+
+        /* a query whose keys are all masked attends to nothing */
+        MTTensor *ones = attention_input(ctx, Arr(int, 2, 2), 2, 4);
+        MTTensor *hide = mt_new_tensor(ctx, Arr(float, -INFINITY, -INFINITY, 0, 0), Arr(int, 2, 2), 2);
+        o              = mt_tensor_attention(ones, ones, ones, hide, 0);
+        mt_assert_true(t, o->data[0] == 0 && o->data[1] == 0 && isfinite(o->data[2]),
+                       "test attention fully masked row", "should produce zeros");
+
+        free(ref);
+        mt_context_free(ctx);
+}
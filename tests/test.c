@@ -8,20 +8,41 @@ void run_tests(void) {
 #ifndef SKIP_BASIC_TESTS
         run_tensor_creation_tests(&t);
         run_tensor_slice_tests(&t);
+        run_tensor_nd_tests(&t);
         run_tensor_access_tests(&t);
         run_context_tests(&t);
+        run_allocator_tests(&t);
+        run_pool_tests(&t);
+        run_serialization_tests(&t);
+        run_buffer_tests(&t);
+        run_foreign_format_tests(&t);
+        run_dataloader_tests(&t);
+        run_checkpoint_tests(&t);
+        run_storage_tests(&t);
+        run_plan_tests(&t);
         run_broadcast_tests(&t);
         run_get_data_by_constrain(&t);
 #endif
 
 #ifndef SKIP_MATH_TESTS
         run_tensor_addition_tests(&t);
+        run_tensor_broadcast_plan_tests(&t);
         run_tensor_subtraction_tests(&t);
         run_tensor_negation_tests(&t);
         run_tensor_sum_tests(&t);
         run_tensor_el_multiplication_tests(&t);
         run_tensor_matrix_multiplication_tests(&t);
         run_tensor_transpose_tests(&t);
+        run_tensor_softmax_tests(&t);
+        run_tensor_conv2d_tests(&t);
+        run_tensor_fast_math_tests(&t);
+        run_tensor_dtype_tests(&t);
+        run_tensor_quantize_tests(&t);
+        run_tensor_sparse_tests(&t);
+        run_tensor_gather_tests(&t);
+        run_tensor_max_tests(&t);
+        run_tensor_norm_tests(&t);
+        run_tensor_attention_tests(&t);
 #endif
 
 #ifndef SKIP_AUTOGRAD_TESTS
@@ -36,6 +57,15 @@ void run_tests(void) {
         run_autograd_neg_tests(&t);
         run_autograd_log_tests(&t);
         run_autograd_relu_tests(&t);
+        run_autograd_softmax_tests(&t);
+        run_autograd_conv2d_tests(&t);
+        run_autograd_tanh_sigmoid_tests(&t);
+        run_autograd_spmm_tests(&t);
+        run_autograd_embedding_tests(&t);
+        run_autograd_max_topk_tests(&t);
+        run_autograd_norm_tests(&t);
+        run_autograd_attention_tests(&t);
+        run_autograd_profiler_tests(&t);
 #endif
 
         printf("========================================================================\n");
@@ -21,22 +21,50 @@ typedef struct {
         __mt_issame;                                             \
 })
 
+#define __mt_arrclose(a, b, len, tol) ({                               \
+        int __mt_isclose = 1;                                            \
+        for (long i = 0; i < len; i++)                                   \
+                __mt_isclose = __mt_isclose && (fabs((a[i]) - (b[i])) <= (tol)); \
+        __mt_isclose;                                                    \
+})
+
 /* testing tensor core functionality */
 void run_tensor_creation_tests(Test *);
 void run_tensor_slice_tests(Test *);
+void run_tensor_nd_tests(Test *);
 void run_tensor_access_tests(Test *);
 void run_context_tests(Test *);
+void run_allocator_tests(Test *);
+void run_pool_tests(Test *);
+void run_serialization_tests(Test *);
+void run_buffer_tests(Test *);
+void run_foreign_format_tests(Test *);
+void run_dataloader_tests(Test *);
+void run_checkpoint_tests(Test *);
+void run_storage_tests(Test *);
+void run_plan_tests(Test *);
 void run_broadcast_tests(Test *t);
 void run_get_data_by_constrain(Test *t);
 
 /* testing math functionality **/
 void run_tensor_addition_tests(Test *);
+void run_tensor_broadcast_plan_tests(Test *);
 void run_tensor_subtraction_tests(Test *);
 void run_tensor_negation_tests(Test *t);
 void run_tensor_sum_tests(Test *t);
 void run_tensor_el_multiplication_tests(Test *t);
 void run_tensor_matrix_multiplication_tests(Test *t);
 void run_tensor_transpose_tests(Test *t);
+void run_tensor_softmax_tests(Test *t);
+void run_tensor_conv2d_tests(Test *t);
+void run_tensor_fast_math_tests(Test *t);
+void run_tensor_dtype_tests(Test *t);
+void run_tensor_quantize_tests(Test *t);
+void run_tensor_sparse_tests(Test *t);
+void run_tensor_gather_tests(Test *t);
+void run_tensor_max_tests(Test *t);
+void run_tensor_norm_tests(Test *t);
+void run_tensor_attention_tests(Test *t);
 
 /* testing autograd engine **/
 void run_simple_autograd_tests(Test *);
@@ -49,4 +77,13 @@ void run_autograd_matmul_tests(Test *t);
 void run_autograd_exp_tests(Test *t);
 void run_autograd_neg_tests(Test *t);
 void run_autograd_log_tests(Test *t);
-void run_autograd_relu_tests(Test *t);
\ No newline at end of file
+void run_autograd_relu_tests(Test *t);
+void run_autograd_softmax_tests(Test *t);
+void run_autograd_conv2d_tests(Test *t);
+void run_autograd_tanh_sigmoid_tests(Test *t);
+void run_autograd_spmm_tests(Test *t);
+void run_autograd_embedding_tests(Test *t);
+void run_autograd_max_topk_tests(Test *t);
+void run_autograd_norm_tests(Test *t);
+void run_autograd_attention_tests(Test *t);
+void run_autograd_profiler_tests(Test *t);
\ No newline at end of file